@@ -0,0 +1,46 @@
+// Capacity.h
+// Table sizes per role. A sketch picks a preset as the template argument of
+// CommunicationsFor (and RadiatorManagerFor, RadiatorCacheFor,
+// CommandQueueFor); the .cpp files only see the sizes through the object,
+// so a preset changes no other file. Run Code/sim/capacity_report for the
+// RAM each one costs.
+// Keep this file identical in every sketch.
+#ifndef CAPACITY_H
+#define CAPACITY_H
+
+#include <stdint.h>
+
+#define MAX_ESPNOW_PEERS 20 // unencrypted peers the ESP-NOW driver holds, one of them the broadcast address
+#define MAX_FLEET_RADIATORS 32 // bit per radiator in uint32_t masks
+
+// A radiator only talks to the server, and to neighbors when relaying
+struct RadiatorCapacity {
+  static constexpr uint8_t peers = 2; // discovered boards: the server, and one spare
+  static constexpr uint8_t txQueue = 4; // an ack, a discovery reply and relayed frames
+  static constexpr uint8_t neighbors = 8;
+  static constexpr uint8_t routes = 1; // only the server keeps paths to radiators
+  static constexpr uint8_t relaySeen = 16;
+  static constexpr uint8_t radiators = 0;
+};
+
+// One flat or house
+struct ServerCapacity {
+  static constexpr uint8_t peers = 10;
+  static constexpr uint8_t txQueue = 12; // a setpoint to every radiator and a little more
+  static constexpr uint8_t neighbors = 8;
+  static constexpr uint8_t routes = 10;
+  static constexpr uint8_t relaySeen = 16;
+  static constexpr uint8_t radiators = 10;
+};
+
+// As many radiators as the ESP-NOW driver has peer slots for
+struct LargeServerCapacity {
+  static constexpr uint8_t peers = MAX_ESPNOW_PEERS - 1;
+  static constexpr uint8_t txQueue = 24;
+  static constexpr uint8_t neighbors = 12;
+  static constexpr uint8_t routes = MAX_ESPNOW_PEERS - 1;
+  static constexpr uint8_t relaySeen = 32;
+  static constexpr uint8_t radiators = MAX_ESPNOW_PEERS - 1;
+};
+
+#endif
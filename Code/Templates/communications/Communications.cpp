@@ -2,10 +2,26 @@
 
 Communications* Communications::instance = nullptr;
 
-Communications::Communications() {}
-
 const uint8_t Communications::broadcastAddr[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
+void Communications::attach(Peer* peers, uint8_t peerCapacity, TxEntry* queue, uint8_t queueCapacity,
+                            Neighbor* neighborTable, uint8_t neighborCapacity,
+                            RelayRoute* routeTable, uint8_t routeCapacity, uint32_t* seenTable, uint8_t seenCapacity,
+                            AuthSender* senderTable, uint8_t senderCapacity) {
+  knownPeers = peers;
+  maxPeers = peerCapacity;
+  txQueue = queue;
+  txQueueSize = queueCapacity;
+  neighbors = neighborTable;
+  maxNeighbors = neighborCapacity;
+  routes = routeTable;
+  maxRoutes = routeCapacity;
+  seen = seenTable;
+  seenSize = seenCapacity;
+  authSenders = senderTable;
+  maxAuthSenders = senderCapacity;
+}
+
 void Communications::begin() {
   if (instance == nullptr) {
     instance = this;
@@ -20,6 +36,7 @@ void Communications::begin() {
 
   esp_now_register_recv_cb(onDataRecv);
   esp_now_register_send_cb(onDataSent);
+  esp_wifi_get_mac(WIFI_IF_STA, ownMac);
 
   addPeer(broadcastAddr);
 
@@ -27,10 +44,12 @@ void Communications::begin() {
 }
 
 void Communications::broadcastDiscovery() {
-  DiscoveryPayload payload = {};
-  strncpy(payload.name, deviceName, MAX_NAME_LEN - 1);
+  sendDiscovery(broadcastAddr, false);
 
-  send(broadcastAddr, DISCOVERY_MSG_TYPE, reinterpret_cast<const uint8_t*>(&payload), sizeof(payload));
+  // Out of the server's range the broadcast reaches nobody who answers; ask it along the relay path
+  if (relayEnabled && !relayRoot && rootKnown && pathHops > 1) {
+    sendDiscovery(rootMac, false);
+  }
 
   Serial.println("Discovery message broadcasted.");
 }
@@ -44,61 +63,319 @@ void Communications::printMac() {
 
 String Communications::macToString(const uint8_t* mac) {
   char buffer[18];
-  snprintf(buffer, sizeof(buffer), "%02X:%02X:%02X:%02X:%02X:%02X",
-           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  formatMac(mac, buffer);
   return String(buffer);
 }
 
-esp_err_t Communications::send(const uint8_t* addr, uint8_t type, const uint8_t* payload, uint8_t length) {
-  if (length > 248) {
+void Communications::formatMac(const uint8_t* mac, char* out) {
+  static const char hexDigits[] = "0123456789ABCDEF";
+
+  for (int i = 0; i < 6; i++) {
+    out[i * 3] = hexDigits[mac[i] >> 4];
+    out[i * 3 + 1] = hexDigits[mac[i] & 0x0F];
+    out[i * 3 + 2] = ':';
+  }
+  out[17] = '\0';
+}
+
+esp_err_t Communications::send(const uint8_t* addr, uint8_t type, const uint8_t* payload, uint8_t length, TxPriority priority) {
+  if (relayEnabled) {
+    uint8_t route[MAX_RELAY_HOPS][6];
+    int hops = routeTo(addr, route);
+    if (hops > 0) {
+      return sendRelayed(addr, route, hops, type, payload, length, priority);
+    }
+  }
+
+  return enqueue(addr, addr, type, payload, length, priority);
+}
+
+// === Transmit queue ===
+// Frames wait here until the in-flight window and the pacing let them out.
+// Send callbacks free window slots but do not send, they run in the Wi-Fi
+// task; queued frames go out from the next send() or update().
+// Frames are also queued from the receive callback, in the Wi-Fi task, while
+// loop() may be pumping, so the queue, the in-flight window and the pacing
+// are only touched under txLock. Nothing that blocks or calls out runs under
+// it: esp_now_send, the send handler and Serial come after it is left.
+
+// dest nullptr: a relayed frame of someone else's
+esp_err_t Communications::enqueue(const uint8_t* hop, const uint8_t* dest, uint8_t type, const uint8_t* payload, uint8_t length, TxPriority priority) {
+  size_t headerSize = timeSyncEnabled ? sizeof(TimedHeader) : sizeof(MessageHeader);
+  size_t trailerSize = authEnabled ? sizeof(AuthTrailer) : 0;
+  if (length > 250 - headerSize - trailerSize) {
     Serial.println("Payload too large for ESP-NOW");
     return ESP_ERR_INVALID_SIZE;
   }
 
-  uint8_t buffer[250]; // 2 bytes for header + up to 248 bytes of payload
-  MessageHeader header = { MESSAGE_MAGIC, type, length };
+  uint8_t evicted[6];
+  uint8_t evictedType;
+  bool reportEvicted = false;
+  portENTER_CRITICAL(&txLock);
+  if (txCount == txQueueSize) {
+    // Full: push out the newest frame of the lowest class below this one
+    int victim = -1;
+    for (int i = 0; i < txCount; i++) {
+      const TxEntry& entry = txQueue[i];
+      if (entry.priority <= priority) continue;
+      if (victim < 0 || entry.priority > txQueue[victim].priority ||
+          (entry.priority == txQueue[victim].priority && entry.order > txQueue[victim].order)) {
+        victim = i;
+      }
+    }
 
-  memcpy(buffer, &header, sizeof(header));
-  memcpy(buffer + sizeof(header), payload, length);
+    if (victim < 0) {
+      txStats.dropped[priority]++;
+      portEXIT_CRITICAL(&txLock);
+      Serial.println("Transmit queue full, message dropped");
+      return ESP_ERR_ESPNOW_NO_MEM;
+    }
+    reportEvicted = dropQueued(victim, evicted, evictedType);
+  }
+
+  TxEntry& entry = txQueue[txCount++];
+  memcpy(entry.hop, hop, 6);
+  if (dest) memcpy(entry.dest, dest, 6);
+  entry.forwarded = dest == nullptr;
+  entry.type = type == RELAY_FORWARD_MSG_TYPE ? payload[offsetof(RelayHeader, type)] : type;
+  entry.priority = priority;
+  entry.order = txOrder++;
+  entry.queuedAt = micros();
+
+  // A timed header gets its time, and a signed frame its counter and tag, when the frame goes to the driver
+  uint16_t magic = authEnabled ? (timeSyncEnabled ? MESSAGE_MAGIC_SIGNED_TIMED : MESSAGE_MAGIC_SIGNED)
+                               : (timeSyncEnabled ? MESSAGE_MAGIC_TIMED : MESSAGE_MAGIC);
+  TimedHeader header = { { magic, type, length }, 0 };
+  memcpy(entry.frame, &header, headerSize);
+  memcpy(entry.frame + headerSize, payload, length);
+  entry.length = headerSize + length + trailerSize;
+
+  txStats.depth = txCount;
+  if (txCount > txStats.depthPeak) txStats.depthPeak = txCount;
+  portEXIT_CRITICAL(&txLock);
+
+  if (reportEvicted) reportFailed(evicted, evictedType);
+  pumpQueue();
+  return ESP_OK;
+}
+
+// One caller at a time hands frames to the driver. A frame queued meanwhile,
+// from the other task or from the send handler, is left to that caller.
+void Communications::pumpQueue() {
+  portENTER_CRITICAL(&txLock);
+  if (txPumping) {
+    portEXIT_CRITICAL(&txLock);
+    return;
+  }
+  txPumping = true;
+
+  if (txPaceUs > 0 && txTokens < txBurst) {
+    unsigned long elapsed = micros() - txRefilledAt;
+    uint32_t earned = elapsed / txPaceUs;
+    if (earned > 0) {
+      txTokens = min((uint32_t)txBurst, txTokens + earned);
+      txRefilledAt += earned * txPaceUs;
+    }
+  }
+
+  TxEntry entry; // the frame at the driver, out of the queue while unlocked
+  while (txCount > 0 && inFlightCount < txWindow && (txPaceUs == 0 || txTokens > 0)) {
+    int next = 0;
+    for (int i = 1; i < txCount; i++) {
+      if (txQueue[i].priority < txQueue[next].priority ||
+          (txQueue[i].priority == txQueue[next].priority && txQueue[i].order < txQueue[next].order)) {
+        next = i;
+      }
+    }
+
+    TxEntry& queued = txQueue[next];
+    if (timeSyncEnabled) stampFrame(queued);
+    if (!takeCounter(queued)) break; // out of counters until update() reserves more
+
+    entry = queued;
+    txQueue[next] = txQueue[--txCount];
+    txStats.depth = txCount;
+
+    // Its window slot is taken first, the send callback may come before esp_now_send returns
+    TxInFlight& record = inFlight[inFlightCount++];
+    memcpy(record.hop, entry.hop, 6);
+    memcpy(record.dest, entry.dest, 6);
+    record.forwarded = entry.forwarded;
+    record.type = entry.type;
+    record.sentAt = millis();
+    portEXIT_CRITICAL(&txLock);
+
+    signFrame(entry); // the tag is the slow part, it is not worth holding the lock for
+    esp_err_t result = esp_now_send(entry.hop, entry.frame, entry.length);
+    if (captureRing && result != ESP_ERR_ESPNOW_NO_MEM) capture(CAPTURE_TX, entry.hop, result == ESP_OK ? 0 : -1, entry.frame, entry.length);
+
+    portENTER_CRITICAL(&txLock);
+    if (result != ESP_OK) dropInFlight(entry.hop);
+    if (result == ESP_ERR_ESPNOW_NO_MEM) {
+      txStats.driverBusy++;
+      if (txCount < txQueueSize) {
+        txQueue[txCount++] = entry; // stays queued for the next pass
+        txStats.depth = txCount;
+        break;
+      }
+      // The queue filled up behind it, it goes as any other failed frame
+    }
+
+    if (result != ESP_OK) {
+      txStats.dropped[entry.priority]++;
+      portEXIT_CRITICAL(&txLock);
+      Serial.println("Failed to send message");
+      Serial.print(result);
+      Serial.print(" - ");
+      Serial.println(esp_err_to_name(result));
+      if (!entry.forwarded && memcmp(entry.dest, broadcastAddr, 6) != 0) reportFailed(entry.dest, entry.type);
+      portENTER_CRITICAL(&txLock);
+      continue;
+    }
+
+    uint32_t waited = micros() - entry.queuedAt;
+    txStats.waitTotalUs += waited;
+    if (waited > txStats.waitMaxUs) txStats.waitMaxUs = waited;
+    txStats.sent++;
+    if (inFlightCount > txStats.inFlightPeak) txStats.inFlightPeak = inFlightCount;
+
+    if (txPaceUs > 0) {
+      if (txTokens == txBurst) txRefilledAt = micros();
+      txTokens--;
+    }
+  }
+
+  txPumping = false;
+  portEXIT_CRITICAL(&txLock);
+}
+
+// Times written as the frame goes to the driver, so waiting in the queue
+// does not count as radio latency: the timed header, and the send times of
+// this node's own time sync exchanges
+void Communications::stampFrame(TxEntry& entry) {
+  MessageHeader header;
+  memcpy(&header, entry.frame, sizeof(header));
+  if (headerLength(header) != sizeof(TimedHeader)) return;
+
+  uint32_t sentAt = isTimeSynced() ? max(networkMicros(), (uint32_t)1) : 0;
+  memcpy(entry.frame + sizeof(MessageHeader), &sentAt, sizeof(sentAt));
+
+  uint8_t* payload = entry.frame + sizeof(TimedHeader);
+  if (header.type == TIME_REQUEST_MSG_TYPE) {
+    timeRequestT1 = micros();
+    memcpy(payload + offsetof(TimeRequest, t1), &timeRequestT1, sizeof(timeRequestT1));
+  } else if (header.type == TIME_REPLY_MSG_TYPE) {
+    uint32_t t3 = networkMicros();
+    memcpy(payload + offsetof(TimeReply, t3), &t3, sizeof(t3));
+  }
+}
+
+// Removes a frame that will not be sent, under txLock. True when it is to be
+// reported as failed, to dest with its type, once the lock is left.
+bool Communications::dropQueued(int index, uint8_t* dest, uint8_t& type) {
+  TxEntry& entry = txQueue[index];
+  txStats.dropped[entry.priority]++;
 
-  esp_err_t result = esp_now_send(addr, buffer, sizeof(header) + length);
-  if (result != ESP_OK) {
-    Serial.println("Failed to send message");
-    Serial.print(result);
-    Serial.print(" - ");
-    Serial.println(esp_err_to_name(result));
+  bool report = !entry.forwarded && memcmp(entry.dest, broadcastAddr, 6) != 0;
+  memcpy(dest, entry.dest, 6);
+  type = entry.type;
+
+  txQueue[index] = txQueue[--txCount];
+  txStats.depth = txCount;
+  return report;
+}
+
+void Communications::reportFailed(const uint8_t* dest, uint8_t type) {
+  if (userSendHandler) {
+    userSendHandler(dest, type, ESP_NOW_SEND_FAIL);
   }
+}
 
-  return result;
+// Send callbacks only name the next hop, and come in the order the frames
+// were handed to the driver, so the oldest record for that hop is the one
+bool Communications::takeInFlight(const uint8_t* hop, TxInFlight& record) {
+  portENTER_CRITICAL(&txLock);
+  for (int i = 0; i < inFlightCount; i++) {
+    if (memcmp(inFlight[i].hop, hop, 6) == 0) {
+      record = inFlight[i];
+      memmove(&inFlight[i], &inFlight[i + 1], (inFlightCount - i - 1) * sizeof(TxInFlight));
+      inFlightCount--;
+      portEXIT_CRITICAL(&txLock);
+      return true;
+    }
+  }
+  portEXIT_CRITICAL(&txLock);
+  return false;
 }
 
+// Gives back the slot of a frame the driver refused, under txLock: the newest
+// record for its hop, as only the caller pumping adds records
+void Communications::dropInFlight(const uint8_t* hop) {
+  for (int i = inFlightCount - 1; i >= 0; i--) {
+    if (memcmp(inFlight[i].hop, hop, 6) == 0) {
+      memmove(&inFlight[i], &inFlight[i + 1], (inFlightCount - i - 1) * sizeof(TxInFlight));
+      inFlightCount--;
+      return;
+    }
+  }
+}
 
-void Communications::setReceiveHandler(std::function<void(const uint8_t*, uint8_t, const uint8_t*, int)> handler) {
+void Communications::expireInFlight() {
+  unsigned long now = millis();
+  portENTER_CRITICAL(&txLock);
+  while (inFlightCount > 0 && now - inFlight[0].sentAt > TX_INFLIGHT_TIMEOUT_MS) {
+    txStats.expired++;
+    memmove(&inFlight[0], &inFlight[1], (inFlightCount - 1) * sizeof(TxInFlight));
+    inFlightCount--;
+  }
+  portEXIT_CRITICAL(&txLock);
+}
+
+void Communications::setTxWindow(uint8_t frames) {
+  txWindow = constrain(frames, 1, TX_MAX_WINDOW);
+}
+
+void Communications::setTxPacing(uint8_t burst, uint32_t intervalUs) {
+  txBurst = max(burst, (uint8_t)1);
+  txPaceUs = intervalUs;
+  txTokens = txBurst;
+}
+
+const TxStats& Communications::getTxStats() const {
+  return txStats;
+}
+
+void Communications::setReceiveHandler(ReceiveHandler handler) {
   userRecvHandler = handler;
 }
 
-void Communications::setSendHandler(std::function<void(const uint8_t*, esp_now_send_status_t)> handler) {
+int Communications::getRxRssi() const {
+  return rxRssi;
+}
+
+void Communications::setSendHandler(SendHandler handler) {
   userSendHandler = handler;
 }
 
-void Communications::setDiscoveryHandler(std::function<void(const Peer&)> handler) {
+void Communications::setDiscoveryHandler(DiscoveryHandler handler) {
   discoveryHandler = handler;
 }
 
 void Communications::setName(const char* name) {
-  strncpy(deviceName, name, MAX_NAME_LEN - 1);
-  deviceName[MAX_NAME_LEN - 1] = '\0';
+  snprintf(deviceName, sizeof(deviceName), "%s", name);
 }
 
-void Communications::addToDiscoveryWhitelist(const char* name) {
-  if (whitelistCount >= MAX_WHITELIST) {
-    Serial.println("Whitelist full, cannot add more names.");
-    return;
-  }
+void Communications::setDeviceClass(DeviceClass cls, uint8_t instance) {
+  deviceClass = cls;
+  instanceId = instance;
+}
 
-  strncpy(whitelist[whitelistCount], name, MAX_NAME_LEN - 1);
-  whitelist[whitelistCount][MAX_NAME_LEN - 1] = '\0';
-  whitelistCount++;
+void Communications::addToDiscoveryWhitelist(DeviceClass cls) {
+  discoveryClasses |= 1UL << cls;
+}
+
+void Communications::setLegacyDiscovery(bool legacy) {
+  legacyDiscovery = legacy;
 }
 
 int Communications::getPeerCount() const {
@@ -119,113 +396,252 @@ const Peer* Communications::getPeerByName(const char* name) const {
   return nullptr;
 }
 
+const Peer* Communications::getPeerByClass(DeviceClass cls) const {
+  if (cls >= DEVICE_CLASS_COUNT || classPeer[cls] == 0) return nullptr;
+  return &knownPeers[classPeer[cls] - 1];
+}
+
+const char* Communications::className(uint8_t cls) {
+  switch (cls) {
+    case DEVICE_CLASS_SERVER: return "server";
+    case DEVICE_CLASS_RADIATOR: return "radiator";
+    default: return "unknown";
+  }
+}
+
 void Communications::onDataSent(const uint8_t* mac_addr, esp_now_send_status_t status) {
-  Serial.printf("Sent to %s %s\n", macToString(mac_addr).c_str(),
-                status == ESP_NOW_SEND_SUCCESS ? "Success" : "Fail");
+  char macText[18]; // no String per frame in the Wi-Fi task
+  formatMac(mac_addr, macText);
+  Serial.printf("Sent to %s %s\n", macText, status == ESP_NOW_SEND_SUCCESS ? "Success" : "Fail");
+
+  if (!instance) return;
+  if (instance->captureRing) instance->capture(CAPTURE_SENT, mac_addr, status, nullptr, 0);
+
+  // A relayed message is reported against its destination; success means the first radiator got it
+  bool delivered = status == ESP_NOW_SEND_SUCCESS;
+  if (instance->relayEnabled) {
+    instance->noteSendResult(mac_addr, delivered);
+  }
+
+  uint8_t reportAs[6];
+  memcpy(reportAs, mac_addr, 6);
+  uint8_t type = UNKNOWN_MSG_TYPE;
+  TxInFlight record;
+  if (instance->takeInFlight(mac_addr, record)) {
+    if (record.forwarded) return;
+    memcpy(reportAs, record.dest, 6);
+    type = record.type;
+    // The radiator in between is gone or out of reach, go direct until a new path is heard
+    if (!delivered && memcmp(record.dest, mac_addr, 6) != 0) {
+      instance->forgetRoute(record.dest);
+    }
+  }
 
-  if (instance && instance->userSendHandler) {
-    instance->userSendHandler(mac_addr, status);
+  if (instance->userSendHandler) {
+    instance->userSendHandler(reportAs, type, status);
   }
 }
 
 void Communications::onDataRecv(const esp_now_recv_info_t* recvInfo, const uint8_t* data, int len) {
   if (!instance) return;
+  instance->rxAt = micros();
+  instance->rxRssi = recvInfo->rx_ctrl ? recvInfo->rx_ctrl->rssi : 0;
+  if (instance->captureRing) instance->capture(CAPTURE_RX, recvInfo->src_addr, instance->rxRssi, data, len);
 
-  if (len < sizeof(MessageHeader)) {
+  if (len < (int)sizeof(MessageHeader)) {
     Serial.println("Too short for header");
     return;
   }
+  size_t frameLength = (size_t)len;
 
   const MessageHeader* header = (const MessageHeader*)data;
 
-  if (header->magic != MESSAGE_MAGIC) {
+  bool signedFrame = header->magic == MESSAGE_MAGIC_SIGNED || header->magic == MESSAGE_MAGIC_SIGNED_TIMED;
+  if (header->magic != MESSAGE_MAGIC && header->magic != MESSAGE_MAGIC_TIMED && !signedFrame) {
     Serial.println("Invalid message magic");
     return;
   }
 
-  if (len != sizeof(MessageHeader) + header->length) {
-    Serial.printf("Payload length mismatch: expected %d, got %d\n", header->length, len - sizeof(MessageHeader));
+  size_t headerSize = headerLength(*header);
+  size_t trailerSize = trailerLength(*header);
+  if (frameLength != headerSize + header->length + trailerSize) {
+    Serial.printf("Payload length mismatch: expected %d, got %d\n", header->length, len - (int)(headerSize + trailerSize));
     return;
   }
 
-  const uint8_t* payloadData = data + sizeof(MessageHeader);
+  // Without a key of its own a board takes signed frames as they are, so a switched server still reaches the rest
+  if (instance->authEnabled && !instance->verifyFrame(recvInfo->src_addr, data, len, signedFrame)) {
+    if (header->type != AUTH_RESPONSE_MSG_TYPE) instance->challengeSender(recvInfo->src_addr, true); // often another board's
+    return;
+  }
 
-  if (isDiscoveryMessage(*header)) {
-    if (header->length != sizeof(DiscoveryPayload)) {
-      Serial.println("Invalid discovery payload length");
-      return;
+  const uint8_t* payloadData = data + headerSize;
+
+  if (instance->relayEnabled && recvInfo->rx_ctrl) {
+    instance->noteNeighbor(recvInfo->src_addr, recvInfo->rx_ctrl->rssi);
+  }
+
+  if (headerSize == sizeof(TimedHeader) && instance->timeSyncEnabled) {
+    uint32_t sentAt;
+    memcpy(&sentAt, data + sizeof(MessageHeader), sizeof(sentAt));
+    instance->noteSentAt(recvInfo->src_addr, sentAt);
+  }
+
+  instance->dispatch(recvInfo->src_addr, header->type, payloadData, header->length, true);
+
+  // A peer is asked for its counter before its first command, including one the discovery just added
+  if (instance->authEnabled) {
+    instance->challengeSender(recvInfo->src_addr, false);
+    instance->retryChallenges();
+  }
+}
+
+// mac is the sender, or the origin of a relayed message (direct false)
+void Communications::dispatch(const uint8_t* mac, uint8_t type, const uint8_t* data, uint8_t length, bool direct) {
+  if (isDiscoveryMessage(type)) {
+    Peer found = {};
+    memcpy(found.mac, mac, 6);
+    bool isResponse;
+    if (type == DISCOVERY_MSG_TYPE) {
+      if (length != sizeof(DiscoveryPayload)) {
+        Serial.println("Invalid discovery payload length");
+        return;
+      }
+      DiscoveryPayload payload;
+      memcpy(&payload, data, sizeof(payload));
+      snprintf(found.name, sizeof(found.name), "%.*s", MAX_NAME_LEN - 1, payload.name); // may arrive unterminated
+      found.deviceClass = classFromName(found.name);
+      found.named = true;
+      isResponse = payload.isResponse;
+    } else {
+      if (length < sizeof(CompactDiscovery)) {
+        Serial.println("Invalid discovery payload length");
+        return;
+      }
+      CompactDiscovery payload;
+      memcpy(&payload, data, sizeof(payload));
+      found.deviceClass = payload.deviceClass;
+      found.version = payload.version;
+      found.caps = payload.flags & ~DISCOVERY_RESPONSE;
+      found.instance = payload.instance;
+      found.named = !(found.caps & DISCOVERY_CAP_NAMED); // the name is filled in once it is adopted
+      isResponse = payload.flags & DISCOVERY_RESPONSE;
     }
+    handleDiscovery(found, isResponse);
+    return;
+  }
+
+  if (type == NAME_REQUEST_MSG_TYPE || type == NAME_REPLY_MSG_TYPE) {
+    handleName(mac, type, data, length);
+    return;
+  }
+
+  if (type == RELAY_BEACON_MSG_TYPE || type == RELAY_FORWARD_MSG_TYPE) {
+    if (!relayEnabled) return;
 
-    DiscoveryPayload payload;
-    memcpy(&payload, payloadData, sizeof(payload));
-    instance->handleDiscovery(recvInfo->src_addr, payload);
+    if (type == RELAY_FORWARD_MSG_TYPE && direct) {
+      handleForward(data, length);
+    } else if (type == RELAY_BEACON_MSG_TYPE && length == sizeof(RelayBeacon)) {
+      RelayBeacon beacon;
+      memcpy(&beacon, data, sizeof(beacon));
+      handleBeacon(mac, beacon, direct);
+    }
     return;
   }
 
-  if (instance->userRecvHandler) {
-    instance->userRecvHandler(recvInfo->src_addr, header->type, payloadData, header->length);
+  if (type == TIME_REQUEST_MSG_TYPE || type == TIME_REPLY_MSG_TYPE) {
+    if (!timeSyncEnabled) return;
+
+    if (type == TIME_REQUEST_MSG_TYPE && timeMaster && length == sizeof(TimeRequest)) {
+      TimeRequest request;
+      memcpy(&request, data, sizeof(request));
+      handleTimeRequest(mac, request);
+    } else if (type == TIME_REPLY_MSG_TYPE && !timeMaster && length == sizeof(TimeReply)) {
+      TimeReply reply;
+      memcpy(&reply, data, sizeof(reply));
+      handleTimeReply(mac, reply);
+    }
+    return;
+  }
+
+  if (type == AUTH_CHALLENGE_MSG_TYPE || type == AUTH_RESPONSE_MSG_TYPE) {
+    // Responses end in verifyFrame(), which has their counter
+    AuthChallenge challenge;
+    if (type == AUTH_CHALLENGE_MSG_TYPE && direct && authEnabled && findChallenge(data, length, ownMac, challenge)) {
+      addToBatch(authAnswers, mac, challenge.nonce);
+    }
+    return;
+  }
+
+  if (userRecvHandler) {
+    userRecvHandler(mac, type, data, length);
   }
 }
 
-bool Communications::isDiscoveryMessage(const MessageHeader& msg) {
-  return msg.type == DISCOVERY_MSG_TYPE;
+bool Communications::isDiscoveryMessage(uint8_t type) {
+  return type == DISCOVERY_MSG_TYPE || type == DISCOVERY_COMPACT_MSG_TYPE;
 }
 
-void Communications::handleDiscovery(const uint8_t* mac, const DiscoveryPayload& payload) {
-  // Reject if not on whitelist
-  bool allowed = false;
-  if (whitelistCount == 0) {
-    allowed = true;
-  } else {
-    for (int i = 0; i < whitelistCount; ++i) {
-      if (strncmp(payload.name, whitelist[i], MAX_NAME_LEN) == 0) {
-        allowed = true;
-        break;
-      }
-    }
+DeviceClass Communications::classFromName(const char* name) {
+  for (uint8_t cls = DEVICE_CLASS_UNKNOWN + 1; cls < DEVICE_CLASS_COUNT; cls++) {
+    if (strncmp(name, className(cls), MAX_NAME_LEN) == 0) return (DeviceClass)cls;
   }
+  return DEVICE_CLASS_UNKNOWN;
+}
 
-  if (!allowed) {
-    Serial.printf("Discovery ignored: '%s' not in whitelist.\n", payload.name);
+// found: the sender as its discovery describes it
+void Communications::handleDiscovery(const Peer& found, bool isResponse) {
+  // Reject if not on whitelist
+  if (discoveryClasses != 0 && (found.deviceClass >= 32 || !(discoveryClasses & (1UL << found.deviceClass)))) {
+    Serial.printf("Discovery ignored: class %u not in whitelist.\n", found.deviceClass);
     return;
   }
-  
-  if (isKnownPeer(mac)) {
-    if (!payload.isResponse) {
-      sendDiscoveryResponse(mac);
+
+  Peer* known = findPeer(found.mac);
+  if (known) {
+    // Reflashed since: answer in the format it speaks now
+    known->version = found.version;
+    known->caps = found.caps;
+    if (!isResponse) {
+      sendDiscoveryResponse(found.mac);
     }
-    
+    if (!known->named) requestName(found.mac);
     return;
   }
 
-  if (peerCount >= MAX_PEERS) {
+  if (peerCount >= maxPeers) {
     Serial.println("Max peers reached; ignoring new discovery.");
     return;
   }
 
-  if (!addPeer(mac)) return;
+  if (!addPeer(found.mac)) return;
 
   Peer& peer = knownPeers[peerCount++];
-  memcpy(peer.mac, mac, 6);
-  strncpy(peer.name, payload.name, MAX_NAME_LEN - 1);
-  peer.name[MAX_NAME_LEN - 1] = '\0';
+  peer = found;
+  if (!peer.name[0]) snprintf(peer.name, sizeof(peer.name), "%s", className(peer.deviceClass));
+  if (peer.deviceClass < DEVICE_CLASS_COUNT && classPeer[peer.deviceClass] == 0) classPeer[peer.deviceClass] = peerCount;
 
-  Serial.printf("Discovered new peer: %s (%s)\n", peer.name, macToString(mac).c_str());
+  Serial.printf("Discovered new peer: %s (%s)\n", peer.name, macToString(peer.mac).c_str());
 
-  if (!payload.isResponse) {
-    sendDiscoveryResponse(mac);
+  if (!isResponse) {
+    sendDiscoveryResponse(peer.mac);
   }
+  if (!peer.named) requestName(peer.mac);
 
   if (discoveryHandler) {
     discoveryHandler(peer);
   }
 }
 
-bool Communications::isKnownPeer(const uint8_t* mac) {
+Peer* Communications::findPeer(const uint8_t* mac) {
   for (int i = 0; i < peerCount; ++i) {
-    if (memcmp(mac, knownPeers[i].mac, 6) == 0) return true;
+    if (memcmp(mac, knownPeers[i].mac, 6) == 0) return &knownPeers[i];
   }
-  return false;
+  return nullptr;
+}
+
+bool Communications::isKnownPeer(const uint8_t* mac) {
+  return findPeer(mac) != nullptr;
 }
 
 bool Communications::addPeer(const uint8_t* mac) {
@@ -244,12 +660,962 @@ bool Communications::addPeer(const uint8_t* mac) {
 }
 
 void Communications::sendDiscoveryResponse(const uint8_t* mac) {
-  DiscoveryPayload responsePayload = {};
-  strncpy(responsePayload.name, deviceName, MAX_NAME_LEN - 1);
-  responsePayload.isResponse = true;
+  sendDiscovery(mac, true);
+}
+
+void Communications::sendDiscovery(const uint8_t* mac, bool isResponse) {
+  const Peer* peer = findPeer(mac);
+  if (peer ? peer->version == 0 : legacyDiscovery) {
+    DiscoveryPayload responsePayload = {};
+    snprintf(responsePayload.name, sizeof(responsePayload.name), "%s", deviceName);
+    responsePayload.isResponse = isResponse;
+    send(mac, DISCOVERY_MSG_TYPE, reinterpret_cast<const uint8_t*>(&responsePayload), sizeof(responsePayload), TX_PRIORITY_DISCOVERY);
+  } else {
+    CompactDiscovery payload = { DISCOVERY_VERSION, deviceClass, capabilities(), instanceId };
+    if (isResponse) payload.flags |= DISCOVERY_RESPONSE;
+    send(mac, DISCOVERY_COMPACT_MSG_TYPE, payload, TX_PRIORITY_DISCOVERY);
+  }
+
+  char macText[18];
+  formatMac(mac, macText);
+  Serial.printf("Sent discovery %s to %s\n", isResponse ? "response" : "request", macText);
+}
+
+uint8_t Communications::capabilities() const {
+  uint8_t caps = 0;
+  if (relayEnabled) caps |= DISCOVERY_CAP_RELAY;
+  if (timeSyncEnabled) caps |= DISCOVERY_CAP_TIME_SYNC;
+  if (authEnabled) caps |= DISCOVERY_CAP_SIGNED;
+  if (strncmp(deviceName, className(deviceClass), MAX_NAME_LEN) != 0) caps |= DISCOVERY_CAP_NAMED;
+  return caps;
+}
+
+// Until the reply comes the peer goes by its class's name; a lost request is
+// repeated on its next discovery
+void Communications::requestName(const uint8_t* mac) {
+  uint8_t none = 0;
+  send(mac, NAME_REQUEST_MSG_TYPE, &none, 0, TX_PRIORITY_DISCOVERY);
+}
+
+void Communications::handleName(const uint8_t* mac, uint8_t type, const uint8_t* data, uint8_t length) {
+  Peer* peer = findPeer(mac);
+  if (!peer) return;
+
+  if (type == NAME_REQUEST_MSG_TYPE) {
+    send(mac, NAME_REPLY_MSG_TYPE, reinterpret_cast<const uint8_t*>(deviceName), strlen(deviceName), TX_PRIORITY_DISCOVERY);
+  } else if (length < MAX_NAME_LEN) {
+    memcpy(peer->name, data, length);
+    peer->name[length] = '\0';
+    peer->named = true;
+  }
+}
+
+// === Relaying ===
+// Every relaying node broadcasts a beacon with its path cost to the server,
+// and measures the RSSI of everything it hears. A radiator takes as its next
+// hop the neighbor whose advertised cost plus the cost of the link to it is
+// lowest, which makes the paths a shortest-path tree rooted at the server,
+// and the server learns each radiator's branch from its beacons and from the
+// route of the relayed messages it receives, then sends back along it.
+
+void Communications::enableRelay(bool root) {
+  relayEnabled = true;
+  relayRoot = root;
+  relaySeq = esp_random(); // so a restarted node's messages are not taken for ones seen before
+  nextBeaconAt = millis() + esp_random() % 1000;
+}
+
+void Communications::update() {
+  expireInFlight();
+  portENTER_CRITICAL(&txLock);
+  bool reserve = authEnabled && authReserved - authCounter <= AUTH_COUNTER_BLOCK / 2;
+  portEXIT_CRITICAL(&txLock);
+  if (reserve) reserveCounters();
+  sendBatch(authChallenges, AUTH_CHALLENGE_MSG_TYPE);
+  sendBatch(authAnswers, AUTH_RESPONSE_MSG_TYPE);
+  pumpQueue();
+  updateTimeSync();
+
+  if (!relayEnabled) return;
+
+  unsigned long now = millis();
+  bool dropped = false;
+  for (int i = 0; i < neighborCount;) {
+    if (now - neighbors[i].lastHeard > RELAY_NEIGHBOR_TIMEOUT_MS) {
+      neighbors[i] = neighbors[--neighborCount];
+      dropped = true;
+    } else {
+      i++;
+    }
+  }
+  if (dropped) chooseUplink();
+
+  if ((long)(now - nextBeaconAt) >= 0) {
+    sendBeacon();
+    nextBeaconAt = now + RELAY_BEACON_INTERVAL_MS * 3 / 4 + esp_random() % (RELAY_BEACON_INTERVAL_MS / 2);
+  }
+}
+
+int Communications::getHops(const uint8_t* mac) const {
+  uint8_t route[MAX_RELAY_HOPS][6];
+  return relayEnabled ? routeTo(mac, route) + 1 : 1;
+}
+
+void Communications::sendBeacon() {
+  RelayBeacon beacon = {};
+  if (relayRoot) {
+    memcpy(beacon.root, ownMac, 6);
+    beacon.cost = 0;
+    beacon.hops = 0;
+  } else {
+    if (rootKnown) memcpy(beacon.root, rootMac, 6);
+    beacon.cost = pathCost;
+    beacon.hops = pathHops;
+    if (pathHops > 1) memcpy(beacon.route, pathRoute, (pathHops - 1) * 6);
+  }
+
+  send(broadcastAddr, RELAY_BEACON_MSG_TYPE, beacon, TX_PRIORITY_TELEMETRY);
+
+  // The server does not hear the broadcast from beyond its range
+  if (!relayRoot && rootKnown && pathHops > 1) {
+    send(rootMac, RELAY_BEACON_MSG_TYPE, beacon, TX_PRIORITY_TELEMETRY);
+  }
+}
+
+void Communications::handleBeacon(const uint8_t* mac, const RelayBeacon& beacon, bool direct) {
+  if (beacon.cost != RELAY_NO_ROUTE && beacon.hops > MAX_RELAY_HOPS + 1) return;
+
+  if (direct) {
+    Neighbor* neighbor = findNeighbor(mac);
+    if (neighbor) {
+      neighbor->cost = beacon.cost;
+      neighbor->hops = beacon.hops;
+      memcpy(neighbor->route, beacon.route, sizeof(beacon.route));
+      neighbor->beaconed = true;
+    }
+  }
+
+  if (relayRoot) {
+    if (beacon.cost == RELAY_NO_ROUTE || beacon.hops == 0 || memcmp(beacon.root, ownMac, 6) != 0) return;
+
+    learnRoute(mac, beacon.route, beacon.hops - 1);
+
+    // A radiator that missed the discovery broadcast, e.g. after a restart
+    if (!isKnownPeer(mac) && peerCount < maxPeers && ensurePeer(mac)) {
+      sendDiscovery(mac, false);
+    }
+    return;
+  }
+
+  if (beacon.cost == 0) {
+    memcpy(rootMac, mac, 6);
+    rootKnown = true;
+  } else if (!rootKnown && beacon.cost != RELAY_NO_ROUTE) {
+    memcpy(rootMac, beacon.root, 6);
+    rootKnown = true;
+  }
+
+  chooseUplink();
+}
+
+void Communications::handleForward(const uint8_t* data, uint8_t length) {
+  if (length < sizeof(RelayHeader)) return;
+
+  RelayHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (header.hops == 0 || header.hops > MAX_RELAY_HOPS || length != sizeof(RelayHeader) + header.length) {
+    Serial.println("Invalid relayed message");
+    return;
+  }
+
+  if (isDuplicate(header.origin, header.seq)) {
+    Serial.println("Duplicate relayed message dropped");
+    return;
+  }
+
+  const uint8_t* inner = data + sizeof(RelayHeader);
+
+  if (memcmp(header.dest, ownMac, 6) == 0) {
+    // Answers go back the way this came, until the origin advertises something better
+    if (relayRoot) learnRoute(header.origin, header.route, header.hops);
+    dispatch(header.origin, header.type, inner, header.length, false);
+    return;
+  }
+
+  int position = -1;
+  for (int i = 0; i < header.hops; i++) {
+    if (memcmp(header.route[i], ownMac, 6) == 0) position = i;
+  }
+  if (position < 0 || header.ttl == 0) {
+    Serial.println("Relayed message not routed through here, dropped");
+    return;
+  }
+
+  header.ttl--;
+  const uint8_t* next = position + 1 < header.hops ? header.route[position + 1] : header.dest;
+
+  uint8_t buffer[248];
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), inner, header.length);
+
+  // Someone else's message has already waited a hop, it goes ahead of our own
+  if (!ensurePeer(next)) return;
+  enqueue(next, nullptr, RELAY_FORWARD_MSG_TYPE, buffer, length, TX_PRIORITY_COMMAND);
+}
+
+esp_err_t Communications::sendRelayed(const uint8_t* dest, const uint8_t route[][6], uint8_t hops, uint8_t type, const uint8_t* payload, uint8_t length, TxPriority priority) {
+  if (sizeof(RelayHeader) + length > 248) {
+    Serial.println("Payload too large to relay");
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  RelayHeader header = {};
+  memcpy(header.origin, ownMac, 6);
+  memcpy(header.dest, dest, 6);
+  memcpy(header.route, route, hops * 6);
+  header.hops = hops;
+  header.ttl = hops;
+  header.seq = ++relaySeq;
+  header.type = type;
+  header.length = length;
+  isDuplicate(ownMac, header.seq); // remember it, in case it comes back
+
+  uint8_t buffer[248];
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), payload, length);
+
+  if (!ensurePeer(route[0])) return ESP_ERR_ESPNOW_NOT_FOUND;
+  return enqueue(route[0], dest, RELAY_FORWARD_MSG_TYPE, buffer, sizeof(header) + length, priority);
+}
 
-  send(mac, DISCOVERY_MSG_TYPE, reinterpret_cast<const uint8_t*>(&responsePayload), sizeof(responsePayload));
+Neighbor* Communications::findNeighbor(const uint8_t* mac) {
+  for (int i = 0; i < neighborCount; i++) {
+    if (memcmp(neighbors[i].mac, mac, 6) == 0) return &neighbors[i];
+  }
+  return nullptr;
+}
+
+void Communications::noteNeighbor(const uint8_t* mac, int rssi) {
+  Neighbor* neighbor = findNeighbor(mac);
+  if (neighbor) {
+    neighbor->rssi = (neighbor->rssi * 3 + rssi) / 4;
+    neighbor->lastHeard = millis();
+    return;
+  }
+
+  // Table full: take the place of the weakest, if this one is heard better
+  bool replaced = false;
+  if (neighborCount < maxNeighbors) {
+    neighbor = &neighbors[neighborCount++];
+  } else {
+    neighbor = &neighbors[0];
+    for (int i = 1; i < neighborCount; i++) {
+      if (neighbors[i].rssi < neighbor->rssi) neighbor = &neighbors[i];
+    }
+    if (neighbor->rssi >= rssi) return;
+    replaced = true;
+  }
+
+  *neighbor = {};
+  memcpy(neighbor->mac, mac, 6);
+  neighbor->rssi = rssi;
+  neighbor->cost = RELAY_NO_ROUTE;
+  neighbor->lastHeard = millis();
+
+  if (replaced) chooseUplink();
+}
+
+void Communications::noteSendResult(const uint8_t* mac, bool delivered) {
+  Neighbor* neighbor = findNeighbor(mac);
+  if (!neighbor) return;
+
+  uint8_t fails = delivered ? 0 : min(neighbor->fails + 1, 3);
+  if (fails != neighbor->fails) {
+    neighbor->fails = fails;
+    chooseUplink();
+  }
+}
+
+// Roughly the expected transmissions over the link, doubled for every recent
+// failure, plus one so that a good direct link beats two good hops
+uint8_t Communications::linkCost(const Neighbor& neighbor) {
+  uint8_t cost;
+  if (neighbor.rssi >= -80) cost = 1;
+  else if (neighbor.rssi >= -85) cost = 2;
+  else if (neighbor.rssi >= -88) cost = 4;
+  else if (neighbor.rssi >= -91) cost = 8;
+  else cost = 16;
+  return (cost << neighbor.fails) + 1;
+}
+
+void Communications::chooseUplink() {
+  if (relayRoot) return;
+
+  const uint8_t* uplinkMac = pathHops > 1 ? pathRoute[0] : rootMac;
+  const Neighbor* best = nullptr;
+  int bestCost = RELAY_NO_ROUTE;
+  const Neighbor* current = nullptr;
+  int currentCost = RELAY_NO_ROUTE;
+
+  for (int i = 0; i < neighborCount; i++) {
+    const Neighbor& neighbor = neighbors[i];
+    if (!neighbor.beaconed || neighbor.cost == RELAY_NO_ROUTE || neighbor.hops > MAX_RELAY_HOPS) continue;
+
+    bool loops = false;
+    for (int hop = 0; hop + 1 < neighbor.hops; hop++) {
+      loops = loops || memcmp(neighbor.route[hop], ownMac, 6) == 0;
+    }
+    if (loops) continue;
+
+    int cost = min(neighbor.cost + linkCost(neighbor), RELAY_NO_ROUTE - 1);
+    if (pathCost != RELAY_NO_ROUTE && memcmp(neighbor.mac, uplinkMac, 6) == 0) {
+      current = &neighbor;
+      currentCost = cost;
+    }
+    if (!best || cost < bestCost || (cost == bestCost && neighbor.hops < best->hops)) {
+      best = &neighbor;
+      bestCost = cost;
+    }
+  }
+
+  // Stay on the current path unless the new one is clearly cheaper
+  if (current && currentCost < bestCost + RELAY_SWITCH_MARGIN) {
+    best = current;
+    bestCost = currentCost;
+  }
+
+  if (!best) {
+    pathCost = RELAY_NO_ROUTE;
+    pathHops = 0;
+    return;
+  }
+
+  uint8_t hops = best->hops + 1;
+  if (hops != pathHops || (hops > 1 && memcmp(pathRoute[0], best->mac, 6) != 0)) {
+    Serial.printf("Relay path to the server: %d hops, cost %d\n", hops, bestCost);
+  }
+
+  pathCost = bestCost;
+  pathHops = hops;
+  if (best->hops > 0) {
+    memcpy(pathRoute[0], best->mac, 6);
+    memcpy(pathRoute[1], best->route[0], (best->hops - 1) * 6);
+  }
+}
+
+// Fills route with the radiators a message to addr goes through, returns how many
+int Communications::routeTo(const uint8_t* addr, uint8_t route[][6]) const {
+  if (relayRoot) {
+    const RelayRoute* entry = findRoute(addr);
+    if (!entry || entry->hops == 0) return 0;
+    memcpy(route, entry->route, entry->hops * 6);
+    return entry->hops;
+  }
+
+  if (!rootKnown || pathCost == RELAY_NO_ROUTE || pathHops < 2 || memcmp(addr, rootMac, 6) != 0) return 0;
+  memcpy(route, pathRoute, (pathHops - 1) * 6);
+  return pathHops - 1;
+}
+
+const RelayRoute* Communications::findRoute(const uint8_t* mac) const {
+  for (int i = 0; i < routeCount; i++) {
+    if (memcmp(routes[i].mac, mac, 6) == 0) return &routes[i];
+  }
+  return nullptr;
+}
+
+// route lists the radiators from mac towards the server
+void Communications::learnRoute(const uint8_t* mac, const uint8_t route[][6], uint8_t hops) {
+  if (hops > MAX_RELAY_HOPS) return;
+
+  RelayRoute* entry = const_cast<RelayRoute*>(findRoute(mac));
+  if (!entry) {
+    if (routeCount < maxRoutes) {
+      entry = &routes[routeCount++];
+    } else {
+      // Full: make room by dropping one of a radiator that is not a peer
+      for (int i = 0; i < routeCount && !entry; i++) {
+        if (!isKnownPeer(routes[i].mac)) entry = &routes[i];
+      }
+      if (!entry) return;
+    }
+    memcpy(entry->mac, mac, 6);
+  }
+
+  entry->hops = hops;
+  for (int i = 0; i < hops; i++) {
+    memcpy(entry->route[i], route[hops - 1 - i], 6);
+  }
+}
+
+void Communications::forgetRoute(const uint8_t* mac) {
+  for (int i = 0; i < routeCount; i++) {
+    if (memcmp(routes[i].mac, mac, 6) == 0) {
+      routes[i] = routes[--routeCount];
+      return;
+    }
+  }
+}
+
+bool Communications::isDuplicate(const uint8_t* origin, uint16_t seq) {
+  uint32_t key = (uint32_t)origin[4] << 24 | (uint32_t)origin[5] << 16 | seq;
+  for (int i = 0; i < seenSize; i++) {
+    if (seen[i] == key) return true;
+  }
+
+  seen[seenNext] = key;
+  seenNext = (seenNext + 1) % seenSize;
+  return false;
+}
+
+bool Communications::ensurePeer(const uint8_t* mac) {
+  return esp_now_is_peer_exist(mac) || addPeer(mac);
+}
+
+
+// === Time sync ===
+// The master's micros() is the network time. Every other node asks it for
+// the time NTP-style: the request leaves at t1 on this clock, arrives at t2
+// on the master's, the reply leaves at t3 and arrives at t4. Taking the two
+// trips as equally long, the master's clock is ahead of ours by
+// (t2 - t1) - delay / 2, where delay = (t4 - t1) - (t3 - t2). Queueing,
+// retries and a busy Wi-Fi task make one trip longer than the other, by up
+// to the delay, so a straight line is fitted through the last exchanges with
+// the fast ones counting most; its slope is the drift. Until the first
+// reply, a timed frame straight from the master sets the clock to within one
+// trip, e.g. its relay beacons, and one far off the fit asks again at once.
+
+void Communications::enableTimeSync(const uint8_t* master) {
+  timeSyncEnabled = true;
+  timeMaster = master == nullptr;
+  timeStats.synced = timeMaster;
+  if (master) memcpy(masterMac, master, 6);
+  nextTimeSyncAt = millis();
+}
+
+bool Communications::isTimeSynced() const {
+  return timeStats.synced;
+}
+
+uint32_t Communications::networkMicros() const {
+  return networkAt(micros());
+}
+
+uint32_t Communications::networkAt(uint32_t local) const {
+  if (timeMaster) return local;
+  int32_t since = local - timeRefAt;
+  return local + timeOffset + (int32_t)((int64_t)since * timeDriftPpb / 1000000000);
+}
+
+const TimeStats& Communications::getTimeStats() const {
+  return timeStats;
+}
+
+size_t Communications::headerLength(const MessageHeader& header) {
+  bool timed = header.magic == MESSAGE_MAGIC_TIMED || header.magic == MESSAGE_MAGIC_SIGNED_TIMED;
+  return timed ? sizeof(TimedHeader) : sizeof(MessageHeader);
+}
+
+size_t Communications::trailerLength(const MessageHeader& header) {
+  bool signedFrame = header.magic == MESSAGE_MAGIC_SIGNED || header.magic == MESSAGE_MAGIC_SIGNED_TIMED;
+  return signedFrame ? sizeof(AuthTrailer) : 0;
+}
+
+void Communications::updateTimeSync() {
+  if (!timeSyncEnabled || timeMaster) return;
+
+  unsigned long now = millis();
+  if ((long)(now - nextTimeSyncAt) < 0) return;
+
+  // A request still unanswered is given up, its reply would be stale
+  TimeRequest request = { (uint32_t)micros() };
+  timeRequestT1 = request.t1;
+  timeRequestPending = true;
+  timeStats.requests++;
+  send(masterMac, TIME_REQUEST_MSG_TYPE, request, TX_PRIORITY_ACK);
+
+  if (timeSampleCount < TIME_SYNC_SAMPLES) {
+    nextTimeSyncAt = now + TIME_SYNC_ACQUIRE_MS;
+  } else {
+    nextTimeSyncAt = now + TIME_SYNC_INTERVAL_MS * 3 / 4 + esp_random() % (TIME_SYNC_INTERVAL_MS / 2);
+  }
+}
+
+void Communications::handleTimeRequest(const uint8_t* mac, const TimeRequest& request) {
+  TimeReply reply = { request.t1, networkAt(rxAt), 0 };
+  reply.t3 = networkMicros();
+  send(mac, TIME_REPLY_MSG_TYPE, reply, TX_PRIORITY_ACK);
+}
+
+void Communications::handleTimeReply(const uint8_t* mac, const TimeReply& reply) {
+  if (!timeRequestPending || reply.t1 != timeRequestT1 || memcmp(mac, masterMac, 6) != 0) return;
+  timeRequestPending = false;
+  timeStats.replies++;
+
+  uint32_t t4 = rxAt;
+  int32_t delay = (int32_t)(t4 - reply.t1) - (int32_t)(reply.t3 - reply.t2);
+  if (delay < 0) delay = 0;
+
+  TimeSample sample = { t4, reply.t2 - reply.t1 - delay / 2, delay };
+  addTimeSample(sample);
+}
+
+void Communications::addTimeSample(const TimeSample& sample) {
+  timeStats.delayUs = sample.delay;
+
+  if (timeSampleCount > 0) {
+    int32_t error = sample.offset - (networkAt(sample.at) - sample.at);
+    timeStats.errorUs = error;
+    if (abs(error) > TIME_SYNC_STEP_US + sample.delay / 2) {
+      Serial.printf("Master clock moved by %d us, resyncing\n", (int)error);
+      timeSampleCount = 0;
+      timeSampleNext = 0;
+      timeDriftPpb = 0;
+      timeStats.steps++;
+    }
+  }
+
+  timeSamples[timeSampleNext] = sample;
+  timeSampleNext = (timeSampleNext + 1) % TIME_SYNC_SAMPLES;
+  if (timeSampleCount < TIME_SYNC_SAMPLES) timeSampleCount++;
+
+  fitTime();
+  timeStats.synced = true;
+}
+
+// Weighted least squares relative to the newest exchange; the drift is kept
+// as it was until the exchanges span TIME_SYNC_DRIFT_SPAN_MS
+void Communications::fitTime() {
+  const TimeSample& newest = timeSamples[(timeSampleNext + TIME_SYNC_SAMPLES - 1) % TIME_SYNC_SAMPLES];
+
+  int32_t fastest = INT32_MAX;
+  for (int i = 0; i < timeSampleCount; i++) {
+    fastest = min(fastest, timeSamples[i].delay);
+  }
+
+  int32_t first = 0;
+  double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i < timeSampleCount; i++) {
+    const TimeSample& sample = timeSamples[i];
+    double spread = sample.delay - fastest + TIME_SYNC_DELAY_SLACK_US;
+    double w = 1 / (spread * spread);
+    double x = (int32_t)(sample.at - newest.at);
+    double y = (int32_t)(sample.offset - newest.offset);
+    first = min(first, (int32_t)(sample.at - newest.at));
+    sw += w;
+    sx += w * x;
+    sy += w * y;
+    sxx += w * x * x;
+    sxy += w * x * y;
+  }
+
+  double slope = timeDriftPpb / 1e9;
+  if (timeSampleCount >= 2 && -first >= TIME_SYNC_DRIFT_SPAN_MS * 1000L) {
+    slope = (sw * sxy - sx * sy) / (sw * sxx - sx * sx);
+    slope = constrain(slope, -TIME_SYNC_MAX_DRIFT_PPB / 1e9, TIME_SYNC_MAX_DRIFT_PPB / 1e9);
+  }
+
+  timeRefAt = newest.at;
+  timeOffset = newest.offset + (int32_t)lround((sy - slope * sx) / sw);
+  timeDriftPpb = (int32_t)lround(slope * 1e9);
+  timeStats.driftPpb = timeDriftPpb;
+}
+
+// sentAt is the direct sender's network time when its driver got the frame
+void Communications::noteSentAt(const uint8_t* mac, uint32_t sentAt) {
+  if (sentAt == 0) return;
+
+  if (!timeStats.synced) {
+    if (memcmp(mac, masterMac, 6) == 0) {
+      timeRefAt = rxAt;
+      timeOffset = sentAt - rxAt;
+    }
+    return;
+  }
+
+  int32_t latency = networkAt(rxAt) - sentAt;
+  if (abs(latency) > TIME_SYNC_STEP_US) {
+    timeStats.hopOutliers++;
+    // The master restarted, or this clock is off: ask now rather than at the next exchange
+    unsigned long now = millis();
+    if (!timeMaster && memcmp(mac, masterMac, 6) == 0 && (long)(nextTimeSyncAt - now) > TIME_SYNC_ACQUIRE_MS) {
+      nextTimeSyncAt = now;
+    }
+    return;
+  }
+
+  if (timeStats.hopSamples == 0 || latency < timeStats.hopMinUs) timeStats.hopMinUs = latency;
+  if (timeStats.hopSamples == 0 || latency > timeStats.hopMaxUs) timeStats.hopMaxUs = latency;
+  timeStats.hopSamples++;
+  timeStats.hopTotalUs += latency;
+}
+
+// === Signed frames ===
+// Every board holds the same key and signs each frame as it goes to the
+// driver: a counter that only grows, then a SipHash-2-4 tag over the
+// sender's MAC and the frame, cut to AUTH_TAG_BYTES. A receiver keeps the
+// last counter of everyone it hears from and drops a frame whose counter is
+// not above it, which also drops the copies the driver's retries deliver
+// twice. Counters are reserved in NVS AUTH_COUNTER_BLOCK at a time, so one
+// write covers that many frames and a restart skips the rest of the block.
+// update() reserves the next block once half of one is used: frames are
+// signed wherever the queue is pumped, which may be the Wi-Fi task, and
+// that must not wait for a flash write.
+// The last counters of others are only kept in RAM. A board that restarts
+// knows none, and a recorded frame would pass as the first it hears. So it
+// takes only discovery, beacons and time sync from a sender until it has
+// challenged it: a broadcast with a random nonce, answered with the nonce
+// and the sender's next counter. Every frame recorded before has a lower one.
+
+void Communications::enableAuth(const uint8_t* key) {
+  memcpy(authKey, key, AUTH_KEY_BYTES); // little-endian, as SipHash reads its key
+  authStore.begin("coms", true);
+  authCounter = (uint32_t)authStore.getLong("authCounter", 0);
+  authStore.end();
+  authReserved = authCounter;
+  reserveCounters();
+  authSenderCount = 0;
+  authEnabled = true;
+}
+
+// Frames already queued are still signed on the way out
+void Communications::disableAuth() {
+  authEnabled = false;
+}
+
+const AuthStats& Communications::getAuthStats() const {
+  return authStats;
+}
+
+// The block after the reserved one, written before the counters are used
+void Communications::reserveCounters() {
+  uint32_t reserved = authReserved + AUTH_COUNTER_BLOCK;
+  authStore.begin("coms", false);
+  authStore.putLong("authCounter", (long)reserved);
+  authStore.end();
+  portENTER_CRITICAL(&txLock);
+  authReserved = reserved;
+  authStats.reserved++;
+  portEXIT_CRITICAL(&txLock);
+}
+
+// Under txLock, so counters go out in the order they are taken
+bool Communications::takeCounter(TxEntry& entry) {
+  MessageHeader header;
+  memcpy(&header, entry.frame, sizeof(header));
+  if (trailerLength(header) == 0) return true; // queued before enableAuth()
+
+  if (authCounter == authReserved) return false;
+
+  AuthTrailer* trailer = (AuthTrailer*)(entry.frame + entry.length - sizeof(AuthTrailer));
+  uint32_t counter = authCounter++;
+  memcpy(&trailer->counter, &counter, sizeof(counter));
+  return true;
+}
+
+// Outside txLock, on the caller's copy of the frame
+void Communications::signFrame(TxEntry& entry) {
+  MessageHeader header;
+  memcpy(&header, entry.frame, sizeof(header));
+  if (trailerLength(header) == 0) return;
+
+  AuthTrailer* trailer = (AuthTrailer*)(entry.frame + entry.length - sizeof(AuthTrailer));
+  computeTag(ownMac, entry.frame, entry.length - AUTH_TAG_BYTES, trailer->tag);
+}
+
+bool Communications::verifyFrame(const uint8_t* mac, const uint8_t* data, int len, bool signedFrame) {
+  if (!signedFrame) {
+    authStats.unsignedFrames++;
+    return false;
+  }
+
+  const AuthTrailer* trailer = (const AuthTrailer*)(data + len - sizeof(AuthTrailer));
+  uint8_t tag[AUTH_TAG_BYTES];
+  computeTag(mac, data, len - AUTH_TAG_BYTES, tag);
+  uint8_t difference = 0;
+  for (int i = 0; i < AUTH_TAG_BYTES; i++) difference |= tag[i] ^ trailer->tag[i];
+  if (difference) {
+    authStats.forged++;
+    return false;
+  }
+
+  MessageHeader header;
+  memcpy(&header, data, sizeof(header));
+  // Answered whoever asks, counter or not: a replayed challenge only costs one
+  if (header.type == AUTH_CHALLENGE_MSG_TYPE) return true;
+
+  uint32_t counter;
+  memcpy(&counter, &trailer->counter, sizeof(counter));
+  int slot = findAuthSender(mac);
+
+  if (header.type == AUTH_RESPONSE_MSG_TYPE) {
+    AuthChallenge response;
+    if (!findChallenge(data + headerLength(header), header.length, ownMac, response)) return false; // other boards' challenges
+
+    if (slot < 0 || authSenders[slot].synced || authSenders[slot].nonce == 0 || response.nonce != authSenders[slot].nonce) {
+      authStats.replayed++;
+      return false;
+    }
+    authSenders[slot].synced = true;
+    authSenders[slot].counter = counter;
+    authSenders[slot].heardAt = millis();
+    authStats.accepted++;
+    return false; // nothing to dispatch
+  }
+
+  // Before a challenge too, or the driver's duplicates of a time request would each get a reply
+  if (slot >= 0 && (int32_t)(counter - authSenders[slot].counter) <= 0) {
+    authStats.replayed++;
+    return false;
+  }
+
+  if (slot < 0) {
+    if (authSenderCount < maxAuthSenders) {
+      slot = authSenderCount++;
+    } else {
+      // Peers keep their counters, or their next command would wait for another challenge.
+      // A sender without one goes first, it costs nothing to forget.
+      for (int i = 0; i < authSenderCount; i++) {
+        if (isKnownPeer(authSenders[i].mac)) continue;
+        if (slot < 0 || authSenders[i].synced < authSenders[slot].synced
+            || (authSenders[i].synced == authSenders[slot].synced && (long)(authSenders[i].heardAt - authSenders[slot].heardAt) < 0)) {
+          slot = i;
+        }
+      }
+    }
+    memset(&authSenders[slot], 0, sizeof(AuthSender));
+    memcpy(authSenders[slot].mac, mac, 6);
+  }
+  authSenders[slot].counter = counter;
+  authSenders[slot].heardAt = millis();
+
+  if (!authSenders[slot].synced) {
+    // Boards still find each other, their routes and the time meanwhile: a recorded one of these
+    // only announces a board that exists, asks for a reply, or answers a request no longer pending
+    if (isDiscoveryMessage(header.type) || header.type == RELAY_BEACON_MSG_TYPE
+        || header.type == TIME_REQUEST_MSG_TYPE || header.type == TIME_REPLY_MSG_TYPE) {
+      authStats.accepted++;
+      return true;
+    }
+    authStats.unsynced++;
+    return false;
+  }
+
+  authStats.accepted++;
+  return true;
+}
+
+int Communications::findAuthSender(const uint8_t* mac) const {
+  for (int i = 0; i < authSenderCount; i++) {
+    if (memcmp(authSenders[i].mac, mac, 6) == 0) return i;
+  }
+  return -1;
+}
+
+// A sender without a counter is challenged after its frame was dropped, and
+// a peer as soon as it is heard; again every AUTH_CHALLENGE_RETRY_MS until
+// the response comes
+void Communications::challengeSender(const uint8_t* mac, bool dropped) {
+  int slot = findAuthSender(mac);
+  if (slot < 0 || authSenders[slot].synced) return;
+  if (!dropped && !isKnownPeer(mac)) return;
+
+  AuthSender& sender = authSenders[slot];
+  unsigned long now = millis();
+  if (sender.nonce != 0 && now - sender.challengedAt < AUTH_CHALLENGE_RETRY_MS) return;
+
+  uint32_t nonce = esp_random() | 1; // never 0, which stands for not challenged yet
+  if (!addToBatch(authChallenges, mac, nonce)) return;
+  sender.nonce = nonce;
+  sender.challengedAt = now;
+  authStats.challenges++;
+}
+
+// Only the receive callback touches the sender table, so a peer that has
+// not answered is asked again on whatever frame comes in next
+void Communications::retryChallenges() {
+  for (int i = 0; i < authSenderCount; i++) {
+    if (!authSenders[i].synced && authSenders[i].nonce != 0) challengeSender(authSenders[i].mac, false);
+  }
+}
+
+// An entry for the same board is replaced: the challenger keeps only its
+// latest nonce
+bool Communications::addToBatch(AuthBatch& batch, const uint8_t* to, uint32_t nonce) {
+  portENTER_CRITICAL(&txLock);
+  int i = 0;
+  while (i < batch.count && memcmp(batch.entries[i].to, to, 6) != 0) i++;
+  bool added = i < AUTH_CHALLENGES_PER_FRAME;
+  if (added) {
+    memcpy(batch.entries[i].to, to, 6);
+    batch.entries[i].nonce = nonce;
+    if (i == batch.count) batch.count++;
+  }
+  portEXIT_CRITICAL(&txLock);
+  return added;
+}
+
+// After a restart many boards challenge at once. Entries gather while a frame
+// of the batch's type still waits for the channel, so one takes them all.
+void Communications::sendBatch(AuthBatch& batch, uint8_t type) {
+  AuthChallenge entries[AUTH_CHALLENGES_PER_FRAME];
+  uint8_t count = 0;
+  portENTER_CRITICAL(&txLock);
+  bool waiting = false;
+  for (int i = 0; i < txCount && !waiting; i++) {
+    MessageHeader header;
+    memcpy(&header, txQueue[i].frame, sizeof(header));
+    waiting = header.type == type;
+  }
+  if (!waiting) {
+    count = batch.count;
+    memcpy(entries, batch.entries, count * sizeof(AuthChallenge));
+    batch.count = 0;
+  }
+  portEXIT_CRITICAL(&txLock);
+  if (count == 0) return;
+
+  // Behind acks and time replies, like the discovery that precedes them
+  enqueue(broadcastAddr, broadcastAddr, type, (const uint8_t*)entries, count * sizeof(AuthChallenge), TX_PRIORITY_DISCOVERY);
+}
+
+bool Communications::findChallenge(const uint8_t* payload, uint8_t length, const uint8_t* to, AuthChallenge& found) {
+  if (length % sizeof(AuthChallenge) != 0) return false;
+  for (int offset = 0; offset < length; offset += sizeof(AuthChallenge)) {
+    memcpy(&found, payload + offset, sizeof(found));
+    if (memcmp(found.to, to, 6) == 0) return true;
+  }
+  return false;
+}
+
+void Communications::computeTag(const uint8_t* mac, const uint8_t* frame, int length, uint8_t* tag) const {
+  uint8_t message[6 + 250];
+  memcpy(message, mac, 6);
+  memcpy(message + 6, frame, length);
+  uint64_t hash = sipHash(authKey, message, 6 + length);
+  memcpy(tag, &hash, AUTH_TAG_BYTES);
+}
+
+static inline uint64_t rotl(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
 
-  Serial.printf("Sent discovery response to %s\n", macToString(mac).c_str());
+#define SIP_ROUND(v0, v1, v2, v3) \
+  do { \
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+  } while (0)
+
+// Little-endian reads, like the ESP32 and the PC
+uint64_t Communications::sipHash(const uint64_t key[2], const uint8_t* data, size_t length) {
+  uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+
+  size_t whole = length & ~(size_t)7;
+  for (size_t i = 0; i < whole; i += 8) {
+    uint64_t m;
+    memcpy(&m, data + i, 8);
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  uint64_t last = (uint64_t)length << 56;
+  for (size_t i = whole; i < length; i++) {
+    last |= (uint64_t)data[i] << (8 * (i - whole));
+  }
+  v3 ^= last;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; i++) SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// === Capture ===
+// A writer takes the next record number atomically, so the Wi-Fi task and
+// loop() can both record without a lock: the copy into the slot is all the
+// cost a frame pays. The dump skips a slot whose seq changed while it read it.
+
+void Communications::enableCapture(CaptureRecord* ring, uint16_t records) {
+  captureRing = nullptr;
+  memset(ring, 0, records * sizeof(CaptureRecord));
+  captureSize = records;
+  captureNext = 0;
+  __atomic_store_n(&captureRing, ring, __ATOMIC_RELEASE);
+}
+
+void Communications::disableCapture() {
+  __atomic_store_n(&captureRing, (CaptureRecord*)nullptr, __ATOMIC_RELEASE);
 }
 
+uint32_t Communications::getCaptureCount() const {
+  return __atomic_load_n(&captureNext, __ATOMIC_RELAXED);
+}
+
+void Communications::capture(uint8_t kind, const uint8_t* mac, int info, const uint8_t* frame, int length) {
+  CaptureRecord* ring = __atomic_load_n(&captureRing, __ATOMIC_ACQUIRE);
+  if (!ring) return; // disabled since the caller looked
+
+  uint32_t number = __atomic_fetch_add(&captureNext, 1, __ATOMIC_RELAXED);
+  CaptureRecord& record = ring[number % captureSize];
+
+  __atomic_store_n(&record.seq, 0, __ATOMIC_RELAXED);
+  record.at = micros();
+  memcpy(record.mac, mac, 6);
+  record.kind = kind;
+  record.info = info;
+  record.length = min(length, 255);
+  memcpy(record.frame, frame, min(length, CAPTURE_FRAME_BYTES));
+  __atomic_store_n(&record.seq, number + 1, __ATOMIC_RELEASE);
+}
+
+// CAPTURE/1 <name> <mac> relay=<0|1> time=<0|1>
+// PEER <mac> <name> <class> <version>        every known peer, in discovery order
+// CAP <seq> <micros> <R|T|S> <info> <mac> <length> <hex of the kept bytes>
+// CAPTURE/END <records> <lost>               lost: overwritten or torn while printing
+void Communications::dumpCapture(Print& out) {
+  CaptureRecord* ring = captureRing;
+  if (!ring) {
+    out.println("CAPTURE/OFF");
+    return;
+  }
+  disableCapture();
+
+  char mac[18];
+  formatMac(ownMac, mac);
+  out.printf("CAPTURE/1 %s %s relay=%d time=%d\n", deviceName, mac, relayEnabled, timeSyncEnabled);
+  for (int i = 0; i < peerCount; i++) {
+    formatMac(knownPeers[i].mac, mac);
+    out.printf("PEER %s %s %u %u\n", mac, knownPeers[i].name, knownPeers[i].deviceClass, knownPeers[i].version);
+  }
+
+  uint32_t next = captureNext;
+  uint32_t first = next > captureSize ? next - captureSize : 0;
+  uint32_t printed = 0;
+  char hex[CAPTURE_FRAME_BYTES * 2 + 1];
+  for (uint32_t number = first; number < next; number++) {
+    CaptureRecord record = ring[number % captureSize];
+    if (record.seq != number + 1) continue;
+
+    int kept = min((int)record.length, CAPTURE_FRAME_BYTES);
+    for (int i = 0; i < kept; i++) {
+      snprintf(hex + i * 2, 3, "%02x", record.frame[i]);
+    }
+    hex[kept * 2] = '\0';
+    formatMac(record.mac, mac);
+    out.printf("CAP %u %u %c %d %s %u %s\n", (unsigned)number, (unsigned)record.at, record.kind, record.info, mac,
+               record.length, hex);
+    printed++;
+  }
+  out.printf("CAPTURE/END %u %u\n", (unsigned)printed, (unsigned)(next - printed));
+
+  __atomic_store_n(&captureRing, ring, __ATOMIC_RELEASE);
+}
@@ -1,6 +1,6 @@
 #include "Communications.h"
 
-Communications coms;
+CommunicationsFor<ServerCapacity> coms; // room for 10 peers, see Capacity.h
 
 struct MyPayload {
   int value;
@@ -11,6 +11,7 @@ void setup() {
   Serial.begin(115200);
   coms.begin();
   coms.setName("radiator");
+  coms.setDeviceClass(DEVICE_CLASS_RADIATOR); // what discovery announces; the name goes to peers that ask
 
   coms.setReceiveHandler([](const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
     if (type == 1 && len == sizeof(MyPayload)) {
@@ -20,7 +21,7 @@ void setup() {
     }
   });
 
-  coms.setSendHandler([](const uint8_t* mac, esp_now_send_status_t status) {
+  coms.setSendHandler([](const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
     Serial.println(status == ESP_NOW_SEND_SUCCESS ? "Sent OK!" : "Send Failed.");
   });
 
@@ -28,6 +29,8 @@ void setup() {
 }
 
 void loop() {
+  coms.update(); // sends what the transmit queue held back
+
   for (int i = 0; i < coms.getPeerCount(); ++i) {
     const Peer* p = coms.getPeer(i);
     Serial.printf("Peer %d: %s [%s]\n", i, p->name, Communications::macToString(p->mac).c_str());
@@ -5,22 +5,203 @@
 #include <esp_now.h>
 #include <esp_wifi.h>
 #include <WiFi.h>
-#include <functional>
+#include "Capacity.h"
+#include <Preferences.h>
+#include "Delegate.h"
 
-#define MAX_PEERS 10
 #define MAX_NAME_LEN 32
-#define DISCOVERY_MSG_TYPE 0
+#define DISCOVERY_MSG_TYPE 0 // name-based DiscoveryPayload, still understood and answered in kind
 #define MESSAGE_MAGIC 0x42A7
-#define MAX_WHITELIST 4
+#define UNKNOWN_MSG_TYPE 0xFF // given to the send handler for a result whose frame is no longer tracked
+
+// Discovery by device class (CompactDiscovery); a name other than the class's is asked for once
+#define DISCOVERY_COMPACT_MSG_TYPE 0xF4
+#define NAME_REQUEST_MSG_TYPE 0xF5 // no payload
+#define NAME_REPLY_MSG_TYPE 0xF6 // the sender's name, without the terminating zero
+#define DISCOVERY_VERSION 1 // 0 stands for the name-based discovery
+#define DISCOVERY_RESPONSE 0x80 // in CompactDiscovery::flags, the rest are DISCOVERY_CAP_* bits
+#define DISCOVERY_CAP_RELAY 0x01
+#define DISCOVERY_CAP_TIME_SYNC 0x02
+#define DISCOVERY_CAP_SIGNED 0x04
+#define DISCOVERY_CAP_NAMED 0x08 // the sender's name is not its class's, ask for it
+
+// Transmit queue in front of esp_now_send, Capacity::txQueue frames long
+#define TX_MAX_WINDOW 8
+#define TX_WINDOW 4 // frames handed to the driver and not yet reported sent
+#define TX_BURST 4 // frames that may go out back to back
+#define TX_PACE_US 2000 // then one frame per this long
+#define TX_INFLIGHT_TIMEOUT_MS 1000 // a send callback that never came frees its window slot after this
+
+// Relaying (enableRelay): radiators out of the server's range reach it through one or two others
+#define RELAY_BEACON_MSG_TYPE 0xF0 // link-cost heartbeat of a relaying node
+#define RELAY_FORWARD_MSG_TYPE 0xF1 // a message carried through other radiators
+#define MAX_RELAY_HOPS 2 // radiators a relayed message may pass through
+#define RELAY_BEACON_INTERVAL_MS 10000 // jittered by +-25%
+#define RELAY_NEIGHBOR_TIMEOUT_MS 45000 // a neighbor not heard from for this long is dropped
+#define RELAY_SWITCH_MARGIN 2 // a new path must be this much cheaper to replace the current one
+#define RELAY_NO_ROUTE 0xFF
+
+// Time sync (enableTimeSync): every node keeps the master's micros() as its network time
+#define MESSAGE_MAGIC_TIMED 0x42A8 // header followed by the sender's network time, see TimedHeader
+#define TIME_REQUEST_MSG_TYPE 0xF2
+#define TIME_REPLY_MSG_TYPE 0xF3
+#define TIME_SYNC_SAMPLES 8 // exchanges the offset and drift are fitted to
+#define TIME_SYNC_ACQUIRE_MS 2000 // between exchanges until TIME_SYNC_SAMPLES replies came
+#define TIME_SYNC_INTERVAL_MS 30000 // then, jittered by +-25%
+#define TIME_SYNC_DRIFT_SPAN_MS 60000 // exchanges the drift is fitted to must span this long
+#define TIME_SYNC_DELAY_SLACK_US 500 // an exchange counts 1 / (its delay over the fastest + this)^2 in the fit
+#define TIME_SYNC_STEP_US 20000 // an offset this far off the fit means the master restarted, start over
+#define TIME_SYNC_MAX_DRIFT_PPB 500000 // crystals are good to a few tens of ppm, anything past this is noise
+
+// Signed frames (enableAuth): a tag from a key every board shares, and a counter against replays
+#define MESSAGE_MAGIC_SIGNED 0x42A9 // header and payload followed by an AuthTrailer
+#define MESSAGE_MAGIC_SIGNED_TIMED 0x42AA // TimedHeader and payload followed by an AuthTrailer
+#define AUTH_KEY_BYTES 16
+#define AUTH_TAG_BYTES 4 // of the 8 B SipHash-2-4; a forged frame gets through once in 2^32 tries
+#define AUTH_COUNTER_BLOCK 1024 // counters reserved in NVS at a time, so a restart never reuses one
+#define AUTH_CHALLENGE_MSG_TYPE 0xF7 // AuthChallenge, asks a sender for a counter it has not used yet
+#define AUTH_RESPONSE_MSG_TYPE 0xF8 // AuthChallenges sent back, signed with that counter
+#define AUTH_CHALLENGES_PER_FRAME 23 // in one challenge or response; past that a challenger asks again
+#define AUTH_CHALLENGE_RETRY_MS 1000 // between challenges to a sender that has not answered
+
+// Capture (enableCapture): every frame sent and received, and every send result, in a ring
+#define CAPTURE_FRAME_BYTES 79 // frame bytes kept per record, which makes a record 96 B and keeps a timed, relayed discovery whole
 
 typedef struct {
   uint16_t magic;
-  uint8_t type; // 0 = discovery, user-defined types > 0
+  uint8_t type; // 0 = discovery, user-defined types > 0, 0xF0 and up = relaying, time sync and discovery
   uint8_t length; // length of the payload
 } MessageHeader;
 
+// Header of every frame a node with time sync sends
+typedef struct {
+  MessageHeader header; // magic is MESSAGE_MAGIC_TIMED or MESSAGE_MAGIC_SIGNED_TIMED
+  uint32_t sentAt; // sender's network time when handed to the driver, 0 while it is not synced
+} TimedHeader;
+
+// Queued frames go out highest class first, in order within a class
+enum TxPriority : uint8_t {
+  TX_PRIORITY_COMMAND, // user commands
+  TX_PRIORITY_ACK,
+  TX_PRIORITY_DISCOVERY,
+  TX_PRIORITY_TELEMETRY, // relay beacons
+  TX_PRIORITY_COUNT
+};
+
+struct TxStats {
+  uint32_t sent; // frames handed to the driver
+  uint32_t dropped[TX_PRIORITY_COUNT]; // queue full, pushed out by a higher class, or refused by the driver
+  uint32_t driverBusy; // times the driver was out of buffers, the frame stayed queued
+  uint32_t expired; // send callbacks that never came
+  uint32_t waitMaxUs; // longest a frame waited in the queue
+  uint64_t waitTotalUs;
+  uint8_t depth; // frames queued now
+  uint8_t depthPeak;
+  uint8_t inFlightPeak;
+};
+
+// A frame waiting in the transmit queue
+struct TxEntry {
+  uint8_t hop[6];
+  uint8_t dest[6]; // reported to the send handler instead of hop
+  bool forwarded; // someone else's message, not reported
+  uint8_t type; // reported with dest: the carried message's when relayed
+  uint8_t priority;
+  uint8_t length;
+  uint32_t order;
+  unsigned long queuedAt; // micros()
+  uint8_t frame[250];
+};
+
+struct TimeStats {
+  bool synced;
+  uint32_t requests; // exchanges started
+  uint32_t replies;
+  uint32_t steps; // times the master's clock jumped and the fit started over
+  int32_t delayUs; // round trip of the last exchange, without the master's turnaround
+  int32_t errorUs; // last exchange's offset against the fit before it, the sync error
+  int32_t driftPpb; // this clock against the master's, positive when it runs slow
+  // One-way latency of timed frames received from a synced sender, driver to driver, per radio hop
+  uint32_t hopSamples;
+  int64_t hopTotalUs;
+  int32_t hopMinUs; // negative when the clocks disagree by more than the latency
+  int32_t hopMaxUs;
+  uint32_t hopOutliers; // off by more than TIME_SYNC_STEP_US, mostly a clock that jumped and is not synced again yet
+};
+
+// Ends every signed frame. The tag covers the sender's MAC and the whole
+// frame up to it, counter included.
+struct AuthTrailer {
+  uint32_t counter; // the sender's, higher in every frame it sends
+  uint8_t tag[AUTH_TAG_BYTES];
+};
+
+// Last counter taken from a sender; a frame must come with a higher one.
+// Until the sender answered a challenge there is none, see verifyFrame().
+struct AuthSender {
+  uint8_t mac[6];
+  bool synced; // counter is one the sender used after this board started
+  uint32_t counter;
+  uint32_t nonce; // of the last challenge, 0 before the first
+  unsigned long challengedAt; // millis()
+  unsigned long heardAt; // millis(), the least recently heard non-peer makes room for a new one
+};
+
+// Broadcast both ways, so neither board needs the other in the driver's peer
+// list. A frame carries every challenge, or every answer, since the last update().
+struct __attribute__((packed)) AuthChallenge {
+  uint8_t to[6]; // the board asked for a counter; in the response, the board that asked
+  uint32_t nonce;
+};
+
+// Gathered in the receive callback and sent from update(), under txLock
+struct AuthBatch {
+  AuthChallenge entries[AUTH_CHALLENGES_PER_FRAME];
+  uint8_t count;
+};
+
+struct AuthStats {
+  uint32_t accepted;
+  uint32_t unsignedFrames; // dropped, sent without a key
+  uint32_t forged; // dropped, the tag did not match
+  uint32_t replayed; // dropped, counter not above the sender's last; also the driver's own duplicates
+  uint32_t unsynced; // dropped, no counter from the sender since this board started
+  uint32_t challenges; // sent to senders without a counter
+  uint32_t reserved; // counter blocks written to NVS
+};
+
+enum CaptureKind : uint8_t {
+  CAPTURE_RX = 'R', // frame received, info is its RSSI
+  CAPTURE_TX = 'T', // frame handed to the driver, info is 0 when it took the frame, -1 when it refused it
+  CAPTURE_SENT = 'S' // send callback, info is the esp_now_send_status_t, no frame
+};
+
+// One slot of the capture ring. Written from whichever task the frame is on:
+// seq is 0 while the slot is being filled, then the record's number + 1.
+struct CaptureRecord {
+  uint32_t seq;
+  uint32_t at; // micros()
+  uint8_t mac[6]; // sender, or next hop
+  uint8_t kind; // CaptureKind
+  int8_t info;
+  uint8_t length; // of the whole frame, header included; past CAPTURE_FRAME_BYTES only the start is kept
+  uint8_t frame[CAPTURE_FRAME_BYTES];
+};
+
+enum DeviceClass : uint8_t {
+  DEVICE_CLASS_UNKNOWN, // also a name-based board whose name is no class's
+  DEVICE_CLASS_SERVER,
+  DEVICE_CLASS_RADIATOR,
+  DEVICE_CLASS_COUNT
+};
+
 struct Peer {
   uint8_t mac[6];
+  uint8_t deviceClass; // DeviceClass
+  uint8_t version; // of the discovery it speaks, 0 for the name-based one
+  uint8_t caps; // DISCOVERY_CAP_* bits
+  uint8_t instance;
+  bool named; // name is the peer's own, not its class's
   char name[MAX_NAME_LEN];
 };
 
@@ -29,60 +210,357 @@ struct DiscoveryPayload {
   bool isResponse; // true if this is a reply
 };
 
+// A newer version may append fields; the first four stay
+struct CompactDiscovery {
+  uint8_t version; // DISCOVERY_VERSION of the sender
+  uint8_t deviceClass; // DeviceClass
+  uint8_t flags; // DISCOVERY_RESPONSE and the sender's DISCOVERY_CAP_* bits
+  uint8_t instance; // tells boards of one class apart, 0 when unused
+};
+
+// Broadcast by relaying nodes; the sender's path to the server
+struct RelayBeacon {
+  uint8_t root[6]; // the server's MAC, zero while the sender has no path
+  uint8_t cost; // path cost to the server, 0 from the server, RELAY_NO_ROUTE without a path
+  uint8_t hops; // radio hops to the server
+  uint8_t route[MAX_RELAY_HOPS][6]; // radiators between the sender and the server, nearest first
+};
+
+// Precedes the carried message in a RELAY_FORWARD_MSG_TYPE payload
+struct RelayHeader {
+  uint8_t origin[6];
+  uint8_t dest[6];
+  uint8_t route[MAX_RELAY_HOPS][6]; // radiators in the order the message passes them
+  uint8_t hops; // entries of route in use
+  uint8_t ttl; // forwards left
+  uint16_t seq; // per origin, for duplicate suppression
+  uint8_t type; // of the carried message
+  uint8_t length;
+};
+
+struct Neighbor {
+  uint8_t mac[6];
+  int16_t rssi; // dBm, smoothed over received frames
+  uint8_t fails; // sends to it that failed in a row
+  uint8_t cost; // its path cost to the server, from its beacon
+  uint8_t hops;
+  uint8_t route[MAX_RELAY_HOPS][6];
+  bool beaconed; // cost, hops and route are known
+  unsigned long lastHeard;
+};
+
+// The server's path to a radiator, from what the radiator last advertised or used
+struct RelayRoute {
+  uint8_t mac[6];
+  uint8_t hops; // radiators in between, 0 when direct
+  uint8_t route[MAX_RELAY_HOPS][6]; // nearest the server first
+};
+
+// Times are written again when the frame goes to the driver, unless relayed
+struct TimeRequest {
+  uint32_t t1; // requester's micros() when sent
+};
+
+struct TimeReply {
+  uint32_t t1; // from the request
+  uint32_t t2; // master's network time when the request arrived
+  uint32_t t3; // and when the reply was sent
+};
+
+// Handlers run in the Wi-Fi task on every frame; see Delegate.h for what a lambda may capture
+typedef Delegate<void(const uint8_t* mac, uint8_t type, const uint8_t* data, int len)> ReceiveHandler;
+typedef Delegate<void(const uint8_t* mac, uint8_t type, esp_now_send_status_t status)> SendHandler;
+typedef Delegate<void(const Peer& peer)> DiscoveryHandler;
+
+// Declare a CommunicationsFor<Capacity>, which holds the tables; this class
+// only points at them, so the code does not depend on their size
 class Communications {
 public:
   static const uint8_t broadcastAddr[6];
 
-  Communications();
-
   void begin();
   void broadcastDiscovery();
-  esp_err_t send(const uint8_t* addr, uint8_t type, const uint8_t* payload, uint8_t length);
+  // Queues the message; ESP_OK once queued, the send handler gets the outcome
+  esp_err_t send(const uint8_t* addr, uint8_t type, const uint8_t* payload, uint8_t length, TxPriority priority = TX_PRIORITY_COMMAND);
   template <typename T>
-  esp_err_t send(const uint8_t* addr, uint8_t type, const T& payload) {
+  esp_err_t send(const uint8_t* addr, uint8_t type, const T& payload, TxPriority priority = TX_PRIORITY_COMMAND) {
     static_assert(sizeof(T) <= 248, "Payload too large for ESP-NOW");
 
-    return send(addr, type, reinterpret_cast<const uint8_t*>(&payload), sizeof(T));
+    return send(addr, type, reinterpret_cast<const uint8_t*>(&payload), sizeof(T), priority);
   }
   void sendDiscoveryResponse(const uint8_t* mac);
 
-  void setReceiveHandler(std::function<void(const uint8_t* mac, uint8_t type, const uint8_t* data, int len)> handler);
-  void setSendHandler(std::function<void(const uint8_t*, esp_now_send_status_t)> handler);
-  void setDiscoveryHandler(std::function<void(const Peer&)> handler);
+  void enableRelay(bool root = false); // root: this is the server the paths lead to
+  void update(); // call from loop(), sends what the window and pacing held back, and relay beacons
+
+  void setTxWindow(uint8_t frames); // up to TX_MAX_WINDOW
+  void setTxPacing(uint8_t burst, uint32_t intervalUs); // intervalUs 0: no pacing
+  const TxStats& getTxStats() const;
+
+  // Two-way exchanges with master give this node the master's clock, see
+  // networkMicros(). nullptr: this node is the master. Every node then sends
+  // timed headers, so set it on all of them.
+  void enableTimeSync(const uint8_t* master = nullptr);
+  bool isTimeSynced() const;
+  uint32_t networkMicros() const; // the master's micros(), this node's own until synced; wraps like micros()
+  const TimeStats& getTimeStats() const;
+  static size_t headerLength(const MessageHeader& header); // of a received frame
+  static size_t trailerLength(const MessageHeader& header); // sizeof(AuthTrailer) when signed, else 0
 
-  void setName(const char* name);
-  void addToDiscoveryWhitelist(const char* name);
+  // Signs every frame sent with key and drops every frame received without
+  // a valid tag or with a counter its sender used before. The counter is
+  // kept across restarts in the NVS namespace "coms". After a restart only
+  // discovery, relay beacons and time sync are taken from a sender until it
+  // answered a challenge with a counter it had not used before. Set the same key on all
+  // boards; call it before the first send. Peers stay unencrypted in the
+  // driver, so its limit on encrypted peers does not apply.
+  void enableAuth(const uint8_t* key);
+  void disableAuth();
+  const AuthStats& getAuthStats() const;
+  static uint64_t sipHash(const uint64_t key[2], const uint8_t* data, size_t length); // SipHash-2-4
+
+  // Records every frame into ring, overwriting the oldest, until disabled.
+  // dumpCapture() prints the ring as text lines Code/sim/replay.cpp reads
+  // back into the host stack; capturing pauses while it prints.
+  void enableCapture(CaptureRecord* ring, uint16_t records);
+  void disableCapture();
+  void dumpCapture(Print& out);
+  uint32_t getCaptureCount() const; // records written since enabled, overwritten ones included
+
+  int getHops(const uint8_t* mac) const; // radio hops a message to mac takes
+  int getRxRssi() const; // dBm of the frame the receive handler is given, its last hop if relayed; 0 if unknown
+
+  void setReceiveHandler(ReceiveHandler handler);
+  void setSendHandler(SendHandler handler);
+  void setDiscoveryHandler(DiscoveryHandler handler);
+
+  void setName(const char* name); // a name other than the class's is sent once to each peer
+  void setDeviceClass(DeviceClass deviceClass, uint8_t instance = 0); // what discovery announces
+  void addToDiscoveryWhitelist(DeviceClass deviceClass); // none added: every class
+  // Broadcasts name-based discoveries, for boards whose firmware has no
+  // device classes; replies always go in the format of the discovery
+  void setLegacyDiscovery(bool legacy);
 
   int getPeerCount() const;
   const Peer* getPeer(int index) const;
   const Peer* getPeerByName(const char* name) const;
+  const Peer* getPeerByClass(DeviceClass deviceClass) const; // the first one discovered, without a search
+  static const char* className(uint8_t deviceClass);
 
   static String macToString(const uint8_t* mac);
+  static void formatMac(const uint8_t* mac, char* out); // out holds 18 chars: "AA:BB:CC:DD:EE:FF"
   static void printMac();
 
+protected:
+  Communications() = default;
+
+  // A copy shares the tables of the original until it is given its own
+  void attach(Peer* peers, uint8_t peerCapacity, TxEntry* queue, uint8_t queueCapacity, Neighbor* neighborTable, uint8_t neighborCapacity,
+              RelayRoute* routeTable, uint8_t routeCapacity, uint32_t* seenTable, uint8_t seenCapacity,
+              AuthSender* senderTable, uint8_t senderCapacity);
+
 private:
   static Communications* instance;
 
   char deviceName[MAX_NAME_LEN] = "Unknown";
+  uint8_t deviceClass = DEVICE_CLASS_UNKNOWN;
+  uint8_t instanceId = 0;
+  uint8_t ownMac[6] = {};
 
-  Peer knownPeers[MAX_PEERS];
+  Peer* knownPeers = nullptr;
+  uint8_t maxPeers = 0;
   int peerCount = 0;
+  uint8_t classPeer[DEVICE_CLASS_COUNT] = {}; // index + 1 of the first peer of each class, 0 for none
 
-  char whitelist[MAX_WHITELIST][MAX_NAME_LEN];
-  int whitelistCount = 0;
+  uint32_t discoveryClasses = 0; // bit per DeviceClass, 0: every class
+  bool legacyDiscovery = false;
 
   static void onDataRecv(const esp_now_recv_info_t* recvInfo, const uint8_t* data, int len);
   static void onDataSent(const uint8_t* mac_addr, esp_now_send_status_t status);
 
-  static bool isDiscoveryMessage(const MessageHeader& msg);
-  void handleDiscovery(const uint8_t* mac, const DiscoveryPayload& payload);
+  // Transmit queue
+  struct TxInFlight {
+    uint8_t hop[6];
+    uint8_t dest[6];
+    bool forwarded;
+    uint8_t type;
+    unsigned long sentAt; // millis()
+  };
+
+  TxEntry* txQueue = nullptr; // unordered, the next one is picked by priority and order
+  uint8_t txQueueSize = 0;
+  int txCount = 0;
+  uint32_t txOrder = 0;
+  TxInFlight inFlight[TX_MAX_WINDOW];
+  int inFlightCount = 0;
+  uint8_t txWindow = TX_WINDOW;
+  uint8_t txBurst = TX_BURST;
+  uint32_t txPaceUs = TX_PACE_US;
+  uint8_t txTokens = TX_BURST;
+  unsigned long txRefilledAt = 0; // micros()
+  TxStats txStats = {};
+  portMUX_TYPE txLock = portMUX_INITIALIZER_UNLOCKED; // the queue, the window, the pacing and the frame counter
+  bool txPumping = false; // a caller is handing frames to the driver
+
+  // Relaying
+  bool relayEnabled = false;
+  bool relayRoot = false;
+  uint8_t rootMac[6] = {};
+  bool rootKnown = false;
+
+  Neighbor* neighbors = nullptr;
+  uint8_t maxNeighbors = 0;
+  int neighborCount = 0;
+
+  uint8_t pathCost = RELAY_NO_ROUTE; // this radiator's path to the server
+  uint8_t pathHops = 0;
+  uint8_t pathRoute[MAX_RELAY_HOPS][6];
+
+  RelayRoute* routes = nullptr; // the server's paths to radiators
+  uint8_t maxRoutes = 0;
+  int routeCount = 0;
+
+  uint32_t* seen = nullptr; // ring of recently relayed messages, for duplicate suppression
+  uint8_t seenSize = 0;
+  int seenNext = 0;
+  uint16_t relaySeq = 0;
+
+  unsigned long nextBeaconAt = 0;
+
+  // Time sync
+  struct TimeSample {
+    uint32_t at; // local micros() when the reply came
+    uint32_t offset; // master's clock minus ours
+    int32_t delay;
+  };
+
+  bool timeSyncEnabled = false;
+  bool timeMaster = false;
+  uint8_t masterMac[6] = {};
+  uint32_t timeOffset = 0; // network time at timeRefAt, minus timeRefAt
+  uint32_t timeRefAt = 0;
+  int32_t timeDriftPpb = 0;
+  TimeSample timeSamples[TIME_SYNC_SAMPLES];
+  int timeSampleCount = 0;
+  int timeSampleNext = 0;
+  uint32_t timeRequestT1 = 0;
+  bool timeRequestPending = false;
+  unsigned long nextTimeSyncAt = 0;
+  unsigned long rxAt = 0; // micros() when the frame being dispatched arrived
+  TimeStats timeStats = {};
+
+  // Signed frames
+  bool authEnabled = false;
+  uint64_t authKey[2] = {};
+  uint32_t authCounter = 0; // next one to send
+  uint32_t authReserved = 0; // counters below this are reserved in NVS
+  Preferences authStore; // not the sketch's, which may have another namespace open
+  AuthSender* authSenders = nullptr;
+  uint8_t maxAuthSenders = 0;
+  int authSenderCount = 0;
+  AuthBatch authChallenges = {};
+  AuthBatch authAnswers = {};
+  AuthStats authStats = {};
+
+  // Capture
+  CaptureRecord* captureRing = nullptr; // nullptr while not capturing
+  uint16_t captureSize = 0;
+  uint32_t captureNext = 0; // number of the next record, taken atomically by the writer
+
+  esp_err_t enqueue(const uint8_t* hop, const uint8_t* dest, uint8_t type, const uint8_t* payload, uint8_t length, TxPriority priority);
+  void pumpQueue();
+  void stampFrame(TxEntry& entry);
+  bool dropQueued(int index, uint8_t* dest, uint8_t& type);
+  bool takeInFlight(const uint8_t* hop, TxInFlight& record);
+  void dropInFlight(const uint8_t* hop);
+  void expireInFlight();
+  void reportFailed(const uint8_t* dest, uint8_t type);
+
+  esp_err_t sendRelayed(const uint8_t* dest, const uint8_t route[][6], uint8_t hops, uint8_t type, const uint8_t* payload, uint8_t length, TxPriority priority);
+  void dispatch(const uint8_t* mac, uint8_t type, const uint8_t* data, uint8_t length, bool direct);
+  void handleForward(const uint8_t* data, uint8_t length);
+  void handleBeacon(const uint8_t* mac, const RelayBeacon& beacon, bool direct);
+  void sendBeacon();
+  void noteNeighbor(const uint8_t* mac, int rssi);
+  void noteSendResult(const uint8_t* mac, bool delivered);
+  Neighbor* findNeighbor(const uint8_t* mac);
+  void chooseUplink();
+  int routeTo(const uint8_t* addr, uint8_t route[][6]) const;
+  const RelayRoute* findRoute(const uint8_t* mac) const;
+  void learnRoute(const uint8_t* mac, const uint8_t route[][6], uint8_t hops);
+  void forgetRoute(const uint8_t* mac);
+  bool isDuplicate(const uint8_t* origin, uint16_t seq);
+  bool ensurePeer(const uint8_t* mac);
+  static uint8_t linkCost(const Neighbor& neighbor);
+
+  void updateTimeSync();
+  void handleTimeRequest(const uint8_t* mac, const TimeRequest& request);
+  void handleTimeReply(const uint8_t* mac, const TimeReply& reply);
+  void addTimeSample(const TimeSample& sample);
+  void fitTime();
+  uint32_t networkAt(uint32_t local) const;
+  void noteSentAt(const uint8_t* mac, uint32_t sentAt);
+
+  bool takeCounter(TxEntry& entry); // false when out of reserved counters
+  void signFrame(TxEntry& entry);
+  bool verifyFrame(const uint8_t* mac, const uint8_t* data, int len, bool signedFrame); // true: dispatch it
+  int findAuthSender(const uint8_t* mac) const;
+  void challengeSender(const uint8_t* mac, bool dropped);
+  void retryChallenges();
+  bool addToBatch(AuthBatch& batch, const uint8_t* to, uint32_t nonce); // false when full
+  void sendBatch(AuthBatch& batch, uint8_t type);
+  static bool findChallenge(const uint8_t* payload, uint8_t length, const uint8_t* to, AuthChallenge& found);
+  void reserveCounters();
+  void computeTag(const uint8_t* mac, const uint8_t* frame, int length, uint8_t* tag) const;
+
+  void capture(uint8_t kind, const uint8_t* mac, int info, const uint8_t* frame, int length);
+
+  static bool isDiscoveryMessage(uint8_t type);
+  static DeviceClass classFromName(const char* name);
+  void handleDiscovery(const Peer& found, bool isResponse);
+  void sendDiscovery(const uint8_t* mac, bool isResponse); // in the peer's format, or setLegacyDiscovery()'s
+  void requestName(const uint8_t* mac);
+  void handleName(const uint8_t* mac, uint8_t type, const uint8_t* data, uint8_t length);
+  uint8_t capabilities() const;
+  Peer* findPeer(const uint8_t* mac);
   bool isKnownPeer(const uint8_t* mac);
   bool addPeer(const uint8_t* mac);
 
-  std::function<void(const uint8_t*, uint8_t, const uint8_t*, int)> userRecvHandler;
-  std::function<void(const uint8_t*, esp_now_send_status_t)> userSendHandler;
-  std::function<void(const Peer&)> discoveryHandler;
+  ReceiveHandler userRecvHandler;
+  SendHandler userSendHandler;
+  DiscoveryHandler discoveryHandler;
+  int8_t rxRssi = 0;
+
+};
+
+// Communications with its tables sized for a role, see Capacity.h:
+//   CommunicationsFor<RadiatorCapacity> coms;
+template <typename Capacity>
+class CommunicationsFor : public Communications {
+public:
+  static_assert(Capacity::peers > 0 && Capacity::peers < MAX_ESPNOW_PEERS, "one ESP-NOW peer slot is the broadcast address");
+  static_assert(Capacity::txQueue >= 2 && Capacity::routes > 0 && Capacity::relaySeen > 0, "tables need at least one entry");
+
+  CommunicationsFor() { attachTables(); }
+  // Several kilobytes of tables, and the callbacks reach one instance; not to be copied
+  CommunicationsFor(const CommunicationsFor&) = delete;
+  CommunicationsFor& operator=(const CommunicationsFor&) = delete;
 
+private:
+  struct Tables {
+    Peer peers[Capacity::peers];
+    TxEntry txQueue[Capacity::txQueue];
+    Neighbor neighbors[Capacity::neighbors];
+    RelayRoute routes[Capacity::routes];
+    uint32_t seen[Capacity::relaySeen] = {};
+    AuthSender senders[Capacity::peers + Capacity::neighbors]; // every peer, and the boards heard most recently
+  } tables;
+
+  void attachTables() {
+    attach(tables.peers, Capacity::peers, tables.txQueue, Capacity::txQueue,
+           tables.neighbors, Capacity::neighbors, tables.routes, Capacity::routes, tables.seen, Capacity::relaySeen,
+           tables.senders, Capacity::peers + Capacity::neighbors);
+  }
 };
 
 #endif
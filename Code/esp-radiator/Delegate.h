@@ -0,0 +1,71 @@
+// Delegate.h
+// Fixed-size callback used instead of std::function for handlers that run
+// on every frame. Holds a plain function, a method bound to an object, or a
+// lambda whose captures fit in DELEGATE_CAPTURE_SIZE bytes; anything larger
+// fails to compile. Captures are copied bytewise, so they must be trivially
+// copyable (pointers and numbers, not String). Never allocates.
+// Keep this file identical in every sketch.
+#ifndef DELEGATE_H
+#define DELEGATE_H
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#define DELEGATE_CAPTURE_SIZE (2 * sizeof(void*)) // an object pointer and one more word
+
+template <typename Signature>
+class Delegate;
+
+template <typename R, typename... Args>
+class Delegate<R(Args...)> {
+public:
+  Delegate() = default;
+  Delegate(std::nullptr_t) {}
+
+  Delegate(R (*function)(Args...)) {
+    if (function) store(function);
+  }
+
+  template <typename Callable,
+            typename = typename std::enable_if<!std::is_same<typename std::decay<Callable>::type, Delegate>::value>::type>
+  Delegate(Callable callable) {
+    static_assert(sizeof(Callable) <= DELEGATE_CAPTURE_SIZE, "Delegate: lambda captures too much, capture a pointer instead");
+    static_assert(alignof(Callable) <= alignof(void*), "Delegate: capture needs more alignment than a pointer");
+    static_assert(std::is_trivially_copyable<Callable>::value && std::is_trivially_destructible<Callable>::value,
+                  "Delegate: captures must be trivially copyable");
+    store(callable);
+  }
+
+  // Delegate<void(int)>::bind<Display, &Display::show>(&display)
+  template <typename T, R (T::*Method)(Args...)>
+  static Delegate bind(T* object) {
+    return Delegate([object](Args... args) -> R { return (object->*Method)(std::forward<Args>(args)...); });
+  }
+
+  R operator()(Args... args) const {
+    return invoker(storage, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const { return invoker != nullptr; }
+
+private:
+  typedef R (*Invoker)(void* storage, Args... args);
+
+  Invoker invoker = nullptr;
+  alignas(void*) mutable unsigned char storage[DELEGATE_CAPTURE_SIZE] = {};
+
+  template <typename Callable>
+  void store(Callable callable) {
+    ::new (static_cast<void*>(storage)) Callable(callable);
+    invoker = &call<Callable>;
+  }
+
+  template <typename Callable>
+  static R call(void* storage, Args... args) {
+    return (*static_cast<Callable*>(storage))(std::forward<Args>(args)...);
+  }
+};
+
+#endif
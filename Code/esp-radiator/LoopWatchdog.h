@@ -0,0 +1,111 @@
+// LoopWatchdog.h
+// Keep this file identical in esp-server and esp-radiator.
+#ifndef LOOP_WATCHDOG_H
+#define LOOP_WATCHDOG_H
+
+#include <Arduino.h>
+
+#define STALL_LOG_MAGIC 0x53544C31 // "STL1", anything else in RTC memory is from a power cut
+
+// Parts of loop() timed separately, shared so a radiator's report reads the same on the server
+enum LoopStage : uint8_t {
+  STAGE_LOOP, // loop() outside any stage below
+  STAGE_COMS, // Communications::update()
+  STAGE_MANAGER, // RadiatorManager::update()
+  STAGE_WEB, // WebComs or LocalWeb
+  STAGE_INPUT, // buttons and the encoder
+  STAGE_DHT,
+  STAGE_DISPLAY,
+  STAGE_STEPPER,
+  STAGE_SERIAL, // USB serial commands such as the capture dump
+  STAGE_COUNT
+};
+
+// One loop() iteration over budget
+struct StallRecord {
+  uint32_t us; // the whole iteration, 0 when a reset cut it short
+  uint32_t stageUs; // the longest stretch in one stage
+  uint32_t atMs; // millis() when the iteration began
+  uint16_t boot; // StallLog::boots it happened in
+  uint8_t stage; // LoopStage of that stretch, or the one running at the reset
+  uint8_t reset; // esp_reset_reason() when a watchdog restarted the board inside it, else 0
+};
+
+// Kept by the sketch in RTC_NOINIT_ATTR memory, next to a ring of
+// StallRecords, so both outlive a reset. A power cut clears them.
+struct StallLog {
+  uint32_t magic;
+  uint32_t count; // stalls since cleared, the ring holds the last ones
+  uint16_t boots; // since cleared, this one included
+  uint8_t size; // of the ring
+  uint8_t head; // next record to write
+  uint8_t stage; // running now
+  bool inLoop;
+  uint32_t loopAtMs; // millis() when the running iteration began
+};
+
+// Times loop() and each stage in it, and keeps the iterations that took
+// longer than the budget. Stages do not nest: entering one ends the
+// stretch of the one it interrupts, which resumes when it is left.
+class LoopWatchdog {
+public:
+  // Adds a record for the iteration a watchdog reset cut short, if any
+  void begin(StallLog& log, StallRecord* ring, uint8_t size, uint32_t budgetUs);
+
+  void beginLoop();
+  void endLoop();
+  uint8_t enter(uint8_t stage); // returns the stage it interrupts
+
+  uint32_t getCount() const; // stalls since the log was cleared
+  uint16_t getBoots() const;
+  uint32_t getBudgetMicros() const;
+  uint32_t getMaxMicros() const; // longest iteration since boot
+  int getRecordCount() const; // records kept
+  const StallRecord& getRecord(int i) const; // oldest first
+
+  // True when there are stalls the last true answer did not cover, at most
+  // once per intervalMs: for sending them on
+  bool reportDue(unsigned long intervalMs);
+
+  static const char* stageName(uint8_t stage);
+
+private:
+  StallLog* log = nullptr;
+  StallRecord* ring = nullptr;
+  uint32_t budgetUs = 0;
+  uint32_t maxUs = 0;
+
+  uint32_t loopStart = 0;
+  uint32_t stageStart = 0;
+  uint32_t worstUs = 0; // longest stretch in this iteration
+  uint8_t worstStage = STAGE_LOOP;
+
+  uint32_t reported = 0; // count at the last true reportDue()
+  unsigned long reportedAt = 0;
+
+  void closeStretch(uint32_t now);
+  void add(const StallRecord& record);
+};
+
+// Times loop() from construction to destruction
+class ScopedLoop {
+public:
+  explicit ScopedLoop(LoopWatchdog& watchdog) : watchdog(watchdog) { watchdog.beginLoop(); }
+  ~ScopedLoop() { watchdog.endLoop(); }
+
+private:
+  LoopWatchdog& watchdog;
+};
+
+// Counts the time from construction to destruction against a stage
+class ScopedStage {
+public:
+  ScopedStage(LoopWatchdog& watchdog, LoopStage stage) : watchdog(watchdog), previous(watchdog.enter(stage)) {}
+  ~ScopedStage() { watchdog.enter(previous); }
+
+private:
+  LoopWatchdog& watchdog;
+  uint8_t previous;
+};
+
+#endif
@@ -4,21 +4,36 @@
 
 #include <stdint.h>
 
-// Message types (start from 1; 0 is reserved for discovery)
+// Message types (start from 1; 0 is reserved for discovery, 0xF0 and up for relaying)
 enum MessageType : uint8_t {
   MSG_TYPE_TEMPERATURE_COMMAND = 1,
-  MSG_TYPE_TEMPERATURE_RESPONSE = 2
+  MSG_TYPE_TEMPERATURE_RESPONSE = 2,
+  MSG_TYPE_RADIATOR_TELEMETRY = 3
   // Add more as needed
 };
 
 // Structure to receive data (temperature)
 struct TemperatureCommand {
   uint8_t temperature;  // Temperature value received
+  uint16_t requestId;   // echoed in the response, 0 when nobody is waiting on it
 };
 
 struct TemperatureResponse {
   uint8_t temperature;  // Temperature value set
   bool success;
+  uint16_t requestId;   // of the command being answered
+};
+
+// Sent by a radiator when its loop() stalled since the last one, see LoopWatchdog.h
+struct RadiatorTelemetry {
+  uint32_t stalls;      // iterations over budget since its stall log was cleared
+  uint32_t budgetUs;
+  uint32_t maxUs;       // longest iteration since it booted
+  uint32_t lastUs;      // the last stall, 0 if a reset cut it short
+  uint32_t stageUs;     // longest stretch of it in one stage
+  uint16_t boots;       // since the stall log was cleared
+  uint8_t stage;        // LoopStage of that stretch
+  uint8_t reset;        // esp_reset_reason() if a watchdog reset ended it
 };
 
 #endif // MESSAGES_H
\ No newline at end of file
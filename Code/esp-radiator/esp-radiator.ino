@@ -1,9 +1,21 @@
 #include <AccelStepper.h>
 #include "Communications.h"
 #include "Messages.h"
+#include "LoopWatchdog.h"
 #include <Preferences.h>
 
 #define DEBUG FALSE // CHANGE TO TRUE TO ENABLE SERIAL OUTPUTS 
+#define MESH_RELAY 0 // CHANGE TO 1 TO REACH THE SERVER THROUGH OTHER RADIATORS (SET IT ON THE SERVER AND EVERY RADIATOR)
+#define TIME_SYNC 0 // CHANGE TO 1 TO KEEP THE SERVER'S CLOCK (SET IT ON THE SERVER AND EVERY RADIATOR)
+#define RADIO_CAPTURE 0 // CHANGE TO 1 TO RECORD THE LAST CAPTURE_RECORDS RADIO FRAMES, SEND 'c' OVER USB SERIAL TO DUMP THEM (SEE Code/sim/replay.cpp)
+#define CAPTURE_RECORDS 64 // 96 B each
+#define LEGACY_DISCOVERY 0 // CHANGE TO 1 WHILE THE SERVER STILL RUNS FIRMWARE FROM BEFORE DEVICE CLASSES (SET IT ON THE SERVER TOO)
+#define FRAME_AUTH 0 // CHANGE TO 1 TO SIGN EVERY RADIO FRAME AND DROP UNSIGNED, FORGED AND REPLAYED ONES (SET IT ON THE SERVER TOO)
+// #define AUTH_KEY { ... } // WITH FRAME_AUTH 1: YOUR OWN 16 RANDOM BYTES, THE SAME IN esp-server.ino
+#define LOOP_BUDGET_US 2000 // loop() iterations slower than this are kept as stalls and sent to the server, the motor stutters past a few steps
+#define STALL_RECORDS 8 // 16 B each, in RTC memory
+#define STALL_REPORT_MS 10000 // at most one stall report to the server this often
+#define LOOP_HANG_RESET 0 // CHANGE TO 1 TO RESTART WHEN loop() HANGS FOR 5 S, THE STAGE IT HUNG IN IS REPORTED AFTER THE RESTART
 #define ESPNOW_CHANNEL 6
 #define STEPS_PER_REVOLUTION 26000
 
@@ -16,8 +28,20 @@ const int stepsPerRevolution = STEPS_PER_REVOLUTION; // For 28BYJ-48 motor
 
 AccelStepper stepper(AccelStepper::HALF4WIRE, IN1, IN3, IN2, IN4);
 
-Communications coms;
+CommunicationsFor<RadiatorCapacity> coms; // tables sized for one server, see Capacity.h
 Preferences preferences;
+LoopWatchdog watchdog;
+RTC_NOINIT_ATTR StallLog stallLog; // outlives a reset, not a power cut
+RTC_NOINIT_ATTR StallRecord stallRing[STALL_RECORDS];
+#if RADIO_CAPTURE
+CaptureRecord captureRing[CAPTURE_RECORDS];
+#endif
+#if FRAME_AUTH
+#ifndef AUTH_KEY
+#error "FRAME_AUTH needs AUTH_KEY: 16 random bytes of your own, the same on every board"
+#endif
+const uint8_t authKey[AUTH_KEY_BYTES] = AUTH_KEY;
+#endif
 
 // Callback function that wilal be executed when data is received
 void OnDataRecv(const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
@@ -66,7 +90,7 @@ void ProcessTemperatureCommand(const uint8_t* mac, const TemperatureCommand& pay
 }
 
 bool isServerMac(const uint8_t mac[6]) {
-  const Peer* server = coms.getPeerByName("server");
+  const Peer* server = coms.getPeerByClass(DEVICE_CLASS_SERVER);
   if (!server) return false;
   return memcmp(mac, server->mac, 6) == 0;
 }
@@ -75,8 +99,9 @@ void sendAckTemperatureResponse(const uint8_t* mac, const TemperatureCommand& pa
   TemperatureResponse response = {};
   response.temperature = payload.temperature;
   response.success = success;
+  response.requestId = payload.requestId;
 
-  esp_err_t result = coms.send(mac, MSG_TYPE_TEMPERATURE_RESPONSE, response);
+  esp_err_t result = coms.send(mac, MSG_TYPE_TEMPERATURE_RESPONSE, response, TX_PRIORITY_ACK);
   if (result == ESP_OK) {
     Serial.println("ACK sent successfully");
   } else {
@@ -84,6 +109,28 @@ void sendAckTemperatureResponse(const uint8_t* mac, const TemperatureCommand& pa
   }
 }
 
+// The stall count and the last stall, once the server is known
+void sendStallReport() {
+  const Peer* server = coms.getPeerByClass(DEVICE_CLASS_SERVER);
+  if (!server || !watchdog.reportDue(STALL_REPORT_MS)) return;
+
+  RadiatorTelemetry telemetry = {};
+  telemetry.stalls = watchdog.getCount();
+  telemetry.budgetUs = watchdog.getBudgetMicros();
+  telemetry.maxUs = watchdog.getMaxMicros();
+  telemetry.boots = watchdog.getBoots();
+  int kept = watchdog.getRecordCount();
+  if (kept > 0) {
+    const StallRecord& last = watchdog.getRecord(kept - 1);
+    telemetry.lastUs = last.us;
+    telemetry.stageUs = last.stageUs;
+    telemetry.stage = last.stage;
+    telemetry.reset = last.reset;
+  }
+
+  coms.send(server->mac, MSG_TYPE_RADIATOR_TELEMETRY, telemetry, TX_PRIORITY_TELEMETRY);
+}
+
 void discoverServer() {
   while(!isServerDiscovered()) {
     Serial.println("Trying to discover server...");
@@ -95,7 +142,7 @@ void discoverServer() {
 }
 
 bool isServerDiscovered() {
-  const Peer* server = coms.getPeerByName("server");
+  const Peer* server = coms.getPeerByClass(DEVICE_CLASS_SERVER);
   if (!server) {
     return false;
   }
@@ -108,13 +155,29 @@ void setup() {
   Serial.println("Booting...");
   Serial.begin(115200);
 
+  watchdog.begin(stallLog, stallRing, STALL_RECORDS, LOOP_BUDGET_US); // first, a reset leaves its stage here
+
   coms.begin();
   coms.setName("radiator");
-  coms.addToDiscoveryWhitelist("server"); // we only want to discover the server and not other radiators
+  coms.setDeviceClass(DEVICE_CLASS_RADIATOR);
+#if LEGACY_DISCOVERY
+  coms.setLegacyDiscovery(true);
+#endif
+#if FRAME_AUTH
+  coms.enableAuth(authKey);
+#endif
+#if RADIO_CAPTURE
+  coms.enableCapture(captureRing, CAPTURE_RECORDS); // from boot, so the discovery is in it
+#endif
+  coms.addToDiscoveryWhitelist(DEVICE_CLASS_SERVER); // we only want to discover the server and not other radiators
   
   // Register to receive the data
   coms.setReceiveHandler(OnDataRecv);
 
+#if MESH_RELAY
+  coms.enableRelay();
+#endif
+
   coms.broadcastDiscovery();
 
   // Setup the stepper motor
@@ -132,8 +195,32 @@ void setup() {
 
   // Loops broadcastDiscovery until server is found
   discoverServer();
+
+#if TIME_SYNC
+  coms.enableTimeSync(coms.getPeerByClass(DEVICE_CLASS_SERVER)->mac); // coms.networkMicros() is then the server's micros()
+#endif
+#if LOOP_HANG_RESET
+  enableLoopWDT(); // after discoverServer(), which can take longer
+#endif
 }
 
 void loop() {
-  stepper.run(); // Always run to move towards target position
+  ScopedLoop watched(watchdog);
+
+  {
+    ScopedStage stage(watchdog, STAGE_STEPPER);
+    stepper.run(); // Always run to move towards target position
+  }
+  {
+    ScopedStage stage(watchdog, STAGE_COMS);
+    coms.update(); // queued frames, relay beacons when relaying, time sync
+    sendStallReport();
+  }
+
+#if RADIO_CAPTURE
+  if (Serial.available() && Serial.read() == 'c') {
+    ScopedStage stage(watchdog, STAGE_SERIAL);
+    coms.dumpCapture(Serial);
+  }
+#endif
 }
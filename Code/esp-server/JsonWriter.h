@@ -0,0 +1,45 @@
+// JsonWriter.h
+// Keep this file identical in both sketches.
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <Arduino.h>
+
+#define JSON_MAX_DEPTH 8
+
+// Streams JSON straight to a Print as it is produced. Nothing is buffered, so
+// the memory used is the same for one radiator or five hundred.
+class JsonWriter {
+public:
+  explicit JsonWriter(Print& out);
+
+  void beginArray();
+  void endArray();
+  void beginObject();
+  void endObject();
+
+  void key(const char* name);
+  void value(const char* text);
+  void value(uint32_t number);
+  void value(int number);
+  void value(bool flag);
+  void macValue(const uint8_t* mac);
+
+  template <typename T>
+  void member(const char* name, T v) {
+    key(name);
+    value(v);
+  }
+
+private:
+  Print& _out;
+  uint8_t _depth = 0;
+  uint8_t _hasItems = 0; // bit per depth: a comma is due before the next item
+  bool _afterKey = false;
+
+  void beforeItem();
+  void open(char c);
+  void close(char c);
+};
+
+#endif
@@ -0,0 +1,127 @@
+// LineReader.h
+// Allocation-free line buffering and tokenizing for the UART text protocol.
+// Keep this file identical in both sketches.
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <Arduino.h>
+#include <ctype.h>
+#include <limits.h>
+
+// Non-owning view into a line buffer. Only valid until the next line is read.
+struct StrView {
+  const char* data;
+  size_t length;
+
+  bool equals(const char* text) const {
+    return strlen(text) == length && memcmp(data, text, length) == 0;
+  }
+
+  bool startsWith(const char* prefix) const {
+    size_t n = strlen(prefix);
+    return n <= length && memcmp(data, prefix, n) == 0;
+  }
+
+  // Parses an optionally signed decimal integer. Rejects empty input,
+  // trailing garbage and values that do not fit in a long.
+  bool toInt(long& out) const {
+    size_t i = 0;
+    bool negative = false;
+    if (i < length && (data[i] == '-' || data[i] == '+')) {
+      negative = data[i] == '-';
+      i++;
+    }
+    if (i == length) return false;
+
+    unsigned long value = 0;
+    for (; i < length; i++) {
+      char c = data[i];
+      if (c < '0' || c > '9') return false;
+      if (value > (unsigned long)(LONG_MAX - (c - '0')) / 10) return false;
+      value = value * 10 + (c - '0');
+    }
+
+    out = negative ? -(long)value : (long)value;
+    return true;
+  }
+
+  // Copies into a NUL-terminated buffer, truncating to fit
+  void copyTo(char* out, size_t size) const {
+    size_t n = min(length, size - 1);
+    memcpy(out, data, n);
+    out[n] = '\0';
+  }
+};
+
+// Splits line on delimiter into at most maxParts views. The last part keeps
+// the remainder of the line, delimiters included. Returns the part count.
+inline int tokenize(StrView line, char delimiter, StrView* parts, int maxParts) {
+  int count = 0;
+  size_t start = 0;
+
+  for (size_t i = 0; i < line.length && count < maxParts - 1; i++) {
+    if (line.data[i] == delimiter) {
+      parts[count++] = { line.data + start, i - start };
+      start = i + 1;
+    }
+  }
+
+  if (count < maxParts) {
+    parts[count++] = { line.data + start, line.length - start };
+  }
+
+  return count;
+}
+
+// Fixed-capacity line buffer. A line longer than N - 1 bytes is dropped
+// whole and counted in overflows; reading resumes after its newline.
+template <size_t N>
+class LineReader {
+public:
+  // Returns true when c completed a line, available through line()
+  bool push(char c) {
+    if (c != '\n') {
+      if (_length < N - 1) {
+        _buffer[_length++] = c;
+      } else if (!_overflow) {
+        _overflow = true;
+        overflows++;
+      }
+      return false;
+    }
+
+    bool complete = !_overflow;
+    _lineLength = _length;
+    _length = 0;
+    _overflow = false;
+    if (!complete) return false;
+
+    // trim whitespace and the \r of \r\n line endings
+    _lineStart = 0;
+    while (_lineStart < _lineLength && isspace((unsigned char)_buffer[_lineStart])) _lineStart++;
+    while (_lineLength > _lineStart && isspace((unsigned char)_buffer[_lineLength - 1])) _lineLength--;
+    _buffer[_lineLength] = '\0';
+    return true;
+  }
+
+  // NUL-terminated, valid until the next push()
+  StrView line() const {
+    return { _buffer + _lineStart, _lineLength - _lineStart };
+  }
+
+  void reset() {
+    _length = 0;
+    _overflow = false;
+  }
+
+  uint32_t overflows = 0;
+
+private:
+  char _buffer[N];
+  size_t _length = 0;
+  size_t _lineStart = 0;
+  size_t _lineLength = 0;
+  bool _overflow = false;
+};
+
+#endif
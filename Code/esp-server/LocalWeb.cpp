@@ -0,0 +1,407 @@
+#include "LocalWeb.h"
+#include <WiFi.h>
+#include <LittleFS.h>
+#include "Assets.h"
+#include "JsonWriter.h"
+
+// HTTP status for each LinkCommandOutcome on the GET /set/* path
+static const int outcomeStatus[LINK_OUTCOME_COUNT] = { 200, 409, 502, 504, 503 };
+
+static void sendAsset(AsyncWebServerRequest *request, const Asset& asset) {
+  // Hashed URLs never change, index.html is revalidated on every load
+  const char* cacheControl = asset.immutable ? "public, max-age=31536000, immutable" : "no-cache";
+
+  if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == asset.etag) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", asset.etag);
+    response->addHeader("Cache-Control", cacheControl);
+    request->send(response);
+    return;
+  }
+
+  AsyncWebServerResponse *response = request->beginResponse(LittleFS, asset.file, asset.mime);
+  response->addHeader("Content-Encoding", "gzip");
+  response->addHeader("ETag", asset.etag);
+  response->addHeader("Cache-Control", cacheControl);
+  request->send(response);
+}
+
+LocalWeb::LocalWeb(RadiatorManager& manager, RadiatorCommands& commands)
+  : _manager(manager), _commands(commands), _radiators(manager), _server(80), _ws("/ws"),
+    _clients(_ws, _radiators) {}
+
+void LocalWeb::begin() {
+  // ESP-NOW keeps the station interface, the soft-AP fixes the channel
+  WiFi.mode(WIFI_AP_STA);
+  WiFi.softAP(ssid, password, LOCAL_WEB_CHANNEL);
+  snprintf(ip, sizeof(ip), "%s", WiFi.softAPIP().toString().c_str());
+  Serial.printf("Web server on %s, channel %d\n", ip, LOCAL_WEB_CHANNEL);
+
+  if (!LittleFS.begin()) {
+    Serial.println("An Error has occurred while mounting LittleFS");
+  }
+  _bootId = esp_random();
+
+  // Pages and icons, gzip-compressed by esp-web/tools/build_assets.py
+  for (const Asset& asset : assets) {
+    _server.on(asset.path, HTTP_GET, [&asset](AsyncWebServerRequest *request) {
+      sendAsset(request, asset);
+    });
+  }
+
+  // Compatibility path, the page itself sends commands over the WebSocket.
+  // Both answer once the radiators acked, failed or timed out.
+  _server.on("/set/all", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    if (!request->hasParam("temperature")) {
+      request->send(400, "text/plain", "Missing temperature parameter");
+      return;
+    }
+    holdSetpoint(request, -1, request->getParam("temperature")->value().toInt());
+  });
+
+  _server.on("/set/temp", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    if (!request->hasParam("id") || !request->hasParam("temp")) {
+      request->send(400, "text/plain", "Missing id or temp parameter");
+      return;
+    }
+
+    long id = request->getParam("id")->value().toInt();
+    if (!_commands.isValidIndex(id)) {
+      request->send(400, "text/plain", commandResultText(COMMAND_BAD_ID));
+      return;
+    }
+    holdSetpoint(request, id, request->getParam("temp")->value().toInt());
+  });
+
+  _server.on("/set/name", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    if (!request->hasParam("id") || !request->hasParam("name")) {
+      request->send(400, "text/plain", "Missing id or name parameter");
+      return;
+    }
+
+    String id = request->getParam("id")->value();
+    String name = request->getParam("name")->value();
+    CommandResult result = queueName(id.toInt(), name.c_str(), name.length());
+    if (result == COMMAND_QUEUED) {
+      request->send(200, "text/plain", "Set name for ID " + id + " to " + name);
+    } else {
+      request->send(result == COMMAND_BUSY ? 503 : 400, "text/plain", commandResultText(result));
+    }
+  });
+
+  _server.on("/api/radiators", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    sendRadiators(request);
+  });
+
+  // Link statistics change with every frame, so they are never cached.
+  // Read on the AsyncTCP task like the radiators, a count can be one event behind.
+  _server.on("/api/links", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    _radiators.writeLinksJson(*response);
+    request->send(response);
+  });
+
+  _server.on("/sync", HTTP_GET, [this](AsyncWebServerRequest *request) {
+    WebEvent event = {};
+    event.type = WEB_SYNC;
+    postEvent(event);
+    request->send(200, "text/plain", "Sync command sent");
+  });
+
+  _server.onNotFound([](AsyncWebServerRequest *request) {
+    request->send(404, "text/plain", "Not found");
+  });
+
+  _ws.onEvent([this](AsyncWebSocket *, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                     uint8_t *data, size_t len) {
+    if (type == WS_EVT_CONNECT) {
+      WebEvent event = {};
+      event.type = WEB_CONNECT;
+      event.clientId = client->id();
+      if (!postEvent(event)) client->close();
+    } else if (type == WS_EVT_DISCONNECT) {
+      WebEvent event = {};
+      event.type = WEB_DISCONNECT;
+      event.clientId = client->id();
+      postEvent(event); // if lost, WebClients notices the client is gone
+    } else if (type == WS_EVT_DATA) {
+      // Commands are small, only whole single-frame text messages are accepted
+      AwsFrameInfo *info = (AwsFrameInfo*)arg;
+      if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
+        handleWebCommand(client, data, len);
+      }
+    }
+  });
+  _server.addHandler(&_ws);
+  _server.begin();
+}
+
+void LocalWeb::update() {
+  applyEvents();
+
+  CommandDone done;
+  while (_manager.takeCommandDone(done)) {
+    resolveRequest(done.request, done.outcome);
+  }
+  while (uint16_t id = findExpired()) {
+    resolveRequest(id, LINK_OUTCOME_TIMED_OUT);
+  }
+
+  pushChanges();
+  _clients.update();
+}
+
+bool LocalWeb::postEvent(const WebEvent& event) {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_eventCount == MAX_WEB_EVENTS) return false;
+
+  _events[_eventCount++] = event;
+  return true;
+}
+
+bool LocalWeb::hasRoomFor(int setpoints) {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _pending.available() >= setpoints && MAX_WEB_EVENTS - _eventCount >= setpoints;
+}
+
+// Checks a setpoint for one radiator (index) or all (-1) and queues it under a
+// new request id, answered by resolveRequest()
+CommandResult LocalWeb::queueSetpoint(int index, long temperature, uint32_t clientId, uint32_t req, uint8_t op,
+                                      AsyncWebServerRequest *http) {
+  if (index >= 0 && !_commands.isValidIndex(index)) return COMMAND_BAD_ID;
+  if (!RadiatorCommands::isValidTemp(temperature)) return COMMAND_BAD_TEMP;
+
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_eventCount == MAX_WEB_EVENTS) return COMMAND_BUSY;
+
+  PendingRequest *request = _pending.add(index);
+  if (!request) return COMMAND_BUSY;
+  request->clientId = clientId;
+  request->req = req;
+  request->op = op;
+  request->http = http;
+
+  WebEvent& event = _events[_eventCount++];
+  event = {};
+  event.type = index < 0 ? WEB_SET_ALL : WEB_SET_TEMP;
+  event.index = index;
+  event.temperature = temperature;
+  event.request = request->id;
+  return COMMAND_QUEUED;
+}
+
+CommandResult LocalWeb::queueName(long index, const char* name, size_t length) {
+  if (!_commands.isValidIndex(index)) return COMMAND_BAD_ID;
+  if (!RadiatorCommands::isValidName(name, length)) return COMMAND_BAD_NAME;
+
+  WebEvent event = {};
+  event.type = WEB_SET_NAME;
+  event.index = index;
+  memcpy(event.name, name, length);
+  return postEvent(event) ? COMMAND_QUEUED : COMMAND_BUSY;
+}
+
+CommandResult LocalWeb::applyOperation(JsonObject op, uint32_t clientId, uint32_t req, uint8_t opIndex) {
+  const char* type = op["op"] | "";
+  long index = op["id"] | -1L;
+  long temp = op["t"] | -1L;
+
+  if (strcmp(type, "temp") == 0) {
+    if (!_commands.isValidIndex(index)) return COMMAND_BAD_ID;
+    return queueSetpoint(index, temp, clientId, req, opIndex, nullptr);
+  } else if (strcmp(type, "all") == 0) {
+    return queueSetpoint(-1, temp, clientId, req, opIndex, nullptr);
+  } else if (strcmp(type, "name") == 0) {
+    const char* name = op["name"] | "";
+    return queueName(index, name, strlen(name));
+  } else if (strcmp(type, "group") == 0) {
+    // One request id per radiator, each reported on its own. Checked
+    // up front so a group is queued whole or not at all.
+    JsonArray ids = op["ids"].as<JsonArray>();
+    if (ids.size() == 0) return COMMAND_BAD_ID;
+    for (JsonVariant id : ids) {
+      if (!_commands.isValidIndex(id | -1L)) return COMMAND_BAD_ID;
+    }
+    if (!RadiatorCommands::isValidTemp(temp)) return COMMAND_BAD_TEMP;
+    if (!hasRoomFor(ids.size())) return COMMAND_BUSY;
+
+    for (JsonVariant id : ids) {
+      queueSetpoint(id | -1L, temp, clientId, req, opIndex, nullptr);
+    }
+    return COMMAND_QUEUED;
+  }
+  return COMMAND_BAD_OP;
+}
+
+// Same batches as esp-web:
+// {"req":7,"ops":[{"op":"temp","id":2,"t":21},...]} -> {"req":7,"results":[{"ok":true},...]}
+void LocalWeb::handleWebCommand(AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+  static StaticJsonDocument<1024> doc;
+  DeserializationError error = deserializeJson(doc, data, len);
+  if (error) {
+    Serial.printf("Invalid WebSocket command: %s\n", error.c_str());
+    return;
+  }
+
+  _reply.clear();
+  JsonWriter json(_reply);
+  json.beginObject();
+  uint32_t req = doc["req"] | (uint32_t)0;
+  json.member("req", req);
+  json.key("results");
+  json.beginArray();
+
+  int count = 0;
+  for (JsonObject op : doc["ops"].as<JsonArray>()) {
+    CommandResult result = count < MAX_BATCH_OPS ? applyOperation(op, client->id(), req, count) : COMMAND_BATCH_FULL;
+    count++;
+
+    json.beginObject();
+    json.member("ok", result == COMMAND_QUEUED);
+    if (result != COMMAND_QUEUED) {
+      json.member("error", commandResultText(result));
+    }
+    json.endObject();
+  }
+
+  json.endArray();
+  json.endObject();
+  client->text(_reply.view().data, _reply.view().length);
+}
+
+// Leaves the HTTP request open until resolveRequest() answers it. The
+// disconnect handler goes in first so an early outcome finds it in place.
+void LocalWeb::holdSetpoint(AsyncWebServerRequest *request, int index, long temperature) {
+  request->onDisconnect([this, request]() {
+    std::lock_guard<std::mutex> guard(_lock);
+    _pending.forgetHttp(request);
+  });
+
+  CommandResult result = queueSetpoint(index, temperature, 0, 0, 0, request);
+  if (result != COMMAND_QUEUED) {
+    request->send(result == COMMAND_BUSY ? 503 : 400, "text/plain", commandResultText(result));
+  }
+}
+
+// Read on the AsyncTCP task: a radiator changing meanwhile can show up half
+// updated, and is pushed again over the WebSocket right after
+void LocalWeb::sendRadiators(AsyncWebServerRequest *request) {
+  char etag[24];
+  _radiators.writeEtag(etag, sizeof(etag), _bootId);
+
+  if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == etag) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", etag);
+    request->send(response);
+    return;
+  }
+
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  _radiators.writeJson(*response);
+  request->send(response);
+}
+
+void LocalWeb::applyEvents() {
+  WebEvent events[MAX_WEB_EVENTS];
+  int count;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    count = _eventCount;
+    memcpy(events, _events, count * sizeof(WebEvent));
+    _eventCount = 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const WebEvent& event = events[i];
+    switch (event.type) {
+      case WEB_SET_ALL:
+        _commands.setAll(event.temperature, event.request);
+        break;
+
+      case WEB_SET_TEMP:
+        _commands.setTemp(event.index, event.temperature, event.request);
+        break;
+
+      case WEB_SET_NAME:
+        _commands.setName(event.index, event.name, strnlen(event.name, LINK_NAME_LEN));
+        break;
+
+      case WEB_CONNECT:
+        if (!_clients.add(event.clientId)) {
+          if (AsyncWebSocketClient *client = _ws.client(event.clientId)) client->close();
+        }
+        break;
+
+      case WEB_DISCONNECT:
+        _clients.remove(event.clientId);
+        break;
+
+      case WEB_SYNC:
+        _clients.markAllChanged();
+        break;
+    }
+  }
+}
+
+// Answers whoever sent the command, on its WebSocket as
+// {"req":7,"op":0,"id":2,"result":"acked","ms":412} (no id for set-all)
+// or as the response to its held HTTP request
+void LocalWeb::resolveRequest(uint16_t id, uint8_t outcome) {
+  PendingRequest request;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    PendingRequest *entry = _pending.find(id);
+    if (!entry) return; // timed out here already
+
+    request = *entry;
+    _pending.remove(entry);
+
+    // Answered under the lock so the disconnect handler cannot free it meanwhile
+    if (request.http) {
+      char text[48];
+      snprintf(text, sizeof(text), "%s in %u ms", linkOutcomeName(outcome), (unsigned)(millis() - request.startedAt));
+      request.http->send(outcome < LINK_OUTCOME_COUNT ? outcomeStatus[outcome] : 500, "text/plain", text);
+      return;
+    }
+  }
+
+  AsyncWebSocketClient *client = _ws.client(request.clientId);
+  if (!client) return;
+
+  _message.clear();
+  JsonWriter json(_message);
+  json.beginObject();
+  json.member("req", request.req);
+  json.member("op", (uint32_t)request.op);
+  if (request.index >= 0) {
+    json.member("id", (int)request.index);
+  }
+  json.member("result", linkOutcomeName(outcome));
+  json.member("ms", (uint32_t)(millis() - request.startedAt));
+  json.endObject();
+  client->text(_message.view().data, _message.view().length);
+}
+
+uint16_t LocalWeb::findExpired() {
+  std::lock_guard<std::mutex> guard(_lock);
+  PendingRequest *request = _pending.findExpired();
+  return request ? request->id : 0;
+}
+
+// Radiators with a version past the last push go to every client
+void LocalWeb::pushChanges() {
+  uint32_t version = _manager.getVersion();
+  if (version == _pushedVersion) return;
+
+  // WebClients marks radiators in a uint32_t, the presets stay well below that
+  int count = min(_manager.getNumRadiators(), MAX_FLEET_RADIATORS);
+  uint32_t changed = 0;
+  for (int i = 0; i < count; i++) {
+    if (_manager.getRadiatorVersion(i) > _pushedVersion) changed |= 1UL << i;
+  }
+  _clients.markChanged(changed);
+  _pushedVersion = version;
+}
@@ -0,0 +1,92 @@
+#ifndef LOCAL_WEB_H
+#define LOCAL_WEB_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <ArduinoJson.h>
+#include <mutex>
+#include "RadiatorManager.h"
+#include "RadiatorCommands.h"
+#include "RadiatorJson.h"
+#include "WebClients.h"
+#include "PendingRequests.h"
+#include "MessageBuffer.h"
+
+#define LOCAL_WEB_CHANNEL 1 // the soft-AP and ESP-NOW share the radio, radiators listen here
+#define MAX_BATCH_OPS 16 // operations accepted per WebSocket command
+#define COMMAND_REPLY_LEN 768 // fits MAX_BATCH_OPS results
+#define MAX_WEB_EVENTS 32 // commands and connects waiting for loop()
+
+// Single-board mode: esp-server serves the web page and its WebSocket itself,
+// with the same API as esp-web, and hands commands to RadiatorManager through
+// RadiatorCommands instead of over the UART.
+//
+// Request and WebSocket handlers run on the AsyncTCP task. They only check a
+// command and queue it; update() applies it from loop() like WebComs does.
+class LocalWeb {
+public:
+  char ssid[33] = "ESP32-Access-Point";
+  char password[65] = "123456789";
+  char ip[16] = "";
+
+  LocalWeb(RadiatorManager& manager, RadiatorCommands& commands);
+  void begin(); // after Communications::begin()
+  void update(); // call from loop()
+
+private:
+  enum EventType : uint8_t {
+    WEB_SET_ALL,
+    WEB_SET_TEMP,
+    WEB_SET_NAME,
+    WEB_CONNECT,
+    WEB_DISCONNECT,
+    WEB_SYNC
+  };
+
+  struct WebEvent {
+    uint8_t type; // EventType
+    int8_t index;
+    uint8_t temperature;
+    uint16_t request; // PendingRequests id of a setpoint
+    uint32_t clientId; // WebSocket client of a connect or disconnect
+    char name[LINK_NAME_LEN];
+  };
+
+  RadiatorManager& _manager;
+  RadiatorCommands& _commands;
+  RadiatorJson _radiators;
+  AsyncWebServer _server;
+  AsyncWebSocket _ws;
+  WebClients _clients; // loop() only
+  uint32_t _pushedVersion = 0;
+  uint32_t _bootId = 0;
+
+  // Shared with the AsyncTCP task. Never held while calling into the
+  // WebSocket, which takes the library's own lock.
+  std::mutex _lock;
+  PendingRequests _pending;
+  WebEvent _events[MAX_WEB_EVENTS];
+  int _eventCount = 0;
+
+  MessageBuffer<COMMAND_REPLY_LEN> _reply; // AsyncTCP task
+  MessageBuffer<COMMAND_REPLY_LEN> _message; // loop()
+
+  // AsyncTCP task
+  bool postEvent(const WebEvent& event);
+  bool hasRoomFor(int setpoints);
+  CommandResult queueSetpoint(int index, long temperature, uint32_t clientId, uint32_t req, uint8_t op,
+                              AsyncWebServerRequest *http);
+  CommandResult queueName(long index, const char* name, size_t length);
+  CommandResult applyOperation(JsonObject op, uint32_t clientId, uint32_t req, uint8_t opIndex);
+  void handleWebCommand(AsyncWebSocketClient *client, const uint8_t *data, size_t len);
+  void holdSetpoint(AsyncWebServerRequest *request, int index, long temperature);
+  void sendRadiators(AsyncWebServerRequest *request);
+
+  // loop()
+  void applyEvents();
+  void resolveRequest(uint16_t id, uint8_t outcome);
+  uint16_t findExpired();
+  void pushChanges();
+};
+
+#endif
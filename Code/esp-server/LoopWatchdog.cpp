@@ -0,0 +1,130 @@
+#include "LoopWatchdog.h"
+
+static const char* const stageNames[STAGE_COUNT] = {
+  "loop",
+  "coms",
+  "manager",
+  "web",
+  "input",
+  "dht",
+  "display",
+  "stepper",
+  "serial"
+};
+
+static bool isWatchdogReset(esp_reset_reason_t reason) {
+  return reason == ESP_RST_TASK_WDT || reason == ESP_RST_INT_WDT || reason == ESP_RST_WDT;
+}
+
+void LoopWatchdog::begin(StallLog& stallLog, StallRecord* stallRing, uint8_t size, uint32_t budget) {
+  log = &stallLog;
+  ring = stallRing;
+  budgetUs = budget;
+
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (reason == ESP_RST_POWERON || log->magic != STALL_LOG_MAGIC || log->size != size || log->head >= size) {
+    memset(log, 0, sizeof(*log));
+    memset(ring, 0, size * sizeof(StallRecord));
+    log->magic = STALL_LOG_MAGIC;
+    log->size = size;
+  } else if (log->inLoop && isWatchdogReset(reason)) {
+    add({ 0, 0, log->loopAtMs, log->boots, log->stage, (uint8_t)reason });
+  }
+
+  log->boots++;
+  log->inLoop = false;
+  log->stage = STAGE_LOOP;
+}
+
+void LoopWatchdog::beginLoop() {
+  if (!log) return;
+
+  loopStart = micros();
+  stageStart = loopStart;
+  worstUs = 0;
+  worstStage = STAGE_LOOP;
+  log->loopAtMs = millis();
+  log->stage = STAGE_LOOP;
+  log->inLoop = true;
+}
+
+void LoopWatchdog::endLoop() {
+  if (!log) return;
+
+  uint32_t now = micros();
+  closeStretch(now);
+  log->inLoop = false;
+
+  uint32_t us = now - loopStart;
+  if (us > maxUs) maxUs = us;
+  if (us <= budgetUs) return;
+
+  add({ us, worstUs, log->loopAtMs, log->boots, worstStage, 0 });
+  Serial.printf("loop() stalled for %u us, %u us in %s\n", (unsigned)us, (unsigned)worstUs, stageName(worstStage));
+}
+
+uint8_t LoopWatchdog::enter(uint8_t stage) {
+  if (!log) return stage;
+
+  uint8_t previous = log->stage;
+  uint32_t now = micros();
+  closeStretch(now);
+  stageStart = now;
+  log->stage = stage;
+  return previous;
+}
+
+// Ends the stretch of the running stage at now
+void LoopWatchdog::closeStretch(uint32_t now) {
+  uint32_t spent = now - stageStart;
+  if (spent > worstUs) {
+    worstUs = spent;
+    worstStage = log->stage;
+  }
+}
+
+void LoopWatchdog::add(const StallRecord& record) {
+  ring[log->head] = record;
+  log->head = (log->head + 1) % log->size;
+  log->count++;
+}
+
+uint32_t LoopWatchdog::getCount() const {
+  return log ? log->count : 0;
+}
+
+uint16_t LoopWatchdog::getBoots() const {
+  return log ? log->boots : 0;
+}
+
+uint32_t LoopWatchdog::getBudgetMicros() const {
+  return budgetUs;
+}
+
+uint32_t LoopWatchdog::getMaxMicros() const {
+  return maxUs;
+}
+
+int LoopWatchdog::getRecordCount() const {
+  if (!log) return 0;
+  return log->count < log->size ? log->count : log->size;
+}
+
+const StallRecord& LoopWatchdog::getRecord(int i) const {
+  int oldest = log->count < log->size ? 0 : log->head;
+  return ring[(oldest + i) % log->size];
+}
+
+bool LoopWatchdog::reportDue(unsigned long intervalMs) {
+  if (!log || log->count == reported) return false;
+  if (reported != 0 && millis() - reportedAt < intervalMs) return false;
+
+  reported = log->count;
+  reportedAt = millis();
+  return true;
+}
+
+const char* LoopWatchdog::stageName(uint8_t stage) {
+  if (stage >= STAGE_COUNT) return "invalid";
+  return stageNames[stage];
+}
@@ -0,0 +1,112 @@
+#include "RadiatorCommands.h"
+
+const char* commandResultText(CommandResult result) {
+  switch (result) {
+    case COMMAND_QUEUED: return "queued";
+    case COMMAND_BAD_ID: return "unknown radiator";
+    case COMMAND_BAD_TEMP: return "temperature out of range";
+    case COMMAND_BAD_NAME: return "invalid name";
+    case COMMAND_BATCH_FULL: return "too many operations";
+    case COMMAND_BUSY: return "too many commands in flight";
+    case COMMAND_BAD_ZONE: return "unknown zone";
+    default: return "unknown operation";
+  }
+}
+
+RadiatorCommands::RadiatorCommands(RadiatorManager& manager)
+  : _manager(manager) {}
+
+bool RadiatorCommands::isValidTemp(long temperature) {
+  return temperature >= MIN_TEMP && temperature <= MAX_TEMP;
+}
+
+bool RadiatorCommands::isValidIndex(long index) const {
+  return index >= 0 && index < _manager.getNumRadiators();
+}
+
+bool RadiatorCommands::isValidZone(long zone) {
+  return zone >= 0 && zone < MAX_ZONES;
+}
+
+bool RadiatorCommands::isValidName(const char* name, size_t length) {
+  // '/' would split the text protocol command
+  return length > 0 && length < LINK_NAME_LEN && !memchr(name, '/', length);
+}
+
+CommandResult RadiatorCommands::setAll(long temperature, uint16_t request) {
+  if (!isValidTemp(temperature)) {
+    _manager.rejectCommand(request);
+    return COMMAND_BAD_TEMP;
+  }
+
+  _manager.sendTemperatureToAll(temperature, request);
+  return COMMAND_QUEUED;
+}
+
+CommandResult RadiatorCommands::setTemp(long index, long temperature, uint16_t request) {
+  CommandResult result = COMMAND_QUEUED;
+  if (!isValidIndex(index)) {
+    result = COMMAND_BAD_ID;
+  } else if (!isValidTemp(temperature)) {
+    result = COMMAND_BAD_TEMP;
+  }
+
+  if (result != COMMAND_QUEUED) {
+    _manager.rejectCommand(request);
+    return result;
+  }
+
+  _manager.sendTemperatureTo(index, temperature, request);
+  return COMMAND_QUEUED;
+}
+
+CommandResult RadiatorCommands::setName(long index, const char* name, size_t length) {
+  if (!isValidIndex(index)) return COMMAND_BAD_ID;
+  if (!isValidName(name, length)) return COMMAND_BAD_NAME;
+
+  char copy[LINK_NAME_LEN];
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+  _manager.setRadiatorName(index, copy);
+  return COMMAND_QUEUED;
+}
+
+CommandResult RadiatorCommands::setZoneTemp(long zone, long temperature, uint16_t request) {
+  CommandResult result = COMMAND_QUEUED;
+  if (!isValidZone(zone)) {
+    result = COMMAND_BAD_ZONE;
+  } else if (!isValidTemp(temperature)) {
+    result = COMMAND_BAD_TEMP;
+  }
+
+  if (result != COMMAND_QUEUED) {
+    _manager.rejectCommand(request);
+    return result;
+  }
+
+  _manager.sendTemperatureToZone(zone, temperature, request);
+  return COMMAND_QUEUED;
+}
+
+CommandResult RadiatorCommands::setZoneName(long zone, const char* name, size_t length) {
+  if (!isValidZone(zone)) return COMMAND_BAD_ZONE;
+  if (!isValidName(name, length)) return COMMAND_BAD_NAME;
+
+  char copy[LINK_NAME_LEN];
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+  _manager.setZoneName(zone, copy);
+  return COMMAND_QUEUED;
+}
+
+CommandResult RadiatorCommands::setZoneMember(long zone, long index, bool member) {
+  if (!isValidZone(zone)) return COMMAND_BAD_ZONE;
+  if (!isValidIndex(index)) return COMMAND_BAD_ID;
+
+  if (member) {
+    _manager.addToZone(zone, index);
+  } else {
+    _manager.removeFromZone(zone, index);
+  }
+  return COMMAND_QUEUED;
+}
@@ -0,0 +1,46 @@
+#ifndef RADIATOR_COMMANDS_H
+#define RADIATOR_COMMANDS_H
+
+#include <Arduino.h>
+#include "RadiatorManager.h"
+
+enum CommandResult : uint8_t {
+  COMMAND_QUEUED,
+  COMMAND_BAD_ID,
+  COMMAND_BAD_TEMP,
+  COMMAND_BAD_NAME,
+  COMMAND_BAD_OP,
+  COMMAND_BATCH_FULL,
+  COMMAND_BUSY,
+  COMMAND_BAD_ZONE
+};
+
+const char* commandResultText(CommandResult result);
+
+// Setpoint and name changes from the web, checked and handed to
+// RadiatorManager. WebComs uses it for commands from esp-web, LocalWeb for
+// the web clients it serves itself in single-board mode. Call from loop().
+// A rejected setpoint with a request id is still reported, as failed, so
+// every request id gets exactly one outcome from takeCommandDone().
+class RadiatorCommands {
+public:
+  RadiatorCommands(RadiatorManager& manager);
+
+  CommandResult setAll(long temperature, uint16_t request = 0);
+  CommandResult setTemp(long index, long temperature, uint16_t request = 0);
+  CommandResult setName(long index, const char* name, size_t length);
+
+  CommandResult setZoneTemp(long zone, long temperature, uint16_t request = 0);
+  CommandResult setZoneName(long zone, const char* name, size_t length);
+  CommandResult setZoneMember(long zone, long index, bool member); // adds or removes the radiator
+
+  static bool isValidTemp(long temperature);
+  bool isValidIndex(long index) const;
+  static bool isValidZone(long zone);
+  static bool isValidName(const char* name, size_t length);
+
+private:
+  RadiatorManager& _manager;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "RadiatorJson.h"
+#include "JsonWriter.h"
+#include "LoopWatchdog.h"
+
+// {"id":2,"mac":"..","name":"..","curr_temp":21,"ack":true,"online":true,"v":17}, id only for deltas
+static void writeRadiator(JsonWriter& json, const RadiatorManager& manager, int index, bool withId) {
+  json.beginObject();
+  if (withId) {
+    json.member("id", index);
+  }
+  json.key("mac");
+  json.macValue(manager.getMac(index));
+  json.member("name", manager.getRadiatorName(index));
+  json.member("curr_temp", (uint32_t)manager.getRadiatorTemperature(index));
+  json.member("ack", manager.isAcked(index));
+  json.member("online", manager.isOnline(index));
+  json.member("v", manager.getRadiatorVersion(index));
+  json.endObject();
+}
+
+// {"link":2,"mac":"..","delivered":412,"failed":3,"acks":40,"ack_avg":5210,"ack_p50":8191,"ack_p95":16383,
+//  "ack_max":20480,"rssi":-71,"seen":1520}, round trips in microseconds, seen in milliseconds ago
+static void writeLink(JsonWriter& json, const RadiatorManager& manager, int index) {
+  const RadiatorLink& link = manager.getLink(index);
+
+  json.beginObject();
+  json.member("link", index);
+  json.key("mac");
+  json.macValue(manager.getMac(index));
+  json.member("delivered", link.delivered);
+  json.member("failed", link.failed);
+  json.member("acks", link.acks);
+  json.member("ack_avg", link.ackAvgUs);
+  json.member("ack_p50", manager.ackPercentileMicros(index, 50));
+  json.member("ack_p95", manager.ackPercentileMicros(index, 95));
+  json.member("ack_max", link.ackMaxUs);
+  json.member("rssi", (int)link.rssi);
+  json.member("seen", (uint32_t)(millis() - manager.getLastSeen(index)));
+  json.endObject();
+}
+
+RadiatorJson::RadiatorJson(const RadiatorManager& manager)
+  : _manager(manager) {}
+
+bool RadiatorJson::isSynced() const {
+  return true; // the manager is the source, there is nothing to wait for
+}
+
+int RadiatorJson::getCount() const {
+  return _manager.getNumRadiators();
+}
+
+void RadiatorJson::writeJson(Print& out) const {
+  // Each radiator goes out as soon as it is written, no document is held in RAM
+  JsonWriter json(out);
+  json.beginArray();
+  for (int i = 0; i < _manager.getNumRadiators(); i++) {
+    writeRadiator(json, _manager, i, false);
+  }
+  json.endArray();
+}
+
+void RadiatorJson::writeRadiatorJson(Print& out, int index) const {
+  JsonWriter json(out);
+  writeRadiator(json, _manager, index, true);
+}
+
+void RadiatorJson::writeEtag(char* out, size_t size, uint32_t bootId) const {
+  snprintf(out, size, "\"%08x.%u\"", (unsigned)bootId, (unsigned)_manager.getVersion());
+}
+
+void RadiatorJson::writeLinkJson(Print& out, int index) const {
+  JsonWriter json(out);
+  writeLink(json, _manager, index);
+}
+
+void RadiatorJson::writeLinksJson(Print& out) const {
+  JsonWriter json(out);
+  json.beginArray();
+  for (int i = 0; i < _manager.getNumRadiators(); i++) {
+    writeLink(json, _manager, i);
+  }
+  json.endArray();
+}
+
+// {"radiator":2,"mac":"..","stalls":4,"boots":2,"budget":2000,"max":9120,"us":9120,"stage":"coms",
+//  "stage_us":8870,"reset":0}, us 0 and reset set when a watchdog reset ended its last stall
+void RadiatorJson::writeStallJson(Print& out, int index) const {
+  const RadiatorTelemetry& telemetry = _manager.getTelemetry(index);
+
+  JsonWriter json(out);
+  json.beginObject();
+  json.member("radiator", index);
+  json.key("mac");
+  json.macValue(_manager.getMac(index));
+  json.member("stalls", telemetry.stalls);
+  json.member("boots", (uint32_t)telemetry.boots);
+  json.member("budget", telemetry.budgetUs);
+  json.member("max", telemetry.maxUs);
+  json.member("us", telemetry.lastUs);
+  json.member("stage", LoopWatchdog::stageName(telemetry.stage));
+  json.member("stage_us", telemetry.stageUs);
+  json.member("reset", (uint32_t)telemetry.reset);
+  json.endObject();
+}
+
+// {"zone":1,"name":"Upstairs","temp":21,"members":[0,3,4],"pending":[4]}
+void RadiatorJson::writeZoneJson(Print& out, int zone) const {
+  JsonWriter json(out);
+  json.beginObject();
+  json.member("zone", zone);
+  json.member("name", _manager.getZoneName(zone));
+  json.member("temp", (uint32_t)_manager.getZoneTemperature(zone));
+  json.key("members");
+  json.beginArray();
+  for (int i = 0; i < _manager.getNumRadiators(); i++) {
+    if (_manager.isInZone(zone, i)) json.value(i);
+  }
+  json.endArray();
+  json.key("pending");
+  json.beginArray();
+  for (int i = _manager.nextPending(zone, 0); i != -1; i = _manager.nextPending(zone, i + 1)) {
+    json.value(i);
+  }
+  json.endArray();
+  json.endObject();
+}
@@ -0,0 +1,36 @@
+#ifndef RADIATOR_JSON_H
+#define RADIATOR_JSON_H
+
+#include <Arduino.h>
+#include "RadiatorManager.h"
+#include "RadiatorSource.h"
+
+// The radiator list as JSON, written straight from RadiatorManager. Used for
+// the text protocol to esp-web and for the web clients in single-board mode.
+class RadiatorJson : public RadiatorSource {
+public:
+  RadiatorJson(const RadiatorManager& manager);
+
+  bool isSynced() const override;
+  int getCount() const override;
+
+  void writeJson(Print& out) const override;
+  void writeRadiatorJson(Print& out, int index) const override;
+  void writeEtag(char* out, size_t size, uint32_t bootId) const; // changes with every state version
+
+  // Link statistics, see RadiatorLink. Not part of the state versions, they
+  // change with every frame and are only sent when asked for.
+  void writeLinkJson(Print& out, int index) const;
+  void writeLinksJson(Print& out) const; // array of every radiator's
+
+  // The last stall report of a radiator, see RadiatorTelemetry
+  void writeStallJson(Print& out, int index) const;
+
+  // A zone with its members and the ones not acked yet, by radiator index
+  void writeZoneJson(Print& out, int zone) const;
+
+private:
+  const RadiatorManager& _manager;
+};
+
+#endif
@@ -1,124 +1,575 @@
 #include "RadiatorManager.h"
+#include "Stats.h"
+#include "LoopWatchdog.h"
 
-RadiatorManager::RadiatorManager(Communications& comsRef)
-  : coms(comsRef) {}
+// Acked and online bits are set from the Wi-Fi task and share words with
+// other radiators' bits, so bits change atomically. The waiting sets are
+// only touched from loop() and change in place.
+static inline bool hasBit(const uint32_t* set, int index) {
+  return set[index >> 5] & (1UL << (index & 31));
+}
+
+static inline void addBit(uint32_t* set, int index) {
+  __atomic_fetch_or(&set[index >> 5], 1UL << (index & 31), __ATOMIC_RELAXED);
+}
+
+static inline void removeBit(uint32_t* set, int index) {
+  __atomic_fetch_and(&set[index >> 5], ~(1UL << (index & 31)), __ATOMIC_RELAXED);
+}
+
+RadiatorManager::RadiatorManager(Communications& comsRef, const RadiatorTables& tables)
+  : t(tables), words(RADIATOR_SET_WORDS(tables.capacity)), coms(comsRef) {
+  for (int z = 0; z < MAX_ZONES; z++) {
+    snprintf(zones[z].name, sizeof(zones[z].name), "Zone %d", z + 1);
+    zones[z].temp = DEFAULT_TEMP;
+  }
+}
 
 void RadiatorManager::processTemperatureResponse(const uint8_t* mac, const TemperatureResponse& response) {
   int idx = findRadiatorIndex(mac);
   if (idx == -1) {
-    Serial.printf("ACK from unknown device [%s]: %d°C\n",
-                  Communications::macToString(mac).c_str(), response.temperature);
+    char macText[18];
+    Communications::formatMac(mac, macText);
+    Serial.printf("ACK from unknown device [%s]: %d°C\n", macText, response.temperature);
     return;
   }
 
+  t.lastSeen[idx] = millis();
+  RadiatorLink& link = t.links[idx];
+  link.rssi = coms.getRxRssi();
+  // An answer to an older setpoint would make the round trip look shorter
+  if (link.awaitingAck && response.temperature == t.temps[idx]) {
+    link.awaitingAck = false;
+    recordRoundTrip(link, micros() - link.commandSentAt);
+  }
+  if (!hasBit(set(SET_ONLINE), idx)) {
+    addBit(set(SET_ONLINE), idx);
+    markChanged(idx);
+  }
+
+  // Only an answer to the command in flight settles the web request waiting on it
+  if (t.requests[idx] != 0 && response.requestId == t.requests[idx]) {
+    t.requestStates[idx] = response.success ? REQUEST_ACKED : REQUEST_FAILED;
+  }
+
   if (!response.success) {
-    Serial.printf("Failed to set temp on [%s] (wanted %d°C)\n",
-                  Communications::macToString(mac).c_str(), response.temperature);
+    char macText[18];
+    Communications::formatMac(mac, macText);
+    Serial.printf("Failed to set temp on [%s] (wanted %d°C)\n", macText, response.temperature);
     return;
   }
 
-  radiators[idx].ackReceived = true;
-  Serial.printf("ACK received from %s: Temperature set to %d°C\n", radiators[idx].name, response.temperature);
+  addBit(set(SET_ACKED), idx);
+  markChanged(idx);
+  Serial.printf("ACK received from %s: Temperature set to %d°C\n", t.names[idx], response.temperature);
+}
+
+void RadiatorManager::processSendStatus(const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
+  int idx = findRadiatorIndex(mac);
+  if (idx == -1) return;
+
+  bool delivered = status == ESP_NOW_SEND_SUCCESS;
+  if (delivered) {
+    __atomic_add_fetch(&t.links[idx].delivered, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&t.links[idx].failed, 1, __ATOMIC_RELAXED);
+  }
+  // Telemetry polls and the like failing say nothing about the setpoint
+  if (!delivered && type == MSG_TYPE_TEMPERATURE_COMMAND && t.requests[idx] != 0) {
+    t.requestStates[idx] = REQUEST_FAILED;
+  }
+  if (hasBit(set(SET_ONLINE), idx) != delivered) {
+    if (delivered) {
+      addBit(set(SET_ONLINE), idx);
+    } else {
+      removeBit(set(SET_ONLINE), idx);
+    }
+    markChanged(idx);
+  }
+}
+
+void RadiatorManager::processTelemetry(const uint8_t* mac, const RadiatorTelemetry& telemetry) {
+  int idx = findRadiatorIndex(mac);
+  if (idx == -1) return;
+
+  t.lastSeen[idx] = millis();
+  t.telemetry[idx] = telemetry;
+  Serial.printf("%s stalled %u times, the last for %u us in %s\n", t.names[idx], (unsigned)telemetry.stalls,
+                (unsigned)telemetry.lastUs, LoopWatchdog::stageName(telemetry.stage));
 }
 
 void RadiatorManager::handleDiscovery(const Peer& peer) {
-  if (numRadiators >= MAX_RADIATORS) {
+  if (numRadiators >= t.capacity) {
     Serial.println("Maximum number of radiators reached. Skipping.");
     return;
   }
 
   // Check for duplicate MAC
   for (int i = 0; i < numRadiators; ++i) {
-    if (memcmp(radiators[i].mac, peer.mac, 6) == 0) {
+    if (memcmp(t.macs[i], peer.mac, 6) == 0) {
       return;  // Already added
     }
   }
 
   // Add new radiator
-  Radiator& r = radiators[numRadiators++];
-  memcpy(r.mac, peer.mac, 6);
+  int idx = numRadiators;
+  memcpy(t.macs[idx], peer.mac, 6);
 
   // Auto-generate name: "Room X"
-  snprintf(r.name, sizeof(r.name), "Room %d", numRadiators);
+  snprintf(t.names[idx], LINK_NAME_LEN, "Room %u", (unsigned)(idx + 1) % 1000); // capacity stays far below 1000
 
-  r.curr_temp = DEFAULT_TEMP;
-  r.ackReceived = false;
+  t.temps[idx] = DEFAULT_TEMP;
+  t.lastSeen[idx] = millis();
+  t.requests[idx] = 0;
+  t.requestStates[idx] = REQUEST_PENDING;
+  t.links[idx] = {};
+  t.telemetry[idx] = {};
+  removeBit(set(SET_ACKED), idx);
+  addBit(set(SET_ONLINE), idx);
+  numRadiators++;
+  markChanged(idx);
 
-  Serial.printf("New radiator added: %s [%s]\n", r.name, Communications::macToString(r.mac).c_str());
+  Serial.printf("New radiator added: %s [%s]\n", t.names[idx], Communications::macToString(t.macs[idx]).c_str());
 }
 
-void RadiatorManager::sendTemperatureToAll(uint8_t temperature) {
+void RadiatorManager::sendTemperatureToAll(uint8_t temperature, uint16_t request) {
+  STATS_PROBE(PROBE_SEND_ALL);
+
+  PendingCommand* command = beginCommand(request);
+  if (request != 0 && !command) return;
+
   for (int i = 0; i < numRadiators; i++) {
-    sendTemperatureTo(i, temperature);
+    setTemperature(i, temperature, command);
+  }
+  for (Zone& zone : zones) {
+    zone.temp = temperature;
+  }
+  finishIfAnswered(command);
+}
+
+void RadiatorManager::sendTemperatureTo(int index, uint8_t temperature, uint16_t request) {
+  if (index < 0 || index >= numRadiators) {
+    rejectCommand(request);
+    return;
   }
+
+  PendingCommand* command = beginCommand(request);
+  if (request != 0 && !command) return;
+
+  setTemperature(index, temperature, command);
+  finishIfAnswered(command);
 }
 
-void RadiatorManager::sendTemperatureTo(int index, uint8_t temperature) {
-  if (index < 0 || index >= numRadiators) return;
+// Only the zone's members are visited, a word of the membership set at a time
+void RadiatorManager::sendTemperatureToZone(int zone, uint8_t temperature, uint16_t request) {
+  if (zone < 0 || zone >= MAX_ZONES) {
+    rejectCommand(request);
+    return;
+  }
 
-  if (radiators[index].curr_temp == temperature && radiators[index].ackReceived) return;  // already set
+  PendingCommand* command = beginCommand(request);
+  if (request != 0 && !command) return;
 
-  radiators[index].ackReceived = false;
-  radiators[index].curr_temp = temperature;
-  sendTemperatureCommand(radiators[index].mac, temperature);
+  zones[zone].temp = temperature;
+  for (int w = 0; w < liveWords(); w++) {
+    for (uint32_t bits = memberWord(zone, w); bits; bits &= bits - 1) {
+      setTemperature(w * 32 + __builtin_ctz(bits), temperature, command);
+    }
+  }
+  finishIfAnswered(command);
 }
 
-void RadiatorManager::sendTemperatureCommand(const uint8_t* mac, uint8_t temperature) {
+void RadiatorManager::setTemperature(int index, uint8_t temperature, PendingCommand* command) {
+  // Whoever waited on the previous setpoint will not see it applied
+  if (t.requests[index] != 0) {
+    resolveRadiator(index, LINK_OUTCOME_SUPERSEDED);
+  }
+
+  bool acked = hasBit(set(SET_ACKED), index);
+  if (t.temps[index] == temperature && acked) return;  // already set
+
+  if (t.temps[index] == temperature) {
+    STATS_COUNT(COUNTER_FRAMES_RETRIED); // same setpoint again because the last one was never acked
+  }
+
+  removeBit(set(SET_ACKED), index);
+  t.temps[index] = temperature;
+  if (command) {
+    t.requestStates[index] = REQUEST_PENDING;
+    t.requests[index] = command->request;
+    waitingSet(command)[index >> 5] |= 1UL << (index & 31);
+  }
+  markChanged(index);
+  sendTemperatureCommand(t.macs[index], temperature, command ? command->request : 0);
+}
+
+void RadiatorManager::sendTemperatureCommand(const uint8_t* mac, uint8_t temperature, uint16_t request) {
   TemperatureCommand cmd = {};
   cmd.temperature = temperature;
+  cmd.requestId = request;
 
+  int idx = findRadiatorIndex(mac);
+  unsigned long queuedAt = micros();
   esp_err_t result = coms.send(mac, MSG_TYPE_TEMPERATURE_COMMAND, cmd);
+  char macText[18]; // not macToString(), a String per radiator on a fan-out
+  Communications::formatMac(mac, macText);
 
   if (result == ESP_OK) {
-    Serial.printf("Sent temperature command to [%s]: %d°C\n",
-                  Communications::macToString(mac).c_str(), temperature);
+    if (idx != -1) {
+      t.links[idx].commandSentAt = queuedAt;
+      t.links[idx].awaitingAck = true;
+    }
+    Serial.printf("Sent temperature command to [%s]: %d°C\n", macText, temperature);
   } else {
-    Serial.printf("Failed to send temperature command to [%s]: error code %d\n",
-                  Communications::macToString(mac).c_str(), result);
+    Serial.printf("Failed to send temperature command to [%s]: error code %d\n", macText, result);
+    // Not queued, so no send result will come; fail its request now rather than at the timeout
+    if (idx != -1) {
+      __atomic_add_fetch(&t.links[idx].failed, 1, __ATOMIC_RELAXED);
+    }
+    if (idx != -1 && t.requests[idx] != 0) {
+      t.requestStates[idx] = REQUEST_FAILED;
+    }
+  }
+}
+
+void RadiatorManager::rejectCommand(uint16_t request) {
+  if (request != 0) reportDone(request, LINK_OUTCOME_FAILED, 0);
+}
+
+void RadiatorManager::update() {
+  for (int i = 0; i < numRadiators; i++) {
+    if (t.requests[i] == 0) continue;
+
+    uint8_t state = __atomic_load_n(&t.requestStates[i], __ATOMIC_RELAXED);
+    if (state == REQUEST_ACKED) {
+      resolveRadiator(i, LINK_OUTCOME_ACKED);
+    } else if (state == REQUEST_FAILED) {
+      resolveRadiator(i, LINK_OUTCOME_FAILED);
+    }
+  }
+
+  for (PendingCommand& command : pending) {
+    if (command.request == 0 || millis() - command.startedAt <= COMMAND_TIMEOUT_MS) continue;
+
+    uint32_t* waiting = waitingSet(&command);
+    for (int w = 0; w < liveWords(); w++) {
+      for (uint32_t bits = waiting[w]; bits; bits &= bits - 1) {
+        int i = w * 32 + __builtin_ctz(bits);
+        if (t.requests[i] == command.request) t.requests[i] = 0;
+      }
+      waiting[w] = 0;
+    }
+    command.outcome = LINK_OUTCOME_TIMED_OUT;
+    finishIfAnswered(&command);
   }
 }
 
-const Radiator* RadiatorManager::getRadiators() const {
-  return radiators;
+bool RadiatorManager::takeCommandDone(CommandDone& out) {
+  if (doneCount == 0) return false;
+
+  out = done[doneHead];
+  doneHead = (doneHead + 1) % MAX_PENDING_COMMANDS;
+  doneCount--;
+  return true;
+}
+
+const uint8_t* RadiatorManager::getMac(int index) const {
+  return t.macs[index];
+}
+
+const RadiatorLink& RadiatorManager::getLink(int index) const {
+  return t.links[index];
+}
+
+const RadiatorTelemetry& RadiatorManager::getTelemetry(int index) const {
+  return t.telemetry[index];
+}
+
+// Upper edge of the bucket holding the requested percentile, capped at the
+// longest round trip seen
+uint32_t RadiatorManager::ackPercentileMicros(int index, uint8_t percent) const {
+  const RadiatorLink& link = t.links[index];
+  if (link.latencyCount == 0) return 0;
+
+  uint32_t target = ((uint32_t)link.latencyCount * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < LINK_LATENCY_BUCKETS - 1; i++) {
+    seen += link.latency[i];
+    if (seen >= target) return min((1UL << (i + LINK_LATENCY_FIRST_BIT)) - 1, (unsigned long)link.ackMaxUs);
+  }
+  return link.ackMaxUs;
 }
 
 int RadiatorManager::getNumRadiators() const {
   return numRadiators;
 }
 
+int RadiatorManager::getMaxRadiators() const {
+  return t.capacity;
+}
+
 const char* RadiatorManager::getRadiatorName(int index) const {
   if (index < 0 || index >= numRadiators) {
     return "Invalid";
   }
-  return radiators[index].name;
+  return t.names[index];
 }
 
 uint8_t RadiatorManager::getRadiatorTemperature(int index) const {
   if (index < 0 || index >= numRadiators) {
     return 0;
   }
-  return radiators[index].curr_temp;
+  return t.temps[index];
+}
+
+bool RadiatorManager::setRadiatorName(int index, const char* name) {
+  if (index < 0 || index >= numRadiators || name[0] == '\0') return false;
+
+  char* current = t.names[index];
+  if (strncmp(current, name, LINK_NAME_LEN - 1) == 0) return true;
+
+  strncpy(current, name, LINK_NAME_LEN - 1);
+  current[LINK_NAME_LEN - 1] = '\0';
+  markChanged(index);
+  return true;
+}
+
+unsigned long RadiatorManager::getLastSeen(int index) const {
+  return t.lastSeen[index];
+}
+
+uint32_t RadiatorManager::getRadiatorVersion(int index) const {
+  return t.versions[index];
 }
 
+uint32_t RadiatorManager::getVersion() const {
+  return __atomic_load_n(&stateVersion, __ATOMIC_RELAXED);
+}
 
 bool RadiatorManager::isAcked(int index) const {
   if (index < 0 || index >= numRadiators) return false;
-  return radiators[index].ackReceived;
+  return hasBit(set(SET_ACKED), index);
+}
+
+bool RadiatorManager::isOnline(int index) const {
+  if (index < 0 || index >= numRadiators) return false;
+  return hasBit(set(SET_ONLINE), index);
 }
 
 bool RadiatorManager::isAllAcked() const {
-  for (int i = 0; i < numRadiators; i++) {
-    if (!radiators[i].ackReceived) return false;
+  return isZoneAcked(ALL_RADIATORS);
+}
+
+const char* RadiatorManager::getZoneName(int zone) const {
+  if (zone < 0 || zone >= MAX_ZONES) {
+    return "Invalid";
+  }
+  return zones[zone].name;
+}
+
+bool RadiatorManager::setZoneName(int zone, const char* name) {
+  if (zone < 0 || zone >= MAX_ZONES || name[0] == '\0') return false;
+
+  strncpy(zones[zone].name, name, sizeof(zones[zone].name) - 1);
+  zones[zone].name[sizeof(zones[zone].name) - 1] = '\0';
+  return true;
+}
+
+uint8_t RadiatorManager::getZoneTemperature(int zone) const {
+  if (zone < 0 || zone >= MAX_ZONES) {
+    return 0;
+  }
+  return zones[zone].temp;
+}
+
+bool RadiatorManager::addToZone(int zone, int index) {
+  if (zone < 0 || zone >= MAX_ZONES || index < 0 || index >= numRadiators) return false;
+
+  addBit(set(SET_FIRST_ZONE + zone), index);
+  return true;
+}
+
+bool RadiatorManager::removeFromZone(int zone, int index) {
+  if (zone < 0 || zone >= MAX_ZONES || index < 0 || index >= numRadiators) return false;
+
+  removeBit(set(SET_FIRST_ZONE + zone), index);
+  return true;
+}
+
+bool RadiatorManager::isInZone(int zone, int index) const {
+  if (zone < 0 || zone >= MAX_ZONES || index < 0 || index >= numRadiators) return false;
+  return hasBit(set(SET_FIRST_ZONE + zone), index);
+}
+
+int RadiatorManager::getZoneSize(int zone) const {
+  if (!isZone(zone)) return 0;
+
+  int count = 0;
+  for (int w = 0; w < liveWords(); w++) {
+    count += __builtin_popcount(memberWord(zone, w));
   }
+  return count;
+}
 
+// An empty zone is acked, like an empty fleet
+bool RadiatorManager::isZoneAcked(int zone) const {
+  if (!isZone(zone)) return false;
+
+  const uint32_t* acked = set(SET_ACKED);
+  for (int w = 0; w < liveWords(); w++) {
+    if (memberWord(zone, w) & ~acked[w]) return false;
+  }
   return true;
 }
 
+int RadiatorManager::countPending(int zone) const {
+  if (!isZone(zone)) return 0;
+
+  const uint32_t* acked = set(SET_ACKED);
+  int count = 0;
+  for (int w = 0; w < liveWords(); w++) {
+    count += __builtin_popcount(memberWord(zone, w) & ~acked[w]);
+  }
+  return count;
+}
+
+int RadiatorManager::nextPending(int zone, int from) const {
+  if (!isZone(zone) || from < 0 || from >= numRadiators) return -1;
+
+  const uint32_t* acked = set(SET_ACKED);
+  for (int w = from >> 5; w < liveWords(); w++) {
+    uint32_t bits = memberWord(zone, w) & ~acked[w];
+    if (w == from >> 5) bits &= ~0UL << (from & 31);
+    if (bits) return w * 32 + __builtin_ctz(bits);
+  }
+  return -1;
+}
+
+uint32_t* RadiatorManager::set(int which) const {
+  return t.bits + which * words;
+}
+
+bool RadiatorManager::isZone(int zone) const {
+  return zone == ALL_RADIATORS || (zone >= 0 && zone < MAX_ZONES);
+}
+
+uint32_t RadiatorManager::memberWord(int zone, int word) const {
+  uint32_t live = liveMask(word);
+  return zone == ALL_RADIATORS ? live : set(SET_FIRST_ZONE + zone)[word] & live;
+}
+
+uint32_t* RadiatorManager::waitingSet(const PendingCommand* command) const {
+  return set(SET_FIRST_WAITING + (command - pending));
+}
+
+int RadiatorManager::liveWords() const {
+  return RADIATOR_SET_WORDS(numRadiators);
+}
+
+uint32_t RadiatorManager::liveMask(int word) const {
+  int live = numRadiators - word * 32;
+  if (live >= 32) return ~(uint32_t)0;
+  if (live <= 0) return 0;
+  return (1UL << live) - 1;
+}
+
 int RadiatorManager::findRadiatorIndex(const uint8_t* mac) const {
   for (int i = 0; i < numRadiators; i++) {
-    if (memcmp(mac, radiators[i].mac, 6) == 0) {
+    if (memcmp(mac, t.macs[i], 6) == 0) {
       return i;
     }
   }
   return -1;
-}
\ No newline at end of file
+}
+
+PendingCommand* RadiatorManager::beginCommand(uint16_t request) {
+  if (request == 0) return nullptr;
+
+  for (PendingCommand& command : pending) {
+    if (command.request == 0) {
+      command = { request, LINK_OUTCOME_ACKED, millis() };
+      return &command;
+    }
+  }
+
+  Serial.printf("Too many commands in flight, rejected request %u\n", request);
+  reportDone(request, LINK_OUTCOME_BUSY, 0);
+  return nullptr;
+}
+
+PendingCommand* RadiatorManager::findCommand(uint16_t request) {
+  for (PendingCommand& command : pending) {
+    if (command.request == request) return &command;
+  }
+  return nullptr;
+}
+
+void RadiatorManager::resolveRadiator(int index, uint8_t outcome) {
+  PendingCommand* command = findCommand(t.requests[index]);
+  t.requests[index] = 0;
+  if (!command) return;
+
+  waitingSet(command)[index >> 5] &= ~(1UL << (index & 31));
+  command->outcome = max(command->outcome, outcome);
+  finishIfAnswered(command);
+}
+
+void RadiatorManager::finishIfAnswered(PendingCommand* command) {
+  if (!command) return;
+
+  const uint32_t* waiting = waitingSet(command);
+  for (int w = 0; w < liveWords(); w++) {
+    if (waiting[w]) return;
+  }
+
+  uint32_t ms = millis() - command->startedAt;
+  reportDone(command->request, command->outcome, ms);
+  command->request = 0;
+}
+
+void RadiatorManager::reportDone(uint16_t request, uint8_t outcome, uint32_t ms) {
+  STATS_MICROS(PROBE_COMMAND, ms * 1000);
+  STATS_COUNT(outcome == LINK_OUTCOME_ACKED ? COUNTER_COMMANDS_ACKED : COUNTER_COMMANDS_FAILED);
+  if (ms > SLOW_COMMAND_MS) {
+    STATS_COUNT(COUNTER_COMMANDS_SLOW);
+    Serial.printf("Slow command %u: %s after %u ms\n", request, linkOutcomeName(outcome), (unsigned)ms);
+  }
+
+  // The oldest outcome is dropped if nobody takes them
+  if (doneCount == MAX_PENDING_COMMANDS) {
+    doneHead = (doneHead + 1) % MAX_PENDING_COMMANDS;
+    doneCount--;
+  }
+  done[(doneHead + doneCount) % MAX_PENDING_COMMANDS] = { request, outcome, ms };
+  doneCount++;
+}
+
+// Runs on the Wi-Fi task with the answer. Only the halving walks the buckets,
+// about once every LINK_LATENCY_WINDOW / 2 round trips.
+void RadiatorManager::recordRoundTrip(RadiatorLink& link, uint32_t us) {
+  int bucket = 31 - __builtin_clz(us | 1) - (LINK_LATENCY_FIRST_BIT - 1);
+  bucket = constrain(bucket, 0, LINK_LATENCY_BUCKETS - 1);
+
+  if (link.latencyCount == LINK_LATENCY_WINDOW) {
+    link.latencyCount = 0;
+    for (uint16_t& count : link.latency) {
+      count /= 2;
+      link.latencyCount += count;
+    }
+  }
+  link.latency[bucket]++;
+  link.latencyCount++;
+
+  if (link.acks == 0) {
+    link.ackAvgUs = us;
+  } else {
+    link.ackAvgUs += ((int32_t)us - (int32_t)link.ackAvgUs) >> LINK_EWMA_SHIFT;
+  }
+  if (us > link.ackMaxUs) link.ackMaxUs = us;
+  link.acks++;
+}
+
+// Acks and send results arrive on the Wi-Fi task, so the counter is atomic
+void RadiatorManager::markChanged(int index) {
+  t.versions[index] = __atomic_add_fetch(&stateVersion, 1, __ATOMIC_RELAXED);
+}
@@ -3,46 +3,211 @@
 
 #include "Communications.h"
 #include "Messages.h"
+#include "LinkProtocol.h"
 
 #define DEFAULT_TEMP 20
-#define MAX_RADIATORS 10
 
 #define MIN_TEMP 8
 #define MAX_TEMP 28
 
+#define MAX_PENDING_COMMANDS 16 // web commands waiting on radiator acks
+#define COMMAND_TIMEOUT_MS 3000
+#define SLOW_COMMAND_MS 1000 // logged and counted when an outcome takes longer
+
+#define LINK_LATENCY_BUCKETS 12 // log2 buckets of setpoint round trips, under 1 ms up to over 1 s
+#define LINK_LATENCY_FIRST_BIT 10 // bucket 0 holds round trips under 2^10 us
+#define LINK_LATENCY_WINDOW 256 // the histogram halves once it holds this many, so percentiles follow recent acks
+#define LINK_EWMA_SHIFT 3 // each round trip moves the average 1/8 of the way
+
+#define MAX_ZONES 8 // named groups of radiators (a floor, a wing), a radiator may be in several
+#define ALL_RADIATORS -1 // zone argument meaning every radiator
+
+// Bit sets over radiator indexes, 32 radiators a word: acked, online, one
+// membership set per zone and one waiting set per pending command
+#define RADIATOR_SET_WORDS(radiators) (((radiators) + 31) / 32)
+#define RADIATOR_SETS (2 + MAX_ZONES + MAX_PENDING_COMMANDS)
+
+enum RequestState : uint8_t {
+  REQUEST_PENDING,
+  REQUEST_ACKED,
+  REQUEST_FAILED
+};
+
+// Link quality of one radiator, for finding flaky valves. Kept apart from
+// the state the web reads on every change. Each send result,
+// answer and setpoint updates it in O(1), from whichever task it arrives on.
+typedef struct {
+  uint32_t delivered; // frames the radio delivered to it, from the send callback
+  uint32_t failed; // frames it did not take, or the driver would not queue
+  uint32_t acks; // setpoint answers with a measured round trip
+  uint32_t ackAvgUs; // moving average of setpoint -> answer
+  uint32_t ackMaxUs;
+  uint16_t latency[LINK_LATENCY_BUCKETS]; // bucket i ends at 2^(i+10) us, the last is open
+  uint16_t latencyCount;
+  bool awaitingAck;
+  int8_t rssi; // dBm of its last answer, 0 before the first
+  uint32_t commandSentAt; // micros() of the setpoint still owed an answer
+} RadiatorLink;
+
+// A web command in flight. Which radiators still owe an answer is the
+// waiting set of its slot.
 typedef struct {
-  uint8_t mac[6];
-  char name[16];
-  uint8_t curr_temp; // hold current temp for each radiator
-  bool ackReceived; 
-} Radiator;
+  uint16_t request; // 0 = free slot
+  uint8_t outcome; // worst LinkCommandOutcome so far
+  unsigned long startedAt;
+} PendingCommand;
 
+typedef struct {
+  uint16_t request;
+  uint8_t outcome; // LinkCommandOutcome
+  uint32_t ms;
+} CommandDone;
+
+typedef struct {
+  char name[LINK_NAME_LEN];
+  uint8_t temp; // last setpoint sent to the zone, or to all
+} Zone;
+
+// Where a RadiatorManagerFor keeps the radiators: one array per field, so a
+// pass over the fleet only loads the field it reads, and the flags as bit
+// sets, so "is this zone acked" is a few word operations
+typedef struct {
+  uint8_t (*macs)[6];
+  char (*names)[LINK_NAME_LEN];
+  uint8_t* temps; // setpoint last sent
+  uint32_t* versions; // state version of its last change, see getVersion()
+  unsigned long* lastSeen; // millis() of the last frame received from it
+  uint16_t* requests; // web request waiting on it, 0 = none
+  uint8_t* requestStates; // RequestState, set from the Wi-Fi task
+  RadiatorLink* links;
+  RadiatorTelemetry* telemetry; // its last stall report, zero until one comes
+  uint32_t* bits; // RADIATOR_SETS sets of RADIATOR_SET_WORDS(capacity) words
+  int capacity;
+} RadiatorTables;
+
+// Declare a RadiatorManagerFor<Capacity>, which holds the radiator tables
 class RadiatorManager {
 public:
-  RadiatorManager(Communications& comsRef);
-
   void processTemperatureResponse(const uint8_t* mac, const TemperatureResponse& response);
+  void processSendStatus(const uint8_t* mac, uint8_t type, esp_now_send_status_t status);
+  void processTelemetry(const uint8_t* mac, const RadiatorTelemetry& telemetry);
   void handleDiscovery(const Peer& peer);
 
-  void sendTemperatureToAll(uint8_t temperature);
-  void sendTemperatureTo(int index, uint8_t temperature);
-  void sendTemperatureCommand(const uint8_t* mac, uint8_t temperature);
+  // A non-zero request id is tracked until every radiator it reached has
+  // acked, failed or timed out, then reported through takeCommandDone()
+  void sendTemperatureToAll(uint8_t temperature, uint16_t request = 0);
+  void sendTemperatureTo(int index, uint8_t temperature, uint16_t request = 0);
+  void sendTemperatureToZone(int zone, uint8_t temperature, uint16_t request = 0);
+  void sendTemperatureCommand(const uint8_t* mac, uint8_t temperature, uint16_t request = 0);
+
+  void rejectCommand(uint16_t request); // reports a command that was never sent as failed
 
-  const Radiator* getRadiators() const;
+  void update(); // resolves acks and timeouts of tracked commands, call from loop()
+  bool takeCommandDone(CommandDone& done);
+
+  const uint8_t* getMac(int index) const;
+  const RadiatorLink& getLink(int index) const;
+  const RadiatorTelemetry& getTelemetry(int index) const; // like links, outside the state versions
+  uint32_t ackPercentileMicros(int index, uint8_t percent) const; // within a factor of two, like Stats
   int getNumRadiators() const;
+  int getMaxRadiators() const;
   const char* getRadiatorName(int index) const;
   uint8_t getRadiatorTemperature(int index) const;
+  bool setRadiatorName(int index, const char* name);
+  unsigned long getLastSeen(int index) const;
+  uint32_t getRadiatorVersion(int index) const;
+
+  // Bumped on every setpoint, ack, name or liveness change. Each radiator
+  // remembers the version of its last change, so everything newer than a
+  // version N is exactly what changed since N.
+  uint32_t getVersion() const;
 
   bool isAcked(int index) const;
+  bool isOnline(int index) const;
   bool isAllAcked() const;
+
+  // Zones are 0 to MAX_ZONES - 1 and start out empty, named "Zone N". Like
+  // radiator names they are not kept over a reboot.
+  const char* getZoneName(int zone) const;
+  bool setZoneName(int zone, const char* name);
+  uint8_t getZoneTemperature(int zone) const;
+  bool addToZone(int zone, int index);
+  bool removeFromZone(int zone, int index);
+  bool isInZone(int zone, int index) const;
+  int getZoneSize(int zone) const;
+
+  // zone may be ALL_RADIATORS
+  bool isZoneAcked(int zone) const;
+  int countPending(int zone) const; // radiators whose setpoint is not acked yet
+  int nextPending(int zone, int from) const; // first such index >= from, -1 if none
+
+protected:
+  RadiatorManager(Communications& comsRef, const RadiatorTables& tables);
+
 private:
-  Radiator radiators[MAX_RADIATORS];
+  enum RadiatorSet : uint8_t {
+    SET_ACKED,
+    SET_ONLINE, // cleared once a frame to it was not delivered
+    SET_FIRST_ZONE,
+    SET_FIRST_WAITING = SET_FIRST_ZONE + MAX_ZONES // one per pending[] slot
+  };
+
+  RadiatorTables t;
+  int words; // per set
   int numRadiators = 0;
-  uint8_t commonTemp = DEFAULT_TEMP;
+  uint32_t stateVersion = 0;
+  Zone zones[MAX_ZONES];
+
+  PendingCommand pending[MAX_PENDING_COMMANDS] = {};
+  CommandDone done[MAX_PENDING_COMMANDS]; // ring of outcomes not yet taken
+  int doneHead = 0;
+  int doneCount = 0;
 
   Communications& coms;
 
+  uint32_t* set(int which) const;
+  bool isZone(int zone) const; // a zone or ALL_RADIATORS
+  uint32_t memberWord(int zone, int word) const; // that word of the zone's discovered members
+  uint32_t* waitingSet(const PendingCommand* command) const;
+  int liveWords() const; // words of each set that hold discovered radiators
+  uint32_t liveMask(int word) const; // bits of discovered radiators in that word
+
   int findRadiatorIndex(const uint8_t* mac) const;
+  void markChanged(int index);
+  void recordRoundTrip(RadiatorLink& link, uint32_t us);
+  void setTemperature(int index, uint8_t temperature, PendingCommand* command);
+
+  PendingCommand* beginCommand(uint16_t request);
+  PendingCommand* findCommand(uint16_t request);
+  void resolveRadiator(int index, uint8_t outcome);
+  void finishIfAnswered(PendingCommand* command);
+  void reportDone(uint16_t request, uint8_t outcome, uint32_t ms);
+};
+
+// RadiatorManager with room for Capacity::radiators, see Capacity.h
+template <typename Capacity>
+class RadiatorManagerFor : public RadiatorManager {
+public:
+  static_assert(Capacity::radiators > 0, "a server preset has radiators");
+  static_assert(Capacity::radiators <= Capacity::peers, "every radiator is a discovered peer");
+
+  RadiatorManagerFor(Communications& comsRef)
+    : RadiatorManager(comsRef, { macs, names, temps, versions, lastSeen, requests, requestStates,
+                                 linkTable, telemetry, bits, Capacity::radiators }) {}
+  RadiatorManagerFor(const RadiatorManagerFor&) = delete;
+  RadiatorManagerFor& operator=(const RadiatorManagerFor&) = delete;
+
+private:
+  uint8_t macs[Capacity::radiators][6];
+  char names[Capacity::radiators][LINK_NAME_LEN];
+  uint8_t temps[Capacity::radiators];
+  uint32_t versions[Capacity::radiators];
+  unsigned long lastSeen[Capacity::radiators];
+  uint16_t requests[Capacity::radiators];
+  uint8_t requestStates[Capacity::radiators];
+  RadiatorLink linkTable[Capacity::radiators];
+  RadiatorTelemetry telemetry[Capacity::radiators];
+  uint32_t bits[RADIATOR_SETS * RADIATOR_SET_WORDS(Capacity::radiators)] = {};
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include "Stats.h"
+
+Histogram Stats::histograms[PROBE_COUNT] = {};
+uint32_t Stats::counters[COUNTER_COUNT] = {};
+const TxStats* Stats::txStats = nullptr;
+const TimeStats* Stats::timeStats = nullptr;
+const AuthStats* Stats::authStats = nullptr;
+const LoopWatchdog* Stats::stallWatchdog = nullptr;
+
+static const char* const probeNames[PROBE_COUNT] = {
+  "loop",
+  "webcoms",
+  "dht",
+  "display",
+  "send_all",
+  "command"
+};
+
+static const char* const counterNames[COUNTER_COUNT] = {
+  "frames_sent",
+  "frames_failed",
+  "frames_retried",
+  "commands_acked",
+  "commands_failed",
+  "commands_slow"
+};
+
+static uint32_t cyclesToMicros(uint32_t cycles) {
+  return cycles / ESP.getCpuFreqMHz();
+}
+
+const char* Stats::probeName(ProbeId probe) {
+  if (probe >= PROBE_COUNT) return "invalid";
+  return probeNames[probe];
+}
+
+uint32_t Stats::getCount(ProbeId probe) {
+  return histograms[probe].count;
+}
+
+uint32_t Stats::getCounter(CounterId counter) {
+  return __atomic_load_n(&counters[counter], __ATOMIC_RELAXED);
+}
+
+// Upper edge of the bucket holding the requested percentile, so the result
+// is accurate to within a factor of two
+uint32_t Stats::percentileMicros(ProbeId probe, uint8_t percent) {
+  const Histogram& h = histograms[probe];
+  if (h.count == 0) return 0;
+
+  uint32_t target = ((uint64_t)h.count * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += h.buckets[i];
+    if (seen >= target) {
+      uint32_t upper = (i == STATS_BUCKETS - 1) ? UINT32_MAX : ((1UL << (i + 1)) - 1);
+      return cyclesToMicros(min(upper, h.max));
+    }
+  }
+
+  return cyclesToMicros(h.max);
+}
+
+uint32_t Stats::maxMicros(ProbeId probe) {
+  return cyclesToMicros(histograms[probe].max);
+}
+
+// {"stats":{"loop":{"n":..,"p50":..,"p99":..,"max":..},...,"frames_sent":..,
+//  "tx":{"depth":..,...,"dropped":[command,ack,discovery,telemetry]},
+//  "time":{"hop_n":..,"hop_avg":..,"hop_min":..,"hop_max":..,"hop_outliers":..},
+//  "auth":{"accepted":..,"unsigned":..,"forged":..,"replayed":..,"reserved":..},
+//  "stalls":{"count":..,"boots":..,"budget":..,"max":..}}}
+// All times are in microseconds
+void Stats::printJson(Print& out) {
+  out.print("{\"stats\":{");
+
+  for (int i = 0; i < PROBE_COUNT; i++) {
+    ProbeId probe = (ProbeId)i;
+    out.printf("\"%s\":{\"n\":%u,\"p50\":%u,\"p99\":%u,\"max\":%u},",
+               probeNames[i], (unsigned)getCount(probe), (unsigned)percentileMicros(probe, 50),
+               (unsigned)percentileMicros(probe, 99), (unsigned)maxMicros(probe));
+  }
+
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    out.printf("%s\"%s\":%u", i == 0 ? "" : ",", counterNames[i], (unsigned)getCounter((CounterId)i));
+  }
+
+  if (txStats) {
+    const TxStats& tx = *txStats;
+    out.printf(",\"tx\":{\"depth\":%u,\"depth_peak\":%u,\"in_flight_peak\":%u,\"sent\":%u,\"wait_avg\":%u,"
+               "\"wait_max\":%u,\"driver_busy\":%u,\"expired\":%u,\"dropped\":[%u,%u,%u,%u]}",
+               tx.depth, tx.depthPeak, tx.inFlightPeak, (unsigned)tx.sent,
+               (unsigned)(tx.sent ? tx.waitTotalUs / tx.sent : 0), (unsigned)tx.waitMaxUs, (unsigned)tx.driverBusy,
+               (unsigned)tx.expired, (unsigned)tx.dropped[TX_PRIORITY_COMMAND], (unsigned)tx.dropped[TX_PRIORITY_ACK],
+               (unsigned)tx.dropped[TX_PRIORITY_DISCOVERY], (unsigned)tx.dropped[TX_PRIORITY_TELEMETRY]);
+  }
+
+  if (timeStats) {
+    const TimeStats& time = *timeStats;
+    out.printf(",\"time\":{\"hop_n\":%u,\"hop_avg\":%d,\"hop_min\":%d,\"hop_max\":%d,\"hop_outliers\":%u}",
+               (unsigned)time.hopSamples, (int)(time.hopSamples ? time.hopTotalUs / time.hopSamples : 0),
+               (int)time.hopMinUs, (int)time.hopMaxUs, (unsigned)time.hopOutliers);
+  }
+
+  if (authStats) {
+    const AuthStats& auth = *authStats;
+    out.printf(",\"auth\":{\"accepted\":%u,\"unsigned\":%u,\"forged\":%u,\"replayed\":%u,\"unsynced\":%u,"
+               "\"challenges\":%u,\"reserved\":%u}",
+               (unsigned)auth.accepted, (unsigned)auth.unsignedFrames, (unsigned)auth.forged, (unsigned)auth.replayed,
+               (unsigned)auth.unsynced, (unsigned)auth.challenges, (unsigned)auth.reserved);
+  }
+
+  if (stallWatchdog) {
+    const LoopWatchdog& watchdog = *stallWatchdog;
+    out.printf(",\"stalls\":{\"count\":%u,\"boots\":%u,\"budget\":%u,\"max\":%u}", (unsigned)watchdog.getCount(),
+               (unsigned)watchdog.getBoots(), (unsigned)watchdog.getBudgetMicros(), (unsigned)watchdog.getMaxMicros());
+  }
+
+  out.print("}}");
+}
+
+void Stats::watchTx(const TxStats* tx) {
+  txStats = tx;
+}
+
+void Stats::watchTime(const TimeStats* time) {
+  timeStats = time;
+}
+
+void Stats::watchAuth(const AuthStats* auth) {
+  authStats = auth;
+}
+
+void Stats::watchStalls(const LoopWatchdog* watchdog) {
+  stallWatchdog = watchdog;
+}
+
+int Stats::getStallRecords() {
+  return stallWatchdog ? stallWatchdog->getRecordCount() : 0;
+}
+
+// {"stall":0,"boot":3,"at":81234,"us":52410,"stage":"dht","stage_us":50120,"reset":0}
+// at in milliseconds since that boot, us 0 and reset set when a watchdog reset ended it
+void Stats::printStallJson(Print& out, int i) {
+  const StallRecord& record = stallWatchdog->getRecord(i);
+  out.printf("{\"stall\":%d,\"boot\":%u,\"at\":%u,\"us\":%u,\"stage\":\"%s\",\"stage_us\":%u,\"reset\":%u}", i,
+             (unsigned)record.boot, (unsigned)record.atMs, (unsigned)record.us, LoopWatchdog::stageName(record.stage),
+             (unsigned)record.stageUs, (unsigned)record.reset);
+}
+
+void Stats::reset() {
+  memset(histograms, 0, sizeof(histograms));
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  }
+}
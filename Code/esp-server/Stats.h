@@ -0,0 +1,108 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <Arduino.h>
+#include "Communications.h"
+#include "LoopWatchdog.h"
+
+#define STATS_ENABLED 1 // CHANGE TO 0 TO COMPILE ALL PROBES OUT
+#define STATS_BUCKETS 32 // one log2 bucket per bit of the cycle counter
+
+// Named code sections that get a latency histogram
+enum ProbeId : uint8_t {
+  PROBE_LOOP,
+  PROBE_WEBCOMS,
+  PROBE_DHT,
+  PROBE_DISPLAY,
+  PROBE_SEND_ALL,
+  PROBE_COMMAND, // web command reaching the server to its last radiator answer
+  PROBE_COUNT
+};
+
+enum CounterId : uint8_t {
+  COUNTER_FRAMES_SENT,
+  COUNTER_FRAMES_FAILED,
+  COUNTER_FRAMES_RETRIED,
+  COUNTER_COMMANDS_ACKED,
+  COUNTER_COMMANDS_FAILED, // failed, superseded, timed out or rejected
+  COUNTER_COMMANDS_SLOW, // took longer than SLOW_COMMAND_MS
+  COUNTER_COUNT
+};
+
+struct Histogram {
+  uint32_t buckets[STATS_BUCKETS]; // bucket i counts samples in [2^i, 2^(i+1)) cycles
+  uint32_t count;
+  uint32_t max;
+};
+
+class Stats {
+public:
+  static inline void record(ProbeId probe, uint32_t cycles) {
+    Histogram& h = histograms[probe];
+    h.buckets[31 - __builtin_clz(cycles | 1)]++;
+    h.count++;
+    if (cycles > h.max) h.max = cycles;
+  }
+
+  // For spans measured with micros()/millis() rather than the cycle counter
+  static inline void recordMicros(ProbeId probe, uint32_t micros) {
+    uint32_t mhz = ESP.getCpuFreqMHz();
+    record(probe, micros < UINT32_MAX / mhz ? micros * mhz : UINT32_MAX);
+  }
+
+  // Counters are bumped from the Wi-Fi task too, so keep them atomic
+  static inline void increment(CounterId counter) {
+    __atomic_fetch_add(&counters[counter], 1, __ATOMIC_RELAXED);
+  }
+
+  static const char* probeName(ProbeId probe);
+  static uint32_t getCount(ProbeId probe);
+  static uint32_t getCounter(CounterId counter);
+  static uint32_t percentileMicros(ProbeId probe, uint8_t percent);
+  static uint32_t maxMicros(ProbeId probe);
+
+  static void printJson(Print& out);
+  static void reset();
+
+  // Transmit queue counters printed with the rest, see Communications::getTxStats()
+  static void watchTx(const TxStats* tx);
+  // Radio latency measured with time sync, see Communications::getTimeStats()
+  static void watchTime(const TimeStats* time);
+  // Signed frames dropped and accepted, see Communications::getAuthStats()
+  static void watchAuth(const AuthStats* auth);
+  // loop() stalls this board kept, see LoopWatchdog
+  static void watchStalls(const LoopWatchdog* watchdog);
+  static int getStallRecords();
+  static void printStallJson(Print& out, int i); // oldest first
+
+private:
+  static Histogram histograms[PROBE_COUNT];
+  static uint32_t counters[COUNTER_COUNT];
+  static const TxStats* txStats;
+  static const TimeStats* timeStats;
+  static const AuthStats* authStats;
+  static const LoopWatchdog* stallWatchdog;
+};
+
+// Records the cycles spent between construction and destruction
+class ScopedProbe {
+public:
+  explicit ScopedProbe(ProbeId probe) : probe(probe), start(ESP.getCycleCount()) {}
+  ~ScopedProbe() { Stats::record(probe, ESP.getCycleCount() - start); }
+
+private:
+  ProbeId probe;
+  uint32_t start;
+};
+
+#if STATS_ENABLED
+#define STATS_PROBE(id) ScopedProbe probe_##id(id)
+#define STATS_COUNT(id) Stats::increment(id)
+#define STATS_MICROS(id, micros) Stats::recordMicros(id, micros)
+#else
+#define STATS_PROBE(id)
+#define STATS_COUNT(id)
+#define STATS_MICROS(id, micros)
+#endif
+
+#endif
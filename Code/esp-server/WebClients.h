@@ -0,0 +1,64 @@
+#ifndef WEB_CLIENTS_H
+#define WEB_CLIENTS_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include "RadiatorSource.h"
+
+#define MAX_WEB_CLIENTS 8
+#define WS_CLIENT_QUEUE_LIMIT 3 // messages queued in AsyncWebSocket per client before we hold back
+#define WS_CLIENT_STALL_MS 15000 // a client that takes nothing for this long is disconnected
+
+// Radiator state fan-out to the WebSocket clients with per-client backpressure.
+//
+// Nothing is queued per update. Each client only remembers which radiators
+// changed since it was last sent them (or that it needs the whole list), and
+// update() sends the current state once the client has room. A slow
+// client therefore gets one message per radiator however many updates it
+// missed, and memory stays bounded by the AsyncWebSocket queue limit.
+// Each message is built once into a shared buffer for every client it goes to.
+class WebClients {
+public:
+  WebClients(AsyncWebSocket& ws, const RadiatorSource& radiators);
+
+  bool add(uint32_t id); // false when the table is full
+  void remove(uint32_t id);
+
+  void markChanged(uint32_t radiators); // bit per radiator index
+  void markAllChanged(); // whole list, after a full sync
+
+  // For messages that are not radiator state (stats, ...). Clients without
+  // room miss it rather than queue it.
+  void broadcast(const char* data, size_t length);
+
+  void update(); // call from loop()
+
+  int getCount() const;
+
+  uint32_t sent = 0; // messages handed to AsyncWebSocket, per client
+  uint32_t dropped = 0; // broadcasts skipped for clients without room
+  uint32_t disconnected = 0; // clients dropped for staying behind
+
+private:
+  struct Client {
+    uint32_t id; // 0 = free slot
+    uint32_t dirty; // bit per radiator index still to send
+    bool needsList;
+    unsigned long behindSince; // 0 while the client keeps up
+  };
+
+  AsyncWebSocket& _ws;
+  const RadiatorSource& _radiators;
+  Client _clients[MAX_WEB_CLIENTS] = {};
+  int _nextRadiator = 0;
+
+  bool hasRoom(AsyncWebSocketClient *client) const;
+  void sendLists();
+  bool sendRadiator(int index); // false when no client took it
+  void dropStalled();
+
+  template <typename Writer>
+  AsyncWebSocketMessageBuffer* makeMessage(Writer write);
+};
+
+#endif
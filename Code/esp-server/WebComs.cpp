@@ -1,98 +1,460 @@
 #include "WebComs.h"
-#include <ArduinoJson.h>
+#include "Stats.h"
+#include "JsonWriter.h"
 
-WebComs::WebComs(HardwareSerial& serial, RadiatorManager& manager)
-  : _serial(serial), _manager(manager), _buffer("") {}
+enum Keyword : uint8_t {
+  KW_UNKNOWN,
+  KW_ALL,
+  KW_T,
+  KW_GET,
+  KW_RADIATORS,
+  KW_STATS,
+  KW_LINKS,
+  KW_ZONES,
+  KW_STALLS,
+  KW_INFO,
+  KW_SET,
+  KW_TEMP,
+  KW_NAME,
+  KW_ZONE,
+  KW_ADD,
+  KW_DEL,
+  KW_LINK,
+  KW_BIN
+};
+
+struct KeywordEntry {
+  const char* text;
+  Keyword id;
+};
+
+static constexpr KeywordEntry keywords[] = {
+  { "ALL", KW_ALL },
+  { "T", KW_T },
+  { "GET", KW_GET },
+  { "RADIATORS", KW_RADIATORS },
+  { "STATS", KW_STATS },
+  { "LINKS", KW_LINKS },
+  { "ZONES", KW_ZONES },
+  { "STALLS", KW_STALLS },
+  { "INFO", KW_INFO },
+  { "SET", KW_SET },
+  { "TEMP", KW_TEMP },
+  { "NAME", KW_NAME },
+  { "ZONE", KW_ZONE },
+  { "ADD", KW_ADD },
+  { "DEL", KW_DEL },
+  { "LINK", KW_LINK },
+  { "BIN", KW_BIN }
+};
+
+static Keyword lookupKeyword(const StrView& token) {
+  for (const KeywordEntry& keyword : keywords) {
+    if (token.equals(keyword.text)) return keyword.id;
+  }
+  return KW_UNKNOWN;
+}
+
+WebComs::WebComs(HardwareSerial& serial, RadiatorManager& manager, RadiatorCommands& commands)
+  : _serial(serial), _manager(manager), _commands(commands), _json(manager) {}
 
 void WebComs::update() {
+  if (_mode == LINK_MODE_BINARY) {
+    updateBinary();
+  } else {
+    updateText();
+  }
+
+  pushChanges();
+
+  CommandDone done;
+  while (_manager.takeCommandDone(done)) {
+    sendCommandDone(done);
+  }
+}
+
+void WebComs::updateText() {
   while (_serial.available()) {
-    char c = _serial.read();
-    if (c == '\n') {
-      handleLine(_buffer);
-      _buffer = "";
-    } else {
-      _buffer += c;
+    if (_lineReader.push(_serial.read())) {
+      handleLine(_lineReader.line());
     }
   }
 }
 
-void WebComs::handleLine(const String& lineRaw) {
-  String line = lineRaw;
-  line.trim();  // Removes any \r, spaces, etc.
-  Serial.print("Received command: ");
-  Serial.println(line);
-
-  const int MAX_PARTS = 5;
-  String parts[MAX_PARTS];
-  int numParts = splitString(line, '/', parts, MAX_PARTS);
-
-  if (numParts == 0) return; // nothing to do
-
-  if (parts[0] == "ALL" && parts[1] == "T" && numParts >= 3) {
-      int temp = parts[2].toInt();
-      _manager.sendTemperatureToAll(temp);
-  } else if (parts[0] == "GET" && parts[1] == "RADIATORS") {
-      sendRadiatorStates();
-  } else if (parts[0] == "INFO") {
-    ip = parts[1];
-    ssid = parts[2];
-    password = parts[3];
-  } else if (parts[0] == "SET") {
-    if (parts[1] == "TEMP") { // SET/TEMP/<id>/<temperature>
-      int index = parts[2].toInt();
-      int temp = parts[3].toInt();
-      Serial.printf("Setting temperature to [%d]: %d°C\n", index, temp);
-      _manager.sendTemperatureTo(index, temp);
+void WebComs::updateBinary() {
+  while (_serial.available()) {
+    if (_decoder.push(_serial.read())) {
+      _lastFrameAt = millis();
+      handleFrame(_decoder.frame());
     }
   }
 
+  // esp-web pings every LINK_PING_INTERVAL_MS, silence means it rebooted into text mode
+  if (millis() - _lastFrameAt > LINK_TIMEOUT_MS) {
+    fallBackToText();
+  }
+}
+
+void WebComs::handleFrame(const LinkFrame& frame) {
+  switch (frame.type) {
+    case LINK_SET_ALL_TEMP:
+      if (frame.length == sizeof(LinkSetAllTemp)) {
+        const LinkSetAllTemp* cmd = reinterpret_cast<const LinkSetAllTemp*>(frame.payload);
+        _commands.setAll(cmd->temperature, cmd->request);
+      }
+      break;
+
+    case LINK_SET_TEMP:
+      if (frame.length == sizeof(LinkSetTemp)) {
+        const LinkSetTemp* cmd = reinterpret_cast<const LinkSetTemp*>(frame.payload);
+        Serial.printf("Setting temperature to [%d]: %d°C\n", cmd->index, cmd->temperature);
+        _commands.setTemp(cmd->index, cmd->temperature, cmd->request);
+      }
+      break;
+
+    case LINK_GET_RADIATORS:
+      if (frame.length == sizeof(LinkGetRadiators)) {
+        const LinkGetRadiators* req = reinterpret_cast<const LinkGetRadiators*>(frame.payload);
+        sendRadiatorsSince(req->since);
+      } else {
+        sendRadiatorStates();
+      }
+      break;
+
+    case LINK_SET_NAME:
+      if (frame.length > offsetof(LinkSetName, name) && frame.length <= sizeof(LinkSetName)) {
+        size_t nameLen = frame.length - offsetof(LinkSetName, name);
+        _commands.setName(frame.payload[0], (const char*)frame.payload + offsetof(LinkSetName, name), nameLen);
+      }
+      break;
+
+    case LINK_PING:
+      sendFrame(LINK_PONG, nullptr, 0);
+      break;
+
+    case LINK_TEXT_PART:
+    case LINK_TEXT_END:
+      for (int i = 0; i < frame.length; i++) {
+        _tunnelReader.push(frame.payload[i]);
+      }
+      if (frame.type == LINK_TEXT_END && _tunnelReader.push('\n')) {
+        handleLine(_tunnelReader.line());
+      }
+      break;
+
+    default:
+      Serial.printf("Unknown link frame type %d\n", frame.type);
+      break;
+  }
+}
+
+void WebComs::switchToBinary(uint32_t baud) {
+  // Acknowledge at the old rate, then both ends move to the new one
+  _serial.print("LINK/OK/");
+  _serial.println(baud);
+  _serial.flush();
+  _serial.updateBaudRate(baud);
+
+  _mode = LINK_MODE_BINARY;
+  _decoder.reset();
+  _tunnelReader.reset();
+  _lastFrameAt = millis();
+  Serial.printf("Web link switched to binary at %u baud\n", (unsigned)baud);
+}
+
+void WebComs::fallBackToText() {
+  _serial.updateBaudRate(LINK_TEXT_BAUD);
+  _mode = LINK_MODE_TEXT;
+  _lineReader.reset();
+  Serial.println("Web link timed out, back to text protocol");
+}
+
+void WebComs::sendFrame(uint8_t type, const void* payload, uint8_t length) {
+  uint8_t out[LINK_MAX_ENCODED];
+  size_t len = linkEncodeFrame(type, _txSeq++, payload, length, out);
+  _serial.write(out, len);
+}
+
+void WebComs::handleLine(StrView line) {
+  Serial.print("Received command: ");
+  Serial.write(line.data, line.length);
+  Serial.println();
+
+  if (line.length == 0) return; // nothing to do
+
+  const int MAX_PARTS = 6;
+  StrView parts[MAX_PARTS];
+  int numParts = tokenize(line, '/', parts, MAX_PARTS);
+
+  Keyword command = lookupKeyword(parts[0]);
+  Keyword target = numParts > 1 ? lookupKeyword(parts[1]) : KW_UNKNOWN;
+  long index;
+  long value;
+  long request = 0;
+
+  switch (command) {
+    case KW_ALL: // ALL/T/<temperature>, ALL/T/<temperature>/<request id>
+      if (target == KW_T && numParts >= 3 && parts[2].toInt(value)) {
+        if (numParts >= 4) parts[3].toInt(request);
+        _commands.setAll(value, request);
+      }
+      break;
+
+    case KW_GET: // GET/RADIATORS, GET/RADIATORS/<since version>, GET/STATS, GET/LINKS, GET/ZONES, GET/STALLS
+      if (target == KW_RADIATORS && numParts >= 3 && parts[2].toInt(value)) {
+        sendRadiatorsSince(value);
+      } else if (target == KW_RADIATORS) {
+        sendRadiatorStates();
+      } else if (target == KW_STATS) {
+        sendStats();
+      } else if (target == KW_LINKS) {
+        sendLinks();
+      } else if (target == KW_ZONES) {
+        sendZones();
+      } else if (target == KW_STALLS) {
+        sendStalls();
+      }
+      break;
+
+    case KW_INFO: // INFO/<ip>/<ssid>/<password>
+      if (numParts >= 4) {
+        parts[1].copyTo(ip, sizeof(ip));
+        parts[2].copyTo(ssid, sizeof(ssid));
+        parts[3].copyTo(password, sizeof(password));
+      }
+      break;
+
+    case KW_SET: // SET/TEMP/<id>/<temperature>[/<request id>], SET/NAME/<id>/<name>, SET/ZONE/<zone>/...
+      if (target == KW_TEMP && numParts >= 4 && parts[2].toInt(index) && parts[3].toInt(value)) {
+        if (numParts >= 5) parts[4].toInt(request);
+        Serial.printf("Setting temperature to [%ld]: %ld°C\n", index, value);
+        _commands.setTemp(index, value, request);
+      } else if (target == KW_NAME && numParts >= 4 && parts[2].toInt(index)) {
+        _commands.setName(index, parts[3].data, parts[3].length);
+      } else if (target == KW_ZONE && numParts >= 5 && parts[2].toInt(index)) {
+        handleZoneLine(index, parts + 3, numParts - 3);
+      }
+      break;
+
+    case KW_LINK: // LINK/BIN/<baud>
+      if (target == KW_BIN && numParts >= 3 && parts[2].toInt(value) &&
+          _mode == LINK_MODE_TEXT && value >= LINK_TEXT_BAUD && value <= LINK_MAX_BAUD) {
+        switchToBinary(value);
+      }
+      break;
+
+    default:
+      break;
+  }
+
   // other possible commands
-  // SET/ID/TEMP/23 // sets temperature for radiator
-  // SET/ID/NAME/NewName // sets new name for radiator
   // GET/ID // gets specific radiator
   // maybe also change ALL/T23 to SET/ALL/TEMP/23
 }
 
-void WebComs::sendRadiatorStates() {
-  const Radiator* radiators = _manager.getRadiators();
-  StaticJsonDocument<768> doc;
-  JsonArray arr = doc.to<JsonArray>();
+// <zone>/TEMP/<temperature>[/<request id>], <zone>/NAME/<name>, <zone>/ADD/<id>, <zone>/DEL/<id>
+void WebComs::handleZoneLine(long zone, const StrView* parts, int numParts) {
+  Keyword action = lookupKeyword(parts[0]);
+  long value;
+  long request = 0;
 
-  for (int i = 0; i < _manager.getNumRadiators(); i++) {
-    JsonObject obj = arr.createNestedObject();
+  if (action == KW_TEMP && parts[1].toInt(value)) {
+    if (numParts >= 3) parts[2].toInt(request);
+    Serial.printf("Setting temperature of zone %ld: %ld°C\n", zone, value);
+    _commands.setZoneTemp(zone, value, request);
+  } else if (action == KW_NAME) {
+    _commands.setZoneName(zone, parts[1].data, parts[1].length);
+  } else if ((action == KW_ADD || action == KW_DEL) && parts[1].toInt(value)) {
+    _commands.setZoneMember(zone, value, action == KW_ADD);
+  }
+}
+
+void WebComs::sendRadiatorRecord(int index) {
+  const char* name = _manager.getRadiatorName(index);
 
-    char macStr[18];
-    //make desired mac string using sprintf
-    sprintf(macStr, "%02X:%02X:%02X:%02X:%02X:%02X",
-            radiators[i].mac[0], radiators[i].mac[1], radiators[i].mac[2],
-            radiators[i].mac[3], radiators[i].mac[4], radiators[i].mac[5]);
-    
-    obj["mac"] = macStr;
-    obj["name"] = radiators[i].name;
-    obj["curr_temp"] = radiators[i].curr_temp;
-    obj["ack"] = radiators[i].ackReceived;
+  LinkRadiatorState state = {};
+  state.index = index;
+  memcpy(state.mac, _manager.getMac(index), 6);
+  state.curr_temp = _manager.getRadiatorTemperature(index);
+  state.flags = (_manager.isAcked(index) ? LINK_STATE_ACK : 0) | (_manager.isOnline(index) ? LINK_STATE_ONLINE : 0);
+  state.version = _manager.getRadiatorVersion(index);
+  size_t nameLen = strnlen(name, LINK_NAME_LEN);
+  memcpy(state.name, name, nameLen);
+
+  sendFrame(LINK_RADIATOR_STATE, &state, offsetof(LinkRadiatorState, name) + nameLen);
+}
+
+void WebComs::sendStateEnd(uint32_t version, uint32_t since, bool full) {
+  LinkStateEnd end = {};
+  end.count = _manager.getNumRadiators();
+  end.flags = full ? LINK_END_FULL : 0;
+  end.version = version;
+  end.since = since;
+  sendFrame(LINK_STATE_END, &end, sizeof(end));
+}
+
+void WebComs::sendRadiatorStates() {
+  uint32_t version = _manager.getVersion();
+
+  if (_mode == LINK_MODE_BINARY) {
+    for (int i = 0; i < _manager.getNumRadiators(); i++) {
+      sendRadiatorRecord(i);
+    }
+    sendStateEnd(version, 0, true);
+    return;
   }
 
   Serial.println("Sending radiators JSON");
-  serializeJson(doc, _serial);  // Or to SoftwareSerial
+
+  _json.writeJson(_serial);
   _serial.println(); // newline to indicate end
 }
 
-int WebComs::splitString(const String& str, char delimiter, String* parts, int maxParts) {
-    int partCount = 0;
-    int start = 0;
-    int end = str.indexOf(delimiter);
+// One delta per radiator changed after `since`, then a version marker:
+//   {"id":2,"mac":"..","name":"..","curr_temp":21,"ack":true,"online":true,"v":17}
+//   {"v":17,"since":12,"count":4}
+// A receiver whose copy is not at `since` has missed something and should resync.
+void WebComs::sendRadiatorsSince(uint32_t since) {
+  uint32_t version = _manager.getVersion();
+
+  for (int i = 0; i < _manager.getNumRadiators(); i++) {
+    if (_manager.getRadiatorVersion(i) <= since) continue;
 
-    while (end != -1 && partCount < maxParts - 1) {
-        parts[partCount++] = str.substring(start, end);
-        start = end + 1;
-        end = str.indexOf(delimiter, start);
+    if (_mode == LINK_MODE_BINARY) {
+      sendRadiatorRecord(i);
+      continue;
     }
 
-    // Add the last part
-    if (partCount < maxParts) {
-        parts[partCount++] = str.substring(start);
+    _json.writeRadiatorJson(_serial, i);
+    _serial.println();
+  }
+
+  if (_mode == LINK_MODE_BINARY) {
+    sendStateEnd(version, since, false);
+  } else {
+    _serial.printf("{\"v\":%u,\"since\":%u,\"count\":%d}\n",
+                   (unsigned)version, (unsigned)since, _manager.getNumRadiators());
+  }
+}
+
+void WebComs::pushChanges() {
+  uint32_t version = _manager.getVersion();
+  if (version == _pushedVersion) return;
+
+  sendRadiatorsSince(_pushedVersion);
+  _pushedVersion = version;
+}
+
+// {"done":12,"result":"acked","ms":340}
+void WebComs::sendCommandDone(const CommandDone& done) {
+  if (_mode == LINK_MODE_BINARY) {
+    LinkCommandDone frame = { done.request, done.outcome, done.ms };
+    sendFrame(LINK_COMMAND_DONE, &frame, sizeof(frame));
+    return;
+  }
+
+  JsonWriter json(_serial);
+  json.beginObject();
+  json.member("done", (uint32_t)done.request);
+  json.member("result", linkOutcomeName(done.outcome));
+  json.member("ms", done.ms);
+  json.endObject();
+  _serial.println();
+}
+
+void WebComs::sendStats() {
+  Serial.println("Sending stats JSON");
+
+  if (_mode == LINK_MODE_BINARY) {
+    LinkTextWriter out(_serial, _txSeq);
+    Stats::printJson(out);
+    return;
+  }
+
+  Stats::printJson(_serial);
+  _serial.println();
+}
+
+// One line per radiator, then a marker with how many there were:
+//   {"link":2,"mac":"..","delivered":412,"failed":3,"acks":40,"ack_avg":5210,...}
+//   {"links":4}
+void WebComs::sendLinks() {
+  int count = _manager.getNumRadiators();
+
+  if (_mode == LINK_MODE_BINARY) {
+    for (int i = 0; i < count; i++) {
+      LinkTextWriter out(_serial, _txSeq);
+      _json.writeLinkJson(out, i);
     }
+    LinkTextWriter out(_serial, _txSeq);
+    out.printf("{\"links\":%d}", count);
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    _json.writeLinkJson(_serial, i);
+    _serial.println();
+  }
+  _serial.printf("{\"links\":%d}\n", count);
+}
+
+// One line per zone, then a marker like GET/LINKS:
+//   {"zone":1,"name":"Upstairs","temp":21,"members":[0,3,4],"pending":[4]}
+//   {"zones":8}
+void WebComs::sendZones() {
+  if (_mode == LINK_MODE_BINARY) {
+    for (int z = 0; z < MAX_ZONES; z++) {
+      LinkTextWriter out(_serial, _txSeq);
+      _json.writeZoneJson(out, z);
+    }
+    LinkTextWriter out(_serial, _txSeq);
+    out.printf("{\"zones\":%d}", MAX_ZONES);
+    return;
+  }
+
+  for (int z = 0; z < MAX_ZONES; z++) {
+    _json.writeZoneJson(_serial, z);
+    _serial.println();
+  }
+  _serial.printf("{\"zones\":%d}\n", MAX_ZONES);
+}
 
-    return partCount;
+// The server's own stalls, oldest first, then one line per radiator that
+// reported any, then a marker with how many lines of each there were:
+//   {"stall":0,"boot":3,"at":81234,"us":52410,"stage":"dht","stage_us":50120,"reset":0}
+//   {"radiator":2,"mac":"..","stalls":4,"boots":2,"budget":2000,"max":9120,"us":9120,...}
+//   {"stalls":1,"radiators":1}
+void WebComs::sendStalls() {
+  int kept = Stats::getStallRecords();
+  int reported = 0;
+
+  for (int i = 0; i < kept; i++) {
+    if (_mode == LINK_MODE_BINARY) {
+      LinkTextWriter out(_serial, _txSeq);
+      Stats::printStallJson(out, i);
+    } else {
+      Stats::printStallJson(_serial, i);
+      _serial.println();
+    }
+  }
+
+  for (int i = 0; i < _manager.getNumRadiators(); i++) {
+    if (_manager.getTelemetry(i).stalls == 0) continue;
+    reported++;
+
+    if (_mode == LINK_MODE_BINARY) {
+      LinkTextWriter out(_serial, _txSeq);
+      _json.writeStallJson(out, i);
+    } else {
+      _json.writeStallJson(_serial, i);
+      _serial.println();
+    }
+  }
+
+  if (_mode == LINK_MODE_BINARY) {
+    LinkTextWriter out(_serial, _txSeq);
+    out.printf("{\"stalls\":%d,\"radiators\":%d}", kept, reported);
+    return;
+  }
+  _serial.printf("{\"stalls\":%d,\"radiators\":%d}\n", kept, reported);
 }
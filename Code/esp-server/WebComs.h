@@ -2,25 +2,60 @@
 #define WEBCOMS_H
 
 #include "RadiatorManager.h"
+#include "RadiatorCommands.h"
+#include "RadiatorJson.h"
+#include "LinkProtocol.h"
+#include "LineReader.h"
+
+#define WEBCOMS_LINE_LEN 128
 
 class WebComs {
 public:
-    String ssid;
-    String password;
-    String ip;
+    char ssid[33] = "";
+    char password[65] = "";
+    char ip[16] = "";
 
-    WebComs(HardwareSerial& serial, RadiatorManager& manager);
+    WebComs(HardwareSerial& serial, RadiatorManager& manager, RadiatorCommands& commands);
     void update();
 
 private:
+    enum LinkMode : uint8_t {
+        LINK_MODE_TEXT,
+        LINK_MODE_BINARY // negotiated with LINK/BIN/<baud>, see LinkProtocol.h
+    };
+
     HardwareSerial& _serial;
     RadiatorManager& _manager;
-    String _buffer;
+    RadiatorCommands& _commands;
+    RadiatorJson _json;
+    LineReader<WEBCOMS_LINE_LEN> _lineReader;
+
+    LinkMode _mode = LINK_MODE_TEXT;
+    LinkDecoder _decoder;
+    LineReader<WEBCOMS_LINE_LEN> _tunnelReader; // text line reassembled from LINK_TEXT_PART frames
+    uint8_t _txSeq = 0;
+    unsigned long _lastFrameAt = 0;
+    uint32_t _pushedVersion = 0; // manager state version esp-web has been sent
 
-    void handleLine(const String& line);
+    void updateText();
+    void updateBinary();
+    void handleLine(StrView line);
+    void handleZoneLine(long zone, const StrView* parts, int numParts);
+    void handleFrame(const LinkFrame& frame);
+    void switchToBinary(uint32_t baud);
+    void fallBackToText();
+    void sendFrame(uint8_t type, const void* payload, uint8_t length);
     void sendRadiatorStates();
-    int splitString(const String& str, char delimiter, String* parts, int maxParts);
+    void sendRadiatorsSince(uint32_t since);
+    void sendRadiatorRecord(int index);
+    void sendStateEnd(uint32_t version, uint32_t since, bool full);
+    void pushChanges();
+    void sendStats();
+    void sendLinks();
+    void sendZones();
+    void sendStalls();
+    void sendCommandDone(const CommandDone& done);
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -8,10 +8,28 @@
 #include "Messages.h"
 #include "RadiatorManager.h"
 #include "RadiatorDisplay.h"
+#include "RadiatorCommands.h"
 #include "WebComs.h"
+#include "LocalWeb.h"
 #include "Button.h"
+#include "Stats.h"
+#include "LoopWatchdog.h"
 
 #define DEBUG FALSE // CHANGE TO TRUE TO ENABLE SERIAL OUTPUTS 
+#define SINGLE_BOARD 0 // CHANGE TO 1 TO SERVE THE WEB PAGE FROM THIS BOARD, WITHOUT THE ESP8266
+#define MESH_RELAY 0 // CHANGE TO 1 TO LET RADIATORS OUT OF RANGE REACH THIS BOARD THROUGH OTHERS (SET IT ON THE RADIATORS TOO)
+#define TIME_SYNC 0 // CHANGE TO 1 TO GIVE THE RADIATORS THIS BOARD'S CLOCK AND MEASURE RADIO LATENCY (SET IT ON THE RADIATORS TOO)
+#define RADIO_CAPTURE 0 // CHANGE TO 1 TO RECORD THE LAST CAPTURE_RECORDS RADIO FRAMES, SEND 'c' OVER USB SERIAL TO DUMP THEM (SEE Code/sim/replay.cpp)
+#define CAPTURE_RECORDS 128 // 96 B each
+#define LEGACY_DISCOVERY 0 // CHANGE TO 1 WHILE A RADIATOR STILL RUNS FIRMWARE FROM BEFORE DEVICE CLASSES (SET IT ON THE RADIATORS TOO)
+#define FRAME_AUTH 0 // CHANGE TO 1 TO SIGN EVERY RADIO FRAME AND DROP UNSIGNED, FORGED AND REPLAYED ONES (SET IT ON THE RADIATORS TOO)
+// #define AUTH_KEY { ... } // WITH FRAME_AUTH 1: YOUR OWN 16 RANDOM BYTES, THE SAME IN esp-radiator.ino
+#define LOOP_BUDGET_US 30000 // loop() iterations slower than this are kept as stalls, see GET/STALLS (a DHT11 read takes about 25 ms)
+#define STALL_RECORDS 8 // 16 B each, in RTC memory
+#define LOOP_HANG_RESET 0 // CHANGE TO 1 TO RESTART WHEN loop() HANGS FOR 5 S, GET/STALLS THEN SHOWS THE STAGE IT HUNG IN
+#ifndef SERVER_CAPACITY // or build with -DSERVER_CAPACITY=LargeServerCapacity
+#define SERVER_CAPACITY ServerCapacity // CHANGE TO LargeServerCapacity FOR UP TO 19 RADIATORS (SET IT IN esp-web.ino TOO), SEE Capacity.h
+#endif
 
 #define SCREEN_WIDTH 128 // OLED display width, in pixels
 #define SCREEN_HEIGHT 32 // OLED display height, in pixels
@@ -35,12 +53,30 @@
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, -1);
 DHT dht(DHT_PIN, DHT_TYPE);
 
-Communications coms;
-RadiatorManager radiatorManager(coms);
+CommunicationsFor<SERVER_CAPACITY> coms;
+RadiatorManagerFor<SERVER_CAPACITY> radiatorManager(coms);
 RadiatorDisplay radiatorDisplay(display);
-WebComs webComs(Serial2, radiatorManager);
+RadiatorCommands radiatorCommands(radiatorManager);
+#if SINGLE_BOARD
+LocalWeb webComs(radiatorManager, radiatorCommands); // same ip/ssid/password and update() as WebComs
+#else
+WebComs webComs(Serial2, radiatorManager, radiatorCommands);
+#endif
 
 Button infoButton(INFO_BUTTON_PIN);
+LoopWatchdog watchdog;
+RTC_NOINIT_ATTR StallLog stallLog; // outlives a reset, not a power cut
+RTC_NOINIT_ATTR StallRecord stallRing[STALL_RECORDS];
+
+#if RADIO_CAPTURE
+CaptureRecord captureRing[CAPTURE_RECORDS];
+#endif
+#if FRAME_AUTH
+#ifndef AUTH_KEY
+#error "FRAME_AUTH needs AUTH_KEY: 16 random bytes of your own, the same on every board"
+#endif
+const uint8_t authKey[AUTH_KEY_BYTES] = AUTH_KEY;
+#endif
 
 void OnDataRecv(const uint8_t* mac, uint8_t type, const uint8_t* data, int len){
   switch (type) {
@@ -52,15 +88,33 @@ void OnDataRecv(const uint8_t* mac, uint8_t type, const uint8_t* data, int len){
       }
       break;
 
+    case MSG_TYPE_RADIATOR_TELEMETRY:
+      if (len == sizeof(RadiatorTelemetry)) {
+        RadiatorTelemetry payload;
+        memcpy(&payload, data, sizeof(payload));
+        radiatorManager.processTelemetry(mac, payload);
+      }
+      break;
+
     default:
       Serial.println("Unknown message type");
       break;
   }
 }
 
+void OnDataSent(const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
+  radiatorManager.processSendStatus(mac, type, status);
+
+  if (status == ESP_NOW_SEND_SUCCESS) {
+    STATS_COUNT(COUNTER_FRAMES_SENT);
+  } else {
+    STATS_COUNT(COUNTER_FRAMES_FAILED);
+  }
+}
+
 void OnDiscoverNewPeer(const Peer& peer) {
   // Add new radiator
-  if (strncmp(peer.name, "radiator", MAX_NAME_LEN) == 0) {
+  if (peer.deviceClass == DEVICE_CLASS_RADIATOR) {
     radiatorManager.handleDiscovery(peer);
   } else {
     Serial.printf("Discovered unknown type device: %s (%s)\n", peer.name, Communications::macToString(peer.mac).c_str());
@@ -69,7 +123,11 @@ void OnDiscoverNewPeer(const Peer& peer) {
 
 void setup() {
   Serial.begin(115200);
+  watchdog.begin(stallLog, stallRing, STALL_RECORDS, LOOP_BUDGET_US); // first, a reset leaves its stage here
+  Stats::watchStalls(&watchdog);
+#if !SINGLE_BOARD
   Serial2.begin(9600, SERIAL_8N1, RX2, TX2);
+#endif
 
   Wire.begin(SDA_PIN, SCL_PIN);
 
@@ -93,15 +151,44 @@ void setup() {
   // Initialize communications
   coms.begin();
   coms.setName("server");
+  coms.setDeviceClass(DEVICE_CLASS_SERVER);
+#if LEGACY_DISCOVERY
+  coms.setLegacyDiscovery(true);
+#endif
+#if FRAME_AUTH
+  coms.enableAuth(authKey); // before the first frame goes out
+  Stats::watchAuth(&coms.getAuthStats());
+#endif
 
   coms.setReceiveHandler(OnDataRecv);
+  coms.setSendHandler(OnDataSent);
   coms.setDiscoveryHandler(OnDiscoverNewPeer);
 
+#if MESH_RELAY
+  coms.enableRelay(true);
+#endif
+#if TIME_SYNC
+  coms.enableTimeSync(); // the time master
+  Stats::watchTime(&coms.getTimeStats());
+#endif
+  Stats::watchTx(&coms.getTxStats());
+#if RADIO_CAPTURE
+  coms.enableCapture(captureRing, CAPTURE_RECORDS);
+#endif
+
+#if SINGLE_BOARD
+  webComs.begin(); // after coms.begin(), it moves Wi-Fi to AP+STA
+#endif
+
   coms.broadcastDiscovery();
+#if LOOP_HANG_RESET
+  enableLoopWDT();
+#endif
 }
 
 //-- Radiator selection satate
 int currentRadiatorIndex = -1; // -1 - all, 0-n - all radiators in radiators array
+int currentZone = -1; // a zone instead of all, when currentRadiatorIndex is -1
 uint8_t commonTemp = DEFAULT_TEMP;
 uint8_t rotatorTemp = commonTemp;
 uint8_t shownTemp = rotatorTemp;
@@ -120,12 +207,33 @@ int encoderClicked = false;
 
 enum UI_State : uint8_t {
   UI_RADIATORS,
-  UI_INFO
+  UI_INFO,
+  UI_STATS
 };
 UI_State state = UI_RADIATORS;
 bool changed = false;
 
+// All, then each zone with radiators in it, then each radiator
+void selectNext() {
+  if (currentRadiatorIndex == -1) {
+    int zone = currentZone + 1;
+    while (zone < MAX_ZONES && radiatorManager.getZoneSize(zone) == 0) zone++;
+    if (zone < MAX_ZONES) {
+      currentZone = zone;
+      return;
+    }
+    currentZone = -1;
+  }
+
+  currentRadiatorIndex++;
+  if(currentRadiatorIndex >= radiatorManager.getNumRadiators()){
+    currentRadiatorIndex = -1;
+  }
+}
+
 void radiatorState(bool redraw = false) {
+  ScopedStage inputStage(watchdog, STAGE_INPUT);
+
   if (redraw) {
     radiatorDisplay.redraw();
   }
@@ -136,13 +244,13 @@ void radiatorState(bool redraw = false) {
     delay(50); // maybe there is a nonblocking way to do this?
     buttonClicked = true;
 
-    currentRadiatorIndex++;
-    if(currentRadiatorIndex >= radiatorManager.getNumRadiators()){
-      currentRadiatorIndex = -1;
-    }
+    selectNext();
 
     Serial.print("Selected: ");
-    if (currentRadiatorIndex == -1) {
+    if (currentZone != -1) {
+      shownTemp = radiatorManager.getZoneTemperature(currentZone);
+      Serial.println(radiatorManager.getZoneName(currentZone));
+    } else if (currentRadiatorIndex == -1) {
       shownTemp = commonTemp;
       Serial.println("ALL radiators");
     } else {
@@ -175,7 +283,9 @@ void radiatorState(bool redraw = false) {
 
   // Encoder button logic
   if(encoderClicked){
-    if (currentRadiatorIndex == -1) {
+    if (currentZone != -1) {
+      radiatorManager.sendTemperatureToZone(currentZone, rotatorTemp);
+    } else if (currentRadiatorIndex == -1) {
       // Send to all radiators
       commonTemp = rotatorTemp;
       radiatorManager.sendTemperatureToAll(commonTemp);
@@ -188,8 +298,14 @@ void radiatorState(bool redraw = false) {
   }
 
   // Read DHT sensor values
-  float temp = dht.readTemperature();
-  float humidity = dht.readHumidity();
+  float temp;
+  float humidity;
+  {
+    STATS_PROBE(PROBE_DHT);
+    ScopedStage dhtStage(watchdog, STAGE_DHT);
+    temp = dht.readTemperature();
+    humidity = dht.readHumidity();
+  }
   if (isnan(temp) || isnan(humidity)) {
     Serial.println("Failed to read from DHT sensor!");
   } else {
@@ -203,15 +319,27 @@ void radiatorState(bool redraw = false) {
 
   // display logic
   //if 1 from all radiators dont confirm receiving, print CROSS
-  bool acked = currentRadiatorIndex == -1 ? radiatorManager.isAllAcked() : radiatorManager.isAcked(currentRadiatorIndex);
-  //display choosen radiator
-  String name = currentRadiatorIndex == -1 ? "All" : radiatorManager.getRadiatorName(currentRadiatorIndex);
+  bool acked;
+  String name; //display choosen radiator
+  if (currentZone != -1) {
+    acked = radiatorManager.isZoneAcked(currentZone);
+    name = radiatorManager.getZoneName(currentZone);
+  } else if (currentRadiatorIndex == -1) {
+    acked = radiatorManager.isAllAcked();
+    name = "All";
+  } else {
+    acked = radiatorManager.isAcked(currentRadiatorIndex);
+    name = radiatorManager.getRadiatorName(currentRadiatorIndex);
+  }
   // If anything has changed then it will update the display
+  STATS_PROBE(PROBE_DISPLAY);
+  ScopedStage displayStage(watchdog, STAGE_DISPLAY);
   radiatorDisplay.update(currentRadiatorIndex, name, shownTemp, acked, temp);
 }
 
 void infoState(bool redraw) {
   if (!redraw) return; // avoid redrawing
+  ScopedStage stage(watchdog, STAGE_DISPLAY);
 
   display.clearDisplay();
 
@@ -235,13 +363,70 @@ void infoState(bool redraw) {
   display.display();
 }
 
+unsigned long lastStatsDraw = 0;
+
+// p50/max in microseconds per probe, refreshed once a second
+void statsState(bool redraw) {
+  if (!redraw && millis() - lastStatsDraw < 1000) return;
+  lastStatsDraw = millis();
+  ScopedStage stage(watchdog, STAGE_DISPLAY);
+
+  display.clearDisplay();
+  display.setTextSize(1);
+
+  display.setCursor(0, 0);
+  display.printf("loop %u/%u", (unsigned)Stats::percentileMicros(PROBE_LOOP, 50), (unsigned)Stats::maxMicros(PROBE_LOOP));
+
+  display.setCursor(0, 8);
+  display.printf("web %u dht %u", (unsigned)Stats::maxMicros(PROBE_WEBCOMS), (unsigned)Stats::maxMicros(PROBE_DHT));
+
+  display.setCursor(0, 16);
+  display.printf("disp %u all %u", (unsigned)Stats::maxMicros(PROBE_DISPLAY), (unsigned)Stats::maxMicros(PROBE_SEND_ALL));
+
+  display.setCursor(0, 24);
+  display.printf("tx %u f %u r %u", (unsigned)Stats::getCounter(COUNTER_FRAMES_SENT),
+                 (unsigned)Stats::getCounter(COUNTER_FRAMES_FAILED), (unsigned)Stats::getCounter(COUNTER_FRAMES_RETRIED));
+
+  display.display();
+}
+
 void loop() {
-  // constantly reading Serial2 waiting for some info
-  webComs.update();
+  STATS_PROBE(PROBE_LOOP);
+  ScopedLoop watched(watchdog);
+
+  {
+    ScopedStage stage(watchdog, STAGE_MANAGER);
+    radiatorManager.update(); // settles acked and timed out web commands
+  }
+  {
+    ScopedStage stage(watchdog, STAGE_COMS);
+    coms.update(); // queued frames, and relay beacons when relaying
+  }
+
+  // constantly reading Serial2 waiting for some info, or serving the web page in single-board mode
+  {
+    STATS_PROBE(PROBE_WEBCOMS);
+    ScopedStage stage(watchdog, STAGE_WEB);
+    webComs.update();
+  }
+
+#if RADIO_CAPTURE
+  if (Serial.available() && Serial.read() == 'c') {
+    ScopedStage stage(watchdog, STAGE_SERIAL);
+    coms.dumpCapture(Serial);
+  }
+#endif
 
   infoButton.update();
   if (infoButton.wasPressed()) {
-    state = (state == UI_INFO) ? UI_RADIATORS : UI_INFO;
+    // Radiators -> Info -> Stats -> Radiators
+    if (state == UI_RADIATORS) {
+      state = UI_INFO;
+    } else if (state == UI_INFO) {
+      state = UI_STATS;
+    } else {
+      state = UI_RADIATORS;
+    }
     changed = true;
   } else {
     changed = false;
@@ -254,5 +439,8 @@ void loop() {
     case UI_INFO:
       infoState(changed);
       break;
+    case UI_STATS:
+      statsState(changed);
+      break;
   }
 }
@@ -0,0 +1,24 @@
+// Assets.h
+// Generated by esp-web/tools/build_assets.py from esp-web/web/, do not edit.
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <Arduino.h>
+
+struct Asset {
+  const char* path; // URL
+  const char* file; // gzip-compressed file on LittleFS
+  const char* mime;
+  const char* etag; // content hash, quoted for the ETag header
+  bool immutable; // the hash is in the URL, browsers may cache it forever
+};
+
+static constexpr Asset assets[] = {
+  { "/delete.9c6bbe36.svg", "/delete.9c6bbe36.svg.gz", "image/svg+xml", "\"9c6bbe36\"", true },
+  { "/edit.3b5e262f.svg", "/edit.3b5e262f.svg.gz", "image/svg+xml", "\"3b5e262f\"", true },
+  { "/script.820d28ca.js", "/script.820d28ca.js.gz", "text/javascript", "\"820d28ca\"", true },
+  { "/styles.fdce9507.css", "/styles.fdce9507.css.gz", "text/css", "\"fdce9507\"", true },
+  { "/", "/index.html.gz", "text/html", "\"2096ab19\"", false },
+};
+
+#endif
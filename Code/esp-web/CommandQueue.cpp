@@ -0,0 +1,107 @@
+#include "CommandQueue.h"
+
+const char* commandResultText(CommandResult result) {
+  switch (result) {
+    case COMMAND_QUEUED: return "queued";
+    case COMMAND_BAD_ID: return "unknown radiator";
+    case COMMAND_BAD_TEMP: return "temperature out of range";
+    case COMMAND_BAD_NAME: return "invalid name";
+    case COMMAND_BATCH_FULL: return "too many operations";
+    case COMMAND_BUSY: return "too many commands in flight";
+    default: return "unknown operation";
+  }
+}
+
+CommandQueue::CommandQueue(uint8_t* tempTable, uint16_t* requestTable, char (*nameTable)[LINK_NAME_LEN], int capacity)
+  : temps(tempTable), tempRequests(requestTable), names(nameTable), maxRadiators(capacity) {}
+
+bool CommandQueue::isValidTemp(long temperature) {
+  return temperature >= MIN_TEMP && temperature <= MAX_TEMP;
+}
+
+bool CommandQueue::isValidIndex(long index) const {
+  return index >= 0 && index < maxRadiators;
+}
+
+int CommandQueue::getCapacity() const {
+  return maxRadiators;
+}
+
+void CommandQueue::setSupersededHandler(Delegate<void(uint16_t request)> handler) {
+  supersededHandler = handler;
+}
+
+void CommandQueue::supersede(uint16_t request) {
+  coalesced++;
+  if (request != 0 && supersededHandler) {
+    supersededHandler(request);
+  }
+}
+
+CommandResult CommandQueue::setAll(long temperature, uint16_t request) {
+  if (!isValidTemp(temperature)) return COMMAND_BAD_TEMP;
+
+  if (allTemp != 0) supersede(allRequest);
+  for (int i = 0; i < maxRadiators; i++) {
+    if (temps[i] != 0) {
+      temps[i] = 0;
+      supersede(tempRequests[i]);
+    }
+  }
+
+  allTemp = temperature;
+  allRequest = request;
+  return COMMAND_QUEUED;
+}
+
+CommandResult CommandQueue::setTemp(long index, long temperature, uint16_t request) {
+  if (!isValidIndex(index)) return COMMAND_BAD_ID;
+  if (!isValidTemp(temperature)) return COMMAND_BAD_TEMP;
+
+  if (temps[index] != 0) supersede(tempRequests[index]);
+  temps[index] = temperature;
+  tempRequests[index] = request;
+  return COMMAND_QUEUED;
+}
+
+CommandResult CommandQueue::setName(long index, const char* name, size_t length) {
+  if (!isValidIndex(index)) return COMMAND_BAD_ID;
+  // '/' would split the text protocol command
+  if (length == 0 || length >= LINK_NAME_LEN || memchr(name, '/', length)) return COMMAND_BAD_NAME;
+
+  if (names[index][0] != '\0') coalesced++;
+  memcpy(names[index], name, length);
+  names[index][length] = '\0';
+  return COMMAND_QUEUED;
+}
+
+bool CommandQueue::isEmpty() const {
+  if (allTemp != 0) return false;
+  for (int i = 0; i < maxRadiators; i++) {
+    if (temps[i] != 0 || names[i][0] != '\0') return false;
+  }
+  return true;
+}
+
+bool CommandQueue::takeAll(uint8_t& temperature, uint16_t& request) {
+  if (allTemp == 0) return false;
+  temperature = allTemp;
+  request = allRequest;
+  allTemp = 0;
+  return true;
+}
+
+bool CommandQueue::takeTemp(int index, uint8_t& temperature, uint16_t& request) {
+  if (temps[index] == 0) return false;
+  temperature = temps[index];
+  request = tempRequests[index];
+  temps[index] = 0;
+  return true;
+}
+
+bool CommandQueue::takeName(int index, char* name) {
+  if (names[index][0] == '\0') return false;
+  strcpy(name, names[index]);
+  names[index][0] = '\0';
+  return true;
+}
@@ -0,0 +1,81 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <Arduino.h>
+#include "Delegate.h"
+#include "LinkProtocol.h"
+#include "RadiatorCache.h"
+
+#define MIN_TEMP 8
+#define MAX_TEMP 28
+
+enum CommandResult : uint8_t {
+  COMMAND_QUEUED,
+  COMMAND_BAD_ID,
+  COMMAND_BAD_TEMP,
+  COMMAND_BAD_NAME,
+  COMMAND_BAD_OP,
+  COMMAND_BATCH_FULL,
+  COMMAND_BUSY
+};
+
+const char* commandResultText(CommandResult result);
+
+// Setpoint and name changes waiting to be forwarded to esp-server. Changes to
+// the same radiator before the next flush collapse into the last one, and a
+// set-all drops the per-radiator setpoints queued before it. The request id
+// of a dropped setpoint goes to the superseded handler. Declare a
+// CommandQueueFor<Capacity>, which holds the per-radiator tables.
+class CommandQueue {
+public:
+  CommandResult setAll(long temperature, uint16_t request = 0);
+  CommandResult setTemp(long index, long temperature, uint16_t request = 0);
+  CommandResult setName(long index, const char* name, size_t length);
+
+  static bool isValidTemp(long temperature);
+  bool isValidIndex(long index) const;
+  int getCapacity() const;
+
+  void setSupersededHandler(Delegate<void(uint16_t request)> handler);
+
+  bool isEmpty() const;
+
+  // Each take* returns true once per pending change. Take the set-all
+  // first so per-radiator setpoints queued after it win.
+  bool takeAll(uint8_t& temperature, uint16_t& request);
+  bool takeTemp(int index, uint8_t& temperature, uint16_t& request);
+  bool takeName(int index, char* name); // LINK_NAME_LEN bytes
+
+  uint32_t coalesced = 0; // changes replaced before they were sent
+
+protected:
+  CommandQueue(uint8_t* tempTable, uint16_t* requestTable, char (*nameTable)[LINK_NAME_LEN], int capacity);
+
+private:
+  uint8_t allTemp = 0; // 0 = nothing pending
+  uint16_t allRequest = 0;
+  uint8_t* temps; // 0 = nothing pending
+  uint16_t* tempRequests;
+  char (*names)[LINK_NAME_LEN];
+  int maxRadiators;
+
+  Delegate<void(uint16_t request)> supersededHandler;
+
+  void supersede(uint16_t request);
+};
+
+// CommandQueue with room for the server's Capacity::radiators, see Capacity.h
+template <typename Capacity>
+class CommandQueueFor : public CommandQueue {
+public:
+  CommandQueueFor() : CommandQueue(tempTable, requestTable, nameTable, Capacity::radiators) {}
+  CommandQueueFor(const CommandQueueFor&) = delete;
+  CommandQueueFor& operator=(const CommandQueueFor&) = delete;
+
+private:
+  uint8_t tempTable[Capacity::radiators] = {};
+  uint16_t requestTable[Capacity::radiators] = {};
+  char nameTable[Capacity::radiators][LINK_NAME_LEN] = {};
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "JsonWriter.h"
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+JsonWriter::JsonWriter(Print& out) : _out(out) {}
+
+void JsonWriter::beforeItem() {
+  if (_afterKey) {
+    _afterKey = false; // the value belongs to the key just written
+    return;
+  }
+
+  uint8_t bit = 1 << _depth;
+  if (_hasItems & bit) {
+    _out.write(',');
+  }
+  _hasItems |= bit;
+}
+
+void JsonWriter::open(char c) {
+  beforeItem();
+  _out.write(c);
+  if (_depth < JSON_MAX_DEPTH - 1) _depth++;
+  _hasItems &= ~(1 << _depth);
+}
+
+void JsonWriter::close(char c) {
+  _out.write(c);
+  if (_depth > 0) _depth--;
+}
+
+void JsonWriter::beginArray() { open('['); }
+void JsonWriter::endArray() { close(']'); }
+void JsonWriter::beginObject() { open('{'); }
+void JsonWriter::endObject() { close('}'); }
+
+void JsonWriter::key(const char* name) {
+  value(name);
+  _out.write(':');
+  _afterKey = true;
+}
+
+// Writes runs of plain characters in one go and escapes the rest
+void JsonWriter::value(const char* text) {
+  beforeItem();
+  _out.write('"');
+
+  const char* run = text;
+  for (const char* p = text; *p; p++) {
+    unsigned char c = *p;
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+    _out.write(run, p - run);
+    if (c == '"' || c == '\\') {
+      char escaped[2] = { '\\', (char)c };
+      _out.write(escaped, 2);
+    } else {
+      char escaped[6] = { '\\', 'u', '0', '0', hexDigits[c >> 4], hexDigits[c & 0x0F] };
+      _out.write(escaped, 6);
+    }
+    run = p + 1;
+  }
+
+  _out.write(run, strlen(run));
+  _out.write('"');
+}
+
+void JsonWriter::value(uint32_t number) {
+  beforeItem();
+  char digits[10];
+  int len = 0;
+  do {
+    digits[len++] = '0' + number % 10;
+    number /= 10;
+  } while (number);
+
+  char text[10];
+  for (int i = 0; i < len; i++) text[i] = digits[len - 1 - i];
+  _out.write(text, len);
+}
+
+void JsonWriter::value(int number) {
+  if (number < 0) {
+    beforeItem();
+    _out.write('-');
+    _afterKey = true; // digits follow without a separator
+    value((uint32_t)-(int64_t)number);
+    return;
+  }
+  value((uint32_t)number);
+}
+
+void JsonWriter::value(bool flag) {
+  beforeItem();
+  if (flag) {
+    _out.write("true", 4);
+  } else {
+    _out.write("false", 5);
+  }
+}
+
+void JsonWriter::macValue(const uint8_t* mac) {
+  beforeItem();
+  char text[19];
+  text[0] = '"';
+  for (int i = 0; i < 6; i++) {
+    text[1 + i * 3] = hexDigits[mac[i] >> 4];
+    text[2 + i * 3] = hexDigits[mac[i] & 0x0F];
+    text[3 + i * 3] = ':';
+  }
+  text[18] = '"'; // replaces the trailing ':'
+  _out.write(text, 19);
+}
@@ -0,0 +1,169 @@
+#include "LinkProtocol.h"
+
+static const char* const outcomeNames[LINK_OUTCOME_COUNT] = {
+  "acked",
+  "superseded",
+  "failed",
+  "timed_out",
+  "busy"
+};
+
+const char* linkOutcomeName(uint8_t outcome) {
+  if (outcome >= LINK_OUTCOME_COUNT) return "unknown";
+  return outcomeNames[outcome];
+}
+
+int linkOutcomeFromName(const char* name) {
+  for (int i = 0; i < LINK_OUTCOME_COUNT; i++) {
+    if (strcmp(name, outcomeNames[i]) == 0) return i;
+  }
+  return -1;
+}
+
+uint16_t linkCrc16(const uint8_t* data, size_t len, uint16_t crc) {
+  while (len--) {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+size_t cobsEncode(const uint8_t* src, size_t len, uint8_t* dst) {
+  size_t read = 0;
+  size_t write = 1;
+  size_t codeIndex = 0;
+  uint8_t code = 1;
+
+  while (read < len) {
+    if (src[read] == 0) {
+      dst[codeIndex] = code;
+      code = 1;
+      codeIndex = write++;
+      read++;
+    } else {
+      dst[write++] = src[read++];
+      code++;
+      if (code == 0xFF) {
+        dst[codeIndex] = code;
+        code = 1;
+        codeIndex = write++;
+      }
+    }
+  }
+
+  dst[codeIndex] = code;
+  return write;
+}
+
+// Safe to run in place (dst == src). Returns 0 for malformed input.
+size_t cobsDecode(const uint8_t* src, size_t len, uint8_t* dst) {
+  size_t read = 0;
+  size_t write = 0;
+
+  while (read < len) {
+    uint8_t code = src[read];
+    if (code == 0 || read + code > len) return 0;
+    read++;
+
+    for (uint8_t i = 1; i < code; i++) {
+      dst[write++] = src[read++];
+    }
+
+    if (code != 0xFF && read != len) {
+      dst[write++] = 0;
+    }
+  }
+
+  return write;
+}
+
+size_t linkEncodeFrame(uint8_t type, uint8_t seq, const void* payload, uint8_t length, uint8_t* out) {
+  if (length > LINK_MAX_PAYLOAD) return 0;
+
+  uint8_t raw[LINK_MAX_FRAME];
+  raw[0] = type;
+  raw[1] = seq;
+  memcpy(raw + 2, payload, length);
+
+  uint16_t crc = linkCrc16(raw, length + 2);
+  raw[length + 2] = crc & 0xFF;
+  raw[length + 3] = crc >> 8;
+
+  size_t encoded = cobsEncode(raw, length + 4, out);
+  out[encoded++] = 0; // delimiter
+  return encoded;
+}
+
+bool LinkDecoder::push(uint8_t c) {
+  if (c != 0) {
+    if (_length >= sizeof(_buffer)) {
+      if (!_overflow) overflows++;
+      _overflow = true; // drop everything until the next delimiter
+      return false;
+    }
+    _buffer[_length++] = c;
+    return false;
+  }
+
+  size_t encoded = _length;
+  bool overflowed = _overflow;
+  _length = 0;
+  _overflow = false;
+
+  if (overflowed || encoded == 0) return false;
+
+  size_t decoded = cobsDecode(_buffer, encoded, _buffer);
+  if (decoded < 4) {
+    crcErrors++;
+    return false;
+  }
+
+  uint16_t crc = _buffer[decoded - 2] | (_buffer[decoded - 1] << 8);
+  if (linkCrc16(_buffer, decoded - 2) != crc) {
+    crcErrors++;
+    return false;
+  }
+
+  _frame.type = _buffer[0];
+  _frame.seq = _buffer[1];
+  _frame.length = decoded - 4;
+  _frame.payload = _buffer + 2;
+
+  if (_haveSeq && _frame.seq != (uint8_t)(_lastSeq + 1)) {
+    seqGaps++;
+  }
+  _haveSeq = true;
+  _lastSeq = _frame.seq;
+
+  return true;
+}
+
+void LinkDecoder::reset() {
+  _length = 0;
+  _overflow = false;
+  _haveSeq = false;
+}
+
+LinkTextWriter::LinkTextWriter(Stream& stream, uint8_t& seq)
+  : _stream(stream), _seq(seq) {}
+
+LinkTextWriter::~LinkTextWriter() {
+  flushChunk(LINK_TEXT_END);
+}
+
+size_t LinkTextWriter::write(uint8_t c) {
+  if (_length == sizeof(_chunk)) {
+    flushChunk(LINK_TEXT_PART);
+  }
+  _chunk[_length++] = c;
+  return 1;
+}
+
+void LinkTextWriter::flushChunk(uint8_t type) {
+  uint8_t out[LINK_MAX_ENCODED];
+  size_t len = linkEncodeFrame(type, _seq++, _chunk, _length, out);
+  _stream.write(out, len);
+  _length = 0;
+}
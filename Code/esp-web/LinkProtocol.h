@@ -0,0 +1,159 @@
+// LinkProtocol.h
+// Binary framing for the esp-web <-> esp-server UART link.
+// Keep this file identical in both sketches.
+//
+// Frame on the wire: COBS([type][seq][payload...][crc16 lo][crc16 hi]) 0x00
+// CRC16 is CCITT (poly 0x1021, init 0xFFFF) over type, seq and payload.
+#ifndef LINK_PROTOCOL_H
+#define LINK_PROTOCOL_H
+
+#include <Arduino.h>
+
+#define LINK_TEXT_BAUD 9600 // both sides boot in the text protocol at this rate
+#define LINK_MAX_BAUD 921600
+#define LINK_TIMEOUT_MS 3000 // fall back to text when no frame arrives for this long
+#define LINK_PING_INTERVAL_MS 1000
+
+#define LINK_MAX_PAYLOAD 64
+#define LINK_MAX_FRAME (LINK_MAX_PAYLOAD + 4) // type + seq + payload + crc16
+#define LINK_MAX_ENCODED (LINK_MAX_FRAME + LINK_MAX_FRAME / 254 + 2) // COBS overhead + delimiter
+
+#define LINK_NAME_LEN 16
+
+enum LinkMessageType : uint8_t {
+  // esp-web -> esp-server
+  LINK_SET_ALL_TEMP = 1, // LinkSetAllTemp
+  LINK_SET_TEMP = 2, // LinkSetTemp
+  LINK_GET_RADIATORS = 3, // no payload for the full list, LinkGetRadiators for changes since a version
+  LINK_PING = 4, // no payload, keeps the binary link alive
+  LINK_SET_NAME = 5, // LinkSetName
+
+  // esp-server -> esp-web
+  LINK_RADIATOR_STATE = 0x81, // LinkRadiatorState, one frame per radiator
+  LINK_STATE_END = 0x82, // LinkStateEnd, closes a full list or a burst of changes
+  LINK_PONG = 0x83,
+  LINK_COMMAND_DONE = 0x84, // LinkCommandDone, outcome of a command sent with a request id
+
+  // Either direction: a text protocol line tunnelled through frames,
+  // split into LINK_TEXT_PART chunks and terminated by LINK_TEXT_END
+  LINK_TEXT_PART = 0xF0,
+  LINK_TEXT_END = 0xF1
+};
+
+#define LINK_STATE_ACK 0x01
+#define LINK_STATE_ONLINE 0x02
+
+#define LINK_END_FULL 0x01 // the burst was the whole list, not just changes
+
+// What became of a setpoint command, ordered from best to worst so a
+// command that reached several radiators reports its worst outcome
+enum LinkCommandOutcome : uint8_t {
+  LINK_OUTCOME_ACKED,
+  LINK_OUTCOME_SUPERSEDED, // a newer setpoint replaced it before the radiator answered
+  LINK_OUTCOME_FAILED,
+  LINK_OUTCOME_TIMED_OUT,
+  LINK_OUTCOME_BUSY, // too many commands in flight, never sent
+  LINK_OUTCOME_COUNT
+};
+
+const char* linkOutcomeName(uint8_t outcome);
+int linkOutcomeFromName(const char* name); // -1 when unknown
+
+// A non-zero request id is answered with LINK_COMMAND_DONE
+struct __attribute__((packed)) LinkSetAllTemp {
+  uint8_t temperature;
+  uint16_t request;
+};
+
+struct __attribute__((packed)) LinkSetTemp {
+  uint8_t index;
+  uint8_t temperature;
+  uint16_t request;
+};
+
+struct __attribute__((packed)) LinkGetRadiators {
+  uint32_t since; // only radiators changed after this version
+};
+
+struct __attribute__((packed)) LinkSetName {
+  uint8_t index;
+  char name[LINK_NAME_LEN]; // unpadded, like LinkRadiatorState
+};
+
+// The name is sent without padding; the frame length tells how much of it is there
+struct __attribute__((packed)) LinkRadiatorState {
+  uint8_t index;
+  uint8_t mac[6];
+  uint8_t curr_temp;
+  uint8_t flags; // LINK_STATE_*
+  uint32_t version;
+  char name[LINK_NAME_LEN];
+};
+
+struct __attribute__((packed)) LinkStateEnd {
+  uint8_t count; // radiators known to the server
+  uint8_t flags; // LINK_END_*
+  uint32_t version; // server state version the burst brings the receiver up to
+  uint32_t since; // version the burst starts from, 0 when it holds every radiator
+};
+
+struct __attribute__((packed)) LinkCommandDone {
+  uint16_t request;
+  uint8_t outcome; // LinkCommandOutcome
+  uint32_t ms; // from the command reaching the server to its outcome
+};
+
+struct LinkFrame {
+  uint8_t type;
+  uint8_t seq;
+  uint8_t length;
+  const uint8_t* payload;
+};
+
+uint16_t linkCrc16(const uint8_t* data, size_t len, uint16_t crc = 0xFFFF);
+size_t cobsEncode(const uint8_t* src, size_t len, uint8_t* dst);
+size_t cobsDecode(const uint8_t* src, size_t len, uint8_t* dst);
+
+// Writes a complete delimited frame into out (LINK_MAX_ENCODED bytes) and returns its size
+size_t linkEncodeFrame(uint8_t type, uint8_t seq, const void* payload, uint8_t length, uint8_t* out);
+
+// Collects bytes up to the 0x00 delimiter and validates the frame.
+// Anything malformed is dropped and the decoder resyncs on the next delimiter.
+class LinkDecoder {
+public:
+  bool push(uint8_t c); // true when frame() holds a new valid frame
+  const LinkFrame& frame() const { return _frame; }
+  void reset();
+
+  uint32_t crcErrors = 0;
+  uint32_t overflows = 0;
+  uint32_t seqGaps = 0;
+
+private:
+  uint8_t _buffer[LINK_MAX_ENCODED];
+  size_t _length = 0;
+  bool _overflow = false;
+  bool _haveSeq = false;
+  uint8_t _lastSeq = 0;
+  LinkFrame _frame = {};
+};
+
+// Print adapter that tunnels a text line through LINK_TEXT_PART/LINK_TEXT_END frames
+class LinkTextWriter : public Print {
+public:
+  LinkTextWriter(Stream& stream, uint8_t& seq);
+  ~LinkTextWriter();
+
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+private:
+  Stream& _stream;
+  uint8_t& _seq;
+  uint8_t _chunk[LINK_MAX_PAYLOAD];
+  uint8_t _length = 0;
+
+  void flushChunk(uint8_t type);
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef MESSAGE_BUFFER_H
+#define MESSAGE_BUFFER_H
+
+#include <Arduino.h>
+#include "LineReader.h"
+
+// Builds one WebSocket message at a time in a fixed buffer
+template <size_t N>
+class MessageBuffer : public Print {
+public:
+  size_t write(uint8_t c) override {
+    if (_length >= sizeof(_data)) return 0;
+    _data[_length++] = c;
+    return 1;
+  }
+  using Print::write;
+
+  void clear() { _length = 0; }
+  StrView view() const { return { _data, _length }; }
+
+private:
+  char _data[N];
+  size_t _length = 0;
+};
+
+#endif
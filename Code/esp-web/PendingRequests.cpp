@@ -0,0 +1,50 @@
+#include "PendingRequests.h"
+
+PendingRequest* PendingRequests::add(int index) {
+  for (PendingRequest& entry : entries) {
+    if (entry.id != 0) continue;
+
+    entry = {};
+    entry.id = nextId++;
+    if (nextId == 0) nextId = 1; // 0 means untracked on the wire
+    entry.index = index;
+    entry.startedAt = millis();
+    return &entry;
+  }
+  return nullptr;
+}
+
+PendingRequest* PendingRequests::find(uint16_t id) {
+  if (id == 0) return nullptr;
+
+  for (PendingRequest& entry : entries) {
+    if (entry.id == id) return &entry;
+  }
+  return nullptr;
+}
+
+PendingRequest* PendingRequests::findExpired() {
+  for (PendingRequest& entry : entries) {
+    if (entry.id != 0 && millis() - entry.startedAt > REQUEST_TIMEOUT_MS) return &entry;
+  }
+  return nullptr;
+}
+
+void PendingRequests::remove(PendingRequest* request) {
+  request->id = 0;
+  request->http = nullptr;
+}
+
+void PendingRequests::forgetHttp(AsyncWebServerRequest *http) {
+  for (PendingRequest& entry : entries) {
+    if (entry.http == http) entry.http = nullptr;
+  }
+}
+
+int PendingRequests::available() const {
+  int count = 0;
+  for (const PendingRequest& entry : entries) {
+    if (entry.id == 0) count++;
+  }
+  return count;
+}
@@ -0,0 +1,37 @@
+#ifndef PENDING_REQUESTS_H
+#define PENDING_REQUESTS_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#define MAX_PENDING_REQUESTS 16
+#define REQUEST_TIMEOUT_MS 5000 // longer than the server's own timeout, so its answer normally arrives first
+#define SLOW_REQUEST_MS 1000 // logged when an outcome takes longer
+
+// A web command forwarded to the server with a request id and waiting for
+// its outcome. It answers either a WebSocket client or a held HTTP request.
+struct PendingRequest {
+  uint16_t id; // 0 = free slot
+  int8_t index; // radiator, -1 for all
+  uint8_t op; // position in the client's batch
+  uint32_t req; // the client's batch id
+  uint32_t clientId; // WebSocket client, 0 for HTTP
+  AsyncWebServerRequest *http; // null for WebSocket, or once the HTTP client went away
+  unsigned long startedAt;
+};
+
+class PendingRequests {
+public:
+  PendingRequest* add(int index); // nullptr when the table is full
+  PendingRequest* find(uint16_t id);
+  PendingRequest* findExpired(); // one past REQUEST_TIMEOUT_MS, if any
+  void remove(PendingRequest* request);
+  void forgetHttp(AsyncWebServerRequest *http);
+  int available() const;
+
+private:
+  PendingRequest entries[MAX_PENDING_REQUESTS] = {};
+  uint16_t nextId = 1;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "RadiatorCache.h"
+
+RadiatorCache::RadiatorCache(Radiator* table, int capacity)
+  : radiators(table), maxRadiators(capacity) {}
+
+void RadiatorCache::begin(uint32_t id) {
+  bootId = id;
+}
+
+void RadiatorCache::update(int index, const Radiator& radiator) {
+  if (index < 0 || index >= maxRadiators) return;
+
+  radiators[index] = radiator;
+  changed |= 1UL << index;
+  revision++;
+  if (index >= count) count = index + 1;
+}
+
+bool RadiatorCache::applyMarker(uint32_t newVersion, uint32_t since, int newCount) {
+  if (since == 0) {
+    // Full list, also what a rebooted server pushes first
+    synced = true;
+  } else if (!synced || since != version || newVersion < version) {
+    return false;
+  }
+
+  version = newVersion;
+  count = min(newCount, maxRadiators);
+  revision++;
+  return true;
+}
+
+void RadiatorCache::invalidate() {
+  synced = false;
+}
+
+bool RadiatorCache::isSynced() const {
+  return synced;
+}
+
+uint32_t RadiatorCache::getVersion() const {
+  return version;
+}
+
+int RadiatorCache::getCount() const {
+  return count;
+}
+
+int RadiatorCache::getCapacity() const {
+  return maxRadiators;
+}
+
+const Radiator& RadiatorCache::get(int index) const {
+  return radiators[index];
+}
+
+uint32_t RadiatorCache::takeChanged() {
+  uint32_t result = changed;
+  changed = 0;
+  return result;
+}
+
+// {"id":2,"mac":"..","name":"..","curr_temp":21,"ack":true,"online":true,"v":17}, id only for deltas
+void RadiatorCache::writeRadiator(JsonWriter& json, const Radiator& radiator, int id) {
+  json.beginObject();
+  if (id >= 0) {
+    json.member("id", id);
+  }
+  json.key("mac");
+  json.macValue(radiator.mac);
+  json.member("name", radiator.name);
+  json.member("curr_temp", (uint32_t)radiator.curr_temp);
+  json.member("ack", radiator.ackReceived);
+  json.member("online", radiator.online);
+  json.member("v", radiator.version);
+  json.endObject();
+}
+
+void RadiatorCache::writeJson(Print& out) const {
+  JsonWriter json(out);
+  json.beginArray();
+  for (int i = 0; i < count; i++) {
+    writeRadiator(json, radiators[i], -1);
+  }
+  json.endArray();
+}
+
+void RadiatorCache::writeRadiatorJson(Print& out, int index) const {
+  JsonWriter json(out);
+  writeRadiator(json, radiators[index], index);
+}
+
+void RadiatorCache::writeEtag(char* out, size_t size) const {
+  snprintf(out, size, "\"%08x.%u\"", (unsigned)bootId, (unsigned)revision);
+}
@@ -0,0 +1,75 @@
+#ifndef RADIATOR_CACHE_H
+#define RADIATOR_CACHE_H
+
+#include <Arduino.h>
+#include "Capacity.h"
+#include "JsonWriter.h"
+#include "RadiatorSource.h"
+
+typedef struct { 
+  uint8_t mac[6];
+  char name[16];
+  uint8_t curr_temp; // hold current temp for each radiator
+  bool ackReceived; 
+  bool online;
+  uint32_t version; // server state version of its last change
+} Radiator;
+
+// Local mirror of the server's radiator list, kept up to date from the deltas
+// the server pushes. Web reads are answered from here instead of the UART.
+// Declare a RadiatorCacheFor<Capacity>, which holds the table.
+class RadiatorCache : public RadiatorSource {
+public:
+  void begin(uint32_t bootId); // random per boot, keeps ETags from an earlier boot from matching
+
+  void update(int index, const Radiator& radiator);
+
+  // Closes a burst of updates with the server's version marker. Returns false
+  // when the burst did not start where the cache was, so something was missed
+  // and the caller has to resync. A burst starting at 0 holds every radiator.
+  bool applyMarker(uint32_t version, uint32_t since, int count);
+  void invalidate();
+
+  bool isSynced() const override;
+  uint32_t getVersion() const;
+  int getCount() const override;
+  int getCapacity() const;
+  const Radiator& get(int index) const;
+
+  uint32_t takeChanged(); // bit per index updated since the last call
+
+  void writeJson(Print& out) const override; // same array the server sends for GET/RADIATORS
+  void writeRadiatorJson(Print& out, int index) const override; // same delta the server pushes
+  void writeEtag(char* out, size_t size) const;
+
+protected:
+  RadiatorCache(Radiator* table, int capacity);
+
+private:
+  Radiator* radiators;
+  int maxRadiators;
+  int count = 0;
+  uint32_t version = 0;
+  uint32_t bootId = 0;
+  uint32_t revision = 0; // bumped on every change to the cached data
+  uint32_t changed = 0;
+  bool synced = false;
+
+  static void writeRadiator(JsonWriter& json, const Radiator& radiator, int id);
+};
+
+// RadiatorCache with room for the server's Capacity::radiators, see Capacity.h
+template <typename Capacity>
+class RadiatorCacheFor : public RadiatorCache {
+public:
+  static_assert(Capacity::radiators > 0 && Capacity::radiators <= MAX_FLEET_RADIATORS, "a bit per radiator in takeChanged()");
+
+  RadiatorCacheFor() : RadiatorCache(table, Capacity::radiators) {}
+  RadiatorCacheFor(const RadiatorCacheFor&) = delete;
+  RadiatorCacheFor& operator=(const RadiatorCacheFor&) = delete;
+
+private:
+  Radiator table[Capacity::radiators];
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef RADIATOR_SOURCE_H
+#define RADIATOR_SOURCE_H
+
+#include <Arduino.h>
+
+// Radiator state as the web client sees it. esp-web answers from its cache of
+// the server, the server in single-board mode from RadiatorManager itself.
+class RadiatorSource {
+public:
+  virtual bool isSynced() const = 0; // false while there is nothing to show yet
+  virtual int getCount() const = 0;
+
+  virtual void writeJson(Print& out) const = 0; // [{"mac":"..","name":"..",...},...]
+  virtual void writeRadiatorJson(Print& out, int index) const = 0; // {"id":2,"mac":"..",...}
+};
+
+#endif
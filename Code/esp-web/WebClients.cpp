@@ -0,0 +1,213 @@
+#include "WebClients.h"
+
+// Counts what a writer produces so the shared buffer can be sized exactly
+class LengthCounter : public Print {
+public:
+  size_t write(uint8_t) override {
+    length++;
+    return 1;
+  }
+  using Print::write;
+
+  size_t length = 0;
+};
+
+class BufferWriter : public Print {
+public:
+  BufferWriter(uint8_t* data, size_t capacity) : _data(data), _capacity(capacity) {}
+
+  size_t write(uint8_t c) override {
+    if (_length >= _capacity) return 0;
+    _data[_length++] = c;
+    return 1;
+  }
+  using Print::write;
+
+private:
+  uint8_t* _data;
+  size_t _capacity;
+  size_t _length = 0;
+};
+
+// Writes the message twice: once to measure it, once into a buffer of exactly
+// that size which all recipients share. The caller unlocks it when done.
+template <typename Writer>
+AsyncWebSocketMessageBuffer* WebClients::makeMessage(Writer write) {
+  LengthCounter counter;
+  write(counter);
+
+  AsyncWebSocketMessageBuffer *buffer = _ws.makeBuffer(counter.length);
+  if (!buffer) return nullptr;
+  buffer->lock(); // kept until every recipient has queued it
+
+  BufferWriter out(buffer->get(), counter.length);
+  write(out);
+  return buffer;
+}
+
+WebClients::WebClients(AsyncWebSocket& ws, const RadiatorSource& radiators)
+  : _ws(ws), _radiators(radiators) {}
+
+bool WebClients::add(uint32_t id) {
+  for (Client& client : _clients) {
+    if (client.id == 0) {
+      client = { id, 0, true, 0 };
+      return true;
+    }
+  }
+  return false;
+}
+
+void WebClients::remove(uint32_t id) {
+  for (Client& client : _clients) {
+    if (client.id == id) client.id = 0;
+  }
+}
+
+void WebClients::markChanged(uint32_t radiators) {
+  for (Client& client : _clients) {
+    if (client.id != 0) client.dirty |= radiators;
+  }
+}
+
+void WebClients::markAllChanged() {
+  for (Client& client : _clients) {
+    if (client.id != 0) client.needsList = true;
+  }
+}
+
+void WebClients::broadcast(const char* data, size_t length) {
+  AsyncWebSocketMessageBuffer *buffer = nullptr;
+
+  for (Client& client : _clients) {
+    if (client.id == 0) continue;
+
+    AsyncWebSocketClient *socket = _ws.client(client.id);
+    if (!socket) continue;
+    if (!hasRoom(socket)) {
+      dropped++;
+      continue;
+    }
+
+    if (!buffer) {
+      buffer = _ws.makeBuffer(length);
+      if (!buffer) return;
+      buffer->lock();
+      memcpy(buffer->get(), data, length);
+    }
+    socket->text(buffer);
+    sent++;
+  }
+
+  if (buffer) {
+    buffer->unlock();
+    _ws._cleanBuffers();
+  }
+}
+
+void WebClients::update() {
+  if (!_radiators.isSynced()) return;
+
+  dropStalled(); // before sending, so a client that drained anything counts as keeping up
+  sendLists();
+
+  uint32_t dirty = 0;
+  for (const Client& client : _clients) {
+    if (client.id != 0) dirty |= client.dirty;
+  }
+  // Start where the last pass stopped so a client that only has room for one
+  // message now and then still gets every radiator in turn
+  int count = _radiators.getCount();
+  for (int n = 0; n < count && dirty; n++) {
+    int i = (_nextRadiator + n) % count;
+    if (!(dirty & (1UL << i))) continue;
+    dirty &= ~(1UL << i);
+    if (sendRadiator(i)) _nextRadiator = (i + 1) % count;
+  }
+
+  _ws._cleanBuffers();
+}
+
+int WebClients::getCount() const {
+  int count = 0;
+  for (const Client& client : _clients) {
+    if (client.id != 0) count++;
+  }
+  return count;
+}
+
+bool WebClients::hasRoom(AsyncWebSocketClient *client) const {
+  return client->queueLen() < WS_CLIENT_QUEUE_LIMIT;
+}
+
+// The whole list replaces every pending delta of the clients it goes to
+void WebClients::sendLists() {
+  AsyncWebSocketMessageBuffer *buffer = nullptr;
+
+  for (Client& client : _clients) {
+    if (client.id == 0 || !client.needsList) continue;
+
+    AsyncWebSocketClient *socket = _ws.client(client.id);
+    if (!socket || !hasRoom(socket)) continue;
+
+    if (!buffer) {
+      buffer = makeMessage([this](Print& out) { _radiators.writeJson(out); });
+      if (!buffer) return;
+    }
+    socket->text(buffer);
+    sent++;
+    client.needsList = false;
+    client.dirty = 0;
+  }
+
+  if (buffer) buffer->unlock();
+}
+
+bool WebClients::sendRadiator(int index) {
+  AsyncWebSocketMessageBuffer *buffer = nullptr;
+  uint32_t bit = 1UL << index;
+
+  for (Client& client : _clients) {
+    if (client.id == 0 || client.needsList || !(client.dirty & bit)) continue;
+
+    AsyncWebSocketClient *socket = _ws.client(client.id);
+    if (!socket || !hasRoom(socket)) continue;
+
+    if (!buffer) {
+      buffer = makeMessage([this, index](Print& out) { _radiators.writeRadiatorJson(out, index); });
+      if (!buffer) return false;
+    }
+    socket->text(buffer);
+    sent++;
+    client.dirty &= ~bit;
+  }
+
+  if (!buffer) return false;
+  buffer->unlock();
+  return true;
+}
+
+void WebClients::dropStalled() {
+  unsigned long now = millis();
+
+  for (Client& client : _clients) {
+    if (client.id == 0) continue;
+
+    AsyncWebSocketClient *socket = _ws.client(client.id);
+    if (!socket) {
+      client.id = 0; // went away without a disconnect event
+      continue;
+    }
+
+    bool behind = (client.dirty != 0 || client.needsList) && !hasRoom(socket);
+    if (!behind) {
+      client.behindSince = 0;
+    } else if (client.behindSince == 0) {
+      client.behindSince = now | 1; // 0 means keeping up
+    } else if (now - client.behindSince > WS_CLIENT_STALL_MS) {
+      socket->close();
+      client.id = 0;
+      disconnected++;
+    }
+  }
+}
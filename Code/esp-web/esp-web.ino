@@ -4,25 +4,75 @@
 #include <ESPAsyncTCP.h>
 #include <SoftwareSerial.h>
 #include <ArduinoJson.h>
-
+#include "LinkProtocol.h"
+#include "LineReader.h"
+#include "RadiatorCache.h"
+#include "Assets.h"
+#include "CommandQueue.h"
+#include "PendingRequests.h"
+#include "MessageBuffer.h"
+#include "WebClients.h"
+
+#define LINK_HW_UART 0 // CHANGE TO 1 TO RUN THE SERVER LINK ON UART0 (GPIO13 RX / GPIO15 TX), DEBUG OUTPUT MOVES TO GPIO2
+#ifndef SERVER_CAPACITY // or build with -DSERVER_CAPACITY=LargeServerCapacity
+#define SERVER_CAPACITY ServerCapacity // SAME AS IN esp-server.ino, SEE Capacity.h
+#endif
+#define LINK_NEGOTIATE_ATTEMPTS 5
+#define LINK_NEGOTIATE_INTERVAL_MS 1000
+
+#if LINK_HW_UART
+#define LINK_BINARY_BAUD 921600
+HardwareSerial& communicationSerial = Serial;
+HardwareSerial& debugSerial = Serial1; // UART1 is TX only
+#else
+#define LINK_BINARY_BAUD 57600 // fastest rate SoftwareSerial keeps up with next to Wi-Fi
 #define RX 4 //D2
 #define TX 5 //D1
-
 SoftwareSerial communicationSerial(RX, TX);
+HardwareSerial& debugSerial = Serial;
+#endif
+
+#define RADIATOR_JSON_LEN 110 // one radiator in the server's list, longest name and values
+#define RADIATOR_JSON_DOC_SIZE 200 // ArduinoJson pool per radiator in the list: array slot, 6 members, mac and name
+#define SERIAL_LINE_LEN (SERVER_CAPACITY::radiators * RADIATOR_JSON_LEN + 2) // longest JSON line the server sends, the whole list
+#define MAX_BATCH_OPS 16 // operations accepted per WebSocket command
+#define COMMAND_REPLY_LEN 768 // fits MAX_BATCH_OPS results
+#define LINKS_TIMEOUT_MS 2000 // GET /api/links gives up on the server after this long
 
 const char *ssid = "ESP32-Access-Point";
 const char *password = "123456789";
 
-typedef struct { 
-  uint8_t mac[6];
-  char name[16];
-  uint8_t curr_temp; // hold current temp for each radiator
-  bool ackReceived; 
-} Radiator;
+RadiatorCacheFor<SERVER_CAPACITY> cache;
+CommandQueueFor<SERVER_CAPACITY> commands; // filled by the web, forwarded to the server from loop()
+PendingRequests pending; // forwarded commands waiting for their outcome
+
+MessageBuffer<SERIAL_LINE_LEN> message;
+MessageBuffer<COMMAND_REPLY_LEN> reply; // written from WebSocket events
+
+// GET /api/links waiting for the server's link lines, see collectLinkLine()
+AsyncWebServerRequest *linksRequest = nullptr;
+AsyncResponseStream *linksResponse = nullptr;
+int linksCount = 0;
+unsigned long linksRequestedAt = 0;
+
+//-- Server link state
+enum LinkMode : uint8_t {
+  LINK_MODE_TEXT,
+  LINK_MODE_BINARY
+};
+LinkMode linkMode = LINK_MODE_TEXT;
+LinkDecoder linkDecoder;
+uint8_t linkTxSeq = 0;
+unsigned long lastLinkFrameAt = 0;
+unsigned long lastLinkPingAt = 0;
+unsigned long lastNegotiateAt = 0;
+int negotiateAttempts = 0;
+LineReader<SERIAL_LINE_LEN> tunnelReader; // text line reassembled from LINK_TEXT_PART frames
 
 //define websocket with url /ws
 AsyncWebSocket ws("/ws");
 AsyncWebServer server(80);
+WebClients webClients(ws, cache); // radiator state fan-out, sent from loop()
 
 String PARAM_MESSAGE = "temperature";
 
@@ -30,133 +80,473 @@ void notFound(AsyncWebServerRequest *request) {
   request->send(404, "text/plain", "Not found");
 }
 
-void sendTemperature(String temperature) {
-  int temp = temperature.toInt();
-  if (temp >= 8 && temp <= 28) {
-    Serial.print("Set temperature to: ");
-    Serial.println(temp);
-    //Sending flag to set temperature to all
-    communicationSerial.print("ALL/T/");
-    communicationSerial.println(temp);
+void sendAsset(AsyncWebServerRequest *request, const Asset& asset) {
+  // Hashed URLs never change, index.html is revalidated on every load
+  const char* cacheControl = asset.immutable ? "public, max-age=31536000, immutable" : "no-cache";
+
+  if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == asset.etag) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", asset.etag);
+    response->addHeader("Cache-Control", cacheControl);
+    request->send(response);
+    return;
+  }
+
+  AsyncWebServerResponse *response = request->beginResponse(LittleFS, asset.file, asset.mime);
+  response->addHeader("Content-Encoding", "gzip");
+  response->addHeader("ETag", asset.etag);
+  response->addHeader("Cache-Control", cacheControl);
+  request->send(response);
+}
+
+void linkBegin(uint32_t baud) {
+  communicationSerial.begin(baud);
+#if LINK_HW_UART
+  Serial.swap(); // move UART0 off the USB pins
+#endif
+}
+
+void linkSetBaud(uint32_t baud) {
+#if LINK_HW_UART
+  communicationSerial.updateBaudRate(baud);
+#else
+  communicationSerial.end();
+  communicationSerial.begin(baud);
+#endif
+}
+
+void sendLinkFrame(uint8_t type, const void* payload, uint8_t length) {
+  uint8_t out[LINK_MAX_ENCODED];
+  size_t len = linkEncodeFrame(type, linkTxSeq++, payload, length, out);
+  communicationSerial.write(out, len);
+}
+
+// Text protocol line, tunnelled through frames when the binary link is up
+void sendLinkLine(const String& line) {
+  if (linkMode == LINK_MODE_BINARY) {
+    LinkTextWriter out(communicationSerial, linkTxSeq);
+    out.print(line);
+  } else {
+    communicationSerial.println(line);
+  }
+}
+
+void requestRadiators() {
+  if (linkMode == LINK_MODE_BINARY) {
+    sendLinkFrame(LINK_GET_RADIATORS, nullptr, 0);
+  } else {
+    communicationSerial.println("GET/RADIATORS");
+  }
+}
+
+// Asks only for what changed since the cache's version when it has one
+void requestResync() {
+  if (!cache.isSynced()) {
+    requestRadiators();
+    return;
+  }
+
+  debugSerial.printf("Cache out of step, resyncing from version %u\n", (unsigned)cache.getVersion());
+
+  if (linkMode == LINK_MODE_BINARY) {
+    LinkGetRadiators req = { cache.getVersion() };
+    sendLinkFrame(LINK_GET_RADIATORS, &req, sizeof(req));
+  } else {
+    communicationSerial.print("GET/RADIATORS/");
+    communicationSerial.println(cache.getVersion());
+  }
+}
+
+void sendTemperature(uint8_t temp, uint16_t request) {
+  debugSerial.print("Set temperature to: ");
+  debugSerial.println(temp);
+
+  if (linkMode == LINK_MODE_BINARY) {
+    LinkSetAllTemp cmd = { temp, request };
+    sendLinkFrame(LINK_SET_ALL_TEMP, &cmd, sizeof(cmd));
+    return;
   }
+
+  //Sending flag to set temperature to all
+  communicationSerial.print("ALL/T/");
+  communicationSerial.print(temp);
+  communicationSerial.print("/");
+  communicationSerial.println(request);
+}
+
+void sendTemperatureTo(int index, uint8_t temp, uint16_t request) {
+  debugSerial.print("Set temperature to: ");
+  debugSerial.print(temp);
+  debugSerial.print(" for index: ");
+  debugSerial.println(index);
+
+  if (linkMode == LINK_MODE_BINARY) {
+    LinkSetTemp cmd = { (uint8_t)index, temp, request };
+    sendLinkFrame(LINK_SET_TEMP, &cmd, sizeof(cmd));
+    return;
+  }
+
+  communicationSerial.print("SET/TEMP/");
+  communicationSerial.print(index);
+  communicationSerial.print("/");
+  communicationSerial.print(temp);
+  communicationSerial.print("/");
+  communicationSerial.println(request);
+}
+
+void sendNameTo(int index, const char* name) {
+  debugSerial.print("Set name to: ");
+  debugSerial.print(name);
+  debugSerial.print(" for index: ");
+  debugSerial.println(index);
+
+  size_t nameLen = strlen(name);
+  if (linkMode == LINK_MODE_BINARY) {
+    LinkSetName cmd = {};
+    cmd.index = index;
+    memcpy(cmd.name, name, nameLen);
+    sendLinkFrame(LINK_SET_NAME, &cmd, offsetof(LinkSetName, name) + nameLen);
+    return;
+  }
+
+  sendLinkLine("SET/NAME/" + String(index) + "/" + name);
 }
 
-void sendTemperatureTo(String index, String temperature) {
-    int temp = temperature.toInt();
-    
-    if (temp >= 8 && temp <= 28) {
-        Serial.print("Set temperature to: ");
-        Serial.print(temp);
-        Serial.print(" for index: ");
-        Serial.println(index);
+// Forwards whatever the web queued since the last loop, one command per radiator
+void flushCommands() {
+  if (commands.isEmpty()) return;
 
-        communicationSerial.print("SET/TEMP/");
-        communicationSerial.print(index);
-        communicationSerial.print("/");
-        communicationSerial.println(temp);
+  uint8_t temp;
+  uint16_t request;
+  if (commands.takeAll(temp, request)) {
+    sendTemperature(temp, request);
+  }
+
+  char name[LINK_NAME_LEN];
+  for (int i = 0; i < commands.getCapacity(); i++) {
+    if (commands.takeTemp(i, temp, request)) {
+      sendTemperatureTo(i, temp, request);
+    }
+    if (commands.takeName(i, name)) {
+      sendNameTo(i, name);
+    }
+  }
+}
+
+// HTTP status for each LinkCommandOutcome on the GET /set/* path
+static const int outcomeStatus[LINK_OUTCOME_COUNT] = { 200, 409, 502, 504, 503 };
+
+// Answers whoever sent the command, on its WebSocket as
+// {"req":7,"op":0,"id":2,"result":"acked","ms":412} (no id for set-all)
+// or as the response to its held HTTP request
+void resolveRequest(uint16_t id, uint8_t outcome) {
+  PendingRequest *request = pending.find(id);
+  if (!request) return; // timed out here already
+
+  uint32_t ms = millis() - request->startedAt;
+  if (ms > SLOW_REQUEST_MS) {
+    debugSerial.printf("Slow command %u: %s after %u ms\n", id, linkOutcomeName(outcome), (unsigned)ms);
+  }
+
+  if (request->http) {
+    char text[48];
+    snprintf(text, sizeof(text), "%s in %u ms", linkOutcomeName(outcome), (unsigned)ms);
+    request->http->send(outcome < LINK_OUTCOME_COUNT ? outcomeStatus[outcome] : 500, "text/plain", text);
+  } else if (AsyncWebSocketClient *client = ws.client(request->clientId)) {
+    message.clear();
+    JsonWriter json(message);
+    json.beginObject();
+    json.member("req", request->req);
+    json.member("op", (uint32_t)request->op);
+    if (request->index >= 0) {
+      json.member("id", (int)request->index);
     }
+    json.member("result", linkOutcomeName(outcome));
+    json.member("ms", ms);
+    json.endObject();
+    client->text(message.view().data, message.view().length);
+  }
+
+  pending.remove(request);
+}
+
+void expireRequests() {
+  while (PendingRequest *request = pending.findExpired()) {
+    resolveRequest(request->id, LINK_OUTCOME_TIMED_OUT);
+  }
+}
+
+// Queues a setpoint for one radiator (index) or all (-1) under a new request id
+CommandResult queueSetpoint(int index, long temp, uint32_t clientId, uint32_t req, uint8_t op,
+                            AsyncWebServerRequest *http) {
+  PendingRequest *request = pending.add(index);
+  if (!request) return COMMAND_BUSY;
+
+  request->clientId = clientId;
+  request->req = req;
+  request->op = op;
+  request->http = http;
+
+  CommandResult result = index < 0 ? commands.setAll(temp, request->id) : commands.setTemp(index, temp, request->id);
+  if (result != COMMAND_QUEUED) {
+    pending.remove(request);
+  }
+  return result;
+}
+
+CommandResult applyOperation(JsonObject op, uint32_t clientId, uint32_t req, uint8_t opIndex) {
+  const char* type = op["op"] | "";
+  long index = op["id"] | -1L;
+  long temp = op["t"] | -1L;
+
+  if (strcmp(type, "temp") == 0) {
+    if (!commands.isValidIndex(index)) return COMMAND_BAD_ID;
+    return queueSetpoint(index, temp, clientId, req, opIndex, nullptr);
+  } else if (strcmp(type, "all") == 0) {
+    return queueSetpoint(-1, temp, clientId, req, opIndex, nullptr);
+  } else if (strcmp(type, "name") == 0) {
+    const char* name = op["name"] | "";
+    return commands.setName(index, name, strlen(name));
+  } else if (strcmp(type, "group") == 0) {
+    // One request id per radiator, each reported on its own. Checked
+    // up front so a group is queued whole or not at all.
+    JsonArray ids = op["ids"].as<JsonArray>();
+    if (ids.size() == 0) return COMMAND_BAD_ID;
+    for (JsonVariant id : ids) {
+      if (!commands.isValidIndex(id | -1L)) return COMMAND_BAD_ID;
+    }
+    if (!CommandQueue::isValidTemp(temp)) return COMMAND_BAD_TEMP;
+    if (pending.available() < (int)ids.size()) return COMMAND_BUSY;
+
+    for (JsonVariant id : ids) {
+      queueSetpoint(id | -1L, temp, clientId, req, opIndex, nullptr);
+    }
+    return COMMAND_QUEUED;
+  }
+  return COMMAND_BAD_OP;
+}
+
+// {"req":7,"ops":[{"op":"temp","id":2,"t":21},{"op":"all","t":22},
+//                 {"op":"group","ids":[0,2],"t":20},{"op":"name","id":1,"name":"Hall"}]}
+// is answered on the same socket with one result per operation, in order:
+// {"req":7,"results":[{"ok":true},{"ok":false,"error":"temperature out of range"},...]}
+// Accepted setpoints are followed by their outcome once the radiator answers,
+// see resolveRequest()
+void handleWebCommand(AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+  static StaticJsonDocument<1024> doc;
+  DeserializationError error = deserializeJson(doc, data, len);
+  if (error) {
+    debugSerial.printf("Invalid WebSocket command: %s\n", error.c_str());
+    return;
+  }
+
+  reply.clear();
+  JsonWriter json(reply);
+  json.beginObject();
+  uint32_t req = doc["req"] | (uint32_t)0;
+  json.member("req", req);
+  json.key("results");
+  json.beginArray();
+
+  int count = 0;
+  for (JsonObject op : doc["ops"].as<JsonArray>()) {
+    CommandResult result = count < MAX_BATCH_OPS ? applyOperation(op, client->id(), req, count) : COMMAND_BATCH_FULL;
+    count++;
+
+    json.beginObject();
+    json.member("ok", result == COMMAND_QUEUED);
+    if (result != COMMAND_QUEUED) {
+      json.member("error", commandResultText(result));
+    }
+    json.endObject();
+  }
+
+  json.endArray();
+  json.endObject();
+  client->text(reply.view().data, reply.view().length);
+}
+
+// Leaves a queued setpoint's HTTP request open until resolveRequest() answers it
+void holdForOutcome(AsyncWebServerRequest *request, CommandResult result) {
+  if (result != COMMAND_QUEUED) {
+    request->send(result == COMMAND_BUSY ? 503 : 400, "text/plain", commandResultText(result));
+    return;
+  }
+
+  request->onDisconnect([request]() {
+    pending.forgetHttp(request);
+  });
+}
+
+// Result of a queued command as an HTTP response, for the GET /set/* compatibility path
+void sendCommandResult(AsyncWebServerRequest *request, CommandResult result, const String& text) {
+  if (result == COMMAND_QUEUED) {
+    request->send(200, "text/plain", text);
+  } else {
+    request->send(400, "text/plain", commandResultText(result));
+  }
+}
+
+// Link statistics live on the server. The request is held while its
+// {"link":..} lines come over the UART and answered at the {"links":n} marker.
+void requestLinks(AsyncWebServerRequest *request) {
+  if (linksRequest) {
+    request->send(503, "text/plain", "Link statistics already requested");
+    return;
+  }
+
+  linksRequest = request;
+  linksResponse = request->beginResponseStream("application/json");
+  linksResponse->addHeader("Cache-Control", "no-store");
+  linksResponse->print('[');
+  linksCount = 0;
+  linksRequestedAt = millis();
+
+  request->onDisconnect([request]() {
+    if (linksRequest != request) return; // answered already
+    delete linksResponse;
+    linksRequest = nullptr;
+  });
+  sendLinkLine("GET/LINKS");
+}
+
+// False when the line is not for a held GET /api/links
+bool collectLinkLine(StrView line) {
+  if (!linksRequest) return false;
+
+  if (line.startsWith("{\"link\":")) {
+    if (linksCount++ > 0) linksResponse->print(',');
+    linksResponse->write((const uint8_t*)line.data, line.length);
+    return true;
+  }
+
+  if (line.startsWith("{\"links\":")) {
+    linksResponse->print(']');
+    AsyncWebServerRequest *request = linksRequest;
+    linksRequest = nullptr;
+    request->send(linksResponse);
+    return true;
+  }
+  return false;
+}
+
+void expireLinksRequest() {
+  if (!linksRequest || millis() - linksRequestedAt <= LINKS_TIMEOUT_MS) return;
+
+  AsyncWebServerRequest *request = linksRequest;
+  linksRequest = nullptr;
+  delete linksResponse;
+  request->send(504, "text/plain", "Server did not answer");
 }
 
 void sendInfo() {
   String IP = WiFi.softAPIP().toString();
 
-  communicationSerial.print("INFO/");
-  communicationSerial.print(IP);
-  communicationSerial.print("/");
-  communicationSerial.print(ssid);
-  communicationSerial.print("/");
-  communicationSerial.print(password);
-  communicationSerial.println();
+  sendLinkLine("INFO/" + IP + "/" + ssid + "/" + password);
 }
 
 
 void setup() {
-  Serial.begin(115200);
+  debugSerial.begin(115200);
 
-  communicationSerial.begin(9600);
+  linkBegin(LINK_TEXT_BAUD);
 
   WiFi.mode(WIFI_AP);
   WiFi.softAP(ssid, password);
 
-  Serial.println();
+  debugSerial.println();
 
   IPAddress IP = WiFi.softAPIP();
-  Serial.print("AP IP address: ");
-  Serial.println(IP);
+  debugSerial.print("AP IP address: ");
+  debugSerial.println(IP);
 
-  Serial.println("Starting LittleFS!");
+  debugSerial.println("Starting LittleFS!");
   if (!LittleFS.begin()) {
-    Serial.println("An Error has occurred while mounting LittleFS");
+    debugSerial.println("An Error has occurred while mounting LittleFS");
     return;
   }
 
   Dir dir = LittleFS.openDir("/");
-  Serial.println("Files:");
+  debugSerial.println("Files:");
   while (dir.next()) {
-    Serial.print("File: ");
-    Serial.println(dir.fileName());
+    debugSerial.print("File: ");
+    debugSerial.println(dir.fileName());
   }
-  Serial.println("All files listed");
+  debugSerial.println("All files listed");
 
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(LittleFS, "/index.html", "text/html");
-  });
+  // Pages and icons, gzip-compressed by tools/build_assets.py
+  for (const Asset& asset : assets) {
+    server.on(asset.path, HTTP_GET, [&asset](AsyncWebServerRequest *request) {
+      sendAsset(request, asset);
+    });
+  }
 
-  server.on("/styles.css", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(LittleFS, "/styles.css", "text/css");
-  });
+  // Compatibility path, the page itself sends commands over the WebSocket
+  // Both answer once the radiators acked, failed or timed out, see resolveRequest()
+  server.on("/set/all", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam(PARAM_MESSAGE)) {
+      request->send(400, "text/plain", "Missing temperature parameter");
+      return;
+    }
 
-  server.on("/script.js", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(LittleFS, "/script.js", "text/javascript");
+    String temperature = request->getParam(PARAM_MESSAGE)->value();
+    debugSerial.print("Received temperature: ");
+    debugSerial.println(temperature);
+    holdForOutcome(request, queueSetpoint(-1, temperature.toInt(), 0, 0, 0, request));
   });
 
-  server.on("/edit.svg", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(LittleFS, "/edit.svg", "image/svg+xml");
-  });
+  server.on("/set/temp", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("id") || !request->hasParam("temp")) {
+      request->send(400, "text/plain", "Missing id or temp parameter");
+      return;
+    }
 
-  server.on("/delete.svg", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(LittleFS, "/delete.svg", "image/svg+xml");
+    long id = request->getParam("id")->value().toInt();
+    long temperature = request->getParam("temp")->value().toInt();
+    if (!commands.isValidIndex(id)) {
+      request->send(400, "text/plain", commandResultText(COMMAND_BAD_ID));
+      return;
+    }
+    holdForOutcome(request, queueSetpoint(id, temperature, 0, 0, 0, request));
   });
 
-  server.on("/set/all", HTTP_GET, [](AsyncWebServerRequest *request) {
-    String temperature;
-    if (request->hasParam(PARAM_MESSAGE)) {
-      temperature = request->getParam(PARAM_MESSAGE)->value();
-      Serial.print("Received temperature: ");
-      Serial.println(temperature);
-      if (temperature.length() > 0) {
-        sendTemperature(temperature);
-      }
-    } else {
-      temperature = "No message sent";
+  server.on("/set/name", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("id") || !request->hasParam("name")) {
+      request->send(400, "text/plain", "Missing id or name parameter");
+      return;
     }
-    request->send(200, "text/plain", "Received temperature: " + temperature);
-  });
 
-  server.on("/set/temp", HTTP_GET, [](AsyncWebServerRequest *request) {
-      String id;
-      String temperature;
+    String id = request->getParam("id")->value();
+    String name = request->getParam("name")->value();
+    sendCommandResult(request, commands.setName(id.toInt(), name.c_str(), name.length()),
+                      "Set name for ID " + id + " to " + name);
+  });
 
-      if (request->hasParam("id") && request->hasParam("temp")) {
-          id = request->getParam("id")->value();
-          temperature = request->getParam("temp")->value();
+  // Served from the cache; clients revalidate with If-None-Match
+  server.on("/api/radiators", HTTP_GET, [](AsyncWebServerRequest *request) {
+    char etag[24];
+    cache.writeEtag(etag, sizeof(etag));
 
-          Serial.print("Received temperature for ID ");
-          Serial.print(id);
-          Serial.print(": ");
-          Serial.println(temperature);
+    if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == etag) {
+      AsyncWebServerResponse *response = request->beginResponse(304);
+      response->addHeader("ETag", etag);
+      request->send(response);
+      return;
+    }
 
-          // Call your function here:
-          sendTemperatureTo(id, temperature);
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+    cache.writeJson(*response);
+    request->send(response);
+  });
 
-          request->send(200, "text/plain", "Set temp for ID " + id + " to " + temperature);
-      } else {
-          request->send(400, "text/plain", "Missing id or temp parameter");
-      }
+  server.on("/api/links", HTTP_GET, [](AsyncWebServerRequest *request) {
+    requestLinks(request);
   });
 
   server.on("/sync", HTTP_GET, [](AsyncWebServerRequest *request) {
-    communicationSerial.println("GET/RADIATORS");
+    requestRadiators();
     request->send(200, "text/plain", "Sync command sent");
   });
 
@@ -166,40 +556,256 @@ void setup() {
   ws.onEvent([](AsyncWebSocket *server, AsyncWebSocketClient *client, 
   AwsEventType type, void *arg, uint8_t *data, size_t len) {
   if (type == WS_EVT_CONNECT) {
-    communicationSerial.println("GET/RADIATORS");
-    Serial.println("WebSocket client connected");
+    if (!webClients.add(client->id())) {
+      client->close();
+      return;
+    }
+    // New clients get the list straight from the cache once it is filled
+    if (!cache.isSynced()) {
+      requestRadiators();
+    }
+    debugSerial.println("WebSocket client connected");
   } else if (type == WS_EVT_DISCONNECT) {
-    Serial.println("WebSocket client disconnected");
+    webClients.remove(client->id());
+    debugSerial.println("WebSocket client disconnected");
+  } else if (type == WS_EVT_DATA) {
+    // Commands are small, only whole single-frame text messages are accepted
+    AwsFrameInfo *info = (AwsFrameInfo*)arg;
+    if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
+      handleWebCommand(client, data, len);
+    }
   }
   });
   server.addHandler(&ws);
 
   sendInfo(); // send IP, ssid, password to esp-server
+
+  cache.begin(ESP.random());
+  commands.setSupersededHandler([](uint16_t request) {
+    resolveRequest(request, LINK_OUTCOME_SUPERSEDED);
+  });
+  requestRadiators(); // fill the cache before the first page load
 }
 
-String incomingJSON = "";
+LineReader<SERIAL_LINE_LEN> serialLine;
 
 void handleSerialInput() {
+  if (linkMode == LINK_MODE_BINARY) {
+    while (communicationSerial.available()) {
+      if (linkDecoder.push(communicationSerial.read())) {
+        lastLinkFrameAt = millis();
+        handleLinkFrame(linkDecoder.frame());
+      }
+    }
+    return;
+  }
+
   while (communicationSerial.available()) {
-    char c = communicationSerial.read();
-    //Serial.print(c);
-    if (c == '\n') {
-      //Serial.println();
-      sendToWeb(incomingJSON);
-      incomingJSON = "";
-    } else {
-      incomingJSON += c;
+    if (!serialLine.push(communicationSerial.read())) continue;
+
+    StrView line = serialLine.line();
+    long baud;
+    if (line.startsWith("LINK/OK/") && StrView{ line.data + 8, line.length - 8 }.toInt(baud)) {
+      switchToBinary(baud);
+    } else if (line.length > 0) {
+      handleServerLine(line);
     }
   }
 }
 
-//send unchanged json to web
-void sendToWeb(String jsonStr) {
-  Serial.println(jsonStr);
-  ws.textAll(jsonStr);
+bool parseMac(const char* text, uint8_t* mac) {
+  for (int i = 0; i < 6; i++) {
+    char* end;
+    unsigned long byte = strtoul(text, &end, 16);
+    if (end == text || byte > 0xFF || (i < 5 && *end != ':')) return false;
+    mac[i] = byte;
+    text = end + 1;
+  }
+  return true;
+}
+
+Radiator radiatorFromJson(JsonObject obj) {
+  Radiator r = {};
+  parseMac(obj["mac"] | "", r.mac);
+  strncpy(r.name, obj["name"] | "", sizeof(r.name) - 1);
+  r.curr_temp = obj["curr_temp"] | 0;
+  r.ackReceived = obj["ack"] | false;
+  r.online = obj["online"] | true;
+  r.version = obj["v"] | 0;
+  return r;
+}
+
+// Text protocol: radiator lists, deltas and version markers update the cache,
+// everything else (stats, ...) is relayed to the web as is
+void handleServerLine(StrView line) {
+  if (collectLinkLine(line)) return;
+
+  if (line.data[0] != '[' && line.data[0] != '{') {
+    sendToWeb(line);
+    return;
+  }
+
+  static StaticJsonDocument<SERVER_CAPACITY::radiators * RADIATOR_JSON_DOC_SIZE + 64> doc;
+  DeserializationError error = deserializeJson(doc, line.data, line.length);
+  if (error) {
+    debugSerial.printf("Invalid JSON from server: %s\n", error.c_str());
+    return;
+  }
+
+  if (doc.is<JsonArray>()) {
+    uint32_t version = 0;
+    int count = 0;
+    for (JsonObject obj : doc.as<JsonArray>()) {
+      Radiator r = radiatorFromJson(obj);
+      version = max(version, r.version); // the server's version is its newest radiator's
+      cache.update(count++, r);
+    }
+    cache.applyMarker(version, 0, count);
+    cache.takeChanged();
+    webClients.markAllChanged();
+  } else if (doc.containsKey("done")) {
+    int outcome = linkOutcomeFromName(doc["result"] | "");
+    resolveRequest(doc["done"], outcome < 0 ? LINK_OUTCOME_FAILED : outcome);
+  } else if (doc.containsKey("since")) {
+    if (!cache.applyMarker(doc["v"], doc["since"], doc["count"])) {
+      requestResync();
+    }
+    cache.takeChanged();
+  } else if (doc.containsKey("id") && doc.containsKey("mac")) {
+    cache.update(doc["id"], radiatorFromJson(doc.as<JsonObject>()));
+    webClients.markChanged(cache.takeChanged());
+  } else {
+    sendToWeb(line);
+  }
+}
+
+void handleLinkFrame(const LinkFrame& frame) {
+  switch (frame.type) {
+    case LINK_RADIATOR_STATE: {
+      if (frame.length < offsetof(LinkRadiatorState, name)) break;
+
+      LinkRadiatorState state = {};
+      memcpy(&state, frame.payload, min((size_t)frame.length, sizeof(state)));
+
+      Radiator r = {};
+      memcpy(r.mac, state.mac, 6);
+      size_t nameLen = min((size_t)(frame.length - offsetof(LinkRadiatorState, name)), sizeof(r.name) - 1);
+      memcpy(r.name, state.name, nameLen);
+      r.curr_temp = state.curr_temp;
+      r.ackReceived = state.flags & LINK_STATE_ACK;
+      r.online = state.flags & LINK_STATE_ONLINE;
+      r.version = state.version;
+      cache.update(state.index, r);
+      break;
+    }
+
+    case LINK_STATE_END:
+      if (frame.length == sizeof(LinkStateEnd)) {
+        LinkStateEnd end;
+        memcpy(&end, frame.payload, sizeof(end));
+        bool inStep = cache.applyMarker(end.version, end.since, end.count);
+
+        if (end.since == 0) {
+          cache.takeChanged();
+          webClients.markAllChanged();
+        } else {
+          webClients.markChanged(cache.takeChanged());
+        }
+
+        if (!inStep) {
+          requestResync();
+        }
+      }
+      break;
+
+    case LINK_PONG:
+      break;
+
+    case LINK_COMMAND_DONE:
+      if (frame.length == sizeof(LinkCommandDone)) {
+        LinkCommandDone done;
+        memcpy(&done, frame.payload, sizeof(done));
+        resolveRequest(done.request, done.outcome);
+      }
+      break;
+
+    case LINK_TEXT_PART:
+    case LINK_TEXT_END:
+      for (int i = 0; i < frame.length; i++) {
+        tunnelReader.push(frame.payload[i]);
+      }
+      if (frame.type == LINK_TEXT_END && tunnelReader.push('\n') && !collectLinkLine(tunnelReader.line())) {
+        sendToWeb(tunnelReader.line());
+      }
+      break;
+
+    default:
+      debugSerial.printf("Unknown link frame type %d\n", frame.type);
+      break;
+  }
+}
+
+void switchToBinary(uint32_t baud) {
+  if (baud < LINK_TEXT_BAUD || baud > LINK_MAX_BAUD) return;
+
+  linkSetBaud(baud);
+  linkMode = LINK_MODE_BINARY;
+  linkDecoder.reset();
+  tunnelReader.reset();
+  lastLinkFrameAt = millis();
+  lastLinkPingAt = millis();
+
+  debugSerial.printf("Server link switched to binary at %u baud\n", (unsigned)baud);
+  requestRadiators();
+}
+
+void fallBackToText() {
+  linkSetBaud(LINK_TEXT_BAUD);
+  linkMode = LINK_MODE_TEXT;
+  serialLine.reset();
+  negotiateAttempts = 0;
+
+  debugSerial.println("Server link timed out, back to text protocol");
+}
+
+// Offers the binary protocol a few times after boot or a fallback. A server that
+// does not answer LINK/OK keeps us on the text protocol.
+void updateLink() {
+  unsigned long now = millis();
+
+  if (linkMode == LINK_MODE_TEXT) {
+    if (negotiateAttempts < LINK_NEGOTIATE_ATTEMPTS && now - lastNegotiateAt > LINK_NEGOTIATE_INTERVAL_MS) {
+      lastNegotiateAt = now;
+      negotiateAttempts++;
+      communicationSerial.print("LINK/BIN/");
+      communicationSerial.println(LINK_BINARY_BAUD);
+    }
+    return;
+  }
+
+  if (now - lastLinkPingAt > LINK_PING_INTERVAL_MS) {
+    lastLinkPingAt = now;
+    sendLinkFrame(LINK_PING, nullptr, 0);
+  }
+
+  if (now - lastLinkFrameAt > LINK_TIMEOUT_MS) {
+    fallBackToText();
+  }
+}
+
+//send unchanged json to web, radiator state goes through webClients instead
+void sendToWeb(StrView json) {
+  debugSerial.write(json.data, json.length);
+  debugSerial.println();
+  webClients.broadcast(json.data, json.length);
 }
 
 void loop() {
   // listen communicationSerial for incoming messages from ESP32, radiator lists updates and some other info (battery maybe)
   handleSerialInput();
+  updateLink();
+  flushCommands();
+  expireRequests();
+  expireLinksRequest();
+  webClients.update();
 }
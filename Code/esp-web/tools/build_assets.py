@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Builds the LittleFS image contents for esp-web.
+
+Reads the page sources from web/, writes gzip-compressed copies to data/
+and the route table to Assets.h, for esp-web and for esp-server, which
+serves the same page in single-board mode. Every file except index.html gets its
+content hash in the name (script.1a2b3c4d.js), so browsers can cache it
+forever; index.html is rewritten to point at the hashed names and is
+revalidated with its ETag on each load.
+
+Run from anywhere before uploading the LittleFS image:
+    python3 tools/build_assets.py           # build
+    python3 tools/build_assets.py --report  # build and print bytes per page load
+"""
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SOURCE_DIR = os.path.join(ROOT, "web")
+# Sketches that serve the page, each with its own data/ and Assets.h
+SKETCHES = [ROOT, os.path.join(os.path.dirname(ROOT), "esp-server")]
+
+INDEX = "index.html"
+LITTLEFS_NAME_MAX = 31
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "text/javascript",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+    ".json": "application/json",
+}
+
+# Files that can reference others are hashed after the files they point to
+TEXT_TYPES = (".css", ".js", ".html")
+
+# Rough size of the request and response headers of one HTTP exchange
+HEADER_BYTES = 400
+
+
+def fingerprint(data):
+    return hashlib.sha256(data).hexdigest()[:8]
+
+
+def hashed_name(name, digest):
+    stem, ext = os.path.splitext(name)
+    return "%s.%s%s" % (stem, digest, ext)
+
+
+def rewrite_references(text, renames):
+    # Only whole quoted or url() references are replaced, never substrings
+    for name, new_name in renames.items():
+        text = re.sub(r'(["\'(])%s(["\')])' % re.escape(name), r"\g<1>%s\g<2>" % new_name, text)
+    return text
+
+
+def build():
+    names = sorted(os.listdir(SOURCE_DIR))
+    unknown = [n for n in names if os.path.splitext(n)[1] not in MIME_TYPES]
+    if unknown:
+        sys.exit("No MIME type for: %s" % ", ".join(unknown))
+
+    order = sorted(names, key=lambda n: (n == INDEX, os.path.splitext(n)[1] in TEXT_TYPES, n))
+    renames = {}
+    assets = []
+
+    for name in order:
+        with open(os.path.join(SOURCE_DIR, name), "rb") as f:
+            data = f.read()
+
+        ext = os.path.splitext(name)[1]
+        if ext in TEXT_TYPES:
+            data = rewrite_references(data.decode("utf-8"), renames).encode("utf-8")
+
+        digest = fingerprint(data)
+        immutable = name != INDEX
+        served = hashed_name(name, digest) if immutable else name
+        renames[name] = served
+
+        compressed = gzip.compress(data, compresslevel=9, mtime=0)
+        stored = served + ".gz"
+        if len(stored) > LITTLEFS_NAME_MAX:
+            sys.exit("%s is longer than LittleFS allows" % stored)
+
+        assets.append({
+            "source": name,
+            "path": "/" if name == INDEX else "/" + served,
+            "file": "/" + stored,
+            "mime": MIME_TYPES[ext],
+            "etag": digest,
+            "immutable": immutable,
+            "raw": len(data),
+            "gz": len(compressed),
+            "compressed": compressed,
+        })
+
+    for sketch in SKETCHES:
+        output_dir = os.path.join(sketch, "data")
+        os.makedirs(output_dir, exist_ok=True)
+        for old in os.listdir(output_dir):
+            if old.endswith(".gz"):
+                os.remove(os.path.join(output_dir, old))
+        for asset in assets:
+            with open(os.path.join(output_dir, asset["file"][1:]), "wb") as f:
+                f.write(asset["compressed"])
+
+        write_header(assets, os.path.join(sketch, "Assets.h"))
+    return assets
+
+
+def write_header(assets, header):
+    lines = [
+        "// Assets.h",
+        "// Generated by esp-web/tools/build_assets.py from esp-web/web/, do not edit.",
+        "#ifndef ASSETS_H",
+        "#define ASSETS_H",
+        "",
+        "#include <Arduino.h>",
+        "",
+        "struct Asset {",
+        "  const char* path; // URL",
+        "  const char* file; // gzip-compressed file on LittleFS",
+        "  const char* mime;",
+        "  const char* etag; // content hash, quoted for the ETag header",
+        "  bool immutable; // the hash is in the URL, browsers may cache it forever",
+        "};",
+        "",
+        "static constexpr Asset assets[] = {",
+    ]
+    for asset in assets:
+        lines.append('  { "%s", "%s", "%s", "\\"%s\\"", %s },' % (
+            asset["path"], asset["file"], asset["mime"], asset["etag"],
+            "true" if asset["immutable"] else "false"))
+    lines += [
+        "};",
+        "",
+        "#endif",
+        "",
+    ]
+    with open(header, "w", newline="\n") as f:
+        f.write("\n".join(lines))
+
+
+def report(assets):
+    print("%-14s %-28s %8s %8s" % ("source", "path", "raw", "gzip"))
+    for asset in assets:
+        print("%-14s %-28s %8d %8d" % (asset["source"], asset["path"], asset["raw"], asset["gz"]))
+
+    requests = len(assets)
+    raw = sum(a["raw"] for a in assets) + requests * HEADER_BYTES
+    cold = sum(a["gz"] for a in assets) + requests * HEADER_BYTES
+    # Warm: hashed assets come from the browser cache, index.html is a 304
+    warm = HEADER_BYTES
+
+    print()
+    print("cold load, uncompressed: %6d bytes in %d requests" % (raw, requests))
+    print("cold load, gzip:         %6d bytes in %d requests" % (cold, requests))
+    print("warm load:               %6d bytes in 1 request" % warm)
+    print("(each request counted with ~%d bytes of headers)" % HEADER_BYTES)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--report", action="store_true", help="print bytes per cold and warm page load")
+    args = parser.parse_args()
+
+    assets = build()
+    for sketch in SKETCHES:
+        print("Wrote %d assets to %s and %s" % (len(assets), os.path.relpath(os.path.join(sketch, "data")),
+                                                os.path.relpath(os.path.join(sketch, "Assets.h"))))
+    if args.report:
+        print()
+        report(assets)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,68 @@
+// storm.js
+// Radiator table update storm. Paste into the browser console with the web
+// page open (served by esp-web or esp-server, or from web/ on a local server).
+//
+// Loads RADIATORS made-up radiators, then feeds UPDATES single-radiator
+// deltas through handleMessage(), the same path as the WebSocket, PER_FRAME
+// of them per animation frame. Reports the time per frame spent handling the
+// messages, patching the table and laying it out (idle time until the next
+// frame is left out), and how many DOM changes the updates caused.
+(async function storm(RADIATORS = 200, UPDATES = 4000, PER_FRAME = 20) {
+    const table = document.querySelector(".radiators-list");
+    const nextFrame = () => new Promise(resolve => requestAnimationFrame(resolve));
+    const mac = i => "34:85:18:00:" + (i >> 8).toString(16).padStart(2, "0") + ":" + (i & 0xff).toString(16).padStart(2, "0");
+    // Shaped like the server's JSON; the id is what deltas are matched by
+    const radiator = (i, temp) => ({ id: i, mac: mac(i), name: "Room " + (i + 1), curr_temp: temp, online: true, ack: i % 3 !== 0 });
+
+    const list = [];
+    for (let i = 0; i < RADIATORS; i++) list.push(radiator(i, 20));
+    handleMessage(JSON.stringify(list));
+    await nextFrame();
+    await nextFrame();
+
+    // Time the table patch and the layout it causes, wherever the page runs it
+    const render = window.renderRadiators;
+    let renderMs = 0;
+    window.renderRadiators = function () {
+        const start = performance.now();
+        render();
+        table.offsetHeight;
+        renderMs += performance.now() - start;
+    };
+
+    let changes = 0;
+    const observer = new MutationObserver(records => { changes += records.length; });
+    observer.observe(table, { subtree: true, childList: true, characterData: true, attributes: true });
+
+    const frames = [];
+    for (let sent = 0; sent < UPDATES; sent += PER_FRAME) {
+        const start = performance.now();
+        for (let i = sent; i < sent + PER_FRAME && i < UPDATES; i++) {
+            handleMessage(JSON.stringify(radiator((i * 7) % RADIATORS, 15 + i % 15)));
+        }
+        const handled = performance.now() - start;
+        renderMs = 0;
+        // The table patch was scheduled before this frame callback, so it has run once this resolves
+        await nextFrame();
+        frames.push(handled + renderMs);
+    }
+
+    changes += observer.takeRecords().length;
+    observer.disconnect();
+    window.renderRadiators = render;
+
+    frames.sort((a, b) => a - b);
+    const at = q => frames[Math.min(frames.length - 1, Math.floor(q * frames.length))].toFixed(2);
+    const result = {
+        radiators: RADIATORS,
+        updates: UPDATES,
+        perFrame: PER_FRAME,
+        frameMsP50: at(0.5),
+        frameMsP95: at(0.95),
+        frameMsMax: at(1),
+        domChanges: changes,
+        domChangesPerUpdate: (changes / UPDATES).toFixed(2)
+    };
+    console.table(result);
+    return result;
+})();
@@ -0,0 +1,407 @@
+let temperature = 22;
+let minTemp = 8;
+let maxTemp = 28;
+
+let radiators = []; // filled from /api/radiators, then kept current over the WebSocket
+
+let editModeId = null; // null = adding, number = editing
+let socket = null;
+
+function updateTemperatureDisplay() {
+    document.getElementById('temp').value = temperature + '°C';
+}
+function increaseTemp(){
+    if(temperature < 28){
+    temperature++;
+    updateTemperatureDisplay();
+    }
+}
+function decreaseTemp(){
+    if(temperature > 8){
+    temperature--;
+    updateTemperatureDisplay();
+    }
+}
+function setTemperatureFromInput() {
+    let input = parseInt(document.getElementById('temp').value);
+    if(input >= minTemp && input <= maxTemp) {
+        temperature = input;
+        updateTemperatureDisplay();
+    }
+    else {
+        document.getElementById('temp').value = temperature + '°C';
+    }
+}
+
+function sendTemperature(){
+    alert(`Temperature ${temperature}°C sent!`)
+    radiators.forEach(radiator => {
+        radiator.temp = temperature;
+        
+    });
+    scheduleRender();
+    sendOperations([{ op: "all", t: temperature }]);
+}
+
+function sendTemperatureToRadiator(radiatorId, temp) {
+    sendOperations([{ op: "temp", id: radiatorId, t: temp }]);
+}
+
+function sendNameToRadiator(radiatorId, name) {
+    sendOperations([{ op: "name", id: radiatorId, name: name }]);
+}
+
+// === Commands ===
+// Operations go out as one batch over the WebSocket, the reply carries a
+// result per operation. Without an open socket each falls back to GET /set/*.
+let nextRequestId = 1;
+
+function sendOperations(ops) {
+    if (!socket || socket.readyState !== WebSocket.OPEN) {
+        ops.forEach(sendOperationOverHttp);
+        return;
+    }
+
+    socket.send(JSON.stringify({ req: nextRequestId++, ops: ops }));
+}
+
+function sendOperationOverHttp(op) {
+    let url;
+    if (op.op === "all") {
+        url = `/set/all?temperature=${op.t}`;
+    } else if (op.op === "temp") {
+        url = `/set/temp?id=${op.id}&temp=${op.t}`;
+    } else if (op.op === "name") {
+        url = `/set/name?id=${op.id}&name=${encodeURIComponent(op.name)}`;
+    } else {
+        console.warn("No HTTP fallback for operation:", op);
+        return;
+    }
+
+    fetch(url)
+        .then(response => response.text())
+        .then(data => console.log("Response:", data))
+        .catch(error => console.error("Error:", error));
+}
+
+function onCommandResults(data) {
+    data.results.forEach((result, i) => {
+        if (!result.ok) {
+            console.warn(`Command ${data.req} operation ${i} failed: ${result.error}`);
+        }
+    });
+}
+
+// Sent once per accepted setpoint when the radiator acked, failed or timed out:
+// {"req":7,"op":0,"id":2,"result":"acked","ms":412}
+function onCommandOutcome(data) {
+    const target = data.id === undefined ? "all radiators" : `radiator ${data.id}`;
+    const text = `Command ${data.req} operation ${data.op} for ${target}: ${data.result} in ${data.ms} ms`;
+    if (data.result === "acked") {
+        console.log(text);
+    } else {
+        console.warn(text);
+    }
+}
+
+// Maps a radiator object from the server (full list entry or delta) to the UI format
+function toRadiator(r, index) {
+    return {
+        id: index,
+        temp: r.curr_temp,
+        mac: r.mac,
+        name: r.name,
+        ack: r.ack,
+        online: r.online
+    };
+}
+
+function radiatorStatus(radiator) {
+    if (radiator.online === false) return " (offline)";
+    if (radiator.ack === undefined) return "";
+    return radiator.ack ? " ✓" : " …";
+}
+
+// === Radiator table ===
+// One row per radiator, keyed by MAC, created once and then patched: only
+// cells whose text changed are written. Changes only schedule a render, so
+// any number of updates within one animation frame cost a single pass.
+const rows = new Map(); // key -> { row, cells, text, id }
+let renderPending = false;
+
+function scheduleRender() {
+    if (renderPending) return;
+    renderPending = true;
+    requestAnimationFrame(() => {
+        renderPending = false;
+        renderRadiators();
+    });
+}
+
+function createRow(key) {
+    const row = document.getElementById("radiator-row-template").content.firstElementChild.cloneNode(true);
+    const entry = {
+        row: row,
+        cells: {
+            name: row.querySelector(".name-cell"),
+            mac: row.querySelector(".mac-cell"),
+            temp: row.querySelector(".temp-cell")
+        },
+        text: {},
+        id: null
+    };
+    row.querySelector(".edit-button").onclick = () => editRadiator(entry.id);
+    rows.set(key, entry);
+    return entry;
+}
+
+function setCell(entry, cell, text) {
+    if (entry.text[cell] === text) return;
+    entry.text[cell] = text;
+    entry.cells[cell].textContent = text;
+}
+
+function searchQuery() {
+    return document.getElementById("searchQuery").value.toLowerCase();
+}
+
+function setRowVisible(entry, radiator, query) {
+    const hidden = !radiator.name.toLowerCase().includes(query);
+    if (entry.row.hidden !== hidden) entry.row.hidden = hidden;
+}
+
+function renderRadiators() {
+    const header = document.getElementById("column-names");
+    const query = searchQuery();
+    const seen = new Set();
+    let previous = header;
+
+    radiators.forEach(radiator => {
+        let key = radiator.mac || `#${radiator.id}`;
+        if (seen.has(key)) key += `#${radiator.id}`; // two radiators entered with the same MAC
+        seen.add(key);
+
+        const entry = rows.get(key) || createRow(key);
+        entry.id = radiator.id;
+        setCell(entry, "name", radiator.name);
+        setCell(entry, "mac", radiator.mac);
+        setCell(entry, "temp", radiator.temp + "°C" + radiatorStatus(radiator));
+        setRowVisible(entry, radiator, query);
+
+        // Rows follow the radiators' order, only misplaced ones are moved
+        if (previous.nextSibling !== entry.row) {
+            header.parentNode.insertBefore(entry.row, previous.nextSibling);
+        }
+        previous = entry.row;
+    });
+
+    rows.forEach((entry, key) => {
+        if (!seen.has(key)) {
+            entry.row.remove();
+            rows.delete(key);
+        }
+    });
+}
+
+function deleteRadiator(id) {
+    radiators = radiators.filter(r => r.id !== id);
+    scheduleRender();
+}
+
+// Filters by hiding rows, nothing is rebuilt
+function onSearch(){
+    const query = searchQuery();
+    radiators.forEach(radiator => {
+        const entry = rows.get(radiator.mac || `#${radiator.id}`);
+        if (entry) setRowVisible(entry, radiator, query);
+    });
+}
+
+function editRadiator(id) {
+    const radiator = radiators.find(r => r.id === id);
+    if (radiator) {
+        editModeId = id;
+        document.getElementById("newRadiatorName").value = radiator.name;
+        document.getElementById("newMac").value = radiator.mac;
+        document.getElementById("newTemperature").value = radiator.temp;
+        document.querySelector("#addModal h2").textContent = "Edit Radiator";
+        document.getElementById("modal-add").textContent = "Save";
+        document.getElementById("addModal").style.display = "block";
+    }
+}
+
+function disableSyncButton() {
+    const syncButton = document.getElementById("sync-button");
+    syncButton.disabled = true;  // Disable button
+    syncButton.textContent = "Synchronizing...";
+}
+
+function enableSyncButton() {
+    const syncButton = document.getElementById("sync-button");
+    syncButton.disabled = false;
+    syncButton.textContent = "Synchronize";
+}
+
+function synchronize() {
+    disableSyncButton();
+    console.log("Starting synchronization...");
+
+    fetch("/sync")
+        .then(response => response.text())
+        .then(data => {
+            console.log("Sync request sent:", data);
+        })
+        .catch(error => {
+            console.error("Error sending sync command:", error);
+            syncButton.disabled = false;
+            syncButton.textContent = "Synchronize";
+        });
+}
+
+
+function closeModal() {
+    document.getElementById("modal-add").textContent = "Add";
+    document.getElementById("addModal").style.display = "none";
+}
+// Everything the server sends over the WebSocket
+function handleMessage(text) {
+    let data;
+    try {
+        data = JSON.parse(text);
+    } catch (err) {
+        console.warn("Invalid JSON from WebSocket:", text);
+        return;
+    }
+
+    if (data.results !== undefined) {
+        onCommandResults(data);
+    } else if (data.result !== undefined) {
+        onCommandOutcome(data);
+    } else if (Array.isArray(data)) {
+        radiators = data.map(toRadiator);
+        enableSyncButton();
+        scheduleRender();
+    } else if (data.id !== undefined && data.mac !== undefined) {
+        // Delta for a single radiator pushed by the server
+        const updated = toRadiator(data, data.id);
+        const index = radiators.findIndex(r => r.id === data.id);
+        if (index === -1) {
+            radiators.push(updated);
+        } else {
+            radiators[index] = updated;
+        }
+        scheduleRender();
+    }
+}
+
+window.onload = function() {
+    updateTemperatureDisplay();
+
+    // esp-web answers this from its cache, no round trip to the server
+    fetch('/api/radiators')
+        .then(response => response.json())
+        .then(data => {
+            radiators = data.map(toRadiator);
+            scheduleRender();
+        })
+        .catch(err => console.warn("Could not load radiators:", err));
+
+// === WebSocket Setup ===
+    socket = new WebSocket(`ws://${window.location.host}/ws`);
+
+    socket.onopen = function () {
+        console.log("WebSocket connected");
+    };
+
+socket.onmessage = function (event) {
+    handleMessage(event.data);
+};
+
+    socket.onclose = function () {
+        console.log("WebSocket disconnected");
+    };
+
+    // Modal setup
+const modal = document.getElementById("addModal");
+const closeBtn = document.querySelector(".close");
+
+window.addRadiator = function () {
+    editModeId = null;
+    document.getElementById("newRadiatorName").value = "";
+    document.getElementById("newMac").value = "";
+    document.getElementById("newTemperature").value = "";
+    document.querySelector("#addModal h2").textContent = "Add New Radiator";
+    document.getElementById("addModal").style.display = "block";
+};
+
+window.submitNewRadiator = function () {
+    const newName = document.getElementById("newRadiatorName").value;
+    const newMAC = document.getElementById("newMac").value;
+    const newTemperature = parseInt(document.getElementById("newTemperature").value);
+
+    const macRegex = /^([0-9A-Fa-f]{2}[:-]?){5}[0-9A-Fa-f]{2}$/;
+    if (!macRegex.test(newMAC)) {
+        alert("Please enter a valid MAC address.");
+        return;
+    }
+
+    if (!newName) {
+        alert("Please enter a radiator name.");
+        return;
+    }
+    if (!newMAC) {
+        alert("Please enter a radiator MAC address.");
+        return;
+    }
+
+    if(!newTemperature) {
+        alert("Please enter temperature.");
+        return;
+    }
+
+    if(newTemperature < minTemp || newTemperature > maxTemp){
+        alert("Please enter valid temperature (8-28°C)");
+        return;
+    }
+
+    if (editModeId !== null) {
+        // Edit existing radiator
+        const radiator = radiators.find(r => r.id === editModeId);
+        if (radiator) {
+            const ops = [{ op: "temp", id: radiator.id, t: newTemperature }];
+            if (radiator.name !== newName) {
+                ops.push({ op: "name", id: radiator.id, name: newName });
+            }
+            sendOperations(ops);
+
+            radiator.name = newName;
+            radiator.mac = newMAC;
+            radiator.temp = newTemperature;
+        }
+    } else {
+        // Add new radiator
+        const newId = radiators.length ? Math.max(...radiators.map(r => r.id)) + 1 : 1;
+        radiators.push({ id: newId, name: newName, temp: newTemperature, mac: newMAC});
+    }
+
+    scheduleRender();
+    document.getElementById("addModal").style.display = "none";
+    document.getElementById("newRadiatorName").value = "";
+    document.getElementById("newMac").value = "";
+    document.getElementById("newTemperature").value = "";
+
+    editModeId = null;
+};
+
+closeBtn.onclick = function () {
+    modal.style.display = "none";
+    document.getElementById("modal-add").textContent = "Add";
+};
+
+window.onclick = function (event) {
+    if (event.target === modal) {
+        modal.style.display = "none";
+        document.getElementById("modal-add").textContent = "Add";
+    }
+};
+};
\ No newline at end of file
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Compares two micro_bench JSON results and flags regressions.
+
+A benchmark regresses when its cycles/op grew by more than the threshold
+(10% by default) or when it allocates more per operation than before.
+With --benchmark_repetitions the medians are compared, which keeps the
+shortest benchmarks (a few ns) from tripping the threshold on noise.
+Benchmarks only present in one file are listed but never fail the run.
+
+    ./micro_bench --benchmark_repetitions=5 --benchmark_out=new.json --benchmark_out_format=json
+    python3 Code/sim/bench_compare.py old.json new.json [--threshold 10]
+
+Exits 1 when anything regressed, so CI can fail the build on it.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    """Results by benchmark name; the medians when run with repetitions"""
+    with open(path) as f:
+        data = json.load(f)
+    runs = {}
+    medians = {}
+    for bench in data["benchmarks"]:
+        if bench.get("run_type", "iteration") == "iteration":
+            runs[bench["name"]] = bench
+        elif bench.get("aggregate_name") == "median":
+            medians[bench["run_name"]] = bench
+    return medians or runs
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("old")
+    parser.add_argument("new")
+    parser.add_argument("--threshold", type=float, default=10.0, help="allowed cycles/op growth in percent")
+    args = parser.parse_args()
+
+    old = load(args.old)
+    new = load(args.new)
+    regressions = 0
+
+    print(f"{'benchmark':36} {'cycles/op':>21} {'change':>8} {'allocs/op':>13}")
+    for name in sorted(set(old) | set(new)):
+        if name not in old or name not in new:
+            print(f"{name:36} {'only in ' + ('new' if name in new else 'old'):>21}")
+            continue
+
+        before, after = old[name], new[name]
+        cycles_before = before.get("cycles/op", before["cpu_time"])
+        cycles_after = after.get("cycles/op", after["cpu_time"])
+        change = (cycles_after - cycles_before) / cycles_before * 100 if cycles_before else 0.0
+        allocs_before = before.get("allocs/op", 0.0)
+        allocs_after = after.get("allocs/op", 0.0)
+
+        flags = []
+        if change > args.threshold:
+            flags.append("slower")
+        if allocs_after > allocs_before + 1e-9:
+            flags.append("allocates more")
+        regressions += bool(flags)
+
+        print(f"{name:36} {cycles_before:10.1f} {cycles_after:10.1f} {change:+7.1f}% "
+              f"{allocs_before:6.2f} {allocs_after:6.2f}  {', '.join(flags)}")
+
+    print(f"\n{regressions} regression(s)")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
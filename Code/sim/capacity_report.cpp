@@ -0,0 +1,86 @@
+// capacity_report.cpp
+// RAM each capacity preset in Capacity.h costs, from the sizeof of the real
+// classes. Built against one sketch at a time, the include path picks which
+// tables it reports:
+//
+//   g++ ... -I sim/shims -I esp-server sim/capacity_report.cpp   (server and radiator)
+//   g++ ... -I sim/shims -I esp-web sim/capacity_report.cpp      (esp-web)
+//
+// Sizes are for the host, pointers are 8 bytes here and 4 on the boards, so
+// the per-entry tables match and the fixed part comes out a little larger.
+#include <Arduino.h>
+#include <stdio.h>
+#include "Capacity.h"
+
+#if __has_include("RadiatorManager.h")
+#include "Communications.h"
+#include "RadiatorManager.h"
+#include "LoopWatchdog.h"
+
+template <typename Capacity>
+static void report(const char* name) {
+  size_t coms = sizeof(CommunicationsFor<Capacity>);
+  size_t manager = Capacity::radiators ? sizeof(RadiatorManagerFor<Capacity>) : 0;
+  printf("%-20s %5u %7u %9u %6u %9u %9u %9u %7u\n", name,
+         Capacity::peers, Capacity::txQueue, Capacity::neighbors,
+         Capacity::routes, Capacity::relaySeen, (unsigned)coms, (unsigned)manager, (unsigned)(coms + manager));
+}
+
+// RadiatorManagerFor refuses a preset without radiators
+template <>
+void report<RadiatorCapacity>(const char* name) {
+  size_t coms = sizeof(CommunicationsFor<RadiatorCapacity>);
+  printf("%-20s %5u %7u %9u %6u %9u %9u %9s %7u\n", name,
+         RadiatorCapacity::peers, RadiatorCapacity::txQueue, RadiatorCapacity::neighbors,
+         RadiatorCapacity::routes, RadiatorCapacity::relaySeen, (unsigned)coms, "-", (unsigned)coms);
+}
+
+int main() {
+  printf("%-20s %5s %7s %9s %6s %9s %9s %9s %7s\n", "preset", "peers", "txQueue",
+         "neighbors", "routes", "relaySeen", "coms B", "manager B", "total B");
+  report<RadiatorCapacity>("RadiatorCapacity");
+  report<ServerCapacity>("ServerCapacity");
+  report<LargeServerCapacity>("LargeServerCapacity");
+  // RadiatorTables: one array per field, plus a bit in each of the RADIATOR_SETS sets
+  size_t radiator = 6 + LINK_NAME_LEN + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(unsigned long) +
+                    sizeof(uint16_t) + sizeof(uint8_t);
+  printf("\nper entry: Peer %u B, TxEntry %u B, radiator %u B and %d bits, RadiatorLink %u B, RadiatorTelemetry %u B, "
+         "AuthSender %u B\n",
+         (unsigned)sizeof(Peer), (unsigned)sizeof(TxEntry), (unsigned)radiator, RADIATOR_SETS,
+         (unsigned)sizeof(RadiatorLink), (unsigned)sizeof(RadiatorTelemetry), (unsigned)sizeof(AuthSender));
+  printf("every board: LoopWatchdog %u B, and in RTC memory StallLog %u B and %u B per stall record\n",
+         (unsigned)sizeof(LoopWatchdog), (unsigned)sizeof(StallLog), (unsigned)sizeof(StallRecord));
+  return 0;
+}
+
+#elif __has_include("CommandQueue.h")
+#include "RadiatorCache.h"
+#include "CommandQueue.h"
+
+// Mirrors esp-web.ino, which sizes its UART line and JSON pool from the preset
+#define RADIATOR_JSON_LEN 110
+#define RADIATOR_JSON_DOC_SIZE 200
+
+template <typename Capacity>
+static void report(const char* name) {
+  size_t cache = sizeof(RadiatorCacheFor<Capacity>);
+  size_t commands = sizeof(CommandQueueFor<Capacity>);
+  size_t line = Capacity::radiators * RADIATOR_JSON_LEN + 2;
+  size_t doc = Capacity::radiators * RADIATOR_JSON_DOC_SIZE + 64;
+  // the line buffer is held three times: message, tunnelReader and serialLine
+  size_t total = cache + commands + 3 * line + doc;
+  printf("%-20s %10u %7u %10u %9u %7u %7u\n", name, Capacity::radiators, (unsigned)cache,
+         (unsigned)commands, (unsigned)line, (unsigned)doc, (unsigned)total);
+}
+
+int main() {
+  printf("%-20s %10s %7s %10s %9s %7s %7s\n", "preset", "radiators", "cache B", "commands B",
+         "line B", "json B", "total B");
+  report<ServerCapacity>("ServerCapacity");
+  report<LargeServerCapacity>("LargeServerCapacity");
+  return 0;
+}
+
+#else
+#error "build with -I esp-server or -I esp-web"
+#endif
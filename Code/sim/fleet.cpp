@@ -0,0 +1,1217 @@
+// fleet.cpp
+// The whole system on one virtual clock: esp-server's Communications,
+// RadiatorManager, RadiatorCommands and WebComs, and any number of
+// radiators running esp-radiator.ino, over a shared radio channel that
+// loses frames at a seeded rate. Nothing waits for real time, so minutes of
+// a large house take seconds, and the same seed gives the same run.
+//
+// Every board runs the same Communications class, which keeps its state in
+// one object reached through a static instance. radiator_node.cpp's globals
+// are that object plus the stepper and loop watchdog; a board is entered
+// by swapping its saved state into them, and pointing simNvs at its flash,
+// and left by swapping it back out. Only the Communications base moves: it points at tables sized
+// for the board's role (Capacity.h), which stay where they are.
+// Radiators block in delay() (discovery waits 5 s between broadcasts), so
+// each runs as a coroutine on its own stack, and delay() hands control back
+// to the event loop until the board's wake-up time.
+//
+// With -a the boards are spread over a house of that length, the server at
+// one end, and each link gets an RSSI from distance and a fixed shadowing;
+// a transmission is lost at the -l rate or more often the weaker the link.
+// -r turns on Communications' relaying on every board, -w and -p set every
+// board's transmit window and pacing interval (0: none), -L gives the server
+// LargeServerCapacity instead of ServerCapacity.
+//
+// -t turns on time sync, the server as master and each radiator once it
+// knows the server, like TIME_SYNC 1. Every board then gets its own clock,
+// started at a random point of micros()' 32-bit range and off by up to -d
+// ppm (the server's restarts from 0 on reboot), and each received frame is
+// held back by up to -j us, the Wi-Fi task being busy. Once a second the
+// simulation compares every radiator's network time with the server's clock.
+//
+// -c records the server's radio traffic since its last boot, like
+// RADIO_CAPTURE 1, and writes the dump to a file for replay.cpp.
+//
+// -D has every board broadcast the name-based discovery, like
+// LEGACY_DISCOVERY 1 during an update from firmware without device classes.
+//
+// -k signs every frame on every board with one key, like FRAME_AUTH 1, and
+// reports what each side accepted and dropped.
+//
+// -P has the Wi-Fi task cut in: while a board is in esp_now_send(), its
+// receive and send callbacks due before the frame is off the air run there
+// and then, so frames are queued and window slots freed while loop() or
+// another callback is pumping the transmit queue.
+//
+//   ./fleet [-n radiators] [-l loss %] [-a house length m] [-r] [-w window] [-p pacing us] [-L]
+//           [-t] [-j jitter us] [-d ppm] [-c capture file] [-D] [-k] [-P] [-s seed]
+//           [-v] [step@seconds ...]
+//
+// A step is "reboot" (restarts the server), "replay" (the radiator that got
+// the server's last setpoint restarts, and someone who recorded the frame
+// sends it again at once and a second later), "end",
+// or a line esp-web would send over the UART, e.g. ALL/T/21/1. Without steps the run is
+//   -n 200 -l 5 -s 1 reboot@30 ALL/T/21/1@60 end@180
+#include <Arduino.h>
+#include <AccelStepper.h>
+#include <Preferences.h>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <new>
+#include <queue>
+#include <string>
+#include <vector>
+#include <ucontext.h>
+#include "Communications.h"
+#include "Messages.h"
+#include "RadiatorManager.h"
+#include "RadiatorCommands.h"
+#include "WebComs.h"
+#include "Stats.h"
+#include "LoopWatchdog.h"
+
+// radiator_node.cpp
+extern CommunicationsFor<RadiatorCapacity> coms;
+extern AccelStepper stepper;
+extern LoopWatchdog watchdog;
+extern StallLog stallLog;
+extern StallRecord stallRing[];
+void setup();
+void loop();
+
+#define SIM_UNICAST_TRIES 7 // transmissions of a unicast frame before the driver reports a failure (assumed)
+#define SIM_DRIVER_QUEUE 8 // frames the driver holds before esp_now_send fails with ESP_ERR_ESPNOW_NO_MEM (assumed)
+#define SIM_PHY_US 192 // long preamble and PLCP header at 1 Mbps
+#define SIM_FRAME_OVERHEAD 43 // bytes around an ESP-NOW payload: action frame header, vendor element, FCS
+#define SIM_ACK_US 314 // SIFS and the MAC ack at 1 Mbps, or the wait for it
+#define SIM_DIFS_US 50
+#define SIM_SLOT_US 9
+#define SIM_CW_MIN 15 // contention window slots, doubled on every retry
+#define SIM_RADIATOR_LOOP_MS 20 // loop() of a radiator only runs the stepper, which keeps time by itself
+#define SIM_BOOT_SPREAD_MS 5000 // radiators power up at random times within this window
+#define SIM_STACK_SIZE (64 * 1024)
+#define SIM_STACK_FILL 0xA5
+#define SIM_HOUSE_DEPTH_M 12 // the house is -a meters long and this deep
+#define SIM_RSSI_AT_1M -40 // dBm
+#define SIM_PATH_LOSS_EXPONENT 3.3 // indoors, through walls
+#define SIM_SHADOWING_DB 4 // standard deviation of the fixed per-link offset
+#define SIM_RSSI_NOISE_DB 2 // reported RSSI varies by up to this per frame
+#define SIM_PER_MIDPOINT_DBM -90 // half of the transmissions at this RSSI are lost
+#define SIM_PER_SLOPE_DB 1.5
+#define SIM_IN_RANGE_RSSI -60 // every link without -a
+#define SIM_IN_SYNC_US 1000 // a radiator's network time this close to the server's clock counts as synced
+#define SIM_STALL_RECORDS 8 // STALL_RECORDS in esp-radiator.ino
+#define SIM_CAPTURE_RECORDS 16384 // the server's capture ring with -c, 1.5 MB
+
+// === Heap accounting ===
+// Allocations are charged to the board that is entered when they happen
+
+struct HeapCounter {
+  int64_t now = 0;
+  int64_t peak = 0;
+};
+
+struct alignas(16) HeapBlock {
+  HeapCounter* owner;
+  size_t size;
+};
+
+static HeapCounter* heapOwner = nullptr;
+
+void* operator new(size_t size) {
+  HeapBlock* block = (HeapBlock*)malloc(sizeof(HeapBlock) + size);
+  if (!block) throw std::bad_alloc();
+  block->owner = heapOwner;
+  block->size = size;
+  if (heapOwner) {
+    heapOwner->now += size;
+    heapOwner->peak = max(heapOwner->peak, heapOwner->now);
+  }
+  return block + 1;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return operator new(size);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  if (!p) return;
+  HeapBlock* block = (HeapBlock*)p - 1;
+  if (block->owner) block->owner->now -= block->size;
+  free(block);
+}
+
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+// === Boards ===
+
+enum FrameKind : uint8_t {
+  FRAME_DISCOVERY,
+  FRAME_DISCOVERY_REPLY,
+  FRAME_NAME, // name requests and replies
+  FRAME_SETPOINT,
+  FRAME_ACK,
+  FRAME_BEACON,
+  FRAME_OTHER,
+  FRAME_KIND_COUNT
+};
+
+static const char* frameKindNames[FRAME_KIND_COUNT] = { "discovery", "discovery reply", "name", "setpoint", "ack", "beacon",
+                                                             "other" };
+
+struct Board {
+  int id; // 0 is the server, radiators count from 1
+  uint8_t mac[6];
+  double x = 0, y = 0; // meters
+  bool powered = false;
+
+  // Saved state while another board is entered
+  SimClock clock = {};
+  std::shared_ptr<Communications> coms; // a CommunicationsFor this board's role
+  AccelStepper stepper;
+  SimNvs nvs; // its flash, for every Preferences it opens
+  LoopWatchdog watchdog;
+  StallLog stallLog = {};
+  std::vector<StallRecord> stallRing = std::vector<StallRecord>(SIM_STALL_RECORDS);
+
+  ucontext_t context;
+  std::vector<uint8_t> stack;
+  int boots = 0; // a delay() of an earlier boot never returns
+
+  HeapCounter* heap;
+  int inFlight = 0; // frames handed to the driver and not yet reported sent
+  int inFlightPeak = 0;
+
+  uint8_t appliedTemp = 0; // last setpoint the radiator acked
+  bool setForCommand = false;
+};
+
+struct Server {
+  std::shared_ptr<RadiatorManager> table; // a RadiatorManagerFor the server's preset
+  RadiatorManager& manager;
+  RadiatorCommands commands;
+  WebComs web;
+
+  Server(HardwareSerial& uart, std::shared_ptr<RadiatorManager> created)
+    : table(created), manager(*created), commands(manager), web(uart, manager, commands) {}
+};
+
+static std::vector<HeapCounter> heaps; // declared before boards, which free into them on exit
+static std::vector<Board> boards;
+static std::unique_ptr<Server> server;
+static HardwareSerial uart; // esp-server's end of the link to esp-web
+static std::string uartOut;
+static size_t uartBytes = 0;
+
+static bool relaying = false; // -r
+static int txWindow = TX_WINDOW; // -w
+static uint32_t txPaceUs = TX_PACE_US; // -p
+static bool largeServer = false; // -L
+static bool timeSync = false; // -t
+static uint32_t jitterUs = 0; // -j
+static double clockPpm = 20; // -d
+static std::string capturePath; // -c
+static std::vector<CaptureRecord> captureRing;
+static bool legacyDiscovery = false; // -D
+static bool frameAuth = false; // -k
+static bool preempt = false; // -P
+static uint32_t preempted = 0; // callbacks run inside esp_now_send()
+static const uint8_t authKey[AUTH_KEY_BYTES] = { 0x6B, 0x1F, 0xD2, 0x47, 0x90, 0x3C, 0xA5, 0x0E,
+                                                 0x81, 0xF4, 0x29, 0xB7, 0x5D, 0xC6, 0x12, 0x7A };
+
+static Board* entered = nullptr;
+static Board* running = nullptr; // radiator whose coroutine is executing
+static ucontext_t schedulerContext;
+
+static void swapState(Board& board) {
+  std::swap(simClock, board.clock);
+  std::swap<Communications>(coms, *board.coms);
+  std::swap(stepper, board.stepper);
+  std::swap(watchdog, board.watchdog);
+  std::swap(stallLog, board.stallLog);
+  std::swap_ranges(stallRing, stallRing + SIM_STALL_RECORDS, board.stallRing.begin());
+}
+
+static void enter(Board& board) {
+  swapState(board);
+  memcpy(simEspNow.mac, board.mac, 6);
+  simNvs = &board.nvs;
+  entered = &board;
+  heapOwner = board.heap;
+}
+
+static void leave(Board& board) {
+  swapState(board);
+  simNvs = &simDefaultNvs;
+  entered = nullptr;
+  heapOwner = nullptr;
+}
+
+template <typename F>
+static void runOn(Board& board, F work) {
+  if (entered == &board) {
+    work(); // a callback cutting in on the board (-P)
+    return;
+  }
+  enter(board);
+  work();
+  leave(board);
+}
+
+static Board* findBoard(const uint8_t* mac) {
+  for (Board& board : boards) {
+    if (memcmp(board.mac, mac, 6) == 0) return &board;
+  }
+  return nullptr;
+}
+
+// === Events ===
+
+struct Event {
+  uint64_t at;
+  uint64_t seq; // keeps events at the same time in the order they were made
+  std::function<void()> run;
+  int wifiTask; // board whose Wi-Fi task runs it, or -1
+  bool operator<(const Event& other) const { return at != other.at ? at > other.at : seq > other.seq; }
+};
+
+static std::priority_queue<Event> events;
+static uint64_t eventSeq = 0;
+
+static void schedule(uint64_t at, std::function<void()> run, int wifiTask = -1) {
+  HeapCounter* owner = heapOwner;
+  heapOwner = nullptr;
+  events.push({ at, eventSeq++, std::move(run), wifiTask });
+  heapOwner = owner;
+}
+
+// Deterministic and the same on every host, unlike <random> distributions
+static uint64_t rngState = 1;
+static uint32_t rng() {
+  rngState = rngState * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t)(rngState >> 33);
+}
+
+static double uniform() { return rng() / 2147483648.0; }
+
+static uint32_t lossPerMillion = 0;
+static std::vector<std::vector<int>> linkRssi; // [from][to] in dBm
+static std::vector<std::vector<uint32_t>> linkLossPerMillion;
+static bool spread = false; // boards laid out with -a
+
+// Places the boards and gives every link its RSSI and loss rate
+static void layOut(double houseLength) {
+  size_t count = boards.size();
+  linkRssi.assign(count, std::vector<int>(count, SIM_IN_RANGE_RSSI));
+  linkLossPerMillion.assign(count, std::vector<uint32_t>(count, lossPerMillion));
+  if (houseLength <= 0) return;
+  spread = true;
+
+  boards[0].x = 0;
+  boards[0].y = SIM_HOUSE_DEPTH_M / 2.0;
+  for (size_t i = 1; i < count; i++) {
+    boards[i].x = uniform() * houseLength;
+    boards[i].y = uniform() * SIM_HOUSE_DEPTH_M;
+  }
+
+  for (size_t a = 0; a < count; a++) {
+    for (size_t b = a + 1; b < count; b++) {
+      double distance = max(1.0, hypot(boards[a].x - boards[b].x, boards[a].y - boards[b].y));
+      double shadowing = sqrt(-2 * log(max(uniform(), 1e-9))) * cos(2 * M_PI * uniform()) * SIM_SHADOWING_DB;
+      int rssi = (int)lround(SIM_RSSI_AT_1M - 10 * SIM_PATH_LOSS_EXPONENT * log10(distance) + shadowing);
+      double per = 1 / (1 + exp((rssi - SIM_PER_MIDPOINT_DBM) / SIM_PER_SLOPE_DB));
+      double loss = 1 - (1 - per) * (1 - lossPerMillion / 1e6);
+      linkRssi[a][b] = linkRssi[b][a] = rssi;
+      linkLossPerMillion[a][b] = linkLossPerMillion[b][a] = (uint32_t)(loss * 1000000);
+    }
+  }
+}
+
+static bool lost(int from, int to) { return rng() % 1000000 < linkLossPerMillion[from][to]; }
+
+// === Radio ===
+
+struct KindStats {
+  uint32_t frames = 0;
+  uint32_t transmissions = 0;
+  uint32_t failed = 0; // unicast frames the driver reported as not delivered
+  uint64_t airtimeUs = 0;
+};
+
+static KindStats kindStats[FRAME_KIND_COUNT];
+static uint32_t relayedFrames = 0; // relayed messages handed to the driver, each hop counted
+static uint32_t forwardedFrames = 0; // of those, sent on by a radiator in between
+static uint32_t driverRefused = 0; // esp_now_send calls refused for lack of driver buffers
+static uint64_t channelBusyUntil = 0;
+static uint64_t channelBusyUs = 0;
+static std::vector<uint8_t> lastSetpointFrame; // the server's, for the replay step
+static int lastSetpointTo = 0;
+
+// The message a frame carries, looking inside relayed ones; origin is
+// nullptr unless relayed
+static bool unwrap(const uint8_t*& data, size_t& len, const uint8_t** origin) {
+  *origin = nullptr;
+  if (len < sizeof(MessageHeader)) return false;
+  const MessageHeader* header = (const MessageHeader*)data;
+  size_t trailerSize = Communications::trailerLength(*header);
+  if (len < sizeof(MessageHeader) + trailerSize) return false;
+  len -= trailerSize; // a signed frame's AuthTrailer is not part of the message
+  if (header->type != RELAY_FORWARD_MSG_TYPE) return true;
+  size_t headerSize = Communications::headerLength(*header);
+  if (len < headerSize + sizeof(RelayHeader)) return false;
+
+  const RelayHeader* relay = (const RelayHeader*)(data + headerSize);
+  static uint8_t inner[250];
+  MessageHeader innerHeader = { MESSAGE_MAGIC, relay->type, relay->length };
+  memcpy(inner, &innerHeader, sizeof(innerHeader));
+  memcpy(inner + sizeof(innerHeader), relay + 1, min((size_t)relay->length, sizeof(inner) - sizeof(innerHeader)));
+  *origin = relay->origin;
+  data = inner;
+  len = sizeof(innerHeader) + relay->length;
+  return true;
+}
+
+static FrameKind classify(const uint8_t* data, size_t len, bool broadcast) {
+  const uint8_t* origin;
+  if (!unwrap(data, len, &origin)) return FRAME_OTHER;
+  const MessageHeader* header = (const MessageHeader*)data;
+  switch (header->type) {
+    case DISCOVERY_MSG_TYPE:
+    case DISCOVERY_COMPACT_MSG_TYPE: return broadcast ? FRAME_DISCOVERY : FRAME_DISCOVERY_REPLY;
+    case NAME_REQUEST_MSG_TYPE:
+    case NAME_REPLY_MSG_TYPE: return FRAME_NAME;
+    case MSG_TYPE_TEMPERATURE_COMMAND: return FRAME_SETPOINT;
+    case MSG_TYPE_TEMPERATURE_RESPONSE: return FRAME_ACK;
+    case RELAY_BEACON_MSG_TYPE: return FRAME_BEACON;
+    default: return FRAME_OTHER;
+  }
+}
+
+static uint32_t attemptUs(size_t len, int attempt) {
+  uint32_t window = min(SIM_CW_MIN << (attempt - 1), 1023);
+  return SIM_DIFS_US + (rng() % (window + 1)) * SIM_SLOT_US + SIM_PHY_US + (SIM_FRAME_OVERHEAD + len) * 8;
+}
+
+// One-way latency of timed frames as the simulation saw it, for the receivers' TimeStats to be checked
+// against; like them it leaves out frames slower than TIME_SYNC_STEP_US
+struct HopTruth {
+  uint32_t samples = 0;
+  uint64_t totalUs = 0;
+  uint64_t minUs = UINT64_MAX;
+  uint64_t maxUs = 0;
+};
+
+static HopTruth hopTruth[2]; // received by the server, by radiators
+
+// The Wi-Fi task is busy with something else for a while
+static uint64_t rxJitter() { return jitterUs ? rng() % (jitterUs + 1) : 0; }
+
+static void deliver(int to, int from, std::vector<uint8_t> frame, uint64_t sentAt) {
+  Board& board = boards[to];
+  if (!board.powered) return;
+
+  // Counted the way Communications counts: a stamped frame reaching a synced board
+  const MessageHeader* header = (const MessageHeader*)frame.data();
+  uint32_t stamp = 0;
+  if (Communications::headerLength(*header) == sizeof(TimedHeader)) memcpy(&stamp, frame.data() + sizeof(MessageHeader), sizeof(stamp));
+  uint64_t latency = simMicros - sentAt;
+  if (stamp != 0 && board.coms->isTimeSynced() && latency <= TIME_SYNC_STEP_US) {
+    HopTruth& truth = hopTruth[to == 0 ? 0 : 1];
+    truth.samples++;
+    truth.totalUs += latency;
+    truth.minUs = min(truth.minUs, latency);
+    truth.maxUs = max(truth.maxUs, latency);
+  }
+
+  wifi_pkt_rx_ctrl_t rxCtrl = {};
+  rxCtrl.rssi = linkRssi[from][to];
+  if (spread) rxCtrl.rssi += (int)(rng() % (2 * SIM_RSSI_NOISE_DB + 1)) - SIM_RSSI_NOISE_DB;
+  rxCtrl.channel = 1;
+  runOn(board, [&]() {
+    esp_now_recv_info_t info = { boards[from].mac, board.mac, &rxCtrl };
+    simEspNow.onReceive(&info, frame.data(), frame.size());
+  });
+}
+
+static void reportSent(int from, const std::array<uint8_t, 6>& to, bool delivered) {
+  Board& board = boards[from];
+  board.inFlight--;
+  if (!board.powered) return;
+
+  runOn(board, [&]() { simEspNow.onSent(to.data(), delivered ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL); });
+}
+
+static void observeFrame(Board& from, FrameKind kind, const uint8_t* data, size_t len);
+
+// -P: the board's Wi-Fi task runs its callbacks due by until, early, from
+// inside esp_now_send(). The clock stays where it is. Called with no heap
+// owner, the callbacks' allocations are the board's.
+static void cutIn(Board& board, uint64_t until) {
+  static bool inside = false; // the callbacks' own sends only queue, but to be sure
+  if (inside) return;
+  inside = true;
+
+  std::vector<Event> others;
+  while (!events.empty() && events.top().at <= until) {
+    Event event = events.top();
+    events.pop();
+    if (event.wifiTask == board.id) {
+      preempted++;
+      heapOwner = board.heap;
+      event.run();
+      heapOwner = nullptr;
+    } else {
+      others.push_back(std::move(event));
+    }
+  }
+  for (Event& event : others) events.push(std::move(event));
+
+  inside = false;
+}
+
+// esp_now_send() of the entered board. The channel carries one
+// transmission at a time; a unicast frame is repeated until the receiver's
+// MAC ack gets back or the tries run out, a broadcast goes out once.
+static esp_err_t transmit(const uint8_t* to, const uint8_t* data, size_t len) {
+  HeapCounter* owner = heapOwner;
+  heapOwner = nullptr;
+
+  Board& from = *entered;
+  if (from.inFlight >= SIM_DRIVER_QUEUE) {
+    driverRefused++;
+    heapOwner = owner;
+    return ESP_ERR_ESPNOW_NO_MEM;
+  }
+
+  bool broadcast = memcmp(to, Communications::broadcastAddr, 6) == 0;
+  FrameKind kind = classify(data, len, broadcast);
+  KindStats& stats = kindStats[kind];
+  stats.frames++;
+  observeFrame(from, kind, data, len);
+  if (len >= sizeof(MessageHeader) && ((const MessageHeader*)data)->type == RELAY_FORWARD_MSG_TYPE) {
+    relayedFrames++;
+    const uint8_t* origin;
+    const uint8_t* inner = data;
+    size_t innerLen = len;
+    if (unwrap(inner, innerLen, &origin) && memcmp(origin, from.mac, 6) != 0) forwardedFrames++;
+  }
+
+  from.inFlight++;
+  from.inFlightPeak = max(from.inFlightPeak, from.inFlight);
+
+  std::vector<uint8_t> frame(data, data + len);
+  uint64_t sentAt = simMicros;
+  uint64_t start = max(simMicros, channelBusyUntil);
+  uint64_t t = start;
+  bool acked = false;
+
+  if (broadcast) {
+    t += attemptUs(len, 1);
+    stats.transmissions++;
+    for (Board& board : boards) {
+      if (&board != &from && !lost(from.id, board.id)) {
+        schedule(t + rxJitter(), [id = board.id, src = from.id, frame, sentAt]() { deliver(id, src, frame, sentAt); }, board.id);
+      }
+    }
+    acked = true;
+  } else {
+    Board* dest = findBoard(to);
+    if (dest && from.id == 0 && kind == FRAME_SETPOINT) {
+      lastSetpointFrame = frame;
+      lastSetpointTo = dest->id;
+    }
+    bool delivered = false;
+    for (int attempt = 1; attempt <= SIM_UNICAST_TRIES && !acked; attempt++) {
+      t += attemptUs(len, attempt);
+      stats.transmissions++;
+      bool received = dest && dest->powered && !lost(from.id, dest->id);
+      if (received && !delivered) {
+        delivered = true; // retransmissions of a frame already received are dropped by the MAC
+        schedule(t + rxJitter(), [id = dest->id, src = from.id, frame, sentAt]() { deliver(id, src, frame, sentAt); }, dest->id);
+      }
+      t += SIM_ACK_US;
+      acked = received && !lost(dest->id, from.id);
+    }
+    if (!acked) stats.failed++;
+  }
+
+  stats.airtimeUs += t - start;
+  channelBusyUs += t - start;
+  channelBusyUntil = t;
+
+  std::array<uint8_t, 6> dest;
+  memcpy(dest.data(), to, 6);
+  schedule(t, [src = from.id, dest, acked]() { reportSent(src, dest, acked); }, from.id);
+
+  if (preempt) cutIn(from, t);
+  heapOwner = owner;
+  return ESP_OK;
+}
+
+// === Radiators ===
+
+static void resume(Board& board) {
+  enter(board);
+  running = &board;
+  swapcontext(&schedulerContext, &board.context);
+  running = nullptr;
+  leave(board);
+}
+
+// delay() on a radiator: sleep until the wake-up time and let everything else run
+static void boardDelay(unsigned long ms) {
+  Board* board = running;
+  if (!board) return; // the server and the radio callbacks never wait
+
+  schedule(simMicros + ms * 1000ULL, [board, boot = board->boots]() {
+    if (board->boots == boot) resume(*board);
+  });
+  swapcontext(&board->context, &schedulerContext);
+}
+
+static void radiatorMain() {
+  setup();
+  for (;;) {
+    loop();
+    delay(SIM_RADIATOR_LOOP_MS);
+  }
+}
+
+static void bootRadiator(Board& board) {
+  board.powered = true;
+  if (relaying) board.coms->enableRelay(); // what MESH_RELAY 1 does in setup()
+  if (timeSync) {
+    // What TIME_SYNC 1 does in setup() once discoverServer() returns
+    board.coms->setDiscoveryHandler([](const Peer& peer) {
+      if (peer.deviceClass == DEVICE_CLASS_SERVER) coms.enableTimeSync(peer.mac);
+    });
+  }
+  board.coms->setTxWindow(txWindow);
+  board.coms->setTxPacing(TX_BURST, txPaceUs);
+  if (legacyDiscovery) board.coms->setLegacyDiscovery(true); // what LEGACY_DISCOVERY 1 does in setup()
+  if (frameAuth) runOn(board, []() { coms.enableAuth(authKey); }); // what FRAME_AUTH 1 does in setup()
+  board.stack.assign(SIM_STACK_SIZE, SIM_STACK_FILL);
+  getcontext(&board.context);
+  board.context.uc_stack.ss_sp = board.stack.data();
+  board.context.uc_stack.ss_size = board.stack.size();
+  board.context.uc_link = &schedulerContext;
+  makecontext(&board.context, radiatorMain, 0);
+  resume(board);
+}
+
+// A watchdog reset: RAM starts over, NVS and RTC memory keep their values
+static void restartRadiator(Board& board) {
+  board.boots++;
+  board.coms = std::make_shared<CommunicationsFor<RadiatorCapacity>>();
+  bootRadiator(board);
+}
+
+static size_t stackUsed(const Board& board) {
+  size_t untouched = 0;
+  while (untouched < board.stack.size() && board.stack[untouched] == SIM_STACK_FILL) untouched++;
+  return board.stack.size() - untouched;
+}
+
+// === Server ===
+
+static void onServerReceive(const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
+  if (type == MSG_TYPE_TEMPERATURE_RESPONSE && len == sizeof(TemperatureResponse)) {
+    TemperatureResponse payload;
+    memcpy(&payload, data, sizeof(payload));
+    server->manager.processTemperatureResponse(mac, payload);
+  } else if (type == MSG_TYPE_RADIATOR_TELEMETRY && len == sizeof(RadiatorTelemetry)) {
+    RadiatorTelemetry payload;
+    memcpy(&payload, data, sizeof(payload));
+    server->manager.processTelemetry(mac, payload);
+  }
+}
+
+static void onServerSent(const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
+  server->manager.processSendStatus(mac, type, status);
+  STATS_COUNT(status == ESP_NOW_SEND_SUCCESS ? COUNTER_FRAMES_SENT : COUNTER_FRAMES_FAILED);
+}
+
+static void onServerDiscovery(const Peer& peer) {
+  if (peer.deviceClass == DEVICE_CLASS_RADIATOR) {
+    server->manager.handleDiscovery(peer);
+  }
+}
+
+// The communication part of esp-server.ino's setup(), on a fresh board
+static void bootServer() {
+  Board& board = boards[0];
+  board.powered = true;
+  server.reset();
+  if (largeServer) {
+    board.coms = std::make_shared<CommunicationsFor<LargeServerCapacity>>();
+    server.reset(new Server(uart, std::make_shared<RadiatorManagerFor<LargeServerCapacity>>(coms)));
+  } else {
+    board.coms = std::make_shared<CommunicationsFor<ServerCapacity>>();
+    server.reset(new Server(uart, std::make_shared<RadiatorManagerFor<ServerCapacity>>(coms)));
+  }
+  uart.simRx.clear();
+
+  runOn(board, []() {
+    coms.begin();
+    coms.setName("server");
+    coms.setDeviceClass(DEVICE_CLASS_SERVER);
+    coms.setLegacyDiscovery(legacyDiscovery);
+    if (frameAuth) coms.enableAuth(authKey);
+    coms.setReceiveHandler(onServerReceive);
+    coms.setSendHandler(onServerSent);
+    coms.setDiscoveryHandler(onServerDiscovery);
+    if (relaying) coms.enableRelay(true);
+    if (timeSync) coms.enableTimeSync();
+    if (!captureRing.empty()) coms.enableCapture(captureRing.data(), captureRing.size());
+    coms.setTxWindow(txWindow);
+    coms.setTxPacing(TX_BURST, txPaceUs);
+    coms.broadcastDiscovery();
+  });
+}
+
+// === Scenario ===
+
+struct Step {
+  double at; // seconds
+  std::string what;
+};
+
+struct CommandRun {
+  std::string line;
+  uint64_t at;
+  int setpoint;
+  std::string done; // WebComs' {"done":..} line
+  int set = 0; // radiators that acked the setpoint
+  uint64_t lastSetAt = 0;
+  uint64_t serverAckedAt = 0; // every adopted radiator shown as acked at the setpoint
+  uint64_t settledAt = 0; // every valve at its target
+  std::vector<uint64_t> ackedAt; // per radiator adopted when it was issued, when the server saw its ack
+};
+
+static std::vector<CommandRun> commands;
+static int radiatorCount = 200;
+
+static void observeFrame(Board& from, FrameKind kind, const uint8_t* data, size_t len) {
+  const uint8_t* origin;
+  if (kind != FRAME_ACK || from.id == 0 || !unwrap(data, len, &origin)) return;
+  size_t headerSize = Communications::headerLength(*(const MessageHeader*)data);
+  if ((origin && memcmp(origin, from.mac, 6) != 0) || len != headerSize + sizeof(TemperatureResponse)) return;
+
+  TemperatureResponse response;
+  memcpy(&response, data + headerSize, sizeof(response));
+  from.appliedTemp = response.temperature;
+
+  if (commands.empty()) return;
+  CommandRun& command = commands.back();
+  if (!from.setForCommand && response.temperature == command.setpoint) {
+    from.setForCommand = true;
+    command.set++;
+    command.lastSetAt = simMicros;
+  }
+}
+
+// The recorded setpoint frame again, and what its radiator made of it
+static void replaySetpoint() {
+  Board& board = boards[lastSetpointTo];
+  AuthStats before = board.coms->getAuthStats();
+  deliver(board.id, 0, lastSetpointFrame, simMicros);
+  const AuthStats& after = board.coms->getAuthStats();
+
+  const char* fate = "taken, frames are not signed";
+  if (frameAuth) {
+    fate = after.accepted > before.accepted ? "accepted"
+           : after.unsynced > before.unsynced ? "dropped, no counter from the server since the restart"
+           : after.replayed > before.replayed ? "dropped as replayed"
+                                              : "dropped";
+  }
+  printf("%9.3f s  server's last setpoint frame sent to radiator %d again: %s\n", simMicros / 1e6, board.id, fate);
+}
+
+static void issueCommand(const std::string& line) {
+  CommandRun command = { line, simMicros, -1 };
+  if (line.rfind("ALL/T/", 0) == 0) command.setpoint = atoi(line.c_str() + 6);
+  command.ackedAt.assign(server->manager.getNumRadiators(), 0);
+  commands.push_back(command);
+  for (Board& board : boards) board.setForCommand = false;
+
+  uart.simRx += line + "\n";
+}
+
+static void readUart() {
+  uartBytes += uartOut.size();
+  size_t start = 0;
+  size_t end;
+  while ((end = uartOut.find('\n', start)) != std::string::npos) {
+    std::string line = uartOut.substr(start, end - start);
+    if (line.rfind("{\"done\"", 0) == 0 && !commands.empty()) {
+      commands.back().done = line.substr(0, line.find_last_not_of("\r") + 1);
+      printf("%9.3f s  %s\n", simMicros / 1e6, commands.back().done.c_str());
+    }
+    start = end + 1;
+  }
+  uartOut.erase(0, start);
+}
+
+static void checkConvergence() {
+  if (commands.empty() || commands.back().setpoint < 0) return;
+  CommandRun& command = commands.back();
+  const RadiatorManager& manager = server->manager;
+
+  for (size_t i = 0; i < command.ackedAt.size() && (int)i < manager.getNumRadiators(); i++) {
+    if (command.ackedAt[i] == 0 && manager.isAcked(i) && manager.getRadiatorTemperature(i) == command.setpoint) {
+      command.ackedAt[i] = simMicros;
+    }
+  }
+
+  if (command.serverAckedAt == 0 && manager.getNumRadiators() > 0 && manager.isAllAcked()) {
+    bool atSetpoint = true;
+    for (int i = 0; i < manager.getNumRadiators(); i++) {
+      atSetpoint = atSetpoint && manager.getRadiatorTemperature(i) == command.setpoint;
+    }
+    if (atSetpoint) command.serverAckedAt = simMicros;
+  }
+
+  if (command.settledAt == 0 && command.set == radiatorCount) {
+    bool settled = true;
+    for (int i = 1; i <= radiatorCount && settled; i++) {
+      settled = boards[i].stepper.distanceToGo() == 0;
+    }
+    if (settled) command.settledAt = simMicros;
+  }
+}
+
+// === Time sync ===
+
+// From a start or a reboot of the server until every radiator that knows it keeps its clock again
+struct SyncPeriod {
+  const char* what;
+  uint64_t from;
+  uint64_t inSyncAt;
+};
+
+static std::vector<SyncPeriod> syncPeriods;
+static std::vector<double> clockErrors; // us, radiators that consider themselves synced
+static uint32_t staleSamples = 0; // of those, off by a master restart
+
+// Every second: each radiator's network time against the server's micros()
+static void sampleClocks() {
+  uint32_t master = 0;
+  runOn(boards[0], [&]() { master = micros(); });
+
+  bool allInSync = true;
+  for (int i = 1; i <= radiatorCount; i++) {
+    Board& board = boards[i];
+    if (!board.powered || !board.coms->getPeerByClass(DEVICE_CLASS_SERVER)) continue;
+
+    bool synced = false;
+    uint32_t network = 0;
+    runOn(board, [&]() {
+      synced = coms.isTimeSynced();
+      network = coms.networkMicros();
+    });
+
+    int32_t error = network - master;
+    allInSync = allInSync && synced && abs(error) <= SIM_IN_SYNC_US;
+    if (!synced) continue;
+    if (abs(error) > TIME_SYNC_STEP_US) {
+      staleSamples++;
+    } else {
+      clockErrors.push_back(abs(error));
+    }
+  }
+
+  if (allInSync && syncPeriods.back().inSyncAt == 0) syncPeriods.back().inSyncAt = simMicros;
+  schedule(simMicros + 1000000, sampleClocks);
+}
+
+static void printAfter(const char* what, uint64_t at, uint64_t since) {
+  if (at == 0) {
+    printf("  %-28s never\n", what);
+  } else {
+    printf("  %-28s %.3f s\n", what, (at - since) / 1e6);
+  }
+}
+
+static double percentile(std::vector<double> values, double q) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  return values[min(values.size() - 1, (size_t)(q * values.size()))];
+}
+
+int main(int argc, char** argv) {
+  double lossPercent = 5;
+  double houseLength = 0;
+  bool relay = false;
+  uint32_t seed = 1;
+  std::vector<Step> steps;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      radiatorCount = atoi(argv[++i]);
+    } else if (arg == "-l" && i + 1 < argc) {
+      lossPercent = atof(argv[++i]);
+    } else if (arg == "-a" && i + 1 < argc) {
+      houseLength = atof(argv[++i]);
+    } else if (arg == "-r") {
+      relay = true;
+    } else if (arg == "-w" && i + 1 < argc) {
+      txWindow = atoi(argv[++i]);
+    } else if (arg == "-p" && i + 1 < argc) {
+      txPaceUs = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-L") {
+      largeServer = true;
+    } else if (arg == "-t") {
+      timeSync = true;
+    } else if (arg == "-j" && i + 1 < argc) {
+      jitterUs = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-d" && i + 1 < argc) {
+      clockPpm = atof(argv[++i]);
+    } else if (arg == "-c" && i + 1 < argc) {
+      capturePath = argv[++i];
+    } else if (arg == "-D") {
+      legacyDiscovery = true;
+    } else if (arg == "-k") {
+      frameAuth = true;
+    } else if (arg == "-P") {
+      preempt = true;
+    } else if (arg == "-s" && i + 1 < argc) {
+      seed = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-v") {
+      simSerialEcho = true;
+    } else if (arg.find('@') != std::string::npos) {
+      steps.push_back({ atof(arg.c_str() + arg.rfind('@') + 1), arg.substr(0, arg.rfind('@')) });
+    } else {
+      fprintf(stderr, "usage: %s [-n radiators] [-l loss %%] [-a house length m] [-r] [-w window] [-p pacing us] [-L] "
+                      "[-t] [-j jitter us] [-d ppm] [-c capture file] [-D] [-k] [-P] [-s seed] [-v] [step@seconds ...]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (steps.empty()) steps = { { 30, "reboot" }, { 60, "ALL/T/21/1" }, { 180, "end" } };
+  std::stable_sort(steps.begin(), steps.end(), [](const Step& a, const Step& b) { return a.at < b.at; });
+  if (steps.back().what != "end") steps.push_back({ steps.back().at + 60, "end" });
+
+  lossPerMillion = (uint32_t)(lossPercent * 10000);
+  rngState = seed;
+  simRandomState = seed | 1;
+  simEspNow.transmit = transmit;
+  simDelayHook = boardDelay;
+  uart.simTx = &uartOut;
+  if (!capturePath.empty()) captureRing.resize(SIM_CAPTURE_RECORDS);
+
+  heaps.resize(radiatorCount + 1);
+  boards.resize(radiatorCount + 1);
+  for (int i = 0; i <= radiatorCount; i++) {
+    Board& board = boards[i];
+    board.id = i;
+    board.heap = &heaps[i];
+    const uint8_t serverMac[6] = { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01 };
+    const uint8_t radiatorMac[6] = { 0x34, 0x85, 0x18, 0x00, (uint8_t)(i >> 8), (uint8_t)i };
+    memcpy(board.mac, i == 0 ? serverMac : radiatorMac, 6);
+    if (i > 0) board.coms = std::make_shared<CommunicationsFor<RadiatorCapacity>>();
+  }
+  layOut(houseLength);
+  relaying = relay;
+  if (timeSync) {
+    for (Board& board : boards) {
+      board.clock = { 0, ((uint64_t)rng() << 1 | (rng() & 1)), (uniform() * 2 - 1) * clockPpm };
+    }
+    syncPeriods.push_back({ "boot", 0, 0 });
+    schedule(1000000, sampleClocks);
+  }
+
+  printf("%d radiators, %.1f%% loss, seed %u", radiatorCount, lossPercent, (unsigned)seed);
+  if (houseLength > 0) printf(", %.0f m house", houseLength);
+  printf("%s", relay ? ", relaying" : "");
+  if (timeSync) printf(", time sync with %u us jitter, clocks within %.0f ppm", (unsigned)jitterUs, clockPpm);
+  printf("\n\n");
+  auto wallStart = std::chrono::steady_clock::now();
+
+  bootServer();
+  printf("%9.3f s  server boots\n", 0.0);
+  for (int i = 1; i <= radiatorCount; i++) {
+    schedule(rng() % (SIM_BOOT_SPREAD_MS * 1000ULL), [i]() { bootRadiator(boards[i]); });
+  }
+
+  uint64_t endMs = (uint64_t)(steps.back().at * 1000);
+  size_t nextStep = 0;
+
+  // One server loop() pass per virtual millisecond, like local_web.cpp
+  for (uint64_t ms = 0; ms <= endMs; ms++) {
+    uint64_t now = ms * 1000;
+    while (!events.empty() && events.top().at <= now) {
+      Event event = events.top();
+      events.pop();
+      simMicros = event.at;
+      event.run();
+    }
+    simMicros = now;
+
+    while (nextStep < steps.size() && (uint64_t)(steps[nextStep].at * 1000) <= ms) {
+      const std::string& what = steps[nextStep++].what;
+      if (what == "end") break;
+
+      if (what == "reboot") {
+        printf("%9.3f s  server reboots with %d radiators adopted\n", simMicros / 1e6, server->manager.getNumRadiators());
+        if (timeSync) {
+          boards[0].clock = { simMicros, 0, boards[0].clock.ppm }; // micros() starts over
+          syncPeriods.push_back({ "reboot", simMicros, 0 });
+        }
+        bootServer();
+      } else if (what == "replay") {
+        if (lastSetpointFrame.empty()) continue;
+        printf("%9.3f s  radiator %d restarts\n", simMicros / 1e6, lastSetpointTo);
+        restartRadiator(boards[lastSetpointTo]);
+        replaySetpoint(); // before the server is heard from
+        schedule(simMicros + 1000000, replaySetpoint); // once it has answered a challenge
+      } else {
+        printf("%9.3f s  %s with %d radiators adopted\n", simMicros / 1e6, what.c_str(), server->manager.getNumRadiators());
+        issueCommand(what);
+      }
+    }
+
+    runOn(boards[0], []() {
+      server->manager.update();
+      coms.update();
+      server->web.update();
+    });
+    readUart();
+    checkConvergence();
+  }
+
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  if (!capturePath.empty()) {
+    HardwareSerial usb; // what 'c' over USB serial would bring back
+    std::string dump;
+    usb.simTx = &dump;
+    runOn(boards[0], [&usb]() {
+      heapOwner = nullptr; // the text is the simulation's, not the server's heap
+      coms.dumpCapture(usb);
+    });
+    FILE* file = fopen(capturePath.c_str(), "w");
+    if (!file || fwrite(dump.data(), 1, dump.size(), file) != dump.size()) {
+      fprintf(stderr, "cannot write %s\n", capturePath.c_str());
+    }
+    if (file) fclose(file);
+  }
+
+  int foundServer = 0;
+  int nvsWrites = 0;
+  int64_t radiatorHeapPeak = 0;
+  size_t radiatorStackPeak = 0;
+  int radiatorInFlightPeak = 0;
+  for (int i = 1; i <= radiatorCount; i++) {
+    const Board& board = boards[i];
+    if (board.coms->getPeerByClass(DEVICE_CLASS_SERVER)) foundServer++;
+    nvsWrites = max(nvsWrites, (int)board.nvs.writes);
+    radiatorHeapPeak = max(radiatorHeapPeak, board.heap->peak);
+    radiatorStackPeak = max(radiatorStackPeak, stackUsed(board));
+    radiatorInFlightPeak = max(radiatorInFlightPeak, board.inFlightPeak);
+  }
+
+  printf("\n%.0f s simulated in %.2f s (%.0fx real time)\n", endMs / 1e3, wallSeconds, endMs / 1e3 / wallSeconds);
+
+  printf("\ndiscovery\n");
+  printf("  %-28s %d/%d (%s, room for %d)\n", "adopted by the server", server->manager.getNumRadiators(),
+         radiatorCount, largeServer ? "LargeServerCapacity" : "ServerCapacity", server->manager.getMaxRadiators());
+  printf("  %-28s %d/%d\n", "know the server", foundServer, radiatorCount);
+
+  // Per command only for a few; a long series is summed up below
+  int setpointCount = 0;
+  for (const CommandRun& command : commands) setpointCount += command.setpoint >= 0;
+
+  for (const CommandRun& command : commands) {
+    if (setpointCount > 3 && command.setpoint >= 0) continue;
+    printf("\n%s at %.3f s\n", command.line.c_str(), command.at / 1e6);
+    printf("  %-28s %s\n", "outcome", command.done.empty() ? "none" : command.done.c_str());
+    if (command.setpoint < 0) continue;
+    printf("  %-28s %d/%d\n", "radiators set", command.set, radiatorCount);
+    printAfter("last radiator set after", command.set == radiatorCount ? command.lastSetAt : 0, command.at);
+    printAfter("server shows all acked after", command.serverAckedAt, command.at);
+    printAfter("valves settled after", command.settledAt, command.at);
+  }
+
+  if (setpointCount > 0) {
+    std::vector<double> latencies;
+    int expected = 0;
+    for (const CommandRun& command : commands) {
+      for (uint64_t at : command.ackedAt) {
+        expected++;
+        if (at != 0 && at - command.at <= COMMAND_TIMEOUT_MS * 1000ULL) latencies.push_back((at - command.at) / 1e3);
+      }
+    }
+
+    int hops[MAX_RELAY_HOPS + 2] = {};
+    const RadiatorManager& manager = server->manager;
+    for (int i = 0; i < manager.getNumRadiators(); i++) {
+      hops[min(boards[0].coms->getHops(manager.getMac(i)), MAX_RELAY_HOPS + 1)]++;
+    }
+
+    printf("\n%d setpoint command(s), as the server saw them\n", setpointCount);
+    printf("  %-28s %zu/%d (%.1f%%)\n", "acked within timeout", latencies.size(), expected,
+           expected ? 100.0 * latencies.size() / expected : 0.0);
+    printf("  %-28s %.0f / %.0f / %.0f ms\n", "ack after p50/p95/max", percentile(latencies, 0.5),
+           percentile(latencies, 0.95), percentile(latencies, 1));
+    printf("  %-28s %d direct, %d through 1, %d through 2\n", "paths at the end", hops[1], hops[2], hops[3]);
+  }
+
+  // RadiatorLink since the last server boot, the radiators it rates worst
+  const RadiatorManager& manager = server->manager;
+  if (manager.getNumRadiators() > 0) {
+    std::vector<int> order(manager.getNumRadiators());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      return manager.getLink(a).failed > manager.getLink(b).failed;
+    });
+
+    RadiatorLink total = {};
+    for (int i : order) {
+      const RadiatorLink& link = manager.getLink(i);
+      total.delivered += link.delivered;
+      total.failed += link.failed;
+      total.acks += link.acks;
+    }
+
+    printf("\nlinks, as GET/LINKS reports them\n");
+    printf("  %-12s %9s %8s %6s %30s %6s %12s\n", "radiator", "delivered", "failed", "acks", "ack avg/p50/p95/max ms",
+           "rssi", "direct rssi");
+    for (size_t n = 0; n < min(order.size(), (size_t)3); n++) {
+      int i = order[n];
+      const uint8_t* mac = manager.getMac(i);
+      const RadiatorLink& link = manager.getLink(i);
+      char acks[40];
+      snprintf(acks, sizeof(acks), "%.1f / %.1f / %.1f / %.1f", link.ackAvgUs / 1e3, manager.ackPercentileMicros(i, 50) / 1e3,
+               manager.ackPercentileMicros(i, 95) / 1e3, link.ackMaxUs / 1e3);
+      int board = mac[4] << 8 | mac[5];
+      printf("  %-12s %9u %8u %6u %30s %6d %12d\n", manager.getRadiatorName(i), link.delivered, link.failed, link.acks, acks, link.rssi,
+             linkRssi[board][0]);
+    }
+    printf("  %-12s %9u %8u %6u\n", "all", total.delivered, total.failed, total.acks);
+  }
+
+  printf("\nframes on air\n");
+  printf("  %-16s %8s %14s %8s %12s\n", "kind", "frames", "transmissions", "failed", "airtime ms");
+  KindStats total;
+  for (int kind = 0; kind < FRAME_KIND_COUNT; kind++) {
+    const KindStats& stats = kindStats[kind];
+    if (stats.frames == 0) continue;
+    printf("  %-16s %8u %14u %8u %12.1f\n", frameKindNames[kind], stats.frames, stats.transmissions, stats.failed,
+           stats.airtimeUs / 1e3);
+    total.frames += stats.frames;
+    total.transmissions += stats.transmissions;
+    total.failed += stats.failed;
+    total.airtimeUs += stats.airtimeUs;
+  }
+  printf("  %-16s %8u %14u %8u %12.1f\n", "total", total.frames, total.transmissions, total.failed, total.airtimeUs / 1e3);
+  if (relayedFrames > 0) printf("  relayed %u, of which %u sent on by a radiator in between\n", relayedFrames, forwardedFrames);
+  printf("  channel busy %.2f%% of the time\n", 100.0 * channelBusyUs / (endMs * 1000.0));
+  if (driverRefused > 0) printf("  esp_now_send refused %u times, driver full\n", driverRefused);
+  if (preempt) printf("  %u callbacks cut in on esp_now_send\n", preempted);
+
+  // Radiators summed, peaks and the longest wait over all of them
+  TxStats radiatorTx = {};
+  for (int i = 1; i <= radiatorCount; i++) {
+    const TxStats& tx = boards[i].coms->getTxStats();
+    radiatorTx.sent += tx.sent;
+    radiatorTx.waitTotalUs += tx.waitTotalUs;
+    radiatorTx.waitMaxUs = max(radiatorTx.waitMaxUs, tx.waitMaxUs);
+    radiatorTx.depthPeak = max(radiatorTx.depthPeak, tx.depthPeak);
+    radiatorTx.driverBusy += tx.driverBusy;
+    radiatorTx.expired += tx.expired;
+    for (int p = 0; p < TX_PRIORITY_COUNT; p++) radiatorTx.dropped[p] += tx.dropped[p];
+  }
+
+  printf("\ntransmit queue\n");
+  printf("  %-10s %8s %10s %18s %22s %12s %8s\n", "", "sent", "depth peak", "wait avg/max ms", "dropped cmd/ack/dis/tel",
+         "driver busy", "expired");
+  for (int side = 0; side < 2; side++) {
+    const TxStats& tx = side == 0 ? boards[0].coms->getTxStats() : radiatorTx;
+    char dropped[32];
+    snprintf(dropped, sizeof(dropped), "%u/%u/%u/%u", tx.dropped[0], tx.dropped[1], tx.dropped[2], tx.dropped[3]);
+    printf("  %-10s %8u %10u %9.2f /%7.2f %22s %12u %8u\n", side == 0 ? "server" : "radiators", tx.sent, tx.depthPeak,
+           tx.sent ? tx.waitTotalUs / 1e3 / tx.sent : 0.0, tx.waitMaxUs / 1e3, dropped, tx.driverBusy, tx.expired);
+  }
+
+  if (frameAuth) {
+    AuthStats radiatorAuth = {};
+    for (int i = 1; i <= radiatorCount; i++) {
+      const AuthStats& auth = boards[i].coms->getAuthStats();
+      radiatorAuth.accepted += auth.accepted;
+      radiatorAuth.unsignedFrames += auth.unsignedFrames;
+      radiatorAuth.forged += auth.forged;
+      radiatorAuth.replayed += auth.replayed;
+      radiatorAuth.unsynced += auth.unsynced;
+      radiatorAuth.challenges += auth.challenges;
+      radiatorAuth.reserved += auth.reserved;
+    }
+
+    printf("\nsigned frames\n");
+    printf("  %-10s %8s %8s %8s %8s %8s %10s %8s\n", "", "accepted", "unsigned", "forged", "replayed", "unsynced",
+           "challenges", "reserved");
+    for (int side = 0; side < 2; side++) {
+      const AuthStats& auth = side == 0 ? boards[0].coms->getAuthStats() : radiatorAuth;
+      printf("  %-10s %8u %8u %8u %8u %8u %10u %8u\n", side == 0 ? "server" : "radiators", auth.accepted,
+             auth.unsignedFrames, auth.forged, auth.replayed, auth.unsynced, auth.challenges, auth.reserved);
+    }
+  }
+
+  if (timeSync) {
+    int synced = 0;
+    for (int i = 1; i <= radiatorCount; i++) synced += boards[i].coms->isTimeSynced();
+
+    printf("\ntime sync\n");
+    printf("  %-28s %d/%d\n", "radiators synced", synced, radiatorCount);
+    for (const SyncPeriod& period : syncPeriods) {
+      char what[40];
+      snprintf(what, sizeof(what), "within %d us after %s", SIM_IN_SYNC_US, period.what);
+      printAfter(what, period.inSyncAt, period.from);
+    }
+    printf("  %-28s %.0f / %.0f / %.0f us (%zu samples, %u stale after a master restart)\n", "clock error p50/p99/max",
+           percentile(clockErrors, 0.5), percentile(clockErrors, 0.99), percentile(clockErrors, 1), clockErrors.size(),
+           staleSamples);
+
+    // Radiators summed like the transmit queue
+    TimeStats radiatorTime = {};
+    for (int i = 1; i <= radiatorCount; i++) {
+      const TimeStats& time = boards[i].coms->getTimeStats();
+      if (time.hopSamples == 0) continue;
+      radiatorTime.hopMinUs = radiatorTime.hopSamples ? min(radiatorTime.hopMinUs, time.hopMinUs) : time.hopMinUs;
+      radiatorTime.hopMaxUs = radiatorTime.hopSamples ? max(radiatorTime.hopMaxUs, time.hopMaxUs) : time.hopMaxUs;
+      radiatorTime.hopSamples += time.hopSamples;
+      radiatorTime.hopTotalUs += time.hopTotalUs;
+    }
+
+    printf("  one-way latency per hop     %8s %24s %24s\n", "frames", "measured avg/min/max us", "true avg/min/max us");
+    for (int side = 0; side < 2; side++) {
+      const TimeStats& time = side == 0 ? boards[0].coms->getTimeStats() : radiatorTime;
+      const HopTruth& truth = hopTruth[side];
+      char measured[40], actual[40];
+      snprintf(measured, sizeof(measured), "%lld / %d / %d", (long long)(time.hopSamples ? time.hopTotalUs / time.hopSamples : 0),
+               (int)time.hopMinUs, (int)time.hopMaxUs);
+      snprintf(actual, sizeof(actual), "%llu / %llu / %llu", (unsigned long long)(truth.samples ? truth.totalUs / truth.samples : 0),
+               (unsigned long long)(truth.samples ? truth.minUs : 0), (unsigned long long)truth.maxUs);
+      printf("    %-24s %8u %24s %24s\n", side == 0 ? "to the server" : "to radiators", time.hopSamples, measured, actual);
+    }
+  }
+
+  printf("\nmemory high-water marks (host build, 64-bit)\n");
+  size_t serverComs = largeServer ? sizeof(CommunicationsFor<LargeServerCapacity>) : sizeof(CommunicationsFor<ServerCapacity>);
+  size_t serverManager =
+    largeServer ? sizeof(RadiatorManagerFor<LargeServerCapacity>) : sizeof(RadiatorManagerFor<ServerCapacity>);
+  printf("  server    static %zu B (Communications %zu, RadiatorManager %zu, WebComs %zu), heap %lld B, "
+         "%d frames in flight\n",
+         serverComs + serverManager + sizeof(RadiatorCommands) + sizeof(WebComs), serverComs, serverManager,
+         sizeof(WebComs), (long long)heaps[0].peak, boards[0].inFlightPeak);
+  printf("  radiator  static %zu B (Communications), heap %lld B, stack %zu B, %d frames in flight, %d NVS writes\n",
+         sizeof(CommunicationsFor<RadiatorCapacity>), (long long)radiatorHeapPeak, radiatorStackPeak, radiatorInFlightPeak, nvsWrites);
+  printf("  UART to esp-web %zu B\n", uartBytes);
+  return 0;
+}
@@ -0,0 +1,424 @@
+// link_loopback.cpp
+// The esp-server <-> esp-web link over a simulated UART: the real WebComs,
+// RadiatorCommands, RadiatorManager and Communications on one end, esp-web's
+// handshake and LinkDecoder on the other, with every byte paced at the rate
+// its sender runs the line at. Radiators ack setpoints after a radio delay.
+//
+// Both ends boot in the text protocol at 9600 baud. The script runs there,
+// then negotiates the binary protocol at esp-web's SoftwareSerial rate, lets
+// it time out back to text and negotiates the hardware UART rate. Each time
+// it asks for the full list and sends setpoints one radiator at a time, and
+// reports the bytes of a full sync, of the delta pushed for one change, and
+// the round trip from esp-web writing SET/TEMP to it holding the answer.
+//
+//   ./link_loopback [setpoints] [ack delay ms]
+#include <Arduino.h>
+#include <deque>
+#include <map>
+#include <queue>
+#include "WebComs.h"
+#include "Messages.h"
+
+static const int RADIATORS = ServerCapacity::radiators;
+static const int STEP_US = 100; // one loop() pass on each board
+static const int SENT_DELAY_MS = 1; // ESP-NOW send callback after the MAC-level ack
+static const uint32_t SOFTWARE_SERIAL_BAUD = 57600; // LINK_BINARY_BAUD in esp-web.ino, and with LINK_HW_UART
+static const uint32_t HARDWARE_UART_BAUD = 921600;
+static int setpoints = 20;
+static int ackDelayMs = 15;
+
+// --- Radio: every frame arrives, setpoints are acked after ackDelayMs ---
+
+struct RadioEvent {
+  uint64_t at;
+  std::function<void()> deliver;
+  bool operator<(const RadioEvent& other) const { return at > other.at; }
+};
+
+static std::priority_queue<RadioEvent> radio;
+
+static void radiatorMac(int index, uint8_t* mac) {
+  static const uint8_t base[6] = { 0x34, 0x85, 0x18, 0x00, 0x00, 0x00 };
+  memcpy(mac, base, 6);
+  mac[5] = index + 1;
+}
+
+static void deliverResponse(int index, const TemperatureCommand& command) {
+  struct __attribute__((packed)) {
+    MessageHeader header;
+    TemperatureResponse response;
+  } frame = {};
+  frame.header = { MESSAGE_MAGIC, MSG_TYPE_TEMPERATURE_RESPONSE, sizeof(TemperatureResponse) };
+  frame.response = { command.temperature, true, command.requestId };
+
+  uint8_t mac[6];
+  radiatorMac(index, mac);
+  esp_now_recv_info_t info = { mac, simEspNow.mac, nullptr };
+  simEspNow.onReceive(&info, (const uint8_t*)&frame, sizeof(frame));
+}
+
+static esp_err_t transmit(const uint8_t* to, const uint8_t* data, size_t len) {
+  std::vector<uint8_t> copy(to, to + 6);
+  radio.push({ simMicros + SENT_DELAY_MS * 1000, [copy]() { simEspNow.onSent(copy.data(), ESP_NOW_SEND_SUCCESS); } });
+
+  const MessageHeader* header = (const MessageHeader*)data;
+  if (header->type != MSG_TYPE_TEMPERATURE_COMMAND || len != sizeof(MessageHeader) + sizeof(TemperatureCommand)) {
+    return ESP_OK;
+  }
+
+  int index = to[5] - 1;
+  TemperatureCommand command;
+  memcpy(&command, data + sizeof(MessageHeader), sizeof(command));
+  if (index >= 0 && index < RADIATORS) {
+    radio.push({ simMicros + ackDelayMs * 1000, [index, command]() { deliverResponse(index, command); } });
+  }
+  return ESP_OK;
+}
+
+// --- UART: one line per direction, bytes leave one after another at the sender's rate ---
+
+struct UartLine {
+  unsigned long baud = LINK_TEXT_BAUD;
+  std::string written; // the sender's simTx, not on the line yet
+  std::deque<std::pair<uint64_t, char>> onLine; // byte and the ns it has fully arrived at
+  uint64_t freeAtNs = 0;
+
+  void send() {
+    for (char c : written) {
+      uint64_t start = std::max(freeAtNs, simMicros * 1000);
+      freeAtNs = start + 10000000000ULL / baud; // 8N1, ten bits a byte
+      onLine.push_back({ freeAtNs, c });
+    }
+    written.clear();
+  }
+
+  void deliver(HardwareSerial& to) {
+    while (!onLine.empty() && onLine.front().first <= simMicros * 1000) {
+      to.simRx += onLine.front().second;
+      onLine.pop_front();
+    }
+  }
+};
+
+static HardwareSerial serverUart; // Serial2 on esp-server
+static HardwareSerial webUart; // communicationSerial on esp-web
+static UartLine toWeb;
+static UartLine toServer;
+
+static CommunicationsFor<ServerCapacity> coms;
+static RadiatorManagerFor<ServerCapacity> manager(coms);
+static RadiatorCommands commands(manager);
+static WebComs webComs(serverUart, manager, commands);
+
+// --- esp-web's end, as esp-web.ino runs it ---
+
+enum LinkMode : uint8_t {
+  LINK_MODE_TEXT,
+  LINK_MODE_BINARY
+};
+
+static LinkMode linkMode = LINK_MODE_TEXT;
+static LinkDecoder linkDecoder;
+static uint8_t linkTxSeq = 0;
+static unsigned long lastLinkPingAt = 0;
+static std::string serialLine;
+static size_t itemBytes = 0; // bytes of the line or frame being received
+
+struct Traffic {
+  int fullSyncs = 0;
+  size_t fullBytes = 0;
+  int deltas = 0;
+  size_t deltaBytes = 0;
+  int deltaRadiators = 0;
+  size_t doneBytes = 0;
+  size_t burstBytes = 0; // radiator records waiting for the line or frame that closes them
+  int burstRadiators = 0;
+};
+
+static Traffic traffic;
+static std::map<uint16_t, uint64_t> sentAt; // request id -> simMicros esp-web wrote the command
+static std::vector<double> roundTrips; // ms
+
+static void commandDone(uint16_t request) {
+  auto it = sentAt.find(request);
+  if (it == sentAt.end()) return;
+  roundTrips.push_back((simMicros - it->second) / 1000.0);
+  sentAt.erase(it);
+}
+
+static void closeBurst(bool full, size_t bytes) {
+  if (full) {
+    traffic.fullSyncs++;
+    traffic.fullBytes += traffic.burstBytes + bytes;
+  } else {
+    traffic.deltas++;
+    traffic.deltaBytes += traffic.burstBytes + bytes;
+    traffic.deltaRadiators += traffic.burstRadiators;
+  }
+  traffic.burstBytes = 0;
+  traffic.burstRadiators = 0;
+}
+
+static void sendLinkFrame(uint8_t type, const void* payload, uint8_t length) {
+  uint8_t out[LINK_MAX_ENCODED];
+  size_t len = linkEncodeFrame(type, linkTxSeq++, payload, length, out);
+  webUart.write(out, len);
+}
+
+static void switchToBinary(uint32_t baud) {
+  toServer.send(); // what is written so far leaves at the old rate
+  toServer.baud = baud;
+  linkMode = LINK_MODE_BINARY;
+  linkDecoder.reset();
+  lastLinkPingAt = millis();
+}
+
+static void fallBackToText() {
+  toServer.send();
+  toServer.baud = LINK_TEXT_BAUD;
+  linkMode = LINK_MODE_TEXT;
+  serialLine.clear();
+}
+
+static void handleServerLine(const std::string& line, size_t bytes) {
+  if (line.compare(0, 8, "LINK/OK/") == 0) {
+    switchToBinary(strtoul(line.c_str() + 8, nullptr, 10));
+  } else if (line.compare(0, 1, "[") == 0) {
+    closeBurst(true, bytes);
+  } else if (line.compare(0, 6, "{\"id\":") == 0) {
+    traffic.burstBytes += bytes;
+    traffic.burstRadiators++;
+  } else if (line.compare(0, 5, "{\"v\":") == 0) {
+    closeBurst(false, bytes);
+  } else if (line.compare(0, 8, "{\"done\":") == 0) {
+    traffic.doneBytes += bytes;
+    commandDone(strtoul(line.c_str() + 8, nullptr, 10));
+  }
+}
+
+static void handleLinkFrame(const LinkFrame& frame, size_t bytes) {
+  switch (frame.type) {
+    case LINK_RADIATOR_STATE:
+      traffic.burstBytes += bytes;
+      traffic.burstRadiators++;
+      break;
+
+    case LINK_STATE_END:
+      if (frame.length == sizeof(LinkStateEnd)) {
+        LinkStateEnd end;
+        memcpy(&end, frame.payload, sizeof(end));
+        closeBurst(end.flags & LINK_END_FULL, bytes);
+      }
+      break;
+
+    case LINK_COMMAND_DONE:
+      if (frame.length == sizeof(LinkCommandDone)) {
+        LinkCommandDone done;
+        memcpy(&done, frame.payload, sizeof(done));
+        traffic.doneBytes += bytes;
+        commandDone(done.request);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void webUpdate() {
+  while (webUart.available()) {
+    uint8_t c = webUart.read();
+    itemBytes++;
+
+    if (linkMode == LINK_MODE_BINARY) {
+      if (linkDecoder.push(c)) handleLinkFrame(linkDecoder.frame(), itemBytes);
+      if (c == 0) itemBytes = 0;
+      continue;
+    }
+
+    if (c != '\n') {
+      if (c != '\r') serialLine += (char)c;
+      continue;
+    }
+    std::string line;
+    line.swap(serialLine);
+    size_t bytes = itemBytes;
+    itemBytes = 0;
+    handleServerLine(line, bytes);
+  }
+
+  if (linkMode == LINK_MODE_BINARY && millis() - lastLinkPingAt > LINK_PING_INTERVAL_MS) {
+    lastLinkPingAt = millis();
+    sendLinkFrame(LINK_PING, nullptr, 0);
+  }
+}
+
+static void requestRadiators() {
+  if (linkMode == LINK_MODE_BINARY) {
+    sendLinkFrame(LINK_GET_RADIATORS, nullptr, 0);
+  } else {
+    webUart.println("GET/RADIATORS");
+  }
+}
+
+static void setTemp(int index, uint8_t temp, uint16_t request) {
+  sentAt[request] = simMicros;
+  if (linkMode == LINK_MODE_BINARY) {
+    LinkSetTemp cmd = { (uint8_t)index, temp, request };
+    sendLinkFrame(LINK_SET_TEMP, &cmd, sizeof(cmd));
+  } else {
+    webUart.printf("SET/TEMP/%d/%u/%u\r\n", index, (unsigned)temp, (unsigned)request);
+  }
+}
+
+// --- Both boards, one loop() pass each per step ---
+
+static void step() {
+  simMicros += STEP_US;
+  while (!radio.empty() && radio.top().at <= simMicros) {
+    RadioEvent event = radio.top();
+    radio.pop();
+    event.deliver();
+  }
+
+  toServer.deliver(serverUart);
+  manager.update();
+  coms.update();
+  webComs.update();
+  toWeb.send();
+
+  toWeb.deliver(webUart);
+  webUpdate();
+  toServer.send();
+}
+
+// Steps until done() holds, false when it still does not after timeoutMs
+static bool runUntil(const std::function<bool()>& done, int timeoutMs) {
+  uint64_t until = simMicros + timeoutMs * 1000ULL;
+  while (!done()) {
+    if (simMicros >= until) return false;
+    step();
+  }
+  return true;
+}
+
+static void runFor(int ms) {
+  runUntil([]() { return false; }, ms);
+}
+
+static double wireMs(size_t bytes, unsigned long baud) {
+  return bytes * 10 * 1000.0 / baud;
+}
+
+static int failures = 0;
+
+static void measure(const char* name) {
+  unsigned long baud = toWeb.baud;
+
+  traffic = Traffic();
+  uint64_t requestedAt = simMicros;
+  requestRadiators();
+  if (!runUntil([]() { return traffic.fullSyncs > 0; }, 5000)) {
+    printf("%-16s FAIL: no full list within 5 s\n", name);
+    failures++;
+    return;
+  }
+  double syncMs = (simMicros - requestedAt) / 1000.0;
+  size_t fullBytes = traffic.fullBytes;
+  runFor(50);
+
+  traffic = Traffic();
+  roundTrips.clear();
+  sentAt.clear();
+  static uint16_t request = 0;
+  static int round = 0; // a new temperature for every radiator each time, so every setpoint goes on air
+  for (int i = 0; i < setpoints; i++) {
+    setTemp(i % RADIATORS, 16 + round++ % 12, ++request);
+    if (!runUntil([]() { return sentAt.empty(); }, 5000)) {
+      printf("%-16s FAIL: no answer to setpoint %d within 5 s\n", name, i + 1);
+      failures++;
+      return;
+    }
+    runFor(50); // the delta after the ack
+  }
+
+  double sum = 0, max = 0;
+  for (double ms : roundTrips) {
+    sum += ms;
+    max = std::max(max, ms);
+  }
+  size_t deltaBytes = traffic.deltas ? traffic.deltaBytes / traffic.deltas : 0;
+  printf("%-16s %6zu %8.1f %8.1f %9zu %8.1f %6.1f %9zu %8.1f / %5.1f\n", name, fullBytes, wireMs(fullBytes, baud),
+         syncMs, deltaBytes, wireMs(deltaBytes, baud),
+         traffic.deltas ? (double)traffic.deltaRadiators / traffic.deltas : 0.0,
+         traffic.doneBytes / roundTrips.size(), sum / roundTrips.size(), max);
+}
+
+// esp-web offers LINK/BIN/<baud> and waits for LINK/OK
+static bool negotiate(uint32_t baud) {
+  webUart.print("LINK/BIN/");
+  webUart.println(baud);
+  if (!runUntil([]() { return linkMode == LINK_MODE_BINARY; }, 1000)) {
+    printf("FAIL: no LINK/OK for %u baud\n", (unsigned)baud);
+    failures++;
+    return false;
+  }
+  runUntil([]() { return traffic.fullSyncs > 0; }, 1000); // switchToBinary() asks for the list
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) setpoints = atoi(argv[1]);
+  if (argc > 2) ackDelayMs = atoi(argv[2]);
+
+  simEspNow.transmit = transmit;
+  serverUart.simTx = &toWeb.written;
+  serverUart.simBaudChange = [](unsigned long baud) {
+    toWeb.send(); // WebComs flushes LINK/OK at the old rate first
+    toWeb.baud = baud;
+  };
+  webUart.simTx = &toServer.written;
+
+  coms.begin();
+  coms.setName("server");
+  coms.setReceiveHandler([](const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
+    if (type == MSG_TYPE_TEMPERATURE_RESPONSE && len == sizeof(TemperatureResponse)) {
+      TemperatureResponse response;
+      memcpy(&response, data, sizeof(response));
+      manager.processTemperatureResponse(mac, response);
+    }
+  });
+  coms.setSendHandler([](const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
+    manager.processSendStatus(mac, type, status);
+  });
+  serverUart.begin(LINK_TEXT_BAUD);
+
+  for (int i = 0; i < RADIATORS; i++) {
+    Peer peer = {};
+    radiatorMac(i, peer.mac);
+    strcpy(peer.name, "radiator");
+    manager.handleDiscovery(peer);
+  }
+  runFor(3000); // the pushed list of new radiators drains at 9600 baud
+
+  printf("%d radiators, %d setpoints acked after %d ms on air\n\n", RADIATORS, setpoints, ackDelayMs);
+  printf("                   full sync                      delta                SET/TEMP -> done\n");
+  printf("link              bytes  wire ms  sync ms     bytes  wire ms  radiators  bytes  rtt avg / max ms\n");
+
+  measure("text 9600");
+
+  if (negotiate(SOFTWARE_SERIAL_BAUD)) measure("binary 57600");
+
+  // esp-web reboots into text and the server times out behind it
+  fallBackToText();
+  runFor(LINK_TIMEOUT_MS + 500);
+  measure("text again");
+
+  if (negotiate(HARDWARE_UART_BAUD)) measure("binary 921600");
+
+  if (failures) {
+    printf("\n%d failure(s)\n", failures);
+    return 1;
+  }
+  return 0;
+}
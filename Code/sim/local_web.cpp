@@ -0,0 +1,237 @@
+// local_web.cpp
+// esp-server in single-board mode against the HTTP, WebSocket and ESP-NOW
+// stand-ins: the real LocalWeb, RadiatorCommands, RadiatorManager and
+// Communications, with three radiators that ack after a radio delay.
+//
+// Walks through the page load, the WebSocket batch protocol and the held
+// GET /set/* requests, and stops with an error at the first answer that is
+// not what esp-web would have given.
+//
+//   ./local_web [ack delay ms]
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <LittleFS.h>
+#include <queue>
+#include "LocalWeb.h"
+#include "Messages.h"
+
+static const int RADIATORS = 3;
+static int ackDelayMs = 15;
+static const int SENT_DELAY_MS = 1; // ESP-NOW send callback after the MAC-level ack
+
+struct RadioEvent {
+  uint64_t at;
+  std::function<void()> deliver;
+  bool operator<(const RadioEvent& other) const { return at > other.at; }
+};
+
+static std::priority_queue<RadioEvent> radio;
+static bool muted[RADIATORS] = {}; // a muted radiator takes frames but never answers
+static uint64_t firstFrameAt = 0;
+
+static uint8_t radiatorMac(int index, uint8_t* mac) {
+  static const uint8_t base[6] = { 0x34, 0x85, 0x18, 0x00, 0x00, 0x00 };
+  memcpy(mac, base, 6);
+  mac[5] = index + 1;
+  return mac[5];
+}
+
+static void deliverResponse(int index, const TemperatureCommand& command) {
+  struct __attribute__((packed)) {
+    MessageHeader header;
+    TemperatureResponse response;
+  } frame = {};
+  frame.header = { MESSAGE_MAGIC, MSG_TYPE_TEMPERATURE_RESPONSE, sizeof(TemperatureResponse) };
+  frame.response = { command.temperature, true, command.requestId };
+
+  uint8_t mac[6];
+  radiatorMac(index, mac);
+  esp_now_recv_info_t info = { mac, simEspNow.mac, nullptr };
+  simEspNow.onReceive(&info, (const uint8_t*)&frame, sizeof(frame));
+}
+
+// Every frame reaches its radiator; temperature commands are answered after ackDelayMs
+static esp_err_t transmit(const uint8_t* to, const uint8_t* data, size_t len) {
+  if (firstFrameAt == 0) firstFrameAt = simMicros;
+
+  std::vector<uint8_t> copy(to, to + 6);
+  radio.push({ simMicros + SENT_DELAY_MS * 1000, [copy]() { simEspNow.onSent(copy.data(), ESP_NOW_SEND_SUCCESS); } });
+
+  const MessageHeader* header = (const MessageHeader*)data;
+  if (header->type != MSG_TYPE_TEMPERATURE_COMMAND || len != sizeof(MessageHeader) + sizeof(TemperatureCommand)) {
+    return ESP_OK;
+  }
+
+  int index = to[5] - 1;
+  TemperatureCommand command;
+  memcpy(&command, data + sizeof(MessageHeader), sizeof(command));
+  if (index >= 0 && index < RADIATORS && !muted[index]) {
+    radio.push({ simMicros + ackDelayMs * 1000, [index, command]() { deliverResponse(index, command); } });
+  }
+  return ESP_OK;
+}
+
+static CommunicationsFor<ServerCapacity> coms;
+static RadiatorManagerFor<ServerCapacity> manager(coms);
+static RadiatorCommands commands(manager);
+static LocalWeb web(manager, commands);
+
+static std::vector<std::string> received; // WebSocket messages, oldest first
+
+// One loop() pass per virtual millisecond, like esp-server.ino
+static void run(int ms) {
+  for (int i = 0; i < ms; i++) {
+    simMicros += 1000;
+    while (!radio.empty() && radio.top().at <= simMicros) {
+      RadioEvent event = radio.top();
+      radio.pop();
+      event.deliver();
+    }
+    manager.update();
+    web.update();
+    simServer->simSocket()->simDrain(1, [](AsyncWebSocketClient&, const char* data, size_t length, uint64_t) {
+      received.push_back(std::string(data, length));
+    });
+  }
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what, const std::string& got = "") {
+  printf("%s %s%s%s\n", ok ? "ok  " : "FAIL", what, got.empty() ? "" : ": ", got.c_str());
+  if (!ok) failures++;
+}
+
+static bool contains(const std::string& text, const char* part) {
+  return text.find(part) != std::string::npos;
+}
+
+static std::string takeMessage(const char* containing) {
+  for (auto it = received.begin(); it != received.end(); ++it) {
+    if (contains(*it, containing)) {
+      std::string message = *it;
+      received.erase(it);
+      return message;
+    }
+  }
+  return "";
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) ackDelayMs = atoi(argv[1]);
+
+  std::string self = __FILE__;
+  LittleFS.root = self.substr(0, self.rfind('/') + 1) + "../esp-server/data";
+  simEspNow.transmit = transmit;
+
+  coms.begin();
+  coms.setName("server");
+  coms.setReceiveHandler([](const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
+    if (type == MSG_TYPE_TEMPERATURE_RESPONSE && len == sizeof(TemperatureResponse)) {
+      TemperatureResponse response;
+      memcpy(&response, data, sizeof(response));
+      manager.processTemperatureResponse(mac, response);
+    }
+  });
+  coms.setSendHandler([](const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
+    manager.processSendStatus(mac, type, status);
+  });
+  web.begin();
+
+  for (int i = 0; i < RADIATORS; i++) {
+    Peer peer = {};
+    radiatorMac(i, peer.mac);
+    strcpy(peer.name, "radiator");
+    manager.handleDiscovery(peer);
+  }
+  run(1);
+
+  printf("soft-AP %s on channel %d, Wi-Fi mode %s\n\n", web.ip, WiFi.apChannel,
+         WiFi.currentMode == WIFI_AP_STA ? "AP+STA" : "not AP+STA");
+
+  // Page load
+  auto page = simServer->simGet("/");
+  expect(page->response() && page->response()->code == 200 &&
+         page->response()->headers["Content-Encoding"] == "gzip", "GET / serves the gzip page");
+  std::string etag = page->response() ? page->response()->headers["ETag"] : "";
+  auto again = simServer->simGet("/", { { "If-None-Match", etag } });
+  expect(again->response() && again->response()->code == 304, "GET / revalidates to 304");
+
+  auto list = simServer->simGet("/api/radiators");
+  expect(list->response() && contains(list->response()->body, "\"name\":\"Room 3\""), "GET /api/radiators",
+         list->response() ? list->response()->body.substr(0, 60) + "..." : "");
+  std::string listEtag = list->response() ? list->response()->headers["ETag"] : "";
+
+  // WebSocket: the list on connect, then a batch with one good and two bad operations
+  AsyncWebSocket* ws = simServer->simSocket();
+  AsyncWebSocketClient* client = ws->simConnect(100);
+  run(5);
+  expect(!takeMessage("[{\"mac\"").empty(), "WebSocket client gets the list on connect");
+
+  uint64_t sentAt = simMicros;
+  firstFrameAt = 0;
+  ws->simReceive(client, "{\"req\":1,\"ops\":[{\"op\":\"temp\",\"id\":1,\"t\":22},"
+                         "{\"op\":\"temp\",\"id\":9,\"t\":22},{\"op\":\"all\",\"t\":35}]}");
+  run(2);
+  std::string results = takeMessage("\"results\"");
+  expect(results == "{\"req\":1,\"results\":[{\"ok\":true},{\"ok\":false,\"error\":\"unknown radiator\"},"
+                    "{\"ok\":false,\"error\":\"temperature out of range\"}]}", "batch results", results);
+  expect(firstFrameAt != 0, "setpoint on air");
+  printf("     web command to ESP-NOW send: %.1f ms\n", (firstFrameAt - sentAt) / 1000.0);
+
+  run(ackDelayMs + 5);
+  std::string outcome = takeMessage("\"result\"");
+  expect(contains(outcome, "{\"req\":1,\"op\":0,\"id\":1,\"result\":\"acked\""), "batch outcome", outcome);
+  expect(!takeMessage("\"id\":1,\"mac\"").empty(), "radiator 1 pushed to the client");
+
+  auto changed = simServer->simGet("/api/radiators", { { "If-None-Match", listEtag } });
+  expect(changed->response() && changed->response()->code == 200, "GET /api/radiators is fresh after the change");
+
+  // Compatibility path: held until the radiators answer
+  auto setTemp = simServer->simGet("/set/temp?id=2&temp=19");
+  expect(!setTemp->response(), "GET /set/temp is held");
+  run(ackDelayMs + 5);
+  expect(setTemp->response() && setTemp->response()->code == 200, "GET /set/temp answers 200 once acked",
+         setTemp->response() ? setTemp->response()->body : "");
+
+  auto setAll = simServer->simGet("/set/all?temperature=24");
+  run(ackDelayMs + 5);
+  expect(setAll->response() && setAll->response()->code == 200, "GET /set/all answers 200 once all acked",
+         setAll->response() ? setAll->response()->body : "");
+
+  // Radiator 1 has answered the batch and the set-all
+  auto links = simServer->simGet("/api/links");
+  std::string body = links->response() ? links->response()->body : "";
+  std::string link = body.substr(min(body.find("{\"link\":1,"), body.size()));
+  link = link.substr(0, link.find('}') + 1);
+  expect(body[0] == '[' && contains(link, "\"acks\":2,") && contains(link, "\"failed\":0,"), "GET /api/links", link);
+
+  auto badTemp = simServer->simGet("/set/all?temperature=40");
+  expect(badTemp->response() && badTemp->response()->code == 400, "GET /set/all rejects 40°C at once");
+
+  muted[0] = true;
+  auto silent = simServer->simGet("/set/temp?id=0&temp=23");
+  run(COMMAND_TIMEOUT_MS + 100);
+  expect(silent->response() && silent->response()->code == 504, "GET /set/temp answers 504 for a silent radiator",
+         silent->response() ? silent->response()->body : "");
+  muted[0] = false;
+
+  auto first = simServer->simGet("/set/temp?id=1&temp=20");
+  auto second = simServer->simGet("/set/temp?id=1&temp=21");
+  run(ackDelayMs + 5);
+  expect(first->response() && first->response()->code == 409, "a replaced setpoint answers 409");
+  expect(second->response() && second->response()->code == 200, "the setpoint replacing it answers 200");
+
+  auto name = simServer->simGet("/set/name?id=2&name=Hall");
+  run(2);
+  expect(name->response() && name->response()->code == 200 && std::string(manager.getRadiatorName(2)) == "Hall",
+         "GET /set/name renames radiator 2");
+
+  auto gone = simServer->simGet("/set/temp?id=2&temp=25");
+  gone->simDisconnect();
+  gone.reset();
+  run(ackDelayMs + 5); // the outcome must not touch the freed request
+
+  printf("\n%s\n", failures == 0 ? "all answers match esp-web" : "mismatches above");
+  return failures == 0 ? 0 : 1;
+}
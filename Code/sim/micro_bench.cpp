@@ -0,0 +1,786 @@
+// micro_bench.cpp
+// Google Benchmark suite for esp-server's per-frame and per-line hot paths,
+// built for the PC against the shims. Each benchmark reports, besides time,
+// host cycles per operation (x86 TSC) and heap allocations per operation,
+// and the ones that scale with the fleet run at 1, half and all of
+// ServerCapacity::radiators. The radiator list runs at 10, 100 and 500
+// radiators on a bench-only preset, and reports how deep it goes into the
+// stack as well.
+//
+// Absolute numbers are the PC's, not the ESP32's; use them to compare two
+// builds on the same machine. Debug output goes through Serial with echo
+// off, so its formatting is counted as on the board.
+//
+//   ./micro_bench --benchmark_out=bench.json --benchmark_out_format=json
+#include <Arduino.h>
+#include <benchmark/benchmark.h>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <ucontext.h>
+#include <vector>
+#include "Communications.h"
+#include "Delegate.h"
+#include "Messages.h"
+#include "RadiatorManager.h"
+#include "RadiatorCommands.h"
+#include "WebComs.h"
+#include "LineReader.h"
+#include "LoopWatchdog.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// === Allocation counting ===
+
+static uint64_t allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  allocations++;
+  return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+static uint64_t cycleCount() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Runs work once on a stack of its own filled with BENCH_STACK_FILL, and
+// returns how much of it was touched: the deepest work went, on the host,
+// measured the way fleet.cpp measures its radiators
+
+#define BENCH_STACK_SIZE (64 * 1024)
+#define BENCH_STACK_FILL 0xA5
+
+static ucontext_t benchContext;
+static ucontext_t stackContext;
+static const std::function<void()>* stackWork;
+
+static void runStackWork() {
+  (*stackWork)();
+}
+
+static size_t peakStack(const std::function<void()>& work) {
+  static std::vector<uint8_t> stack(BENCH_STACK_SIZE);
+  std::fill(stack.begin(), stack.end(), BENCH_STACK_FILL);
+  stackWork = &work;
+  getcontext(&stackContext);
+  stackContext.uc_stack.ss_sp = stack.data();
+  stackContext.uc_stack.ss_size = stack.size();
+  stackContext.uc_link = &benchContext;
+  makecontext(&stackContext, runStackWork, 0);
+  swapcontext(&benchContext, &stackContext);
+
+  size_t untouched = 0;
+  while (untouched < stack.size() && stack[untouched] == BENCH_STACK_FILL) untouched++;
+  return stack.size() - untouched;
+}
+
+// Runs body once per iteration and adds cycles/op and allocs/op
+template <typename F>
+static void measure(benchmark::State& state, F body) {
+  uint64_t allocationsBefore = allocations;
+  uint64_t cyclesBefore = cycleCount();
+  for (auto _ : state) {
+    body();
+  }
+  uint64_t cycles = cycleCount() - cyclesBefore;
+  uint64_t allocated = allocations - allocationsBefore;
+
+  if (cycles > 0) {
+    state.counters["cycles/op"] = benchmark::Counter((double)cycles, benchmark::Counter::kAvgIterations);
+  }
+  state.counters["allocs/op"] = benchmark::Counter((double)allocated, benchmark::Counter::kAvgIterations);
+}
+
+// === Fixture ===
+// One Communications, like on the board, with the server's handlers and a
+// manager that has discovered the number of radiators the benchmark asks for
+
+static CommunicationsFor<ServerCapacity> coms;
+static HardwareSerial uart; // esp-web's end, writes are dropped
+static std::unique_ptr<RadiatorManagerFor<ServerCapacity>> manager;
+static std::unique_ptr<RadiatorCommands> commands;
+static std::unique_ptr<WebComs> web;
+static CaptureRecord captureRing[128]; // esp-server.ino's CAPTURE_RECORDS
+static const uint8_t authKey[AUTH_KEY_BYTES] = { 0x6B, 0x1F, 0xD2, 0x47, 0x90, 0x3C, 0xA5, 0x0E,
+                                                 0x81, 0xF4, 0x29, 0xB7, 0x5D, 0xC6, 0x12, 0x7A };
+
+static void radiatorMac(int index, uint8_t* mac) {
+  const uint8_t base[6] = { 0x34, 0x85, 0x18, 0x00, 0x00, 0x00 };
+  memcpy(mac, base, 6);
+  mac[4] = index >> 8;
+  mac[5] = index;
+}
+
+static void setupServer(int radiators) {
+  static bool started = false;
+  if (!started) {
+    coms.begin();
+    coms.setName("server");
+    coms.setDeviceClass(DEVICE_CLASS_SERVER);
+    coms.addToDiscoveryWhitelist(DEVICE_CLASS_RADIATOR);
+    started = true;
+  }
+
+  web.reset();
+  commands.reset();
+  manager.reset(new RadiatorManagerFor<ServerCapacity>(coms));
+  commands.reset(new RadiatorCommands(*manager));
+  web.reset(new WebComs(uart, *manager, *commands));
+
+  coms.setReceiveHandler([](const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
+    if (type == MSG_TYPE_TEMPERATURE_RESPONSE && len == sizeof(TemperatureResponse)) {
+      TemperatureResponse response;
+      memcpy(&response, data, sizeof(response));
+      manager->processTemperatureResponse(mac, response);
+    }
+  });
+
+  for (int i = 0; i < radiators; i++) {
+    Peer peer = {};
+    radiatorMac(i, peer.mac);
+    strcpy(peer.name, "radiator");
+    manager->handleDiscovery(peer);
+  }
+}
+
+static void fleetSizes(benchmark::internal::Benchmark* b) {
+  b->Arg(1);
+  if (ServerCapacity::radiators / 2 > 1) b->Arg(ServerCapacity::radiators / 2);
+  b->Arg(ServerCapacity::radiators);
+}
+
+// Builds an ESP-NOW frame the way Communications::send lays it out
+template <typename T>
+static std::string frame(uint8_t type, const T& payload) {
+  MessageHeader header = { MESSAGE_MAGIC, type, sizeof(T) };
+  std::string out((const char*)&header, sizeof(header));
+  out.append((const char*)&payload, sizeof(T));
+  return out;
+}
+
+static void receive(const uint8_t* mac, const std::string& data) {
+  esp_now_recv_info_t info = { const_cast<uint8_t*>(mac), nullptr, nullptr };
+  simEspNow.onReceive(&info, (const uint8_t*)data.data(), data.size());
+}
+
+// Peers up to the argument, discovered and named as a radiator would answer
+static void discoverPeers(int peers) {
+  std::string reply = frame(DISCOVERY_COMPACT_MSG_TYPE, CompactDiscovery{ DISCOVERY_VERSION, DEVICE_CLASS_RADIATOR,
+                                                                          DISCOVERY_RESPONSE, 0 });
+  MessageHeader header = { MESSAGE_MAGIC, NAME_REPLY_MSG_TYPE, 8 };
+  std::string name = std::string((const char*)&header, sizeof(header)) + "radiator";
+  uint8_t mac[6];
+  for (int i = coms.getPeerCount(); i < peers; i++) {
+    radiatorMac(i, mac);
+    receive(mac, reply);
+    receive(mac, name);
+  }
+  // The name requests never get a send callback; let them expire out of the window, the last ones too
+  bool queued = true;
+  while (queued) {
+    queued = coms.getTxStats().depth > 0;
+    simMicros += TX_INFLIGHT_TIMEOUT_MS * 1000UL + 1;
+    coms.update();
+  }
+}
+
+// === Communications ===
+
+// Through the transmit queue to the driver and back in the send callback,
+// one pacing interval apart so every frame goes out at once
+static void BM_Send(benchmark::State& state) {
+  setupServer(1);
+  uint8_t mac[6];
+  radiatorMac(0, mac);
+  TemperatureCommand command = { 21, 7 };
+  measure(state, [&]() {
+    simMicros += TX_PACE_US;
+    benchmark::DoNotOptimize(coms.send(mac, MSG_TYPE_TEMPERATURE_COMMAND, command));
+    simEspNow.onSent(mac, ESP_NOW_SEND_SUCCESS);
+  });
+}
+BENCHMARK(BM_Send);
+
+// The same with RADIO_CAPTURE 1: the frame and its send result also go into the ring
+static void BM_SendCaptured(benchmark::State& state) {
+  setupServer(1);
+  coms.enableCapture(captureRing, sizeof(captureRing) / sizeof(captureRing[0]));
+  uint8_t mac[6];
+  radiatorMac(0, mac);
+  TemperatureCommand command = { 21, 7 };
+  measure(state, [&]() {
+    simMicros += TX_PACE_US;
+    benchmark::DoNotOptimize(coms.send(mac, MSG_TYPE_TEMPERATURE_COMMAND, command));
+    simEspNow.onSent(mac, ESP_NOW_SEND_SUCCESS);
+  });
+  coms.disableCapture();
+}
+BENCHMARK(BM_SendCaptured);
+
+// Header checks and dispatch of an ack to RadiatorManager, found at the last index
+static void BM_OnDataRecvAck(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupServer(radiators);
+  uint8_t mac[6];
+  radiatorMac(radiators - 1, mac);
+  std::string data = frame(MSG_TYPE_TEMPERATURE_RESPONSE, TemperatureResponse{ 21, true, 0 });
+  measure(state, [&]() { receive(mac, data); });
+}
+BENCHMARK(BM_OnDataRecvAck)->Apply(fleetSizes);
+
+static void BM_OnDataRecvAckCaptured(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupServer(radiators);
+  coms.enableCapture(captureRing, sizeof(captureRing) / sizeof(captureRing[0]));
+  uint8_t mac[6];
+  radiatorMac(radiators - 1, mac);
+  std::string data = frame(MSG_TYPE_TEMPERATURE_RESPONSE, TemperatureResponse{ 21, true, 0 });
+  measure(state, [&]() { receive(mac, data); });
+  coms.disableCapture();
+}
+BENCHMARK(BM_OnDataRecvAckCaptured)->Arg(ServerCapacity::radiators);
+
+// With FRAME_AUTH 1. The tag alone, over the sender's MAC and a signed
+// frame of the argument's length: a setpoint or ack, and the largest frame
+static void BM_SipHash(benchmark::State& state) {
+  uint64_t key[2];
+  memcpy(key, authKey, sizeof(key));
+  uint8_t message[6 + ESP_NOW_MAX_DATA_LEN] = {};
+  size_t length = 6 + state.range(0) - AUTH_TAG_BYTES;
+  measure(state, [&]() {
+    message[6]++;
+    benchmark::DoNotOptimize(Communications::sipHash(key, message, length));
+  });
+}
+BENCHMARK(BM_SipHash)
+    ->Arg(sizeof(MessageHeader) + sizeof(TemperatureCommand) + sizeof(AuthTrailer))
+    ->Arg(ESP_NOW_MAX_DATA_LEN);
+
+static void BM_SendSigned(benchmark::State& state) {
+  setupServer(1);
+  coms.enableAuth(authKey);
+  uint8_t mac[6];
+  radiatorMac(0, mac);
+  TemperatureCommand command = { 21, 7 };
+  measure(state, [&]() {
+    simMicros += TX_PACE_US;
+    benchmark::DoNotOptimize(coms.send(mac, MSG_TYPE_TEMPERATURE_COMMAND, command));
+    simEspNow.onSent(mac, ESP_NOW_SEND_SUCCESS);
+    coms.update(); // reserves the next block of counters
+  });
+  coms.disableAuth();
+}
+BENCHMARK(BM_SendSigned);
+
+// A frame from mac signed the way a radiator would sign it
+static std::string signedFrame(const uint8_t* mac, uint8_t type, const void* payload, uint8_t length, uint32_t counter) {
+  MessageHeader header = { MESSAGE_MAGIC_SIGNED, type, length };
+  std::string message((const char*)mac, 6);
+  message.append((const char*)&header, sizeof(header));
+  message.append((const char*)payload, length);
+  message.append((const char*)&counter, sizeof(counter));
+  uint64_t key[2];
+  memcpy(key, authKey, sizeof(key));
+  uint64_t tag = Communications::sipHash(key, (const uint8_t*)message.data(), message.size());
+  message.append((const char*)&tag, AUTH_TAG_BYTES);
+  return message.substr(6);
+}
+
+// Every iteration signs a new ack the way the radiator would, so this is
+// BM_SipHash's first case more than the receive side costs. The radiator
+// answers the server's challenge first, or its acks would all be dropped.
+static void BM_OnDataRecvAckSigned(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupServer(radiators);
+  coms.enableAuth(authKey);
+  uint8_t mac[6];
+  radiatorMac(radiators - 1, mac);
+
+  TemperatureResponse response = { 21, true, 0 };
+  AuthChallenge challenge = {};
+  simEspNow.transmit = [&](const uint8_t*, const uint8_t* data, size_t) {
+    MessageHeader sent;
+    memcpy(&sent, data, sizeof(sent));
+    if (sent.type == AUTH_CHALLENGE_MSG_TYPE) memcpy(&challenge, data + sizeof(sent), sizeof(challenge));
+    return ESP_OK;
+  };
+  uint32_t counter = 0;
+  simMicros += TX_PACE_US;
+  receive(mac, signedFrame(mac, MSG_TYPE_TEMPERATURE_RESPONSE, &response, sizeof(response), ++counter));
+  coms.update(); // sends the challenge
+  simEspNow.transmit = nullptr;
+  simEspNow.onSent(Communications::broadcastAddr, ESP_NOW_SEND_SUCCESS);
+  memcpy(challenge.to, simEspNow.mac, 6);
+  receive(mac, signedFrame(mac, AUTH_RESPONSE_MSG_TYPE, &challenge, sizeof(challenge), ++counter));
+
+  MessageHeader header = { MESSAGE_MAGIC_SIGNED, MSG_TYPE_TEMPERATURE_RESPONSE, sizeof(response) };
+  uint8_t message[6 + sizeof(header) + sizeof(response) + sizeof(AuthTrailer)];
+  memcpy(message, mac, 6);
+  memcpy(message + 6, &header, sizeof(header));
+  memcpy(message + 6 + sizeof(header), &response, sizeof(response));
+  AuthTrailer* trailer = (AuthTrailer*)(message + 6 + sizeof(header) + sizeof(response));
+  esp_now_recv_info_t info = { mac, nullptr, nullptr };
+  uint64_t key[2];
+  memcpy(key, authKey, sizeof(key));
+  uint32_t first = counter;
+  uint32_t acceptedBefore = coms.getAuthStats().accepted;
+  measure(state, [&]() {
+    trailer->counter = ++counter;
+    uint64_t tag = Communications::sipHash(key, message, sizeof(message) - AUTH_TAG_BYTES);
+    memcpy(trailer->tag, &tag, AUTH_TAG_BYTES);
+    simEspNow.onReceive(&info, message + 6, sizeof(message) - 6);
+  });
+  if (coms.getAuthStats().accepted - acceptedBefore != counter - first) state.SkipWithError("signed acks were dropped");
+  coms.disableAuth();
+}
+BENCHMARK(BM_OnDataRecvAckSigned)->Arg(ServerCapacity::radiators);
+
+static void BM_OnDataRecvBadMagic(benchmark::State& state) {
+  setupServer(1);
+  uint8_t mac[6];
+  radiatorMac(0, mac);
+  std::string data = frame(MSG_TYPE_TEMPERATURE_RESPONSE, TemperatureResponse{ 21, true, 0 });
+  data[0] ^= 0xFF;
+  measure(state, [&]() { receive(mac, data); });
+}
+BENCHMARK(BM_OnDataRecvBadMagic);
+
+// A radiator's discovery reply from a peer that is already known, the
+// steady state once the house is set up; peers fill up to the argument
+static void BM_HandleDiscoveryKnown(benchmark::State& state) {
+  int peers = state.range(0);
+  setupServer(0);
+  discoverPeers(peers);
+  std::string data = frame(DISCOVERY_COMPACT_MSG_TYPE, CompactDiscovery{ DISCOVERY_VERSION, DEVICE_CLASS_RADIATOR,
+                                                                         DISCOVERY_RESPONSE, 0 });
+  uint8_t mac[6];
+  radiatorMac(peers - 1, mac);
+  measure(state, [&]() { receive(mac, data); });
+}
+BENCHMARK(BM_HandleDiscoveryKnown)->Arg(1)->Arg(ServerCapacity::peers);
+
+// The same reply from a radiator still on the name-based discovery
+static void BM_HandleDiscoveryKnownLegacy(benchmark::State& state) {
+  int peers = state.range(0);
+  setupServer(0);
+  discoverPeers(peers);
+  DiscoveryPayload payload = {};
+  strcpy(payload.name, "radiator");
+  payload.isResponse = true;
+  std::string data = frame(DISCOVERY_MSG_TYPE, payload);
+  uint8_t mac[6];
+  radiatorMac(peers - 1, mac);
+  measure(state, [&]() { receive(mac, data); });
+}
+BENCHMARK(BM_HandleDiscoveryKnownLegacy)->Arg(ServerCapacity::peers);
+
+// A class from newer firmware, not whitelisted
+static void BM_HandleDiscoveryNotWhitelisted(benchmark::State& state) {
+  setupServer(0);
+  std::string data = frame(DISCOVERY_COMPACT_MSG_TYPE, CompactDiscovery{ DISCOVERY_VERSION, DEVICE_CLASS_COUNT, 0, 0 });
+  uint8_t mac[6];
+  radiatorMac(500, mac);
+  measure(state, [&]() { receive(mac, data); });
+}
+BENCHMARK(BM_HandleDiscoveryNotWhitelisted);
+
+// The radiator's check that a command comes from the server, over a full
+// peer table without one: the longest search by name against the cached index
+static void BM_FindServerByName(benchmark::State& state) {
+  setupServer(0);
+  discoverPeers(ServerCapacity::peers);
+  measure(state, [&]() { benchmark::DoNotOptimize(coms.getPeerByName("server")); });
+}
+BENCHMARK(BM_FindServerByName);
+
+static void BM_FindServerByClass(benchmark::State& state) {
+  setupServer(0);
+  discoverPeers(ServerCapacity::peers);
+  measure(state, [&]() { benchmark::DoNotOptimize(coms.getPeerByClass(DEVICE_CLASS_SERVER)); });
+}
+BENCHMARK(BM_FindServerByClass);
+
+static void BM_MacToString(benchmark::State& state) {
+  uint8_t mac[6];
+  radiatorMac(3, mac);
+  measure(state, [&]() { benchmark::DoNotOptimize(Communications::macToString(mac)); });
+}
+BENCHMARK(BM_MacToString);
+
+static void BM_FormatMac(benchmark::State& state) {
+  uint8_t mac[6];
+  radiatorMac(3, mac);
+  char text[18];
+  measure(state, [&]() {
+    Communications::formatMac(mac, text);
+    benchmark::DoNotOptimize(text);
+  });
+}
+BENCHMARK(BM_FormatMac);
+
+// === Handlers ===
+// The send handler call the Wi-Fi callback makes on every frame, through the
+// Delegate Communications uses and through the std::function it replaced
+
+static uint32_t handled = 0;
+
+static void countSent(const uint8_t*, uint8_t, esp_now_send_status_t status) {
+  handled += status;
+}
+
+template <typename Handler>
+static void callHandler(benchmark::State& state, Handler handler) {
+  uint8_t mac[6];
+  radiatorMac(0, mac);
+  measure(state, [&]() {
+    benchmark::DoNotOptimize(handler);
+    handler(mac, MSG_TYPE_TEMPERATURE_COMMAND, ESP_NOW_SEND_FAIL);
+  });
+  benchmark::DoNotOptimize(handled);
+}
+
+static void BM_DelegateFunction(benchmark::State& state) {
+  callHandler(state, SendHandler(countSent));
+}
+BENCHMARK(BM_DelegateFunction);
+
+static void BM_StdFunctionFunction(benchmark::State& state) {
+  callHandler(state, std::function<void(const uint8_t*, uint8_t, esp_now_send_status_t)>(countSent));
+}
+BENCHMARK(BM_StdFunctionFunction);
+
+// A lambda capturing an object pointer, like a handler forwarding to RadiatorManager
+static void BM_DelegateLambda(benchmark::State& state) {
+  uint32_t* counter = &handled;
+  callHandler(state, SendHandler([counter](const uint8_t*, uint8_t, esp_now_send_status_t status) { *counter += status; }));
+}
+BENCHMARK(BM_DelegateLambda);
+
+static void BM_StdFunctionLambda(benchmark::State& state) {
+  uint32_t* counter = &handled;
+  callHandler(state, std::function<void(const uint8_t*, uint8_t, esp_now_send_status_t)>(
+                       [counter](const uint8_t*, uint8_t, esp_now_send_status_t status) { *counter += status; }));
+}
+BENCHMARK(BM_StdFunctionLambda);
+
+// === RadiatorManager ===
+
+// findRadiatorIndex() is private; a send result for the last radiator that
+// changes nothing is the lookup and a compare
+static void BM_FindRadiatorIndex(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupServer(radiators);
+  uint8_t mac[6];
+  radiatorMac(radiators - 1, mac);
+  measure(state, [&]() { manager->processSendStatus(mac, MSG_TYPE_TEMPERATURE_COMMAND, ESP_NOW_SEND_SUCCESS); });
+}
+BENCHMARK(BM_FindRadiatorIndex)->Apply(fleetSizes);
+
+static void BM_IsAllAcked(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupServer(radiators);
+  uint8_t mac[6];
+  for (int i = 0; i < radiators; i++) {
+    radiatorMac(i, mac);
+    manager->processTemperatureResponse(mac, TemperatureResponse{ DEFAULT_TEMP, true, 0 });
+  }
+  measure(state, [&]() { benchmark::DoNotOptimize(manager->isAllAcked()); });
+}
+BENCHMARK(BM_IsAllAcked)->Apply(fleetSizes);
+
+// A setpoint, its send result and the answer, each of which updates the
+// radiator's RadiatorLink; the answer also records a round trip
+static void BM_SetpointRoundTrip(benchmark::State& state) {
+  setupServer(1);
+  uint8_t mac[6];
+  radiatorMac(0, mac);
+  measure(state, [&]() {
+    simMicros += TX_PACE_US;
+    manager->sendTemperatureCommand(mac, DEFAULT_TEMP);
+    simEspNow.onSent(mac, ESP_NOW_SEND_SUCCESS);
+    manager->processTemperatureResponse(mac, TemperatureResponse{ DEFAULT_TEMP, true, 0 });
+  });
+}
+BENCHMARK(BM_SetpointRoundTrip);
+
+// === Zones and ack aggregation ===
+// The radiator state as arrays and bit sets, against the array of structs it
+// replaced, for fleets past what one ESP-NOW channel holds. Every radiator
+// is acked and a third of them are in zone 0, so each query walks them all.
+
+struct HouseholdCapacity {
+  static constexpr uint8_t peers = 255;
+  static constexpr uint8_t radiators = 255;
+};
+
+// Radiator before the split, with a zone mask as the struct way of grouping
+struct RadiatorStruct {
+  uint8_t mac[6];
+  char name[16];
+  uint8_t curr_temp;
+  bool ackReceived;
+  bool online;
+  unsigned long lastSeen;
+  uint32_t version;
+  uint16_t request;
+  uint8_t requestState;
+  uint8_t zones;
+};
+
+static std::unique_ptr<RadiatorManagerFor<HouseholdCapacity>> household;
+static RadiatorStruct structs[HouseholdCapacity::radiators];
+
+static void setupHousehold(int radiators) {
+  setupServer(0); // starts coms
+  household.reset(new RadiatorManagerFor<HouseholdCapacity>(coms));
+  memset(structs, 0, sizeof(structs));
+
+  uint8_t mac[6];
+  for (int i = 0; i < radiators; i++) {
+    Peer peer = {};
+    radiatorMac(i, peer.mac);
+    strcpy(peer.name, "radiator");
+    household->handleDiscovery(peer);
+    household->processTemperatureResponse(peer.mac, TemperatureResponse{ DEFAULT_TEMP, true, 0 });
+    if (i % 3 == 0) household->addToZone(0, i);
+
+    radiatorMac(i, mac);
+    memcpy(structs[i].mac, mac, 6);
+    structs[i].curr_temp = DEFAULT_TEMP;
+    structs[i].ackReceived = true;
+    structs[i].zones = i % 3 == 0 ? 1 : 0;
+  }
+}
+
+static void householdSizes(benchmark::internal::Benchmark* b) {
+  b->Arg(ServerCapacity::radiators)->Arg(64)->Arg(HouseholdCapacity::radiators);
+}
+
+static void BM_AllAckedBits(benchmark::State& state) {
+  setupHousehold(state.range(0));
+  measure(state, [&]() { benchmark::DoNotOptimize(household->isAllAcked()); });
+}
+BENCHMARK(BM_AllAckedBits)->Apply(householdSizes);
+
+static void BM_AllAckedStructs(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupHousehold(radiators);
+  measure(state, [&]() {
+    bool acked = true;
+    for (int i = 0; i < radiators && acked; i++) {
+      acked = structs[i].ackReceived;
+    }
+    benchmark::DoNotOptimize(acked);
+  });
+}
+BENCHMARK(BM_AllAckedStructs)->Apply(householdSizes);
+
+static void BM_ZoneAckedBits(benchmark::State& state) {
+  setupHousehold(state.range(0));
+  measure(state, [&]() { benchmark::DoNotOptimize(household->isZoneAcked(0)); });
+}
+BENCHMARK(BM_ZoneAckedBits)->Apply(householdSizes);
+
+static void BM_ZoneAckedStructs(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupHousehold(radiators);
+  measure(state, [&]() {
+    bool acked = true;
+    for (int i = 0; i < radiators && acked; i++) {
+      if (structs[i].zones & 1) acked = structs[i].ackReceived;
+    }
+    benchmark::DoNotOptimize(acked);
+  });
+}
+BENCHMARK(BM_ZoneAckedStructs)->Apply(householdSizes);
+
+// "Who is pending": how many of the zone still owe an ack
+static void BM_CountPendingBits(benchmark::State& state) {
+  setupHousehold(state.range(0));
+  measure(state, [&]() { benchmark::DoNotOptimize(household->countPending(0)); });
+}
+BENCHMARK(BM_CountPendingBits)->Apply(householdSizes);
+
+static void BM_CountPendingStructs(benchmark::State& state) {
+  int radiators = state.range(0);
+  setupHousehold(radiators);
+  measure(state, [&]() {
+    int pending = 0;
+    for (int i = 0; i < radiators; i++) {
+      pending += (structs[i].zones & 1) && !structs[i].ackReceived;
+    }
+    benchmark::DoNotOptimize(pending);
+  });
+}
+BENCHMARK(BM_CountPendingStructs)->Apply(householdSizes);
+
+// === Loop watchdog ===
+// What LoopWatchdog adds to every loop(), shaped like esp-radiator.ino's: the
+// iteration and two stages. micros() is the virtual clock here, cheaper than
+// the board's. The stall case writes a record and its debug line every time.
+
+static LoopWatchdog watchdog;
+static StallLog stallLog;
+static StallRecord stallRing[8]; // the sketches' STALL_RECORDS
+
+static void BM_WatchedLoop(benchmark::State& state) {
+  watchdog.begin(stallLog, stallRing, 8, state.range(0));
+  measure(state, []() {
+    ScopedLoop watched(watchdog);
+    {
+      ScopedStage stage(watchdog, STAGE_STEPPER);
+      simMicros++;
+    }
+    {
+      ScopedStage stage(watchdog, STAGE_COMS);
+      simMicros++;
+    }
+  });
+}
+BENCHMARK(BM_WatchedLoop)->ArgName("budget")->Arg(2000)->Arg(0);
+
+// === WebComs ===
+
+static void BM_Tokenize(benchmark::State& state) {
+  const char* line = "SET/TEMP/3/21/17";
+  StrView parts[5];
+  measure(state, [&]() {
+    benchmark::DoNotOptimize(tokenize({ line, strlen(line) }, '/', parts, 5));
+    benchmark::DoNotOptimize(parts);
+  });
+}
+BENCHMARK(BM_Tokenize);
+
+// A line through WebComs::update(): UART read, line buffering, handleLine()
+static void handleLine(benchmark::State& state, const char* line, int radiators) {
+  setupServer(radiators);
+  std::string text = std::string(line) + "\n";
+  web->update(); // first push of the radiator list
+  measure(state, [&]() {
+    uart.simRx += text;
+    web->update();
+  });
+}
+
+static void BM_HandleLineInfo(benchmark::State& state) {
+  handleLine(state, "INFO/192.168.4.1/RadiatorHub/secret123", 1);
+}
+BENCHMARK(BM_HandleLineInfo);
+
+static void BM_HandleLineSetTemp(benchmark::State& state) {
+  setupServer(1);
+  web->update();
+  // Alternating setpoints, so every line reaches the radio
+  const char* lines[2] = { "SET/TEMP/0/21\n", "SET/TEMP/0/22\n" };
+  int n = 0;
+  measure(state, [&]() {
+    uart.simRx += lines[n++ & 1];
+    web->update();
+  });
+}
+BENCHMARK(BM_HandleLineSetTemp);
+
+static void BM_HandleLineAll(benchmark::State& state) {
+  setupServer(state.range(0));
+  web->update();
+  const char* lines[2] = { "ALL/T/21\n", "ALL/T/22\n" };
+  int n = 0;
+  measure(state, [&]() {
+    uart.simRx += lines[n++ & 1];
+    web->update();
+  });
+}
+BENCHMARK(BM_HandleLineAll)->Apply(fleetSizes);
+
+// SET/ZONE/0/TEMP: the setpoint to every radiator in a zone of all of them
+static void BM_HandleLineZone(benchmark::State& state) {
+  setupServer(state.range(0));
+  for (int i = 0; i < state.range(0); i++) manager->addToZone(0, i);
+  web->update();
+  const char* lines[2] = { "SET/ZONE/0/TEMP/21\n", "SET/ZONE/0/TEMP/22\n" };
+  int n = 0;
+  measure(state, [&]() {
+    uart.simRx += lines[n++ & 1];
+    web->update();
+  });
+}
+BENCHMARK(BM_HandleLineZone)->Apply(fleetSizes);
+
+// === Large fleets ===
+// The radiator list past what the server's presets hold, on a manager of
+// its own. Each benchmark also reports stack, the bytes of stack one line
+// took on the host (64-bit), from the call into WebComs::update() down.
+
+struct FleetBenchCapacity {
+  static constexpr int peers = 500;
+  static constexpr int radiators = 500;
+};
+
+static std::unique_ptr<RadiatorManagerFor<FleetBenchCapacity>> fleetManager;
+static std::unique_ptr<RadiatorCommands> fleetCommands;
+static std::unique_ptr<WebComs> fleetWeb;
+
+static void largeFleetSizes(benchmark::internal::Benchmark* b) {
+  b->Arg(10)->Arg(100)->Arg(FleetBenchCapacity::radiators);
+}
+
+static void handleFleetLine(benchmark::State& state, const char* line, int radiators) {
+  setupServer(0); // starts coms
+  fleetWeb.reset();
+  fleetCommands.reset();
+  fleetManager.reset(new RadiatorManagerFor<FleetBenchCapacity>(coms));
+  fleetCommands.reset(new RadiatorCommands(*fleetManager));
+  fleetWeb.reset(new WebComs(uart, *fleetManager, *fleetCommands));
+  for (int i = 0; i < radiators; i++) {
+    Peer peer = {};
+    radiatorMac(i, peer.mac);
+    strcpy(peer.name, "radiator");
+    fleetManager->handleDiscovery(peer);
+  }
+  fleetWeb->update(); // first push of the radiator list
+
+  std::string text = std::string(line) + "\n";
+  std::function<void()> work = [&]() {
+    uart.simRx += text;
+    fleetWeb->update();
+  };
+  state.counters["stack"] = (double)peakStack(work);
+  measure(state, work);
+}
+
+// GET/RADIATORS: the whole list as JSON over the UART
+static void BM_SendRadiatorStates(benchmark::State& state) {
+  handleFleetLine(state, "GET/RADIATORS", state.range(0));
+}
+BENCHMARK(BM_SendRadiatorStates)->Apply(largeFleetSizes);
+
+// GET/RADIATORS/0: sendRadiatorsSince() with every radiator changed, the
+// delta pushChanges() sends after ALL/T
+static void BM_SendRadiatorsSince(benchmark::State& state) {
+  handleFleetLine(state, "GET/RADIATORS/0", state.range(0));
+}
+BENCHMARK(BM_SendRadiatorsSince)->Apply(largeFleetSizes);
+
+// GET/LINKS: a line of link statistics per radiator, and the marker
+static void BM_SendLinks(benchmark::State& state) {
+  handleLine(state, "GET/LINKS", state.range(0));
+}
+BENCHMARK(BM_SendLinks)->Apply(fleetSizes);
+
+BENCHMARK_MAIN();
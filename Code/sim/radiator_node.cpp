@@ -0,0 +1,20 @@
+// radiator_node.cpp
+// esp-radiator.ino compiled for the host, unchanged. The Arduino builder
+// declares a sketch's functions before compiling it, so that is done here.
+// Its globals (coms, stepper, the loop watchdog and its stall log) hold whichever radiator the
+// fleet simulation is running at the moment, see fleet.cpp.
+#include <AccelStepper.h>
+#include <Preferences.h>
+#include "Communications.h"
+#include "Messages.h"
+#include "LoopWatchdog.h"
+
+void OnDataRecv(const uint8_t* mac, uint8_t type, const uint8_t* data, int len);
+void ProcessTemperatureCommand(const uint8_t* mac, const TemperatureCommand& payload);
+bool isServerMac(const uint8_t mac[6]);
+void sendAckTemperatureResponse(const uint8_t* mac, const TemperatureCommand& payload, bool success);
+void sendStallReport();
+void discoverServer();
+bool isServerDiscovered();
+
+#include "../esp-radiator/esp-radiator.ino"
@@ -0,0 +1,512 @@
+// replay.cpp
+// Plays a radio capture back into a fresh Communications on the virtual
+// clock and checks that the board's stack still sends what it sent, when it
+// sent it. The capture is what Communications::dumpCapture() prints: from a
+// board built with RADIO_CAPTURE 1 ('c' over USB serial) or from fleet -c.
+//
+// The capture's header names the board and its settings. A "server" gets
+// Communications and RadiatorManager wired as in esp-server.ino, anything
+// else is a radiator that acks setpoints like esp-radiator.ino. The peers
+// the board knew are discovered first, in their order, so radiator indexes
+// are the board's. Received frames then go in at their capture time with
+// their RSSI, and send results come back at theirs.
+//
+// Frames the board's own code started, setpoints and discovery broadcasts,
+// are started again when the capture shows them going to the driver, and so
+// are the challenges and answers of a signing board, unsigned; the
+// stack has to come up with everything else by itself: discovery replies,
+// acks, relayed messages, time replies, and when each goes out past the
+// transmit window and pacing. Relay beacons and time requests go out on the
+// board's own random timers and are not compared, nor are name requests,
+// which depend on the peers the board knew before the capture started.
+//
+// Sent frames are matched in order against the captured ones to the same
+// next hop with the same message type. The report gives, per kind, the
+// missing and extra frames and how far the matched ones moved, and the host
+// time each received frame took. The exit status is 1 when a frame is
+// missing, extra or more than REPLAY_TOLERANCE_US off.
+//
+//   ./replay capture.txt [-L] [-v]
+//
+// -L gives a server LargeServerCapacity instead of ServerCapacity, -v lists
+// every frame that did not match.
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <vector>
+#include "Communications.h"
+#include "Messages.h"
+#include "RadiatorManager.h"
+
+#define REPLAY_TOLERANCE_US 2000 // a loop() pass either way, on top of the frame's own queueing
+#define REPLAY_DRAIN_MS 1000 // run on past the last record, so a frame held back shows as moved rather than missing
+
+struct Record {
+  uint64_t at; // micros(), unwrapped
+  char kind; // CaptureKind
+  int info;
+  uint8_t mac[6];
+  int length; // of the frame on air
+  std::vector<uint8_t> frame; // the bytes the capture kept
+};
+
+struct PeerLine {
+  uint8_t mac[6];
+  std::string name;
+  unsigned deviceClass = DEVICE_CLASS_UNKNOWN;
+  unsigned version = 0; // 0 as well in a capture from before device classes
+};
+
+// What a sent frame is, looking inside a relayed one
+struct FrameView {
+  bool relayed;
+  uint8_t type; // of the message, relayed or not
+  bool discoveryReply;
+  const uint8_t* origin; // own MAC unless relayed
+  const uint8_t* dest; // the next hop unless relayed
+  const uint8_t* payload;
+  int payloadLength;
+};
+
+static std::string name;
+static uint8_t ownMac[6];
+static bool relay = false;
+static bool timeSync = false;
+static std::vector<PeerLine> peers;
+static std::vector<Record> records;
+static bool isServer = false;
+
+static std::shared_ptr<Communications> coms; // a CommunicationsFor the board's role
+static std::shared_ptr<RadiatorManager> manager; // server only
+
+static bool parseMac(const char* text, uint8_t* mac) {
+  unsigned bytes[6];
+  if (sscanf(text, "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != 6) {
+    return false;
+  }
+  for (int i = 0; i < 6; i++) mac[i] = bytes[i];
+  return true;
+}
+
+static std::string macText(const uint8_t* mac) {
+  char text[18];
+  Communications::formatMac(mac, text);
+  return text;
+}
+
+// Reads the dump, skipping whatever else the board printed around it
+static bool load(const char* path) {
+  std::ifstream in(path);
+  if (!in) return false;
+
+  bool header = false;
+  uint32_t lastRaw = 0;
+  uint64_t at = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+
+    char first[40], second[40], hex[ESP_NOW_MAX_DATA_LEN * 2 + 1] = "";
+    int relayFlag = 0, timeFlag = 0;
+    unsigned seq, raw, length;
+    char kind;
+    int info;
+    if (sscanf(line.c_str(), "CAPTURE/1 %39s %39s relay=%d time=%d", first, second, &relayFlag, &timeFlag) == 4) {
+      name = first;
+      header = parseMac(second, ownMac);
+      relay = relayFlag;
+      timeSync = timeFlag;
+    } else if (sscanf(line.c_str(), "PEER %39s %39s", first, second) == 2) {
+      PeerLine peer;
+      sscanf(line.c_str(), "PEER %*s %*s %u %u", &peer.deviceClass, &peer.version);
+      if (parseMac(first, peer.mac)) {
+        peer.name = second;
+        peers.push_back(peer);
+      }
+    } else if (sscanf(line.c_str(), "CAP %u %u %c %d %39s %u %500s", &seq, &raw, &kind, &info, first, &length, hex) >= 6) {
+      Record record;
+      if (!parseMac(first, record.mac)) continue;
+      // micros() wraps every 71 minutes, and the Wi-Fi task's records may be a little out of order
+      at = records.empty() ? raw : at + (int32_t)(raw - lastRaw);
+      lastRaw = raw;
+      record.at = at;
+      record.kind = kind;
+      record.info = info;
+      record.length = length;
+      for (size_t i = 0; hex[i * 2] && hex[i * 2 + 1]; i++) {
+        unsigned byte;
+        sscanf(hex + i * 2, "%2x", &byte);
+        record.frame.push_back(byte);
+      }
+      records.push_back(record);
+    }
+  }
+  std::stable_sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.at < b.at; });
+  return header;
+}
+
+static bool view(const uint8_t* hop, const uint8_t* data, int length, FrameView& out) {
+  if (length < (int)sizeof(MessageHeader)) return false;
+  MessageHeader header;
+  memcpy(&header, data, sizeof(header));
+  int headerSize = Communications::headerLength(header);
+  length -= Communications::trailerLength(header);
+  if (length < headerSize) return false;
+
+  out = { false, header.type, false, ownMac, hop, data + headerSize, length - headerSize };
+  if (header.type == RELAY_FORWARD_MSG_TYPE) {
+    if (out.payloadLength < (int)sizeof(RelayHeader)) return false;
+    const RelayHeader* carried = (const RelayHeader*)out.payload;
+    out.relayed = true;
+    out.type = carried->type;
+    out.origin = carried->origin;
+    out.dest = carried->dest;
+    out.payload += sizeof(RelayHeader);
+    out.payloadLength -= sizeof(RelayHeader);
+  }
+  if (out.type == DISCOVERY_MSG_TYPE && out.payloadLength >= (int)sizeof(DiscoveryPayload)) {
+    out.discoveryReply = ((const DiscoveryPayload*)out.payload)->isResponse;
+  } else if (out.type == DISCOVERY_COMPACT_MSG_TYPE && out.payloadLength >= (int)sizeof(CompactDiscovery)) {
+    out.discoveryReply = ((const CompactDiscovery*)out.payload)->flags & DISCOVERY_RESPONSE;
+  }
+  return true;
+}
+
+static std::string kindName(const FrameView& frame) {
+  std::string kind;
+  switch (frame.type) {
+    case DISCOVERY_MSG_TYPE:
+    case DISCOVERY_COMPACT_MSG_TYPE: kind = frame.discoveryReply ? "discovery reply" : "discovery"; break;
+    case NAME_REPLY_MSG_TYPE: kind = "name reply"; break;
+    case MSG_TYPE_TEMPERATURE_COMMAND: kind = "setpoint"; break;
+    case MSG_TYPE_TEMPERATURE_RESPONSE: kind = "ack"; break;
+    case RELAY_BEACON_MSG_TYPE: kind = "relay beacon"; break;
+    case TIME_REQUEST_MSG_TYPE: kind = "time request"; break;
+    case TIME_REPLY_MSG_TYPE: kind = "time reply"; break;
+    case AUTH_CHALLENGE_MSG_TYPE: kind = "challenge"; break;
+    case AUTH_RESPONSE_MSG_TYPE: kind = "challenge response"; break;
+    default: kind = "type " + std::to_string(frame.type); break;
+  }
+  return frame.relayed ? "relayed " + kind : kind;
+}
+
+// Sent on the board's own timers, with its own random jitter, or for peers it did not know yet
+static bool timerFrame(const FrameView& frame) {
+  return frame.type == RELAY_BEACON_MSG_TYPE || frame.type == TIME_REQUEST_MSG_TYPE ||
+         frame.type == NAME_REQUEST_MSG_TYPE;
+}
+
+// Started by the sketch rather than by the stack
+static bool startedBySketch(const FrameView& frame) {
+  if (frame.type == DISCOVERY_MSG_TYPE || frame.type == DISCOVERY_COMPACT_MSG_TYPE) return !frame.discoveryReply;
+  return isServer && frame.type == MSG_TYPE_TEMPERATURE_COMMAND && memcmp(frame.origin, ownMac, 6) == 0;
+}
+
+// Started by the board's key, which the replay does not have
+static bool startedByAuth(const FrameView& frame) {
+  return frame.type == AUTH_CHALLENGE_MSG_TYPE || frame.type == AUTH_RESPONSE_MSG_TYPE;
+}
+
+// === Matching ===
+
+struct Track {
+  std::string kind;
+  std::vector<const Record*> captured;
+  std::vector<uint64_t> replayed;
+};
+
+static std::map<std::string, Track> tracks; // by next hop and kind
+static uint32_t timerFrames[2] = {}; // captured, replayed
+
+static Track* trackFor(const uint8_t* hop, const uint8_t* data, int length) {
+  FrameView frame;
+  if (!view(hop, data, length, frame)) return nullptr;
+  std::string kind = kindName(frame);
+  Track& track = tracks[macText(hop) + " " + kind];
+  track.kind = kind;
+  return &track;
+}
+
+// The replayed board's driver: takes every frame, unless the board's refused this one
+static esp_err_t transmit(const uint8_t* to, const uint8_t* data, size_t len) {
+  FrameView frame;
+  if (view(to, data, len, frame) && timerFrame(frame)) {
+    timerFrames[1]++;
+    return ESP_OK;
+  }
+  Track* track = trackFor(to, data, len);
+  if (!track) return ESP_OK;
+
+  size_t index = track->replayed.size();
+  track->replayed.push_back(simMicros);
+  bool refused = index < track->captured.size() && track->captured[index]->info < 0;
+  return refused ? ESP_FAIL : ESP_OK;
+}
+
+// === Board ===
+
+static void onServerReceive(const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
+  if (type == MSG_TYPE_TEMPERATURE_RESPONSE && len == sizeof(TemperatureResponse)) {
+    TemperatureResponse payload;
+    memcpy(&payload, data, sizeof(payload));
+    manager->processTemperatureResponse(mac, payload);
+  }
+}
+
+static void onServerSent(const uint8_t* mac, uint8_t type, esp_now_send_status_t status) {
+  manager->processSendStatus(mac, type, status);
+}
+
+static void onServerDiscovery(const Peer& peer) {
+  if (peer.deviceClass == DEVICE_CLASS_RADIATOR) {
+    manager->handleDiscovery(peer);
+  }
+}
+
+static void onRadiatorReceive(const uint8_t* mac, uint8_t type, const uint8_t* data, int len) {
+  const Peer* server = coms->getPeerByClass(DEVICE_CLASS_SERVER);
+  if (type != MSG_TYPE_TEMPERATURE_COMMAND || len != sizeof(TemperatureCommand)) return;
+  if (!server || memcmp(mac, server->mac, 6) != 0) return;
+
+  TemperatureCommand command;
+  memcpy(&command, data, sizeof(command));
+  TemperatureResponse response = { command.temperature, true, command.requestId };
+  coms->send(mac, MSG_TYPE_TEMPERATURE_RESPONSE, response, TX_PRIORITY_ACK);
+}
+
+// setup() of the board's sketch, then the peers it had, in their order
+static void boot(bool large) {
+  memcpy(simEspNow.mac, ownMac, 6);
+  isServer = name == "server";
+  if (isServer && large) {
+    coms = std::make_shared<CommunicationsFor<LargeServerCapacity>>();
+    manager = std::make_shared<RadiatorManagerFor<LargeServerCapacity>>(*coms);
+  } else if (isServer) {
+    coms = std::make_shared<CommunicationsFor<ServerCapacity>>();
+    manager = std::make_shared<RadiatorManagerFor<ServerCapacity>>(*coms);
+  } else {
+    coms = std::make_shared<CommunicationsFor<RadiatorCapacity>>();
+  }
+
+  coms->begin();
+  coms->setName(name.c_str());
+  coms->setDeviceClass(isServer ? DEVICE_CLASS_SERVER : DEVICE_CLASS_RADIATOR);
+  if (isServer) {
+    coms->setReceiveHandler(onServerReceive);
+    coms->setSendHandler(onServerSent);
+    coms->setDiscoveryHandler(onServerDiscovery);
+    if (relay) coms->enableRelay(true);
+    if (timeSync) coms->enableTimeSync();
+  } else {
+    coms->addToDiscoveryWhitelist(DEVICE_CLASS_SERVER);
+    coms->setReceiveHandler(onRadiatorReceive);
+    if (relay) coms->enableRelay();
+  }
+
+  // Discovery replies, taken without a reply, in the format each peer spoke
+  for (const PeerLine& peer : peers) {
+    esp_now_recv_info_t info = { (uint8_t*)peer.mac, simEspNow.mac, nullptr };
+    if (peer.version == 0) {
+      struct __attribute__((packed)) {
+        MessageHeader header;
+        DiscoveryPayload payload;
+      } frame = {};
+      frame.header = { MESSAGE_MAGIC, DISCOVERY_MSG_TYPE, sizeof(DiscoveryPayload) };
+      strncpy(frame.payload.name, peer.name.c_str(), MAX_NAME_LEN - 1);
+      frame.payload.isResponse = true;
+      simEspNow.onReceive(&info, (const uint8_t*)&frame, sizeof(frame));
+      continue;
+    }
+
+    struct __attribute__((packed)) {
+      MessageHeader header;
+      CompactDiscovery payload;
+    } frame = {};
+    frame.header = { MESSAGE_MAGIC, DISCOVERY_COMPACT_MSG_TYPE, sizeof(CompactDiscovery) };
+    frame.payload = { (uint8_t)peer.version, (uint8_t)peer.deviceClass, DISCOVERY_RESPONSE, 0 };
+    simEspNow.onReceive(&info, (const uint8_t*)&frame, sizeof(frame));
+
+    struct __attribute__((packed)) {
+      MessageHeader header;
+      char name[MAX_NAME_LEN];
+    } named = {};
+    named.header = { MESSAGE_MAGIC, NAME_REPLY_MSG_TYPE, (uint8_t)min(peer.name.size(), (size_t)MAX_NAME_LEN - 1) };
+    memcpy(named.name, peer.name.data(), named.header.length);
+    simEspNow.onReceive(&info, (const uint8_t*)&named, sizeof(MessageHeader) + named.header.length);
+  }
+
+  const Peer* server = coms->getPeerByClass(DEVICE_CLASS_SERVER);
+  if (!isServer && timeSync && server) coms->enableTimeSync(server->mac);
+}
+
+// === Replay ===
+
+static std::vector<double> receiveNs;
+static uint32_t cutFrames = 0; // received frames the capture did not keep whole
+
+static void play(const Record& record) {
+  if (record.kind == CAPTURE_RX) {
+    if (record.length > (int)record.frame.size()) {
+      cutFrames++;
+      return;
+    }
+    wifi_pkt_rx_ctrl_t control = {};
+    control.rssi = record.info;
+    esp_now_recv_info_t info = { (uint8_t*)record.mac, simEspNow.mac, &control };
+    auto start = std::chrono::steady_clock::now();
+    simEspNow.onReceive(&info, record.frame.data(), record.frame.size());
+    receiveNs.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+  } else if (record.kind == CAPTURE_SENT) {
+    simEspNow.onSent(record.mac, (esp_now_send_status_t)record.info);
+  } else if (record.kind == CAPTURE_TX) {
+    FrameView frame;
+    if (!view(record.mac, record.frame.data(), record.frame.size(), frame)) return;
+    if (startedByAuth(frame)) {
+      // Sent unsigned, so it takes its place in the queue and the window
+      coms->send(frame.dest, frame.type, frame.payload, frame.payloadLength, TX_PRIORITY_DISCOVERY);
+      return;
+    }
+    if (!startedBySketch(frame)) return;
+
+    if (frame.type == DISCOVERY_MSG_TYPE || frame.type == DISCOVERY_COMPACT_MSG_TYPE) {
+      coms->broadcastDiscovery();
+    } else if (frame.payloadLength >= (int)sizeof(TemperatureCommand)) {
+      TemperatureCommand command;
+      memcpy(&command, frame.payload, sizeof(command));
+      manager->sendTemperatureCommand(frame.dest, command.temperature, command.requestId);
+    }
+  }
+}
+
+static double percentile(std::vector<double> values, double q) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  return values[min(values.size() - 1, (size_t)(q * values.size()))];
+}
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  bool large = false;
+  bool verbose = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-L") {
+      large = true;
+    } else if (arg == "-v") {
+      verbose = true;
+    } else if (!path && arg[0] != '-') {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (!path) {
+    fprintf(stderr, "usage: %s capture.txt [-L] [-v]\n", argv[0]);
+    return 2;
+  }
+  if (!load(path)) {
+    fprintf(stderr, "%s: no CAPTURE/1 header\n", path);
+    return 2;
+  }
+  if (records.empty()) {
+    printf("capture of %s is empty\n", name.c_str());
+    return 0;
+  }
+
+  uint32_t counts[3] = {};
+  for (const Record& record : records) {
+    counts[record.kind == CAPTURE_RX ? 0 : record.kind == CAPTURE_TX ? 1 : 2]++;
+    if (record.kind != CAPTURE_TX) continue;
+    FrameView frame;
+    if (view(record.mac, record.frame.data(), record.frame.size(), frame) && timerFrame(frame)) {
+      timerFrames[0]++;
+    } else if (Track* track = trackFor(record.mac, record.frame.data(), record.frame.size())) {
+      track->captured.push_back(&record);
+    }
+  }
+
+  uint64_t start = records.front().at / 1000 * 1000;
+  uint64_t end = records.back().at;
+  printf("%s %s, %zu peers%s%s\n", name.c_str(), macText(ownMac).c_str(), peers.size(), relay ? ", relaying" : "",
+         timeSync ? ", time sync" : "");
+  printf("%zu records over %.3f s: %u received, %u sent, %u send results\n\n", records.size(), (end - start) / 1e6,
+         counts[0], counts[1], counts[2]);
+
+  simMicros = start;
+  simEspNow.transmit = transmit;
+  boot(large);
+
+  // One loop() pass per virtual millisecond, like esp-server.ino
+  size_t next = 0;
+  auto wallStart = std::chrono::steady_clock::now();
+  for (uint64_t now = start;; now += 1000) {
+    while (next < records.size() && records[next].at <= now) {
+      simMicros = records[next].at;
+      play(records[next++]);
+    }
+    simMicros = now;
+    if (manager) manager->update();
+    coms->update();
+    if (now >= end + REPLAY_DRAIN_MS * 1000ULL) break;
+  }
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  // Per kind, over every next hop
+  struct Totals {
+    uint32_t captured = 0, replayed = 0, missing = 0, extra = 0, late = 0;
+    std::vector<double> shifts;
+  };
+  std::map<std::string, Totals> kinds;
+  bool differs = false;
+  for (auto& [key, track] : tracks) {
+    Totals& totals = kinds[track.kind];
+    totals.captured += track.captured.size();
+    totals.replayed += track.replayed.size();
+    size_t matched = min(track.captured.size(), track.replayed.size());
+    for (size_t i = 0; i < matched; i++) {
+      double shift = (double)(int64_t)(track.replayed[i] - track.captured[i]->at);
+      totals.shifts.push_back(shift);
+      if (fabs(shift) > REPLAY_TOLERANCE_US) {
+        totals.late++;
+        if (verbose) printf("  moved   %-40s at %.6f s by %+.0f us\n", key.c_str(), track.captured[i]->at / 1e6, shift);
+      }
+    }
+    for (size_t i = matched; i < track.captured.size(); i++) {
+      totals.missing++;
+      if (verbose) printf("  missing %-40s at %.6f s\n", key.c_str(), track.captured[i]->at / 1e6);
+    }
+    for (size_t i = matched; i < track.replayed.size(); i++) {
+      if (track.replayed[i] > end) break; // the board may well have sent it too, after the dump
+      totals.extra++;
+      if (verbose) printf("  extra   %-40s at %.6f s\n", key.c_str(), track.replayed[i] / 1e6);
+    }
+  }
+  if (verbose) printf("\n");
+
+  printf("  %-22s %8s %8s %8s %6s %6s %22s\n", "sent", "captured", "replayed", "missing", "extra", "moved",
+         "shift p50/max us");
+  for (auto& [kind, totals] : kinds) {
+    double largest = 0;
+    for (double shift : totals.shifts) largest = fabs(shift) > fabs(largest) ? shift : largest;
+    std::vector<double> sizes;
+    for (double shift : totals.shifts) sizes.push_back(fabs(shift));
+    char shifts[32];
+    snprintf(shifts, sizeof(shifts), "%.0f / %+.0f", percentile(sizes, 0.5), largest);
+    printf("  %-22s %8u %8u %8u %6u %6u %22s\n", kind.c_str(), totals.captured, totals.replayed, totals.missing,
+           totals.extra, totals.late, shifts);
+    differs = differs || totals.missing || totals.extra || totals.late;
+  }
+  printf("  %-22s %8u %8u %8s (not compared)\n", "beacons, time & names", timerFrames[0], timerFrames[1], "");
+
+  printf("\n  %-28s %zu, %u cut by the capture\n", "received frames replayed", receiveNs.size(), cutFrames);
+  printf("  %-28s %.0f / %.0f / %.0f ns\n", "host time p50/p99/max", percentile(receiveNs, 0.5),
+         percentile(receiveNs, 0.99), percentile(receiveNs, 1));
+  printf("  %-28s %.3f s\n", "replay took", wallSeconds);
+
+  printf("\n%s\n", differs ? "replay differs from the capture" : "replay matches the capture");
+  return differs ? 1 : 0;
+}
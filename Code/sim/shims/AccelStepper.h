@@ -0,0 +1,54 @@
+// AccelStepper.h
+// Host stand-in: the motor runs at its maximum speed from the moment run()
+// is first called with a new target, no ramps. Position follows the virtual
+// clock, so run() may be called as rarely as the simulation likes.
+#ifndef SIM_ACCEL_STEPPER_H
+#define SIM_ACCEL_STEPPER_H
+
+#include <Arduino.h>
+
+class AccelStepper {
+public:
+  enum MotorInterfaceType {
+    DRIVER = 1,
+    FULL4WIRE = 4,
+    HALF4WIRE = 8
+  };
+
+  AccelStepper(uint8_t = FULL4WIRE, uint8_t = 2, uint8_t = 3, uint8_t = 4, uint8_t = 5, bool = true) {}
+
+  void setMaxSpeed(float speed) { _maxSpeed = speed; }
+  void setAcceleration(float) {}
+  void setCurrentPosition(long position) {
+    _position = _target = position;
+    _lastStepAt = simMicros;
+  }
+  void moveTo(long target) {
+    if (_position == _target) _lastStepAt = simMicros;
+    _target = target;
+  }
+
+  long currentPosition() const { return _position; }
+  long targetPosition() const { return _target; }
+  long distanceToGo() const { return _target - _position; }
+
+  bool run() {
+    if (_position == _target || _maxSpeed <= 0) return false;
+
+    long steps = (long)((simMicros - _lastStepAt) * _maxSpeed / 1000000.0);
+    if (steps == 0) return true;
+    long remaining = labs(_target - _position);
+    steps = min(steps, remaining);
+    _position += _target > _position ? steps : -steps;
+    _lastStepAt = simMicros;
+    return _position != _target;
+  }
+
+private:
+  long _position = 0;
+  long _target = 0;
+  float _maxSpeed = 1;
+  uint64_t _lastStepAt = 0;
+};
+
+#endif
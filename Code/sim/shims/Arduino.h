@@ -0,0 +1,278 @@
+// Arduino.h
+// Host stand-in for the parts of the Arduino core the sketches use. Time is
+// virtual: simulations advance simMicros instead of waiting.
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define F(text) text
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define SERIAL_8N1 0
+#define constrain(value, low, high) ((value) < (low) ? (low) : ((value) > (high) ? (high) : (value)))
+
+inline uint64_t simMicros = 0;
+
+// A simulation running several boards sets simDelayHook to let the others
+// run while one waits; without it delay() only moves the clock
+inline void (*simDelayHook)(unsigned long ms) = nullptr;
+
+// The board's own crystal: micros() is offsetUs at simMicros start and runs
+// ppm fast or slow. A simulation with several boards swaps in each one's.
+struct SimClock {
+  uint64_t start;
+  uint64_t offsetUs;
+  double ppm;
+};
+inline SimClock simClock = {};
+
+inline unsigned long micros() {
+  uint64_t elapsed = simMicros - simClock.start;
+  return (unsigned long)(simClock.offsetUs + elapsed + (int64_t)(elapsed * simClock.ppm / 1e6));
+}
+inline unsigned long millis() { return micros() / 1000; }
+inline void delay(unsigned long ms) {
+  if (simDelayHook) {
+    simDelayHook(ms);
+  } else {
+    simMicros += ms * 1000ULL;
+  }
+}
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+inline uint32_t simRandomState = 1;
+inline uint32_t esp_random() {
+  // xorshift32, seeded by the simulation for repeatable runs
+  simRandomState ^= simRandomState << 13;
+  simRandomState ^= simRandomState >> 17;
+  simRandomState ^= simRandomState << 5;
+  return simRandomState;
+}
+
+// Keeps its text on the heap, as the core's String does beyond its short
+// inline buffer, so allocs/op in micro_bench counts every String built. The
+// core's keeps up to 11 chars inline; this one errs on the side of counting.
+class String {
+public:
+  String() {}
+  String(const char* text) { assign(text ? text : "", text ? strlen(text) : 0); }
+  String(const std::string& text) { assign(text.data(), text.size()); }
+  String(char c) { assign(&c, 1); }
+  String(int n) : String(std::to_string(n)) {}
+  String(unsigned n) : String(std::to_string(n)) {}
+  String(long n) : String(std::to_string(n)) {}
+  String(unsigned long n) : String(std::to_string(n)) {}
+  String(const String& other) { assign(other.c_str(), other._length); }
+  String(String&& other) noexcept : _buffer(other._buffer), _length(other._length) {
+    other._buffer = nullptr;
+    other._length = 0;
+  }
+  ~String() { delete[] _buffer; }
+
+  String& operator=(const String& other) {
+    if (this != &other) assign(other.c_str(), other._length);
+    return *this;
+  }
+  String& operator=(String&& other) noexcept {
+    std::swap(_buffer, other._buffer);
+    std::swap(_length, other._length);
+    return *this;
+  }
+
+  const char* c_str() const { return _buffer ? _buffer : ""; }
+  unsigned length() const { return _length; }
+  long toInt() const { return atol(c_str()); }
+  bool startsWith(const char* prefix) const { return strncmp(c_str(), prefix, strlen(prefix)) == 0; }
+
+  String& operator+=(const String& other) {
+    concat(other.c_str(), other._length);
+    return *this;
+  }
+  friend String operator+(const String& a, const String& b) {
+    String sum(a);
+    sum.concat(b.c_str(), b._length);
+    return sum;
+  }
+  friend String operator+(const String& a, const char* b) {
+    String sum(a);
+    sum.concat(b, strlen(b));
+    return sum;
+  }
+  friend String operator+(const char* a, const String& b) {
+    String sum(a);
+    sum.concat(b.c_str(), b._length);
+    return sum;
+  }
+  bool operator==(const String& other) const { return _length == other._length && strcmp(c_str(), other.c_str()) == 0; }
+  bool operator==(const char* other) const { return strcmp(c_str(), other) == 0; }
+  bool operator!=(const String& other) const { return !(*this == other); }
+
+private:
+  char* _buffer = nullptr; // nullptr while empty, like the core's before its first reserve
+  unsigned _length = 0;
+
+  void assign(const char* text, size_t length) {
+    char* buffer = length ? new char[length + 1] : nullptr;
+    if (buffer) {
+      memcpy(buffer, text, length);
+      buffer[length] = '\0';
+    }
+    delete[] _buffer;
+    _buffer = buffer;
+    _length = length;
+  }
+  void concat(const char* text, size_t length) {
+    if (length == 0) return;
+    char* buffer = new char[_length + length + 1];
+    memcpy(buffer, c_str(), _length);
+    memcpy(buffer + _length, text, length);
+    buffer[_length + length] = '\0';
+    delete[] _buffer;
+    _buffer = buffer;
+    _length += length;
+  }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+
+  virtual size_t write(const uint8_t* data, size_t length) {
+    size_t n = 0;
+    while (length--) n += write(*data++);
+    return n;
+  }
+  size_t write(const char* data, size_t length) { return write((const uint8_t*)data, length); }
+  size_t write(const char* text) { return write(text, strlen(text)); }
+
+  size_t print(const char* text) { return write(text); }
+  size_t print(const String& text) { return write(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long n) { return printf("%ld", n); }
+  size_t print(unsigned long n) { return printf("%lu", n); }
+  size_t print(int n) { return print((long)n); }
+  size_t print(unsigned n) { return print((unsigned long)n); }
+  size_t print(uint8_t n) { return print((unsigned long)n); }
+  size_t print(double n, int digits = 2) { return printf("%.*f", digits, n); }
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(T v) { return print(v) + println(); }
+
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return write(buffer, min((size_t)n, sizeof(buffer) - 1));
+  }
+
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+// Debug output goes to stdout while simSerialEcho is set, and is dropped otherwise
+inline bool simSerialEcho = false;
+
+// A UART the simulation can play the other end of: it queues bytes for
+// read() in simRx and, when simTx is set, collects what is written there
+// instead of treating it as debug output
+class HardwareSerial : public Stream {
+public:
+  std::string simRx;
+  std::string* simTx = nullptr;
+  std::function<void(unsigned long)> simBaudChange; // called with the new rate before it applies
+
+  void begin(unsigned long baud, int = 0, int = -1, int = -1) { updateBaudRate(baud); }
+  void updateBaudRate(unsigned long baud) {
+    if (simBaudChange) simBaudChange(baud);
+  }
+
+  int available() override { return (int)(simRx.size() - _rxPos); }
+  int read() override {
+    if (_rxPos >= simRx.size()) return -1;
+    int c = (uint8_t)simRx[_rxPos++];
+    if (_rxPos == simRx.size()) {
+      simRx.clear();
+      _rxPos = 0;
+    }
+    return c;
+  }
+  size_t write(uint8_t c) override {
+    if (simTx) {
+      *simTx += (char)c;
+    } else if (simSerialEcho) {
+      putchar(c);
+    }
+    return 1;
+  }
+  using Print::write;
+
+private:
+  size_t _rxPos = 0;
+};
+
+inline HardwareSerial Serial;
+
+struct EspClass {
+  uint32_t getCycleCount() { return (uint32_t)(simMicros * getCpuFreqMHz()); }
+  uint32_t getCpuFreqMHz() { return 240; }
+};
+
+inline EspClass ESP;
+
+// Why the board last started, in ESP-IDF's order; a simulation sets
+// simResetReason before setup() to play a watchdog reset
+enum esp_reset_reason_t {
+  ESP_RST_UNKNOWN, ESP_RST_POWERON, ESP_RST_EXT, ESP_RST_SW, ESP_RST_PANIC, ESP_RST_INT_WDT,
+  ESP_RST_TASK_WDT, ESP_RST_WDT, ESP_RST_DEEPSLEEP, ESP_RST_BROWNOUT, ESP_RST_SDIO
+};
+inline esp_reset_reason_t simResetReason = ESP_RST_POWERON;
+inline esp_reset_reason_t esp_reset_reason() { return simResetReason; }
+
+#define RTC_NOINIT_ATTR // RTC memory is plain memory here
+
+// FreeRTOS critical sections. Boards run one at a time here, so these only
+// count how deep the running code is in one: esp_now_send() aborts the
+// simulation when called inside, where a real board must not block.
+struct portMUX_TYPE {
+  int depth;
+};
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+inline int simCriticalDepth = 0;
+inline void portENTER_CRITICAL(portMUX_TYPE* mux) {
+  mux->depth++;
+  simCriticalDepth++;
+}
+inline void portEXIT_CRITICAL(portMUX_TYPE* mux) {
+  mux->depth--;
+  simCriticalDepth--;
+}
+
+#endif
@@ -0,0 +1,280 @@
+// ArduinoJson.h
+// Host stand-in for the part of ArduinoJson 6 the sketches read JSON with:
+// deserializeJson() into a document, lookups with [] and defaults with |.
+#ifndef SIM_ARDUINO_JSON_H
+#define SIM_ARDUINO_JSON_H
+
+#include <Arduino.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct SimJsonValue {
+  enum Kind { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } kind = NUL;
+  bool boolean = false;
+  double number = 0;
+  std::string text;
+  std::vector<SimJsonValue> items;
+  std::vector<std::pair<std::string, SimJsonValue>> members;
+};
+
+class JsonArray;
+class JsonObject;
+
+class JsonVariant {
+public:
+  JsonVariant(const SimJsonValue* value = nullptr) : _value(value) {}
+
+  JsonVariant operator[](const char* key) const {
+    if (!_value || _value->kind != SimJsonValue::OBJECT) return JsonVariant();
+    for (const auto& member : _value->members) {
+      if (member.first == key) return JsonVariant(&member.second);
+    }
+    return JsonVariant();
+  }
+  JsonVariant operator[](int index) const {
+    if (!_value || _value->kind != SimJsonValue::ARRAY || index < 0 || index >= (int)_value->items.size()) {
+      return JsonVariant();
+    }
+    return JsonVariant(&_value->items[index]);
+  }
+
+  bool isNull() const { return !_value || _value->kind == SimJsonValue::NUL; }
+  bool containsKey(const char* key) const { return !(*this)[key].isNull(); }
+
+  template <typename T>
+  bool is() const;
+  template <typename T>
+  T as() const;
+
+  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+  operator T() const { return as<T>(); }
+
+  const char* operator|(const char* fallback) const {
+    return _value && _value->kind == SimJsonValue::STRING ? _value->text.c_str() : fallback;
+  }
+  bool operator|(bool fallback) const { return _value && _value->kind == SimJsonValue::BOOL ? _value->boolean : fallback; }
+  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+  T operator|(T fallback) const {
+    return _value && _value->kind == SimJsonValue::NUMBER ? (T)_value->number : fallback;
+  }
+
+protected:
+  const SimJsonValue* _value;
+};
+
+class JsonArray : public JsonVariant {
+public:
+  class iterator {
+  public:
+    explicit iterator(const SimJsonValue* item) : _item(item) {}
+    JsonVariant operator*() const { return JsonVariant(_item); }
+    iterator& operator++() {
+      _item++;
+      return *this;
+    }
+    bool operator!=(const iterator& other) const { return _item != other._item; }
+
+  private:
+    const SimJsonValue* _item;
+  };
+
+  JsonArray(const JsonVariant& variant = JsonVariant()) : JsonVariant(variant) {}
+
+  size_t size() const { return isArray() ? _value->items.size() : 0; }
+  iterator begin() const { return iterator(isArray() ? _value->items.data() : nullptr); }
+  iterator end() const { return iterator(isArray() ? _value->items.data() + _value->items.size() : nullptr); }
+
+private:
+  bool isArray() const { return _value && _value->kind == SimJsonValue::ARRAY; }
+};
+
+class JsonObject : public JsonVariant {
+public:
+  JsonObject(const JsonVariant& variant = JsonVariant()) : JsonVariant(variant) {}
+};
+
+template <typename T>
+bool JsonVariant::is() const {
+  if (!_value) return false;
+  if (std::is_same<T, JsonArray>::value) return _value->kind == SimJsonValue::ARRAY;
+  if (std::is_same<T, JsonObject>::value) return _value->kind == SimJsonValue::OBJECT;
+  if (std::is_same<T, const char*>::value) return _value->kind == SimJsonValue::STRING;
+  if (std::is_same<T, bool>::value) return _value->kind == SimJsonValue::BOOL;
+  return _value->kind == SimJsonValue::NUMBER;
+}
+
+template <typename T>
+T JsonVariant::as() const {
+  if constexpr (std::is_same<T, JsonArray>::value || std::is_same<T, JsonObject>::value) {
+    return T(*this);
+  } else if constexpr (std::is_same<T, const char*>::value) {
+    return *this | (const char*)nullptr;
+  } else if constexpr (std::is_same<T, bool>::value) {
+    return *this | false;
+  } else {
+    return *this | (T)0;
+  }
+}
+
+class DeserializationError {
+public:
+  enum Code { Ok, InvalidInput, NoMemory };
+
+  DeserializationError(Code code = Ok) : _code(code) {}
+  explicit operator bool() const { return _code != Ok; }
+  const char* c_str() const { return _code == Ok ? "Ok" : _code == NoMemory ? "NoMemory" : "InvalidInput"; }
+
+private:
+  Code _code;
+};
+
+// Recursive descent over the whole input, strings keep their escapes decoded
+class SimJsonParser {
+public:
+  SimJsonParser(const char* data, size_t length) : _p(data), _end(data + length) {}
+
+  bool parse(SimJsonValue& out) {
+    if (!value(out, 0)) return false;
+    skipSpace();
+    return _p == _end;
+  }
+
+private:
+  const char* _p;
+  const char* _end;
+
+  void skipSpace() {
+    while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n')) _p++;
+  }
+
+  bool literal(const char* word) {
+    size_t n = strlen(word);
+    if ((size_t)(_end - _p) < n || strncmp(_p, word, n) != 0) return false;
+    _p += n;
+    return true;
+  }
+
+  bool string(std::string& out) {
+    if (_p >= _end || *_p != '"') return false;
+    _p++;
+    while (_p < _end && *_p != '"') {
+      char c = *_p++;
+      if (c == '\\') {
+        if (_p >= _end) return false;
+        c = *_p++;
+        switch (c) {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case 'r': c = '\r'; break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'u':
+            if (_end - _p < 4) return false;
+            c = (char)strtol(std::string(_p, 4).c_str(), nullptr, 16); // ASCII is all the sketches send
+            _p += 4;
+            break;
+        }
+      }
+      out += c;
+    }
+    if (_p >= _end) return false;
+    _p++;
+    return true;
+  }
+
+  bool value(SimJsonValue& out, int depth) {
+    if (depth > 10) return false;
+    skipSpace();
+    if (_p >= _end) return false;
+
+    if (*_p == '{') {
+      _p++;
+      out.kind = SimJsonValue::OBJECT;
+      skipSpace();
+      if (_p < _end && *_p == '}') return ++_p, true;
+      while (true) {
+        std::pair<std::string, SimJsonValue> member;
+        skipSpace();
+        if (!string(member.first)) return false;
+        skipSpace();
+        if (_p >= _end || *_p++ != ':') return false;
+        if (!value(member.second, depth + 1)) return false;
+        out.members.push_back(std::move(member));
+        skipSpace();
+        if (_p < _end && *_p == ',') {
+          _p++;
+          continue;
+        }
+        return _p < _end && *_p++ == '}';
+      }
+    }
+    if (*_p == '[') {
+      _p++;
+      out.kind = SimJsonValue::ARRAY;
+      skipSpace();
+      if (_p < _end && *_p == ']') return ++_p, true;
+      while (true) {
+        out.items.emplace_back();
+        if (!value(out.items.back(), depth + 1)) return false;
+        skipSpace();
+        if (_p < _end && *_p == ',') {
+          _p++;
+          continue;
+        }
+        return _p < _end && *_p++ == ']';
+      }
+    }
+    if (*_p == '"') {
+      out.kind = SimJsonValue::STRING;
+      return string(out.text);
+    }
+    if (literal("true") || literal("false")) {
+      out.kind = SimJsonValue::BOOL;
+      out.boolean = _p[-1] == 'e' && _p[-2] == 'u';
+      return true;
+    }
+    if (literal("null")) return true;
+
+    char* end;
+    std::string number(_p, std::min<size_t>(_end - _p, 32));
+    out.number = strtod(number.c_str(), &end);
+    if (end == number.c_str()) return false;
+    out.kind = SimJsonValue::NUMBER;
+    _p += end - number.c_str();
+    return true;
+  }
+};
+
+template <size_t N>
+class StaticJsonDocument {
+public:
+  JsonVariant operator[](const char* key) const { return JsonVariant(&_root)[key]; }
+  bool containsKey(const char* key) const { return JsonVariant(&_root).containsKey(key); }
+  template <typename T>
+  bool is() const { return JsonVariant(&_root).is<T>(); }
+  template <typename T>
+  T as() const { return JsonVariant(&_root).as<T>(); }
+  void clear() { _root = SimJsonValue(); }
+
+  SimJsonValue _root;
+};
+
+template <size_t N>
+DeserializationError deserializeJson(StaticJsonDocument<N>& doc, const char* data, size_t length) {
+  doc.clear();
+  SimJsonParser parser(data, length);
+  if (!parser.parse(doc._root)) {
+    doc.clear();
+    return DeserializationError::InvalidInput;
+  }
+  return DeserializationError::Ok;
+}
+
+template <size_t N>
+DeserializationError deserializeJson(StaticJsonDocument<N>& doc, const uint8_t* data, size_t length) {
+  return deserializeJson(doc, (const char*)data, length);
+}
+
+#endif
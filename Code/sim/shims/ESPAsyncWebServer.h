@@ -0,0 +1,385 @@
+// ESPAsyncWebServer.h
+// Host stand-in for ESPAsyncWebServer. WebSocket clients drain their queue at
+// their own simulated link rate, and simHeap tracks the memory the library
+// would hold for queued messages. HTTP requests are made up by the simulation
+// with simServer->simGet() and keep the response the handler sent.
+#ifndef SIM_ESP_ASYNC_WEB_SERVER_H
+#define SIM_ESP_ASYNC_WEB_SERVER_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#define WS_MAX_QUEUED_MESSAGES 8 // library default on the ESP8266, more are dropped
+#define SIM_WS_MESSAGE_OVERHEAD 48 // estimated heap per queued message object
+#define SIM_WS_BUFFER_OVERHEAD 16 // estimated heap per message buffer besides its data
+
+struct SimHeap {
+  size_t used = 0;
+  size_t peak = 0;
+
+  void add(size_t bytes) {
+    used += bytes;
+    peak = max(peak, used);
+  }
+  void remove(size_t bytes) { used -= bytes; }
+};
+
+inline SimHeap simHeap;
+
+class AsyncWebSocketMessageBuffer {
+public:
+  explicit AsyncWebSocketMessageBuffer(size_t size) : _data(size + 1, 0) {
+    simHeap.add(size + 1 + SIM_WS_BUFFER_OVERHEAD);
+  }
+  ~AsyncWebSocketMessageBuffer() { simHeap.remove(_data.size() + SIM_WS_BUFFER_OVERHEAD); }
+
+  uint8_t* get() { return _data.data(); }
+  size_t length() const { return _data.size() - 1; }
+  void lock() { _lock = true; }
+  void unlock() { _lock = false; }
+  bool canDelete() const { return _count == 0 && !_lock; }
+
+  void addRef() { _count++; }
+  void release() { _count--; }
+
+private:
+  std::vector<uint8_t> _data;
+  int _count = 0;
+  bool _lock = false;
+};
+
+enum AwsEventType {
+  WS_EVT_CONNECT,
+  WS_EVT_DISCONNECT,
+  WS_EVT_PONG,
+  WS_EVT_ERROR,
+  WS_EVT_DATA
+};
+
+enum AwsFrameType {
+  WS_CONTINUATION = 0,
+  WS_TEXT = 1,
+  WS_BINARY = 2
+};
+
+struct AwsFrameInfo {
+  uint8_t message_opcode;
+  uint32_t num;
+  uint8_t final;
+  uint8_t masked;
+  uint8_t opcode;
+  uint64_t len;
+  uint64_t index;
+};
+
+class AsyncWebSocketClient {
+public:
+  // Called for each message once it has fully left the queue
+  typedef std::function<void(AsyncWebSocketClient& client, const char* data, size_t length, uint64_t queuedAt)> Receiver;
+
+  AsyncWebSocketClient(uint32_t id, double bytesPerMs) : bytesPerMs(bytesPerMs), _id(id) {}
+  ~AsyncWebSocketClient() {
+    while (!_queue.empty()) pop();
+  }
+
+  uint32_t id() const { return _id; }
+
+  void text(const char* data, size_t length) {
+    std::shared_ptr<AsyncWebSocketMessageBuffer> own = std::make_shared<AsyncWebSocketMessageBuffer>(length);
+    memcpy(own->get(), data, length);
+    push(own.get(), own);
+  }
+  void text(AsyncWebSocketMessageBuffer* buffer) { push(buffer, nullptr); }
+
+  size_t queueLen() const { return _queue.size(); }
+  bool canSend() const { return _queue.size() < WS_MAX_QUEUED_MESSAGES; }
+  void close(uint16_t = 0, const char* = nullptr) { closed = true; }
+
+  // Sends up to elapsedMs worth of bytes, handing finished messages to receive
+  void drain(double elapsedMs, const Receiver& receive) {
+    _budget += bytesPerMs * elapsedMs;
+    while (!_queue.empty()) {
+      Message& head = _queue.front();
+      size_t left = head.buffer->length() - head.sent;
+      if (_budget < left) {
+        head.sent += (size_t)_budget;
+        _budget -= (size_t)_budget;
+        return;
+      }
+      _budget -= left;
+      receive(*this, (const char*)head.buffer->get(), head.buffer->length(), head.queuedAt);
+      pop();
+    }
+    _budget = 0; // an idle link does not save up bandwidth
+  }
+
+  double bytesPerMs;
+  bool closed = false;
+  uint32_t dropped = 0; // messages refused because the queue was full
+
+private:
+  struct Message {
+    AsyncWebSocketMessageBuffer* buffer;
+    std::shared_ptr<AsyncWebSocketMessageBuffer> own; // set for text(data, length)
+    size_t sent;
+    uint64_t queuedAt;
+  };
+
+  uint32_t _id;
+  std::deque<Message> _queue;
+  double _budget = 0;
+
+  void push(AsyncWebSocketMessageBuffer* buffer, std::shared_ptr<AsyncWebSocketMessageBuffer> own) {
+    if (_queue.size() >= WS_MAX_QUEUED_MESSAGES) {
+      dropped++;
+      return;
+    }
+    buffer->addRef();
+    simHeap.add(SIM_WS_MESSAGE_OVERHEAD);
+    _queue.push_back({ buffer, own, 0, simMicros });
+  }
+
+  void pop() {
+    _queue.front().buffer->release();
+    simHeap.remove(SIM_WS_MESSAGE_OVERHEAD);
+    _queue.pop_front();
+  }
+};
+
+class AsyncWebHandler {
+public:
+  virtual ~AsyncWebHandler() {}
+};
+
+class AsyncWebSocket;
+typedef std::function<void(AsyncWebSocket* server, AsyncWebSocketClient* client, AwsEventType type, void* arg,
+                           uint8_t* data, size_t len)> AwsEventHandler;
+
+class AsyncWebSocket : public AsyncWebHandler {
+public:
+  explicit AsyncWebSocket(const char*) {}
+  ~AsyncWebSocket() {
+    _clients.clear();
+    _cleanBuffers();
+  }
+
+  void onEvent(AwsEventHandler handler) { _handler = handler; }
+
+  AsyncWebSocketClient* client(uint32_t id) {
+    for (auto& client : _clients) {
+      if (client->id() == id && !client->closed) return client.get();
+    }
+    return nullptr;
+  }
+
+  AsyncWebSocketMessageBuffer* makeBuffer(size_t size) {
+    _buffers.emplace_back(new AsyncWebSocketMessageBuffer(size));
+    return _buffers.back().get();
+  }
+
+  void textAll(const char* data, size_t length) {
+    AsyncWebSocketMessageBuffer* buffer = makeBuffer(length);
+    memcpy(buffer->get(), data, length);
+    for (auto& client : _clients) {
+      if (!client->closed) client->text(buffer);
+    }
+    _cleanBuffers();
+  }
+
+  void _cleanBuffers() {
+    _buffers.erase(std::remove_if(_buffers.begin(), _buffers.end(),
+                                  [](const std::unique_ptr<AsyncWebSocketMessageBuffer>& b) { return b->canDelete(); }),
+                   _buffers.end());
+  }
+
+  // Simulation side
+  AsyncWebSocketClient* simConnect(double bytesPerMs) {
+    _clients.emplace_back(new AsyncWebSocketClient(_nextId++, bytesPerMs));
+    AsyncWebSocketClient* client = _clients.back().get();
+    if (_handler) _handler(this, client, WS_EVT_CONNECT, nullptr, nullptr, 0);
+    return client;
+  }
+
+  // A whole text message from the browser
+  void simReceive(AsyncWebSocketClient* client, const std::string& text) {
+    AwsFrameInfo info = {};
+    info.final = 1;
+    info.opcode = WS_TEXT;
+    info.len = text.size();
+    std::vector<uint8_t> data(text.begin(), text.end());
+    if (_handler) _handler(this, client, WS_EVT_DATA, &info, data.data(), data.size());
+  }
+
+  void simDrain(double elapsedMs, const AsyncWebSocketClient::Receiver& receive) {
+    for (auto& client : _clients) {
+      if (!client->closed) client->drain(elapsedMs, receive);
+    }
+    // A closed client's queue is freed with it
+    for (auto& client : _clients) {
+      if (client->closed && _handler) _handler(this, client.get(), WS_EVT_DISCONNECT, nullptr, nullptr, 0);
+    }
+    _clients.erase(std::remove_if(_clients.begin(), _clients.end(),
+                                  [](const std::unique_ptr<AsyncWebSocketClient>& c) { return c->closed; }),
+                   _clients.end());
+    _cleanBuffers();
+  }
+
+private:
+  std::vector<std::unique_ptr<AsyncWebSocketClient>> _clients;
+  std::vector<std::unique_ptr<AsyncWebSocketMessageBuffer>> _buffers;
+  uint32_t _nextId = 1;
+  AwsEventHandler _handler;
+};
+
+enum WebRequestMethod {
+  HTTP_GET = 1,
+  HTTP_POST = 2,
+  HTTP_ANY = 255
+};
+
+class AsyncWebParameter {
+public:
+  explicit AsyncWebParameter(const String& value) : _value(value) {}
+  const String& value() const { return _value; }
+
+private:
+  String _value;
+};
+
+typedef AsyncWebParameter AsyncWebHeader;
+
+class AsyncWebServerResponse {
+public:
+  AsyncWebServerResponse(int code, const String& contentType, const std::string& body)
+    : code(code), contentType(contentType), body(body) {}
+  virtual ~AsyncWebServerResponse() {}
+
+  void addHeader(const String& name, const String& value) { headers[name.c_str()] = value.c_str(); }
+
+  int code;
+  String contentType;
+  std::string body;
+  std::map<std::string, std::string> headers;
+};
+
+class AsyncResponseStream : public AsyncWebServerResponse, public Print {
+public:
+  explicit AsyncResponseStream(const String& contentType) : AsyncWebServerResponse(200, contentType, "") {}
+
+  size_t write(uint8_t c) override {
+    body += (char)c;
+    return 1;
+  }
+  using Print::write;
+};
+
+typedef std::function<void(void)> ArDisconnectHandler;
+
+class AsyncWebServerRequest {
+public:
+  // url is a path with an optional ?query, values are not URL-decoded
+  AsyncWebServerRequest(const std::string& url, const std::map<std::string, std::string>& headers) {
+    size_t query = url.find('?');
+    path = url.substr(0, query);
+    while (query != std::string::npos) {
+      size_t next = url.find('&', query + 1);
+      std::string pair = url.substr(query + 1, next == std::string::npos ? std::string::npos : next - query - 1);
+      size_t eq = pair.find('=');
+      _params.emplace(pair.substr(0, eq), AsyncWebParameter(eq == std::string::npos ? "" : pair.substr(eq + 1)));
+      query = next;
+    }
+    for (const auto& header : headers) _headers.emplace(header.first, AsyncWebHeader(header.second));
+  }
+
+  bool hasParam(const String& name) const { return _params.count(name.c_str()) != 0; }
+  AsyncWebParameter* getParam(const String& name) {
+    auto it = _params.find(name.c_str());
+    return it == _params.end() ? nullptr : &it->second;
+  }
+  bool hasHeader(const String& name) const { return _headers.count(name.c_str()) != 0; }
+  AsyncWebHeader* getHeader(const String& name) {
+    auto it = _headers.find(name.c_str());
+    return it == _headers.end() ? nullptr : &it->second;
+  }
+
+  AsyncWebServerResponse* beginResponse(int code, const String& contentType = "", const String& content = "") {
+    return new AsyncWebServerResponse(code, contentType, content.c_str());
+  }
+  AsyncWebServerResponse* beginResponse(fs::FS& fs, const String& path, const String& contentType) {
+    std::string data;
+    if (!fs.simRead(path.c_str(), data)) return new AsyncWebServerResponse(404, "text/plain", "Not found");
+    return new AsyncWebServerResponse(200, contentType, data);
+  }
+  AsyncResponseStream* beginResponseStream(const String& contentType) { return new AsyncResponseStream(contentType); }
+
+  void send(int code, const String& contentType = "", const String& content = "") {
+    send(beginResponse(code, contentType, content));
+  }
+  void send(AsyncWebServerResponse* response) {
+    _response.reset(response);
+    sentAt = simMicros;
+  }
+
+  void onDisconnect(ArDisconnectHandler handler) { _onDisconnect = handler; }
+
+  // Simulation side
+  std::string path;
+  uint64_t sentAt = 0;
+  AsyncWebServerResponse* response() const { return _response.get(); }
+  void simDisconnect() {
+    if (_onDisconnect) _onDisconnect();
+  }
+
+private:
+  std::map<std::string, AsyncWebParameter> _params;
+  std::map<std::string, AsyncWebHeader> _headers;
+  std::unique_ptr<AsyncWebServerResponse> _response;
+  ArDisconnectHandler _onDisconnect;
+};
+
+typedef std::function<void(AsyncWebServerRequest* request)> ArRequestHandlerFunction;
+
+class AsyncWebServer;
+inline AsyncWebServer* simServer = nullptr; // the last one constructed
+
+class AsyncWebServer {
+public:
+  explicit AsyncWebServer(uint16_t) { simServer = this; }
+
+  void on(const char* uri, WebRequestMethod, ArRequestHandlerFunction handler) { _routes[uri] = handler; }
+  void onNotFound(ArRequestHandlerFunction handler) { _notFound = handler; }
+  void addHandler(AsyncWebHandler* handler) { _handlers.push_back(handler); }
+  void begin() {}
+
+  // Simulation side: the request stays open until the caller drops it
+  std::unique_ptr<AsyncWebServerRequest> simGet(const std::string& url,
+                                                const std::map<std::string, std::string>& headers = {}) {
+    std::unique_ptr<AsyncWebServerRequest> request(new AsyncWebServerRequest(url, headers));
+    auto route = _routes.find(request->path);
+    if (route != _routes.end()) {
+      route->second(request.get());
+    } else if (_notFound) {
+      _notFound(request.get());
+    }
+    return request;
+  }
+
+  AsyncWebSocket* simSocket() {
+    for (AsyncWebHandler* handler : _handlers) {
+      if (AsyncWebSocket* ws = dynamic_cast<AsyncWebSocket*>(handler)) return ws;
+    }
+    return nullptr;
+  }
+
+private:
+  std::map<std::string, ArRequestHandlerFunction> _routes;
+  ArRequestHandlerFunction _notFound;
+  std::vector<AsyncWebHandler*> _handlers;
+};
+
+#endif
@@ -0,0 +1,35 @@
+// LittleFS.h
+// Host stand-in that reads files from a directory on the host, set by the
+// simulation to a sketch's data/ folder.
+#ifndef SIM_LITTLEFS_H
+#define SIM_LITTLEFS_H
+
+#include <Arduino.h>
+#include <fstream>
+#include <sstream>
+
+namespace fs {
+
+class FS {
+public:
+  std::string root;
+
+  bool begin() { return !root.empty(); }
+
+  bool simRead(const char* path, std::string& out) const {
+    std::ifstream file(root + path, std::ios::binary);
+    if (!file) return false;
+    std::stringstream data;
+    data << file.rdbuf();
+    out = data.str();
+    return true;
+  }
+};
+
+} // namespace fs
+
+using fs::FS;
+
+inline fs::FS LittleFS;
+
+#endif
@@ -0,0 +1,46 @@
+// Preferences.h
+// Host stand-in for the ESP32 NVS key-value store. Values live in a SimNvs,
+// the flash of one board: every Preferences object reads and writes the one
+// simNvs points at, so a simulation with several boards points it at the
+// board it runs, and a board keeps its values across reboots as long as the
+// simulation keeps its SimNvs.
+#ifndef SIM_PREFERENCES_H
+#define SIM_PREFERENCES_H
+
+#include <Arduino.h>
+#include <map>
+
+struct SimNvs {
+  std::map<std::string, long> values;
+  uint32_t writes = 0; // flash writes, for wear estimates
+};
+
+inline SimNvs simDefaultNvs;
+inline SimNvs* simNvs = &simDefaultNvs;
+
+class Preferences {
+public:
+  bool begin(const char* name, bool readOnly = false) {
+    _namespace = name;
+    _readOnly = readOnly;
+    return true;
+  }
+  void end() { _namespace.clear(); }
+
+  size_t putLong(const char* key, long value) {
+    if (_namespace.empty() || _readOnly) return 0;
+    simNvs->values[_namespace + "/" + key] = value;
+    simNvs->writes++;
+    return sizeof(value);
+  }
+  long getLong(const char* key, long fallback = 0) const {
+    auto it = simNvs->values.find(_namespace + "/" + key);
+    return it == simNvs->values.end() ? fallback : it->second;
+  }
+
+private:
+  std::string _namespace;
+  bool _readOnly = false;
+};
+
+#endif
@@ -0,0 +1,40 @@
+// WiFi.h
+// Host stand-in, records the mode and soft-AP settings the sketch asks for.
+#ifndef SIM_WIFI_H
+#define SIM_WIFI_H
+
+#include <Arduino.h>
+
+typedef enum {
+  WIFI_OFF = 0,
+  WIFI_STA,
+  WIFI_AP,
+  WIFI_AP_STA
+} wifi_mode_t;
+
+struct IPAddress {
+  uint8_t octets[4];
+
+  String toString() const {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+    return String(text);
+  }
+};
+
+struct WiFiClass {
+  wifi_mode_t currentMode = WIFI_OFF;
+  int apChannel = 0;
+
+  void mode(wifi_mode_t mode) { currentMode = mode; }
+  void disconnect() {}
+  bool softAP(const char*, const char*, int channel = 1, int = 0, int = 4) {
+    apChannel = channel;
+    return true;
+  }
+  IPAddress softAPIP() { return { { 192, 168, 4, 1 } }; }
+};
+
+inline WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,90 @@
+// esp_now.h
+// Host stand-in for ESP-NOW. Frames go to simEspNow.transmit, set by the
+// simulation, which calls the registered callbacks back when it delivers.
+#ifndef SIM_ESP_NOW_H
+#define SIM_ESP_NOW_H
+
+#include <Arduino.h>
+#include <functional>
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_ESPNOW_BASE 0x3066
+#define ESP_ERR_ESPNOW_NOT_INIT (ESP_ERR_ESPNOW_BASE + 1)
+#define ESP_ERR_ESPNOW_ARG (ESP_ERR_ESPNOW_BASE + 2)
+#define ESP_ERR_ESPNOW_NO_MEM (ESP_ERR_ESPNOW_BASE + 3)
+#define ESP_ERR_ESPNOW_FULL (ESP_ERR_ESPNOW_BASE + 4)
+#define ESP_ERR_ESPNOW_NOT_FOUND (ESP_ERR_ESPNOW_BASE + 5)
+#define ESP_ERR_ESPNOW_EXIST (ESP_ERR_ESPNOW_BASE + 8)
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_MAX_DATA_LEN 250
+
+typedef enum {
+  ESP_NOW_SEND_SUCCESS = 0,
+  ESP_NOW_SEND_FAIL
+} esp_now_send_status_t;
+
+typedef enum {
+  WIFI_IF_STA = 0,
+  WIFI_IF_AP
+} wifi_interface_t;
+
+typedef struct {
+  signed rssi : 8;
+  unsigned channel : 4;
+} wifi_pkt_rx_ctrl_t;
+
+typedef struct {
+  uint8_t* src_addr;
+  uint8_t* des_addr;
+  wifi_pkt_rx_ctrl_t* rx_ctrl;
+} esp_now_recv_info_t;
+
+typedef struct {
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t lmk[16];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+  void* priv;
+} esp_now_peer_info_t;
+
+typedef void (*esp_now_recv_cb_t)(const esp_now_recv_info_t* info, const uint8_t* data, int len);
+typedef void (*esp_now_send_cb_t)(const uint8_t* mac, esp_now_send_status_t status);
+
+struct SimEspNow {
+  uint8_t mac[ESP_NOW_ETH_ALEN] = { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01 };
+  esp_now_recv_cb_t onReceive = nullptr;
+  esp_now_send_cb_t onSent = nullptr;
+  std::function<esp_err_t(const uint8_t* to, const uint8_t* data, size_t len)> transmit;
+};
+
+inline SimEspNow simEspNow;
+
+inline esp_err_t esp_now_init() { return ESP_OK; }
+inline esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  simEspNow.onReceive = cb;
+  return ESP_OK;
+}
+inline esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+  simEspNow.onSent = cb;
+  return ESP_OK;
+}
+inline esp_err_t esp_now_add_peer(const esp_now_peer_info_t*) { return ESP_OK; }
+inline bool esp_now_is_peer_exist(const uint8_t*) { return false; }
+inline esp_err_t esp_now_send(const uint8_t* to, const uint8_t* data, size_t len) {
+  if (simCriticalDepth > 0) {
+    fprintf(stderr, "esp_now_send() inside a critical section\n");
+    abort();
+  }
+  return simEspNow.transmit ? simEspNow.transmit(to, data, len) : ESP_OK;
+}
+inline const char* esp_err_to_name(esp_err_t err) { return err == ESP_OK ? "ESP_OK" : "ESP_FAIL"; }
+
+#endif
@@ -0,0 +1,14 @@
+// esp_wifi.h
+// Host stand-in, the station MAC comes from simEspNow.
+#ifndef SIM_ESP_WIFI_H
+#define SIM_ESP_WIFI_H
+
+#include <string.h>
+#include "esp_now.h"
+
+inline esp_err_t esp_wifi_get_mac(wifi_interface_t, uint8_t* mac) {
+  memcpy(mac, simEspNow.mac, ESP_NOW_ETH_ALEN);
+  return ESP_OK;
+}
+
+#endif
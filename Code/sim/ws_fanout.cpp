@@ -0,0 +1,223 @@
+// ws_fanout.cpp
+// esp-web WebSocket fan-out under an update storm, with the real WebClients,
+// RadiatorCache and JsonWriter against the AsyncWebSocket stand-in.
+//
+// Runs the same seeded update sequence twice: once relaying every delta with
+// ws.textAll() like esp-web used to, once through WebClients. Reports the
+// heap held for queued messages, delivery latency (radiator change to a
+// client holding that state) and updates that never reached a client.
+//
+//   ./ws_fanout [seconds] [updates per second] [seed]
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <map>
+#include <string>
+#include <random>
+#include "RadiatorCache.h"
+#include "WebClients.h"
+
+struct ClientProfile {
+  const char* name;
+  double bytesPerMs;
+  unsigned long stallAtMs; // link stops carrying anything from here on, 0 = never
+};
+
+static const ClientProfile profiles[] = {
+  { "fast", 100, 0 },
+  { "fast", 100, 0 },
+  { "fast", 100, 0 },
+  { "fast", 100, 0 },
+  { "slow", 2, 0 }, // phone at the edge of the soft-AP
+  { "stalled", 100, 5000 } // walks out of range
+};
+
+static const int RADIATORS = ServerCapacity::radiators;
+
+class StringPrint : public Print {
+public:
+  size_t write(uint8_t c) override {
+    data += (char)c;
+    return 1;
+  }
+  using Print::write;
+
+  std::string data;
+};
+
+struct Change {
+  uint32_t version;
+  uint64_t at;
+};
+
+struct Result {
+  size_t heapPeak = 0;
+  uint32_t delivered = 0;
+  uint32_t stale = 0; // changes a still connected client never got
+  uint32_t disconnected = 0;
+  std::vector<uint32_t> latenciesMs;
+};
+
+// Pending changes per client and radiator, settled when a message carrying
+// that radiator at the same or a newer version arrives
+class Tracker {
+public:
+  void produced(int index, uint32_t version) {
+    for (auto& client : _pending) client.second[index].push_back({ version, simMicros });
+  }
+
+  void connect(uint32_t id) { _pending[id].resize(RADIATORS); }
+
+  void received(uint32_t id, const char* data, size_t length, Result& result) {
+    result.delivered++;
+    std::string text(data, length);
+    if (text[0] == '[') {
+      // whole list, radiators in index order
+      size_t pos = 0;
+      for (int index = 0; (pos = text.find("\"v\":", pos)) != std::string::npos; index++) {
+        pos += 4;
+        settle(id, index, strtoul(text.c_str() + pos, nullptr, 10), result);
+      }
+    } else {
+      size_t idPos = text.find("\"id\":");
+      size_t vPos = text.find("\"v\":");
+      if (idPos == std::string::npos || vPos == std::string::npos) return;
+      settle(id, atoi(text.c_str() + idPos + 5), strtoul(text.c_str() + vPos + 4, nullptr, 10), result);
+    }
+  }
+
+  uint32_t unsettled(AsyncWebSocket& ws) {
+    uint32_t count = 0;
+    for (auto& client : _pending) {
+      if (!ws.client(client.first)) continue;
+      for (auto& changes : client.second) count += changes.size();
+    }
+    return count;
+  }
+
+private:
+  std::map<uint32_t, std::vector<std::deque<Change>>> _pending;
+
+  void settle(uint32_t id, int index, uint32_t version, Result& result) {
+    auto& changes = _pending[id][index];
+    while (!changes.empty() && changes.front().version <= version) {
+      result.latenciesMs.push_back((simMicros - changes.front().at) / 1000);
+      changes.pop_front();
+    }
+  }
+};
+
+static Result run(bool useWebClients, int seconds, int updatesPerSecond, unsigned seed) {
+  simMicros = 0;
+  simHeap = SimHeap();
+
+  Result result;
+  Tracker tracker;
+  std::mt19937 random(seed);
+
+  {
+    AsyncWebSocket ws("/ws");
+    RadiatorCacheFor<ServerCapacity> cache;
+    WebClients clients(ws, cache);
+    cache.begin(seed);
+
+    uint32_t version = 0;
+    for (int i = 0; i < RADIATORS; i++) {
+      Radiator r = {};
+      r.mac[5] = i;
+      snprintf(r.name, sizeof(r.name), "Room %d", i + 1);
+      r.curr_temp = 20;
+      r.online = true;
+      r.version = ++version;
+      cache.update(i, r);
+    }
+    cache.applyMarker(version, 0, RADIATORS);
+    cache.takeChanged();
+
+    std::vector<AsyncWebSocketClient*> sockets;
+    for (const ClientProfile& profile : profiles) {
+      AsyncWebSocketClient* socket = ws.simConnect(profile.bytesPerMs);
+      sockets.push_back(socket);
+      tracker.connect(socket->id());
+      if (useWebClients) {
+        clients.add(socket->id());
+      } else {
+        StringPrint list;
+        cache.writeJson(list);
+        socket->text(list.data.data(), list.data.size());
+      }
+    }
+
+    auto receive = [&](AsyncWebSocketClient& client, const char* data, size_t length, uint64_t) {
+      tracker.received(client.id(), data, length, result);
+    };
+
+    std::bernoulli_distribution updateThisMs(updatesPerSecond / 1000.0);
+    std::uniform_int_distribution<int> pickRadiator(0, RADIATORS - 1);
+    std::uniform_int_distribution<int> pickTemp(8, 28);
+
+    unsigned long endMs = seconds * 1000UL;
+    unsigned long quietMs = endMs + 5000; // let the queues drain before counting what is stale
+    for (unsigned long ms = 0; ms < quietMs; ms++) {
+      simMicros = ms * 1000ULL;
+
+      for (size_t i = 0; i < sockets.size(); i++) {
+        if (profiles[i].stallAtMs != 0 && ms == profiles[i].stallAtMs) sockets[i]->bytesPerMs = 0;
+      }
+
+      if (ms < endMs && updateThisMs(random)) {
+        int index = pickRadiator(random);
+        Radiator r = cache.get(index);
+        r.curr_temp = pickTemp(random);
+        r.ackReceived = !r.ackReceived;
+        r.version = ++version;
+        cache.update(index, r);
+        cache.applyMarker(version, version - 1, RADIATORS);
+        tracker.produced(index, version);
+
+        if (useWebClients) {
+          clients.markChanged(cache.takeChanged());
+        } else {
+          cache.takeChanged();
+          StringPrint delta;
+          cache.writeRadiatorJson(delta, index);
+          ws.textAll(delta.data.data(), delta.data.size());
+        }
+      }
+
+      if (useWebClients) clients.update();
+      ws.simDrain(1, receive);
+    }
+
+    result.stale = tracker.unsettled(ws);
+    result.disconnected = clients.disconnected;
+  }
+
+  result.heapPeak = simHeap.peak;
+  return result;
+}
+
+static uint32_t percentile(std::vector<uint32_t> values, int percent) {
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  return values[(values.size() - 1) * percent / 100];
+}
+
+static void report(const char* mode, const Result& result) {
+  printf("%-12s %9zu %9u %8u %8u %8u %8u %7u %6u\n", mode, result.heapPeak, result.delivered,
+         percentile(result.latenciesMs, 50), percentile(result.latenciesMs, 99),
+         percentile(result.latenciesMs, 100), result.stale, (unsigned)result.latenciesMs.size(), result.disconnected);
+}
+
+int main(int argc, char** argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 20;
+  int rate = argc > 2 ? atoi(argv[2]) : 200;
+  unsigned seed = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1;
+
+  printf("%d clients (4 fast, 1 slow, 1 stalling at 5 s), %d radiators, %d updates/s for %d s, seed %u\n\n",
+         (int)(sizeof(profiles) / sizeof(profiles[0])), RADIATORS, rate, seconds, seed);
+  printf("%-12s %9s %9s %8s %8s %8s %8s %7s %6s\n", "mode", "heap peak", "messages", "p50 ms", "p99 ms", "max ms",
+         "stale", "settled", "kicked");
+  report("textAll", run(false, seconds, rate, seed));
+  report("WebClients", run(true, seconds, rate, seed));
+  return 0;
+}